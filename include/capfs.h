@@ -29,6 +29,8 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
 
 /*
  * ============================================================================
@@ -70,6 +72,11 @@ typedef enum {
     CAPFS_IOCTL_OP_GET_CAP =  0,
     CAPFS_IOCTL_OP_SET_CAP =  1,
     CAPFS_IOCTL_OP_IDENTIFY = 2,
+    CAPFS_IOCTL_OP_MAP =      3,
+    CAPFS_IOCTL_OP_GET_CAP_BATCH = 4,
+    CAPFS_IOCTL_OP_RING_SETUP = 5,
+    CAPFS_IOCTL_OP_EPOCH_SETUP = 6,
+    CAPFS_IOCTL_OP_STAT =     7,
 } capfs_ioctl_op_t;
 
 
@@ -91,6 +98,10 @@ union capfs_ioctl_args {
     struct {
         capfs_capref_t cap;
     } identify;
+
+    struct {
+        const char     *path;
+    } map;
 };
 
 /**
@@ -109,16 +120,454 @@ union capfs_ioctl_res {
     struct {
         int               status;
         capfs_filetype_t type;
+        capfs_capref_t   file;      ///< the file owning the capability
+        uint64_t          offset;    ///< offset into the owning region
+        uint64_t          epoch;     ///< the epoch of the file for the result
     } identify;
+
+    struct {
+        int              status;
+        pid_t            pid;       ///< the process holding the descriptor
+        int              fd;        ///< the descriptor in that process
+        int              prot;      ///< the allowed PROT_* flags for mmap(2)
+        uint64_t         offset;    ///< page aligned offset of the content
+        uint64_t         length;    ///< length of the content in bytes
+        uint64_t         size;      ///< current size of the file in bytes
+    } map;
+
+    struct {
+        int              status;
+        pid_t            pid;       ///< the process holding the descriptors
+        int              fd;        ///< the shared memory of the ring
+        int              sq_event;  ///< eventfd to wake up the daemon
+        int              cq_event;  ///< eventfd to wake up the client
+        uint64_t         size;      ///< size of the shared memory in bytes
+    } ring_setup;
+
+    struct {
+        int              status;
+        pid_t            pid;       ///< the process holding the descriptor
+        int              fd;        ///< the epoch page
+        uint64_t         size;      ///< size of the epoch page in bytes
+    } epoch_setup;
+
+    struct {
+        int               status;
+        capfs_filetype_t type;
+        capfs_capref_t   file;      ///< the capability of the file
+        uint64_t          size;      ///< number of used bytes of the file
+        int               perms;     ///< permissions of the file
+        uint64_t          epoch;     ///< the epoch of the file for the result
+    } stat;
+};
+
+/**
+ * @brief the message exchanged with the file system through ioctl(2)
+ *
+ * The operation is encoded in the ioctl command with CAPFS_IOCTL_CMD(). The
+ * path members of the arguments are not passed to the file system, the
+ * operation always applies to the file the ioctl is issued on.
+ *
+ * A successful CAPFS_IOCTL_OP_MAP returns the descriptor @c fd of the process
+ * @c pid which the client obtains with pidfd_getfd(2) or by opening
+ * /proc/<pid>/fd/<fd>, and then maps @c length bytes at @c offset. The
+ * descriptor covers a copy of the file's content only. Stores through a
+ * writable mapping reach the file when the file is released, and the file
+ * cannot grow beyond @c length until then (EBUSY). A read-only mapping is a
+ * snapshot of the content, it does not see the file grow or be replaced.
+ */
+struct capfs_ioctl_msg {
+    union capfs_ioctl_args args;
+    union capfs_ioctl_res  res;
 };
 
+/// the ioctl type used by CAPFS
+#define CAPFS_IOCTL_MAGIC 'C'
+
+/// the ioctl command of an operation
+#define CAPFS_IOCTL_CMD(op) _IOWR(CAPFS_IOCTL_MAGIC, (op), struct capfs_ioctl_msg)
+
+
+/// the maximum number of entries of a batch
+#define CAPFS_IOCTL_BATCH_MAX 256
+
+/// the size of the string table of a batch in bytes
+#define CAPFS_IOCTL_BATCH_STRTAB 8192
+
+/// the path of an entry that refers to the file the ioctl is issued on
+#define CAPFS_IOCTL_BATCH_SELF UINT32_MAX
+
+/**
+ * @brief an entry of a CAPFS_IOCTL_OP_GET_CAP_BATCH request
+ */
+struct capfs_ioctl_batch_entry {
+    uint32_t         path;      ///< offset of the path in the string table
+    int32_t          status;    ///< returns the status of the entry
+    uint64_t         offset;    ///< as for CAPFS_IOCTL_OP_GET_CAP
+    capfs_capref_t  cap;       ///< returns the capability
+};
+
+/**
+ * @brief the message of a CAPFS_IOCTL_OP_GET_CAP_BATCH request
+ *
+ * The paths are NUL terminated strings in the string table. Paths starting
+ * with '/' are relative to the root of the file system, other paths are
+ * relative to the directory the ioctl is issued on. The whole batch is
+ * resolved in one request, and directories shared between the paths are
+ * looked up only once.
+ */
+struct capfs_ioctl_batch {
+    uint32_t count;             ///< the number of entries
+    uint32_t resolved;          ///< returns the number of resolved entries
+    struct capfs_ioctl_batch_entry entries[CAPFS_IOCTL_BATCH_MAX];
+    char     strtab[CAPFS_IOCTL_BATCH_STRTAB];
+};
+
+/// the ioctl command of a batch
+#define CAPFS_IOCTL_BATCH_CMD \
+    _IOWR(CAPFS_IOCTL_MAGIC, CAPFS_IOCTL_OP_GET_CAP_BATCH, struct capfs_ioctl_batch)
+
+
+/*
+ * ============================================================================
+ * CAPFS Submission/Completion Rings
+ * ============================================================================
+ *
+ * A ring is a region of shared memory between a client and the daemon that
+ * holds a submission queue (SQ), a completion queue (CQ) and a data area. The
+ * client produces submission queue entries which the daemon executes against
+ * the backend, and the daemon produces one completion queue entry for each.
+ * Buffers of reads and writes live in the data area of the ring.
+ *
+ * The head and tail indices are free running and accessed atomically by both
+ * sides. A side that runs out of work spins for a while, then sets its
+ * NEED_WAKEUP flag and blocks on its eventfd; the other side only writes the
+ * eventfd if the flag is set.
+ */
+
+/// the number of entries of the submission and completion queues
+#define CAPFS_RING_ENTRIES 256
+
+/// the size of the data area of a ring in bytes
+#define CAPFS_RING_DATA_SIZE (1UL << 20)
 
+/// the daemon sleeps and must be woken up through the sq_event
+#define CAPFS_RING_SQ_NEED_WAKEUP (1U << 0)
+/// the client sleeps and must be woken up through the cq_event
+#define CAPFS_RING_CQ_NEED_WAKEUP (1U << 1)
+/// the ring has been closed by the client or the daemon
+#define CAPFS_RING_SHUTDOWN       (1U << 2)
 
+/**
+ * @brief operations that can be submitted to a ring
+ */
+typedef enum {
+    CAPFS_RING_OP_NOP =     0,
+    CAPFS_RING_OP_READ =    1,     ///< read from cap at offset into buf
+    CAPFS_RING_OP_WRITE =   2,     ///< write buf into cap at offset
+    CAPFS_RING_OP_GET_CAP = 3,     ///< load the capability at offset of cap
+    CAPFS_RING_OP_PUT_CAP = 4,     ///< store arg at offset of cap
+} capfs_ring_op_t;
+
+/**
+ * @brief a submission queue entry
+ */
+struct capfs_ring_sqe {
+    uint32_t         op;        ///< the operation, capfs_ring_op_t
+    uint32_t         flags;     ///< must be zero
+    uint64_t         user_data; ///< copied into the completion
+    capfs_capref_t  cap;       ///< the capability the operation applies to
+    uint64_t         offset;    ///< offset into the capability
+    uint64_t         length;    ///< number of bytes to read or write
+    uint64_t         buf;       ///< offset of the buffer in the data area
+    capfs_capref_t  arg;       ///< the capability to store
+};
+
+/**
+ * @brief a completion queue entry
+ */
+struct capfs_ring_cqe {
+    uint64_t         user_data; ///< the user data of the submission
+    int64_t          res;       ///< bytes transferred or negative error number
+    capfs_capref_t  cap;       ///< the loaded capability
+};
+
+/**
+ * @brief the header at the start of the ring memory
+ *
+ * Indices written by different sides live on different cache lines.
+ */
+struct capfs_ring_hdr {
+    uint32_t sq_head __attribute__((aligned(64)));  ///< written by the daemon
+    uint32_t sq_tail __attribute__((aligned(64)));  ///< written by the client
+    uint32_t cq_head __attribute__((aligned(64)));  ///< written by the client
+    uint32_t cq_tail __attribute__((aligned(64)));  ///< written by the daemon
+    uint32_t flags __attribute__((aligned(64)));    ///< CAPFS_RING_* flags
+    uint32_t entries;           ///< number of entries of each queue
+    uint64_t sq_offset;         ///< offset of the submission queue entries
+    uint64_t cq_offset;         ///< offset of the completion queue entries
+    uint64_t data_offset;       ///< offset of the data area
+    uint64_t data_size;         ///< size of the data area in bytes
+};
+
+
+/*
+ * ============================================================================
+ * CAPFS Epochs
+ * ============================================================================
+ *
+ * The daemon publishes epoch counters in a read-only shared page. The global
+ * epoch changes whenever paths may resolve to different files, the epoch of
+ * a file changes whenever its capabilities are revoked or replaced or its
+ * meta data changes. Files are hashed onto a fixed number of slots, so a
+ * change of one file may also invalidate results of others.
+ *
+ * A client caches results together with the epochs read before issuing the
+ * request. The result is valid as long as the epochs are unchanged.
+ */
+
+/// the number of per-file epoch slots, must be a power of two
+#define CAPFS_EPOCH_SLOTS 2048
+
+/**
+ * @brief the layout of the shared epoch page
+ */
+struct capfs_epoch_page {
+    uint64_t global __attribute__((aligned(64)));  ///< the global epoch
+    uint64_t slots[CAPFS_EPOCH_SLOTS] __attribute__((aligned(64)));
+};
+
+/**
+ * @brief obtains the epoch slot of a file
+ *
+ * @param file  the capability of the file
+ *
+ * @return index into the slots of the epoch page
+ */
+static inline uint32_t capfs_epoch_slot(capfs_capref_t file)
+{
+    return (uint32_t)((file.capaddr * 0x9e3779b97f4a7c15ULL) >> 32)
+           & (CAPFS_EPOCH_SLOTS - 1);
+}
+
+
+/*
+ * ============================================================================
+ * libcapfs client functions
+ * ============================================================================
+ */
+
+/**
+ * @brief issues a CAPFS ioctl on an open file
+ *
+ * @param fd    descriptor of a file or directory in a CAPFS mount
+ * @param op    the operation to execute
+ * @param args  the arguments of the operation, may be NULL
+ * @param res   returns the result of the operation, may be NULL
+ *
+ * @return 0 on success, negative error number on failure
+ */
 int capfs_ioctl(int fd, capfs_ioctl_op_t op,
                 union capfs_ioctl_args * args, union capfs_ioctl_res * res);
 
+/**
+ * @brief issues a CAPFS ioctl on a path
+ *
+ * @param path  path of a file or directory in a CAPFS mount
+ * @param op    the operation to execute
+ * @param args  the arguments of the operation, may be NULL
+ * @param res   returns the result of the operation, may be NULL
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * The file is kept open for subsequent calls on the same path.
+ */
 int capfs_ioctl_path(const char * path, capfs_ioctl_op_t op,
                      union capfs_ioctl_args * args, union capfs_ioctl_res * res);
 
+/**
+ * @brief obtains the capabilities of many files with batched ioctls
+ *
+ * @param dir       a directory in a CAPFS mount, relative paths start there
+ * @param paths     the paths of the files
+ * @param count     the number of paths
+ * @param caps      returns the capability of each path
+ * @param status    returns the status of each path
+ *
+ * @return the number of resolved paths, negative error number on failure
+ */
+long capfs_get_caps(const char * dir, const char * const * paths, size_t count,
+                    capfs_capref_t * caps, int * status);
+
+/**
+ * @brief closes the descriptor kept open for a path by capfs_ioctl_path()
+ *
+ * @param path  the path
+ */
+void capfs_close_path(const char * path);
+
+/**
+ * @brief closes all descriptors kept open by capfs_ioctl_path()
+ */
+void capfs_close_all(void);
+
+/**
+ * @brief maps the content of an open CAPFS file into the address space
+ *
+ * @param fd        descriptor of the file
+ * @param prot      the PROT_* flags of the mapping
+ * @param addr      returns the address of the mapping
+ * @param length    returns the length of the mapping in bytes
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_map(int fd, int prot, void **addr, size_t *length);
+
+/**
+ * @brief removes a mapping established by capfs_map()
+ *
+ * @param addr      the address of the mapping
+ * @param length    the length of the mapping in bytes
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_unmap(void *addr, size_t length);
+
+
+/**
+ * @brief handle of a ring on the client side
+ */
+struct capfs_ring;
+
+/**
+ * @brief sets up a submission/completion ring with the daemon
+ *
+ * @param fd    descriptor of a file or directory in a CAPFS mount
+ * @param ring  returns the ring
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * A ring must only be used by one thread at a time. A process has a single
+ * ring at a time, setting up another one fails with -EBUSY until the first
+ * has been destroyed.
+ */
+int capfs_ring_setup(int fd, struct capfs_ring **ring);
+
+/**
+ * @brief closes a ring, outstanding operations are dropped
+ *
+ * @param ring  the ring
+ */
+void capfs_ring_destroy(struct capfs_ring *ring);
+
+/**
+ * @brief obtains the data area of a ring
+ *
+ * @param ring  the ring
+ * @param size  returns the size of the data area in bytes
+ *
+ * @return pointer to the data area, buffers are passed as offsets into it
+ */
+void *capfs_ring_data(struct capfs_ring *ring, size_t *size);
+
+/**
+ * @brief obtains the next free submission queue entry
+ *
+ * @param ring  the ring
+ *
+ * @return pointer to the zeroed entry, NULL if too many are in flight
+ */
+struct capfs_ring_sqe *capfs_ring_get_sqe(struct capfs_ring *ring);
+
+/**
+ * @brief hands the entries obtained since the last call to the daemon
+ *
+ * @param ring  the ring
+ *
+ * @return the number of submitted entries, negative error number on failure
+ */
+int capfs_ring_submit(struct capfs_ring *ring);
+
+/**
+ * @brief obtains a completion if there is one
+ *
+ * @param ring  the ring
+ * @param cqe   returns the completion
+ *
+ * @return 0 on success, -EAGAIN if there is no completion
+ */
+int capfs_ring_peek_cqe(struct capfs_ring *ring, struct capfs_ring_cqe *cqe);
+
+/**
+ * @brief waits for a completion
+ *
+ * @param ring  the ring
+ * @param cqe   returns the completion
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_ring_wait_cqe(struct capfs_ring *ring, struct capfs_ring_cqe *cqe);
+
+/**
+ * @brief a cache of capability and meta data lookups on the client side
+ */
+struct capfs_cache;
+
+/**
+ * @brief creates a cache for a CAPFS mount
+ *
+ * @param path      a file or directory in the CAPFS mount
+ * @param cache     returns the cache
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * The cache is safe to use from multiple threads.
+ */
+int capfs_cache_create(const char * path, struct capfs_cache **cache);
+
+/**
+ * @brief destroys a cache
+ *
+ * @param cache     the cache
+ */
+void capfs_cache_destroy(struct capfs_cache *cache);
+
+/**
+ * @brief obtains the capability of a path, using the cache if possible
+ *
+ * @param cache     the cache
+ * @param path      path of a file or directory in the CAPFS mount
+ * @param cap       returns the capability
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_cache_get_cap(struct capfs_cache *cache, const char * path,
+                        capfs_capref_t *cap);
+
+/**
+ * @brief identifies a capability, using the cache if possible
+ *
+ * @param cache     the cache
+ * @param cap       the capability
+ * @param res       returns the result as of CAPFS_IOCTL_OP_IDENTIFY
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_cache_identify(struct capfs_cache *cache, capfs_capref_t cap,
+                         union capfs_ioctl_res *res);
+
+/**
+ * @brief obtains the type, size and permissions of a path, using the cache
+ *        if possible
+ *
+ * @param cache     the cache
+ * @param path      path of a file or directory in the CAPFS mount
+ * @param res       returns the result as of CAPFS_IOCTL_OP_STAT
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_cache_stat(struct capfs_cache *cache, const char * path,
+                     union capfs_ioctl_res *res);
+
 
 #endif //CAPFS_H
@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capfs_buddy.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define BUDDY_NIL         UINT32_MAX
+#define BUDDY_STATE_FREE  0x40
+#define BUDDY_STATE_ALLOC 0x80
+#define BUDDY_STATE_ORDER 0x3f
+
+#define BUDDY_BLOCKS(b, order) (1UL << ((order) - (b)->min_order))
+
+
+static void buddy_list_push(struct capfs_buddy *b, uint32_t idx, uint8_t order)
+{
+    b->state[idx] = BUDDY_STATE_FREE | order;
+    b->prev[idx] = BUDDY_NIL;
+    b->next[idx] = b->freelist[order];
+    if (b->freelist[order] != BUDDY_NIL) {
+        b->prev[b->freelist[order]] = idx;
+    }
+    b->freelist[order] = idx;
+}
+
+static void buddy_list_remove(struct capfs_buddy *b, uint32_t idx, uint8_t order)
+{
+    if (b->prev[idx] != BUDDY_NIL) {
+        b->next[b->prev[idx]] = b->next[idx];
+    } else {
+        b->freelist[order] = b->next[idx];
+    }
+
+    if (b->next[idx] != BUDDY_NIL) {
+        b->prev[b->next[idx]] = b->prev[idx];
+    }
+
+    b->state[idx] = 0;
+}
+
+/* removes a free block of an order from the free lists, the lock is held */
+static uint32_t buddy_take(struct capfs_buddy *b, uint8_t order)
+{
+    uint8_t o = order;
+    while (o <= b->max_order && b->freelist[o] == BUDDY_NIL) {
+        o++;
+    }
+
+    if (o > b->max_order) {
+        return BUDDY_NIL;
+    }
+
+    uint32_t idx = b->freelist[o];
+    buddy_list_remove(b, idx, o);
+
+    while (o > order) {
+        o--;
+        buddy_list_push(b, idx + BUDDY_BLOCKS(b, o), o);
+    }
+
+    return idx;
+}
+
+/*
+ * removes the free block of an order with the lowest address below limit
+ * from the free lists, the lock is held
+ */
+static uint32_t buddy_take_lowest(struct capfs_buddy *b, uint8_t order,
+                                  uint32_t limit)
+{
+    uint32_t idx = BUDDY_NIL;
+    uint8_t o = order;
+    for (uint8_t i = order; i <= b->max_order; i++) {
+        for (uint32_t f = b->freelist[i]; f != BUDDY_NIL; f = b->next[f]) {
+            if (f < limit && (idx == BUDDY_NIL || f < idx)) {
+                idx = f;
+                o = i;
+            }
+        }
+    }
+
+    if (idx == BUDDY_NIL) {
+        return BUDDY_NIL;
+    }
+
+    buddy_list_remove(b, idx, o);
+
+    while (o > order) {
+        o--;
+        buddy_list_push(b, idx + BUDDY_BLOCKS(b, o), o);
+    }
+
+    return idx;
+}
+
+
+/**
+ * @brief initializes the buddy allocator with a single free block
+ *
+ * @param b         the buddy allocator
+ * @param min_order order of the smallest block
+ * @param max_order order of the entire range
+ *
+ * @return 0 on success, -ENOMEM on failure
+ */
+int capfs_buddy_init(struct capfs_buddy *b, uint8_t min_order,
+                     uint8_t max_order)
+{
+    assert(min_order <= max_order);
+    assert(max_order - min_order < 32);
+
+    memset(b, 0, sizeof(*b));
+
+    b->min_order = min_order;
+    b->max_order = max_order;
+    b->nblocks = BUDDY_BLOCKS(b, max_order);
+
+    b->state = calloc(b->nblocks, sizeof(*b->state));
+    b->next = calloc(b->nblocks, sizeof(*b->next));
+    b->prev = calloc(b->nblocks, sizeof(*b->prev));
+    b->freelist = calloc(max_order + 1, sizeof(*b->freelist));
+    if (!b->state || !b->next || !b->prev || !b->freelist) {
+        capfs_buddy_destroy(b);
+        return -ENOMEM;
+    }
+
+    for (uint8_t o = 0; o <= max_order; o++) {
+        b->freelist[o] = BUDDY_NIL;
+    }
+
+    buddy_list_push(b, 0, max_order);
+    b->free_bytes = 1UL << max_order;
+
+    pthread_mutex_init(&b->lock, NULL);
+
+    return 0;
+}
+
+/**
+ * @brief releases the state of the buddy allocator
+ *
+ * @param b     the buddy allocator
+ */
+void capfs_buddy_destroy(struct capfs_buddy *b)
+{
+    free(b->state);
+    free(b->next);
+    free(b->prev);
+    free(b->freelist);
+
+    b->state = NULL;
+    b->next = NULL;
+    b->prev = NULL;
+    b->freelist = NULL;
+}
+
+/**
+ * @brief returns the order of the smallest block that holds bytes
+ *
+ * @param b     the buddy allocator
+ * @param bytes number of bytes
+ *
+ * @return order of the block
+ */
+uint8_t capfs_buddy_order(struct capfs_buddy *b, size_t bytes)
+{
+    uint8_t order = b->min_order;
+    while (order < 63 && (1UL << order) < bytes) {
+        order++;
+    }
+
+    return order;
+}
+
+/**
+ * @brief allocates a block of a given order
+ *
+ * @param b         the buddy allocator
+ * @param order     order of the block to allocate
+ * @param ret_addr  returns the address of the block
+ *
+ * @return 0 on success, -ENOSPC if there is no free block of this order
+ */
+int capfs_buddy_alloc(struct capfs_buddy *b, uint8_t order,
+                      uint64_t *ret_addr)
+{
+    if (order < b->min_order) {
+        order = b->min_order;
+    }
+
+    if (order > b->max_order) {
+        return -ENOSPC;
+    }
+
+    pthread_mutex_lock(&b->lock);
+
+    uint32_t idx = buddy_take(b, order);
+    if (idx == BUDDY_NIL) {
+        pthread_mutex_unlock(&b->lock);
+        return -ENOSPC;
+    }
+
+    b->state[idx] = BUDDY_STATE_ALLOC | order;
+    b->free_bytes -= (1UL << order);
+
+    pthread_mutex_unlock(&b->lock);
+
+    *ret_addr = (uint64_t)idx << b->min_order;
+
+    return 0;
+}
+
+/**
+ * @brief allocates the block of a given order at a fixed address
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the block, must be aligned to the order
+ * @param order     order of the block
+ *
+ * @return 0 on success, -EBUSY if the range is not free
+ */
+int capfs_buddy_reserve(struct capfs_buddy *b, uint64_t addr, uint8_t order)
+{
+    if (order < b->min_order || order > b->max_order
+        || (addr & ((1UL << order) - 1))
+        || (addr >> b->min_order) >= b->nblocks) {
+        return -EINVAL;
+    }
+
+    uint32_t idx = addr >> b->min_order;
+
+    pthread_mutex_lock(&b->lock);
+
+    /* find the free block containing the address */
+    uint8_t o = order;
+    uint32_t head = idx;
+    while (o <= b->max_order) {
+        head = idx & ~(BUDDY_BLOCKS(b, o) - 1);
+        if (b->state[head] == (BUDDY_STATE_FREE | o)) {
+            break;
+        }
+        o++;
+    }
+
+    if (o > b->max_order) {
+        pthread_mutex_unlock(&b->lock);
+        return -EBUSY;
+    }
+
+    buddy_list_remove(b, head, o);
+
+    /* split down to the requested order keeping the other halves free */
+    while (o > order) {
+        o--;
+        uint32_t half = BUDDY_BLOCKS(b, o);
+        if (idx >= head + half) {
+            buddy_list_push(b, head, o);
+            head += half;
+        } else {
+            buddy_list_push(b, head + half, o);
+        }
+    }
+
+    assert(head == idx);
+
+    b->state[idx] = BUDDY_STATE_ALLOC | order;
+    b->free_bytes -= (1UL << order);
+
+    pthread_mutex_unlock(&b->lock);
+
+    return 0;
+}
+
+/* returns a block to the free lists, coalescing it with its free buddies */
+static void buddy_release(struct capfs_buddy *b, uint32_t idx, uint8_t order)
+{
+    b->state[idx] = 0;
+    b->free_bytes += (1UL << order);
+
+    /* coalesce with the buddy as long as it is free */
+    while (order < b->max_order) {
+        uint32_t buddy = idx ^ BUDDY_BLOCKS(b, order);
+        if (b->state[buddy] != (BUDDY_STATE_FREE | order)) {
+            break;
+        }
+
+        buddy_list_remove(b, buddy, order);
+        idx = (idx < buddy) ? idx : buddy;
+        order++;
+    }
+
+    buddy_list_push(b, idx, order);
+}
+
+/*
+ * returns the order of the next block of a range allocated by
+ * capfs_buddy_alloc_range(), the largest aligned block that fits
+ */
+static uint8_t buddy_range_order(struct capfs_buddy *b, uint32_t idx,
+                                 uint64_t blocks)
+{
+    uint8_t order = b->min_order + (63 - __builtin_clzl(blocks));
+    if (idx) {
+        uint8_t align = b->min_order + __builtin_ctz(idx);
+        order = (align < order) ? align : order;
+    }
+
+    return order;
+}
+
+/* checks that a range consists of allocated blocks, the lock is held */
+static bool buddy_range_allocated(struct capfs_buddy *b, uint64_t addr,
+                                  uint64_t bytes)
+{
+    uint64_t mask = (1UL << b->min_order) - 1;
+    if (bytes == 0 || (addr & mask) || (bytes & mask)
+        || (addr >> b->min_order) >= b->nblocks
+        || (bytes >> b->min_order) > b->nblocks - (addr >> b->min_order)) {
+        return false;
+    }
+
+    uint32_t idx = addr >> b->min_order;
+    uint64_t blocks = bytes >> b->min_order;
+    while (blocks) {
+        uint8_t order = buddy_range_order(b, idx, blocks);
+        if (b->state[idx] != (BUDDY_STATE_ALLOC | order)) {
+            return false;
+        }
+        idx += BUDDY_BLOCKS(b, order);
+        blocks -= BUDDY_BLOCKS(b, order);
+    }
+
+    return true;
+}
+
+/**
+ * @brief frees a previously allocated block
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the block
+ * @param order     order of the block
+ *
+ * @return 0 on success, -EINVAL if the block was not allocated
+ */
+int capfs_buddy_free(struct capfs_buddy *b, uint64_t addr, uint8_t order)
+{
+    if ((addr >> b->min_order) >= b->nblocks) {
+        return -EINVAL;
+    }
+
+    uint32_t idx = addr >> b->min_order;
+
+    pthread_mutex_lock(&b->lock);
+
+    if (b->state[idx] != (BUDDY_STATE_ALLOC | order)) {
+        pthread_mutex_unlock(&b->lock);
+        return -EINVAL;
+    }
+
+    buddy_release(b, idx, order);
+
+    pthread_mutex_unlock(&b->lock);
+
+    return 0;
+}
+
+/*
+ * marks the blocks of a range at the start of a taken block as allocated and
+ * frees the unused upper halves, the lock is held
+ */
+static void buddy_trim(struct capfs_buddy *b, uint32_t idx, uint8_t order,
+                       uint64_t blocks)
+{
+    while (BUDDY_BLOCKS(b, order) != blocks) {
+        order--;
+        uint32_t half = BUDDY_BLOCKS(b, order);
+        if (blocks <= half) {
+            buddy_list_push(b, idx + half, order);
+        } else {
+            b->state[idx] = BUDDY_STATE_ALLOC | order;
+            b->free_bytes -= (1UL << order);
+            idx += half;
+            blocks -= half;
+        }
+    }
+
+    b->state[idx] = BUDDY_STATE_ALLOC | order;
+    b->free_bytes -= (1UL << order);
+}
+
+/**
+ * @brief allocates a range that is not a power of two in size
+ *
+ * @param b         the buddy allocator
+ * @param bytes     size of the range, rounded up to the smallest block
+ * @param ret_addr  returns the address of the range
+ *
+ * @return 0 on success, -ENOSPC if there is no free block large enough
+ *
+ * The range is carved from the smallest block that holds it and the unused
+ * tail of that block is freed again. The range is therefore aligned to the
+ * order of that block.
+ */
+int capfs_buddy_alloc_range(struct capfs_buddy *b, uint64_t bytes,
+                            uint64_t *ret_addr)
+{
+    uint8_t order = capfs_buddy_order(b, bytes);
+    if (order > b->max_order || bytes == 0) {
+        return -ENOSPC;
+    }
+
+    uint64_t blocks = (bytes + (1UL << b->min_order) - 1) >> b->min_order;
+
+    pthread_mutex_lock(&b->lock);
+
+    uint32_t idx = buddy_take(b, order);
+    if (idx == BUDDY_NIL) {
+        pthread_mutex_unlock(&b->lock);
+        return -ENOSPC;
+    }
+
+    *ret_addr = (uint64_t)idx << b->min_order;
+
+    buddy_trim(b, idx, order, blocks);
+
+    pthread_mutex_unlock(&b->lock);
+
+    return 0;
+}
+
+/**
+ * @brief allocates a range at the lowest free address below a limit
+ *
+ * @param b         the buddy allocator
+ * @param bytes     size of the range, rounded up to the smallest block
+ * @param limit     the range must start below this address
+ * @param ret_addr  returns the address of the range
+ *
+ * @return 0 on success, -ENOSPC if there is no such free block
+ *
+ * See capfs_buddy_alloc_range(). This searches all free lists and is meant
+ * for moving allocated ranges towards the start.
+ */
+int capfs_buddy_alloc_range_below(struct capfs_buddy *b, uint64_t bytes,
+                                  uint64_t limit, uint64_t *ret_addr)
+{
+    uint8_t order = capfs_buddy_order(b, bytes);
+    if (order > b->max_order || bytes == 0) {
+        return -ENOSPC;
+    }
+
+    uint64_t blocks = (bytes + (1UL << b->min_order) - 1) >> b->min_order;
+    uint64_t lidx = limit >> b->min_order;
+    if (lidx > b->nblocks) {
+        lidx = b->nblocks;
+    }
+
+    pthread_mutex_lock(&b->lock);
+
+    uint32_t idx = buddy_take_lowest(b, order, (uint32_t)lidx);
+    if (idx == BUDDY_NIL) {
+        pthread_mutex_unlock(&b->lock);
+        return -ENOSPC;
+    }
+
+    *ret_addr = (uint64_t)idx << b->min_order;
+
+    buddy_trim(b, idx, order, blocks);
+
+    pthread_mutex_unlock(&b->lock);
+
+    return 0;
+}
+
+/**
+ * @brief frees a range allocated by capfs_buddy_alloc_range()
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the range
+ * @param bytes     size of the range
+ *
+ * @return 0 on success, -EINVAL if the range was not allocated
+ */
+int capfs_buddy_free_range(struct capfs_buddy *b, uint64_t addr,
+                           uint64_t bytes)
+{
+    pthread_mutex_lock(&b->lock);
+
+    if (!buddy_range_allocated(b, addr, bytes)) {
+        pthread_mutex_unlock(&b->lock);
+        return -EINVAL;
+    }
+
+    uint32_t idx = addr >> b->min_order;
+    uint64_t blocks = bytes >> b->min_order;
+    while (blocks) {
+        uint8_t order = buddy_range_order(b, idx, blocks);
+        buddy_release(b, idx, order);
+        idx += BUDDY_BLOCKS(b, order);
+        blocks -= BUDDY_BLOCKS(b, order);
+    }
+
+    pthread_mutex_unlock(&b->lock);
+
+    return 0;
+}
+
+/**
+ * @brief allocates a range at a fixed address
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the range, aligned to the smallest block
+ * @param bytes     size of the range, a multiple of the smallest block
+ *
+ * @return 0 on success, -EBUSY if the range is not free
+ */
+int capfs_buddy_reserve_range(struct capfs_buddy *b, uint64_t addr,
+                              uint64_t bytes)
+{
+    uint64_t mask = (1UL << b->min_order) - 1;
+    if (bytes == 0 || (addr & mask) || (bytes & mask)
+        || (addr >> b->min_order) >= b->nblocks
+        || (bytes >> b->min_order) > b->nblocks - (addr >> b->min_order)) {
+        return -EINVAL;
+    }
+
+    uint32_t idx = addr >> b->min_order;
+    uint64_t blocks = bytes >> b->min_order;
+    while (blocks) {
+        uint8_t order = buddy_range_order(b, idx, blocks);
+        int err = capfs_buddy_reserve(b, (uint64_t)idx << b->min_order, order);
+        if (err) {
+            /* the blocks reserved so far are released again */
+            for (uint32_t i = addr >> b->min_order; i < idx;) {
+                uint8_t o = buddy_range_order(b, i, idx - i);
+                capfs_buddy_free(b, (uint64_t)i << b->min_order, o);
+                i += BUDDY_BLOCKS(b, o);
+            }
+            return err;
+        }
+        idx += BUDDY_BLOCKS(b, order);
+        blocks -= BUDDY_BLOCKS(b, order);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief checks whether a range is allocated
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the range
+ * @param bytes     size of the range
+ *
+ * @return true if the range was allocated as a block of this size or by
+ *         capfs_buddy_alloc_range()
+ */
+bool capfs_buddy_is_allocated(struct capfs_buddy *b, uint64_t addr,
+                              uint64_t bytes)
+{
+    pthread_mutex_lock(&b->lock);
+    bool allocated = buddy_range_allocated(b, addr, bytes);
+    pthread_mutex_unlock(&b->lock);
+
+    return allocated;
+}
+
+/**
+ * @brief returns the number of free bytes
+ *
+ * @param b     the buddy allocator
+ */
+uint64_t capfs_buddy_free_bytes(struct capfs_buddy *b)
+{
+    pthread_mutex_lock(&b->lock);
+    uint64_t bytes = b->free_bytes;
+    pthread_mutex_unlock(&b->lock);
+
+    return bytes;
+}
@@ -117,6 +117,18 @@ static struct capability *folderdir[2] = {
  */
 
 
+/**
+ * @brief sets the image the backend stores the file system in
+ *
+ * @param path  path of the image, NULL for the default
+ * @param keep  keep the file system held by an existing image
+ */
+void capfs_backend_set_image(const char *path, bool keep)
+{
+    (void)path;
+    (void)keep;
+}
+
 /**
  * @brief initializes the backend
  *
@@ -325,6 +337,18 @@ int capfs_backend_put_cap(capfs_capref_t cap,
     return 0;
 }
 
+long capfs_backend_cap_scan(capfs_capref_t cap, off_t offset, size_t bytes,
+                            off_t *offsets, size_t count)
+{
+    (void)cap;
+    (void)offset;
+    (void)bytes;
+    (void)offsets;
+    (void)count;
+
+    return -ENOTSUP;
+}
+
 
 /*
  * ============================================================================
@@ -337,7 +361,7 @@ long capfs_backend_read(capfs_capref_t cap, off_t offset,
                        char *rbuf, size_t bytes)
 {
     LOG("cap=" PRIxCAP ", offset=%li, rbuf=%p, size=%zu\n", PRI_CAP(cap), offset,
-        rbuf, bytes);
+        (void *)rbuf, bytes);
 
     if (!(cap.capaddr < NUMCAPS)) {
         return 0;
@@ -359,7 +383,7 @@ long capfs_backend_read(capfs_capref_t cap, off_t offset,
         return 0;
     }
 
-    LOG("copying cap:" PRIxCAP " -> %p \n", PRI_CAP(cap), rbuf);
+    LOG("copying cap:" PRIxCAP " -> %p \n", PRI_CAP(cap), (void *)rbuf);
 
     const char *p = c->payload;
 
@@ -377,17 +401,68 @@ long capfs_backend_read(capfs_capref_t cap, off_t offset,
     return i;
 }
 
+long capfs_backend_read_decoded(const struct capfs_capbounds *bounds,
+                                off_t offset, char *rbuf, size_t bytes)
+{
+    return capfs_backend_read(MKCAP(bounds->base), offset, rbuf, bytes);
+}
+
 long capfs_backend_write(capfs_capref_t cap, off_t offset,
                         const char *wbuf, size_t bytes)
 {
     LOG("cap=" PRIxCAP ", offset=%li, wbuf=%p, size=%zu\n", PRI_CAP(cap), offset,
-        wbuf, bytes);
+        (void *)wbuf, bytes);
 
     (void)cap;
 
     return 0;
 }
 
+long capfs_backend_readv(const struct capfs_backend_iovec *iov, int iovcnt)
+{
+    long total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        long r = capfs_backend_read(iov[i].cap, iov[i].offset, iov[i].buf,
+                                    iov[i].bytes);
+        if (r < 0) {
+            return r;
+        }
+        total += r;
+    }
+
+    return total;
+}
+
+long capfs_backend_writev(const struct capfs_backend_iovec *iov, int iovcnt)
+{
+    long total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        long r = capfs_backend_write(iov[i].cap, iov[i].offset, iov[i].buf,
+                                     iov[i].bytes);
+        if (r < 0) {
+            return r;
+        }
+        total += r;
+    }
+
+    return total;
+}
+
+long capfs_backend_copy(capfs_capref_t src, off_t src_offset,
+                        capfs_capref_t dst, off_t dst_offset, size_t bytes)
+{
+    LOG("src=" PRIxCAP ", src_offset=%li, dst=" PRIxCAP ", dst_offset=%li, "
+        "size=%zu\n", PRI_CAP(src), src_offset, PRI_CAP(dst), dst_offset, bytes);
+
+    return -ENOTSUP;
+}
+
+long capfs_backend_write_decoded(const struct capfs_capbounds *bounds,
+                                 off_t offset, const char *wbuf, size_t bytes)
+{
+    return capfs_backend_write(MKCAP(bounds->base), offset, wbuf, bytes);
+}
+
 int capfs_backend_zero(capfs_capref_t cap)
 {
     (void)cap;
@@ -395,6 +470,79 @@ int capfs_backend_zero(capfs_capref_t cap)
     return -1;
 }
 
+int capfs_backend_punch(capfs_capref_t cap, off_t offset, size_t bytes)
+{
+    (void)cap;
+    (void)offset;
+    (void)bytes;
+
+    return -ENOTSUP;
+}
+
+off_t capfs_backend_seek(capfs_capref_t cap, off_t offset, int whence)
+{
+    (void)cap;
+    (void)offset;
+    (void)whence;
+
+    return -ENOTSUP;
+}
+
+
+/*
+ * ===========================================================================
+ * Capability Allocation
+ * ===========================================================================
+ */
+
+int capfs_backend_cap_alloc(size_t bytes, capfs_capperms_t perms,
+                            capfs_capref_t *ret_cap)
+{
+    (void)bytes;
+    (void)perms;
+    (void)ret_cap;
+
+    return -ENOTSUP;
+}
+
+int capfs_backend_cap_free(capfs_capref_t cap)
+{
+    (void)cap;
+
+    return -ENOTSUP;
+}
+
+long capfs_backend_collect(void)
+{
+    return -ENOTSUP;
+}
+
+long capfs_backend_compact(int mode)
+{
+    (void)mode;
+
+    return -ENOTSUP;
+}
+
+int capfs_backend_cap_mint(capfs_capref_t cap, uintptr_t offset, size_t bytes,
+                           capfs_capperms_t perms, capfs_capref_t *ret_cap)
+{
+    (void)cap;
+    (void)offset;
+    (void)bytes;
+    (void)perms;
+    (void)ret_cap;
+
+    return -ENOTSUP;
+}
+
+int capfs_backend_cap_revoke(capfs_capref_t cap)
+{
+    (void)cap;
+
+    return -ENOTSUP;
+}
+
 
 /*
  * ===========================================================================
@@ -428,4 +576,63 @@ uint64_t capfs_backend_cap_get_size(capfs_capref_t cap)
     (void)cap;
 
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief decodes the bounds and permissions of a capability
+ *
+ * @param cap       the capability to decode
+ * @param bounds    returns the decoded bounds
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The dummy backend keeps the index into the capability store as base.
+ */
+int capfs_backend_cap_decode(capfs_capref_t cap,
+                             struct capfs_capbounds *bounds)
+{
+    if (!(cap.capaddr < NUMCAPS)) {
+        return -EINVAL;
+    }
+
+    bounds->base = cap.capaddr;
+    bounds->size = capstore[cap.capaddr].payload
+                       ? strlen(capstore[cap.capaddr].payload) : 0;
+    bounds->perms = CAPFS_CAPABILITY_PERM_READ;
+    bounds->epoch = 0;
+    bounds->cap = cap;
+
+    return 0;
+}
+
+
+/*
+ * ===========================================================================
+ * Direct Access
+ * ===========================================================================
+ */
+
+int capfs_backend_cap_map(capfs_capref_t cap, capfs_capperms_t perms,
+                          struct capfs_backend_mapping *map)
+{
+    (void)cap;
+    (void)perms;
+    (void)map;
+
+    /* the dummy store lives in the daemon's heap only */
+    return -ENOTSUP;
+}
+
+int capfs_backend_cap_unmap(const struct capfs_backend_mapping *map)
+{
+    (void)map;
+
+    return -ENOTSUP;
+}
+
+bool capfs_backend_cap_mapped(capfs_capref_t cap)
+{
+    (void)cap;
+
+    return false;
+}
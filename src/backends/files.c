@@ -39,10 +39,24 @@
 #include <errno.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#include <capfs_internal.h>
 
+#include <capfs_internal.h>
+#include <capfs_buddy.h>
+#include <capfs_capability.h>
 
 
 /**
@@ -52,12 +66,11 @@ capfs_capref_t capfs_root_capability;
 
 
 #define CAPABILITY_ROOT_CAP = \
-    (struct capability){0, BACKEND_FILES_SIZE, BACKEND_FILES_SIZE_BITS, \
-                           CAPFS_CAPABILITY_PERM_ALL}
+    (struct capability){0, BACKEND_FILES_SIZE, CAPFS_CAPABILITY_PERM_ALL}
 
 
 /**
- * @brief the file name used to store the data TODO: make as an argument
+ * @brief the default file name used to store the data
  */
 #define BACKEND_FILES_PATH "/tmp/foobar.bin"
 
@@ -86,342 +99,3773 @@ capfs_capref_t capfs_root_capability;
  */
 #define BACKEND_FILES_TOTAL_SIZE (BACKEND_FILES_SIZE + BACKEND_FILES_DATA_OFFSET)
 
+/**
+ * @brief the size of the bounce buffer used when copying within the store
+ */
+#define BACKEND_FILES_COPY_CHUNK (64 * 1024)
 
-struct backend_state
-{
-    FILE *file;
-    size_t data_size;
-};
-
-static struct backend_state g_st;
+/**
+ * @brief whether the image is mapped into the daemon (mapped mode)
+ *
+ * In mapped mode copies within the store are done through the mapping, if
+ * the mapping fails or this is disabled copy_file_range() is used instead.
+ */
+#define BACKEND_FILES_MAPPED (1)
 
+/**
+ * @brief copies of at least this size bypass the cache in mapped mode
+ */
+#define BACKEND_FILES_COPY_NT_MIN (256 * 1024)
 
-/*
- * ============================================================================
- * Capability
- * ============================================================================
+/**
+ * @brief the maximum number of buffers passed to a single preadv/pwritev
  */
+#define BACKEND_FILES_IOV_MAX (64)
 
+/**
+ * @brief the number of decoded capabilities remembered by a vectored request
+ */
+#define BACKEND_FILES_IOV_CAPS (8)
 
-struct capability {
-    uint64_t base;
-    uint64_t size;
-    uint8_t size_bits;
-    capfs_capperms_t perms;
-};
+/**
+ * @brief the order of the smallest region handed out by the allocator
+ */
+#define BACKEND_FILES_ALLOC_MIN_BITS (6)
 
+/**
+ * @brief the order of the region at the start of the store that is reserved
+ *        for the file system root record
+ */
+#define BACKEND_FILES_RESERVED_BITS (12)
 
-#define dump_capability(c) do { \
-    LOG("{%lx, %lx %u, %u}\n", (c)->base, (c)->size, (c)->size_bits, (c)->perms); \
-        } while(0);
+/**
+ * @brief the address of the word that marks an image as stopped cleanly, at
+ *        the end of the reserved region
+ */
+#define BACKEND_FILES_CLEAN_ADDR ((1UL << BACKEND_FILES_RESERVED_BITS) - 8)
 
-static void capability_decompress(uint64_t comp, struct capability *cap)
-{
-    cap->base = (comp & 0xffffffffffff);
-    cap->size_bits = (uint8_t)((comp >> 48) & 0xff);
-    cap->size  = (1UL << cap->size_bits);
-    cap->perms = (uint8_t)(comp >> 56);
-}
+/**
+ * @brief the value of the clean marker of an image stopped cleanly
+ */
+#define BACKEND_FILES_CLEAN_MAGIC (0xc1ea4ca9f5UL)
 
-static uint64_t capability_compres(struct capability *cap)
-{
-    return ((uint64_t)cap->size_bits << 48) | (cap->base & 0xffffffffffff) |
-           ((uint64_t)cap->perms << 56);
-}
+/**
+ * @brief the maximum number of capabilities with a derivation record
+ */
+#define BACKEND_FILES_DERIV_RECORDS (1 << 16)
 
+/**
+ * @brief the number of hash buckets of the derivation records in bits
+ */
+#define BACKEND_FILES_DERIV_BUCKET_BITS (14)
 
+/**
+ * @brief the number of decoded capabilities cached per thread in bits
+ */
+#define BACKEND_FILES_CAP_CACHE_BITS (6)
 
-/*
- * ===========================================================================
- * Capability to Capref Conversion
- * ===========================================================================
- *
- * XXX: We implement a dummy capability to capref conversion here. This is
- *      not considered to be save
+/**
+ * @brief the size of the store range covered by one sequence lock in bits
  */
+#define BACKEND_FILES_SEQ_BITS (16)
 
+/**
+ * @brief the number of spins on a sequence lock before yielding the CPU
+ */
+#define BACKEND_FILES_SEQ_SPINS (128)
 
-#define CAPFS_CAPREF_SALT (0xAAAAAAAAAAAAAAAAUL)
+/**
+ * @brief the number of meta data words read at once when scanning the image
+ */
+#define BACKEND_FILES_SCAN_WORDS (1024)
 
-int capref_to_capability(capfs_capref_t cap, struct capability *ret_cap)
-{
-    capability_decompress(cap.capaddr ^ CAPFS_CAPREF_SALT, ret_cap);
+/**
+ * @brief the number of slots of the capability table in bits
+ */
+#define BACKEND_FILES_CAPTAB_BITS (18)
 
-    return 0;
-}
+/**
+ * @brief the size of the store swept at once by the revocation sweeper
+ */
+#define BACKEND_FILES_SWEEP_SLICE (256 * 1024)
 
-int capability_to_capref(struct capability *cap, capfs_capref_t *ret_cap)
-{
-    ret_cap->capaddr = capability_compres(cap) ^ CAPFS_CAPREF_SALT;
+/**
+ * @brief the pause between two slices of the revocation sweeper
+ */
+#define BACKEND_FILES_SWEEP_PAUSE_USEC (200)
 
-    return 0;
-}
+/**
+ * @brief the number of capabilities checked per scan of the sweeper
+ */
+#define BACKEND_FILES_SWEEP_BATCH (256)
 
+/**
+ * @brief the number of threads marking reachable regions
+ */
+#define BACKEND_FILES_GC_THREADS (4)
 
-/*
- * ============================================================================
- * Meta data
- * ============================================================================
+/**
+ * @brief the time between two cycles of the garbage collector
  */
+#define BACKEND_FILES_GC_INTERVAL_SEC (60)
 
-#define PTR2OFFSET(ptr) (((ptr) / (sizeof(uint32_t) * 8)) * sizeof(uint32_t))
+/**
+ * @brief the pause between two moved regions of an online compaction
+ */
+#define BACKEND_FILES_COMPACT_PAUSE_USEC (1000)
 
-static int metadata_rawread(uint64_t ptr, uint32_t *md)
-{
-    assert(PTR2OFFSET(ptr) < BACKEND_FILES_DATA_OFFSET);
+#if defined(__x86_64__) || defined(__i386__)
+#define CAPSTORE_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CAPSTORE_CPU_RELAX() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
 
-    if (g_st.file == NULL) {
-        return -1;
-    }
 
-    if (fseek(g_st.file, PTR2OFFSET(ptr), SEEK_SET)) {
-        return -1;
-    }
+struct backend_state
+{
+    int fd;
+    char *map;                  ///< mapping of the image in mapped mode or NULL
+    size_t data_size;
+    struct capfs_buddy heap;    ///< region allocator for the data region
+};
 
-    if (fread(&md, sizeof(md), 1, g_st.file) != 1) {
-        return -1;
-    }
+static struct backend_state g_st = { .fd = -1 };
 
-    return 0;
-}
 
-static int metadata_rawwrite(uint64_t ptr, uint32_t md)
-{
-    assert(PTR2OFFSET(ptr) < BACKEND_FILES_DATA_OFFSET);
+/*
+ * ============================================================================
+ * Capability
+ * ============================================================================
+ *
+ * The encoding of capabilities is in capfs_capability.h.
+ */
 
-    if (g_st.file == NULL) {
-        return -1;
-    }
 
-    if (fseek(g_st.file, PTR2OFFSET(ptr), SEEK_SET)) {
-        return -1;
-    }
+#define dump_capability(c) do { \
+    LOG("{%lx, %lx, %u}\n", (c)->base, (c)->size, (c)->perms); \
+        } while(0);
 
-    if (fwrite(&md, sizeof(md), 1, g_st.file) != 1) {
-        return -1;
+static void capability_decompress_bases_generic(const uint64_t *comp, size_t n,
+                                                uint64_t *bases)
+{
+    for (size_t i = 0; i < n; i++) {
+        uint8_t e = (comp[i] >> CAPABILITY_EXP_SHIFT)
+                    & CAPABILITY_MASK(CAPABILITY_EXP_BITS);
+        bases[i] = (comp[i] & CAPABILITY_MASK(CAPABILITY_BASE_BITS)) << e;
     }
-
-    return 0;
 }
 
-static int metadata_is_capability(uint64_t offset)
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void capability_decompress_bases_avx2(const uint64_t *comp, size_t n,
+                                             uint64_t *bases)
 {
-    uint64_t ptr = offset / sizeof(uintptr_t);
-
-    /* must be pointer aligned */
-    if (offset & 0x3) {
-        return 0;
+    const __m256i emask =
+        _mm256_set1_epi64x(CAPABILITY_MASK(CAPABILITY_EXP_BITS));
+    const __m256i bmask =
+        _mm256_set1_epi64x(CAPABILITY_MASK(CAPABILITY_BASE_BITS));
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(comp + i));
+        __m256i e = _mm256_and_si256(_mm256_srli_epi64(c, CAPABILITY_EXP_SHIFT),
+                                     emask);
+        __m256i b = _mm256_sllv_epi64(_mm256_and_si256(c, bmask), e);
+        _mm256_storeu_si256((__m256i *)(bases + i), b);
     }
 
-
-    uint32_t md = 0;
-    metadata_rawread(ptr, &md);
-
-    return (md & (1 << ptr % 32));
+    capability_decompress_bases_generic(comp + i, n - i, bases + i);
 }
+#endif
 
-static int metadata_valid_bits_generic(uint64_t from, uint64_t to, bool set)
+/**
+ * @brief decodes the base addresses of an array of compressed capabilities
+ *
+ * @param comp      the compressed capabilities
+ * @param n         number of capabilities
+ * @param bases     returns the base addresses
+ */
+static void capability_decompress_bases(const uint64_t *comp, size_t n,
+                                        uint64_t *bases)
 {
-    assert(from <= to);
+#if defined(__x86_64__)
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
 
-    if (g_st.file == NULL) {
-        return -1;
+    if (avx2) {
+        capability_decompress_bases_avx2(comp, n, bases);
+        return;
     }
+#endif
+
+    capability_decompress_bases_generic(comp, n, bases);
+}
 
-    uint64_t ptr_from = from / sizeof(uintptr_t);
-    uint64_t ptr_to = (to + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
 
 
-    uint32_t md;
+/*
+ * ===========================================================================
+ * Derivation Tracking
+ * ===========================================================================
+ *
+ * Minting a capability records which capability it was derived from. Every
+ * revocation marks the record of the revoked capability and bumps a global
+ * revocation epoch. A record remembers the epoch in which its chain of
+ * parents was last found valid, so using a capability costs a lookup and an
+ * epoch compare; the chain is only walked once after each revocation.
+ * Capabilities without a record, e.g. the root and allocations, are valid.
+ */
 
-    uint64_t bit = ptr_from % 32;
-    if (bit) {
-        metadata_rawread(ptr_from, &md);
 
-        while((ptr_from <= ptr_to) && (bit < 32)) {
-            md = (set ? md | (1<< bit) : md & ~(1<< bit));
-            bit++;
-            ptr_from++;
-        }
+#define DERIV_NONE UINT32_MAX
 
-        metadata_rawwrite(ptr_from, md);
-    }
+struct derivation {
+    uint64_t comp;          ///< the compressed capability
+    uint32_t parent;        ///< record of the capability this was minted from
+    uint32_t next;          ///< next record in the bucket or on the free list
+    uint64_t checked;       ///< revocation epoch the chain was last valid in
+    bool revoked;           ///< the capability has been revoked
+};
 
-    assert((ptr_from % 32) == 0);
+static struct {
+    pthread_rwlock_t lock;
+    uint64_t epoch;         ///< bumped by every revocation
+    uint32_t used;          ///< number of records in use
+    uint32_t free;          ///< head of the list of free records
+    uint32_t buckets[1 << BACKEND_FILES_DERIV_BUCKET_BITS];
+    struct derivation *records;
+} g_deriv = { .lock = PTHREAD_RWLOCK_INITIALIZER, .epoch = 1 };
 
-    md = (set ? 0xffffffff : 0);
 
-    while(ptr_from + 32 <= ptr_to) {
-        metadata_rawwrite(ptr_from, md);
-        ptr_from += 32;
+static int derivation_init(void)
+{
+    g_deriv.records = calloc(BACKEND_FILES_DERIV_RECORDS,
+                             sizeof(struct derivation));
+    if (g_deriv.records == NULL) {
+        return -ENOMEM;
     }
 
-    if (ptr_from < ptr_to) {
-
-        metadata_rawread(ptr_from, &md);
-        bit = 0;
-        while((ptr_from <= ptr_to)) {
-            assert(bit < 32);
-            md = (set ? md | (1<< bit) : md & ~(1<< bit));
-            bit++;
-            ptr_from++;
-        }
+    for (uint32_t i = 0; i < BACKEND_FILES_DERIV_RECORDS; i++) {
+        g_deriv.records[i].next = i + 1;
+    }
+    g_deriv.records[BACKEND_FILES_DERIV_RECORDS - 1].next = DERIV_NONE;
 
-        metadata_rawwrite(ptr_from, md);
+    for (uint32_t i = 0; i < (1U << BACKEND_FILES_DERIV_BUCKET_BITS); i++) {
+        g_deriv.buckets[i] = DERIV_NONE;
     }
 
+    g_deriv.free = 0;
+    g_deriv.used = 0;
+    g_deriv.epoch = 1;
+
     return 0;
 }
 
-
-static int metadata_clear_valid_bits(uint64_t from, uint64_t to)
+static void derivation_destroy(void)
 {
-    return metadata_valid_bits_generic(from, to, false);
+    free(g_deriv.records);
+    g_deriv.records = NULL;
+    __atomic_store_n(&g_deriv.used, 0, __ATOMIC_RELAXED);
 }
 
-static int metadata_set_valid_bits(uint64_t from, uint64_t to)
+static inline uint32_t derivation_hash(uint64_t comp)
 {
-    return metadata_valid_bits_generic(from, to, true);
+    return (uint32_t)((comp * 0x9e3779b97f4a7c15UL)
+                      >> (64 - BACKEND_FILES_DERIV_BUCKET_BITS));
 }
 
-
-
-static inline uint64_t capstore_addr2offset(uintptr_t addr)
+/* the caller holds the lock */
+static uint32_t derivation_lookup(uint64_t comp)
 {
-    return addr + BACKEND_FILES_DATA_OFFSET;
-}
+    uint32_t i = g_deriv.buckets[derivation_hash(comp)];
+    while (i != DERIV_NONE && g_deriv.records[i].comp != comp) {
+        i = g_deriv.records[i].next;
+    }
 
+    return i;
+}
 
-static int capstore_rawread(uint64_t offset, void *rbuf, size_t bytes)
+/* the caller holds the lock for writing */
+static uint32_t derivation_insert(uint64_t comp, uint32_t parent)
 {
-    if (g_st.file == NULL) {
-        LOGA("no file set\n");
-        return -1;
+    uint32_t i = g_deriv.free;
+    if (i == DERIV_NONE) {
+        return DERIV_NONE;
     }
 
-    if (offset + bytes >= g_st.data_size) {
-        LOGA("outside of data range\n");
-        return -1;
-    }
+    struct derivation *d = &g_deriv.records[i];
+    g_deriv.free = d->next;
 
-    if (fseek(g_st.file, capstore_addr2offset(offset), SEEK_SET)) {
-        LOGA("seek failed\n");
-        return -1;
-    }
+    uint32_t h = derivation_hash(comp);
+    d->comp = comp;
+    d->parent = parent;
+    d->checked = g_deriv.epoch;
+    d->revoked = false;
+    d->next = g_deriv.buckets[h];
+    g_deriv.buckets[h] = i;
 
-    if (fread(rbuf, 1, bytes, g_st.file) != 1) {
-        return ferror(g_st.file);
-    }
+    __atomic_store_n(&g_deriv.used, g_deriv.used + 1, __ATOMIC_RELAXED);
 
-    return 0;
+    return i;
 }
 
-static int capstore_rawwrite(uint64_t offset, const void *wbuf, size_t bytes)
+/**
+ * @brief checks whether a capability or one of its ancestors was revoked
+ *
+ * @param comp  the compressed capability
+ *
+ * @return 0 if the capability is valid, -EACCES if it was revoked
+ */
+static int derivation_check(uint64_t comp)
 {
-    if (g_st.file == NULL) {
-        return -1;
-    }
-
-    if (offset + bytes >= g_st.data_size) {
-        return -1;
-    }
-
-    if (fseek(g_st.file, capstore_addr2offset(offset), SEEK_SET)) {
-        return -1;
-    }
-
-    if (fwrite(wbuf, 1, bytes, g_st.file) != 1) {
-        return ferror(g_st.file);
+    if (__atomic_load_n(&g_deriv.used, __ATOMIC_RELAXED) == 0) {
+        return 0;
     }
 
-    return 0;
-}
+    int err = 0;
 
+    pthread_rwlock_rdlock(&g_deriv.lock);
 
+    uint32_t i = derivation_lookup(comp);
+    if (i != DERIV_NONE) {
+        struct derivation *d = &g_deriv.records[i];
+        if (__atomic_load_n(&d->checked, __ATOMIC_RELAXED) != g_deriv.epoch) {
+            for (; i != DERIV_NONE; i = g_deriv.records[i].parent) {
+                if (g_deriv.records[i].revoked) {
+                    err = -EACCES;
+                    break;
+                }
+            }
 
+            if (!err) {
+                __atomic_store_n(&d->checked, g_deriv.epoch, __ATOMIC_RELAXED);
+            }
+        }
+    }
 
+    pthread_rwlock_unlock(&g_deriv.lock);
 
+    return err;
+}
 
-/*
- * ============================================================================
- * Backend initialization
- * ============================================================================
+/**
+ * @brief drops the records of all capabilities within a region
+ *
+ * @param base  start address of the region
+ * @param size  size of the region in bytes
+ *
+ * Capabilities derived from a region lie within it, so freeing the region
+ * drops whole derivation trees and a new allocation of the region starts
+ * without stale revocations.
  */
+static void derivation_drop_region(uint64_t base, uint64_t size)
+{
+    if (__atomic_load_n(&g_deriv.used, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
 
+    pthread_rwlock_wrlock(&g_deriv.lock);
+
+    for (uint32_t h = 0; h < (1U << BACKEND_FILES_DERIV_BUCKET_BITS); h++) {
+        uint32_t *link = &g_deriv.buckets[h];
+        while (*link != DERIV_NONE) {
+            struct derivation *d = &g_deriv.records[*link];
+
+            struct capability c;
+            capability_decompress(d->comp, &c);
+            if (c.base < base || c.base >= base + size) {
+                link = &d->next;
+                continue;
+            }
+
+            uint32_t i = *link;
+            *link = d->next;
+            d->next = g_deriv.free;
+            g_deriv.free = i;
+            g_deriv.used--;
+        }
+    }
+
+    pthread_rwlock_unlock(&g_deriv.lock);
+}
 
 /**
- * @brief initializes the backend
- *
- * @param conn      the FUSE connection information
- * @param cfg       the FUSE configuration
+ * @brief moves the records of all capabilities within a region
  *
- * @return pointer to allocated backend data structure
+ * @param from  old start address of the region
+ * @param to    new start address of the region
+ * @param size  size of the region in bytes
  *
- * Note this also obtains the root capability for the backend
+ * The records keep their parents and revocation state.
  */
-void *capfs_backend_init(struct fuse_conn_info * conn,
-                         struct fuse_config * cfg)
+static void derivation_relocate(uint64_t from, uint64_t to, uint64_t size)
 {
-    int err;
+    if (__atomic_load_n(&g_deriv.used, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
 
-    LOG("Initializing backend conn=%p, cfg=%p\n", conn, cfg);
+    pthread_rwlock_wrlock(&g_deriv.lock);
+
+    /* unlinked first, so no record is visited twice */
+    uint32_t moved = DERIV_NONE;
+    for (uint32_t h = 0; h < (1U << BACKEND_FILES_DERIV_BUCKET_BITS); h++) {
+        uint32_t *link = &g_deriv.buckets[h];
+        while (*link != DERIV_NONE) {
+            struct derivation *d = &g_deriv.records[*link];
+
+            struct capability c;
+            capability_decompress(d->comp, &c);
+            if (c.base < from || c.base >= from + size) {
+                link = &d->next;
+                continue;
+            }
+
+            uint32_t i = *link;
+            *link = d->next;
+            d->next = moved;
+            moved = i;
+        }
+    }
 
-    (void)conn;
-    (void)cfg;
+    while (moved != DERIV_NONE) {
+        struct derivation *d = &g_deriv.records[moved];
+        uint32_t next = d->next;
 
+        struct capability c;
+        capability_decompress(d->comp, &c);
+        c.base = c.base - from + to;
+        d->comp = capability_compres(&c);
 
-    LOG("Attempt to open file '%s'\n", BACKEND_FILES_PATH);
-    g_st.file = fopen ( BACKEND_FILES_PATH , "r+b" );
-    if (g_st.file == NULL) {
-        LOGA("The file does not exist.. creating...\n");
-        g_st.file = fopen ( BACKEND_FILES_PATH , "w+b");
-        if (g_st.file == NULL) {
-            PANIC(errno, "%s\n", "ERROR while opening file");
-        }
+        uint32_t h = derivation_hash(d->comp);
+        d->next = g_deriv.buckets[h];
+        g_deriv.buckets[h] = moved;
 
-        LOG("Truncate file to %" PRIu64" bytes\n", BACKEND_FILES_TOTAL_SIZE);
-        if((err = truncate(BACKEND_FILES_PATH, BACKEND_FILES_TOTAL_SIZE))) {
-            PANIC(err, "%s\n", "ERROR while truncating file");
-        }
+        moved = next;
     }
 
-    fseek(g_st.file, 0L, SEEK_END);
-    if(ftell(g_st.file) != BACKEND_FILES_TOTAL_SIZE) {
-        PANIC(EINVAL, "bad file size: %" PRIu64 " expected %" PRIu64 "\n",
-              ftell(g_st.file), BACKEND_FILES_TOTAL_SIZE);
-    };
-    rewind(g_st.file);
-
-
-    g_st.data_size = BACKEND_FILES_SIZE;
+    pthread_rwlock_unlock(&g_deriv.lock);
+}
 
-    /* create the root capability */
 
-    struct capability rootcap = {0, BACKEND_FILES_SIZE, BACKEND_FILES_SIZE_BITS,
-                                 CAPFS_CAPABILITY_PERM_READ |
-                                 CAPFS_CAPABILITY_PERM_WRITE |
-                                 CAPFS_CAPABILITY_PERM_EXEC};
 
-    LOGA("setting root capability\n");
-    capability_to_capref(&rootcap, &capfs_root_capability);
+/*
+ * ===========================================================================
+ * Revocation Bitmap
+ * ===========================================================================
+ *
+ * Freed regions are painted into a bitmap with one bit per allocation
+ * granule. Their addresses stay in quarantine until the sweeper has cleared
+ * all stored capabilities pointing into them, so a capability stored before
+ * the free never grants access to a later allocation of the region.
+ */
 
 
-    return NULL;
-}
+static uint64_t g_revmap[(BACKEND_FILES_SIZE >> BACKEND_FILES_ALLOC_MIN_BITS) / 64];
 
 
-/**
- * @brief destroys the backend
- *
- * @param st    pointer to the returned backend data structure of init()
- *
- * @return error number TODO: possible error values
- */
-int capfs_backend_destroy(void *st)
+/* paints or clears the granules of a region */
+static void revmap_paint(uint64_t base, uint64_t size, bool paint)
 {
-    (void)st;
+    uint64_t g = base >> BACKEND_FILES_ALLOC_MIN_BITS;
+    uint64_t end = (base + size) >> BACKEND_FILES_ALLOC_MIN_BITS;
 
-    return 0;
+    for (; g < end; g++) {
+        uint64_t bit = 1UL << (g % 64);
+        if (paint) {
+            __atomic_fetch_or(&g_revmap[g / 64], bit, __ATOMIC_RELEASE);
+        } else {
+            __atomic_fetch_and(&g_revmap[g / 64], ~bit, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* paints the first granule of a region, false if it was painted already */
+static inline bool revmap_claim(uint64_t base)
+{
+    uint64_t g = base >> BACKEND_FILES_ALLOC_MIN_BITS;
+    uint64_t bit = 1UL << (g % 64);
+
+    return !(__atomic_fetch_or(&g_revmap[g / 64], bit, __ATOMIC_ACQ_REL) & bit);
+}
+
+/* checks whether an address lies in a region in quarantine */
+static inline bool revmap_test(uint64_t addr)
+{
+    uint64_t g = addr >> BACKEND_FILES_ALLOC_MIN_BITS;
+    if (g >= (BACKEND_FILES_SIZE >> BACKEND_FILES_ALLOC_MIN_BITS)) {
+        return false;
+    }
+
+    return (__atomic_load_n(&g_revmap[g / 64], __ATOMIC_ACQUIRE)
+            >> (g % 64)) & 1;
+}
+
+
+
+/*
+ * ===========================================================================
+ * Region Table
+ * ===========================================================================
+ *
+ * The size of every allocated region is recorded at the granule it starts
+ * at. A region is aligned to the smallest power of two that holds it, so the
+ * region containing an address is found by probing one start per order.
+ * Regions mapped by clients are pinned and never moved by the compactor.
+ */
+
+
+#define REGION_PINNED (1U << 31)
+
+static uint32_t g_regions[BACKEND_FILES_SIZE >> BACKEND_FILES_ALLOC_MIN_BITS];
+
+static inline void region_track(uint64_t base, uint64_t size)
+{
+    __atomic_store_n(&g_regions[base >> BACKEND_FILES_ALLOC_MIN_BITS],
+                     (uint32_t)(size >> BACKEND_FILES_ALLOC_MIN_BITS),
+                     __ATOMIC_SEQ_CST);
+}
+
+static inline void region_forget(uint64_t base)
+{
+    __atomic_store_n(&g_regions[base >> BACKEND_FILES_ALLOC_MIN_BITS], 0,
+                     __ATOMIC_RELEASE);
+}
+
+/* returns the size of the region starting at a granule, 0 if there is none */
+static inline uint64_t region_size(uint64_t g)
+{
+    return (uint64_t)(__atomic_load_n(&g_regions[g], __ATOMIC_ACQUIRE)
+                      & ~REGION_PINNED) << BACKEND_FILES_ALLOC_MIN_BITS;
+}
+
+static inline void region_pin(uint64_t base)
+{
+    __atomic_fetch_or(&g_regions[base >> BACKEND_FILES_ALLOC_MIN_BITS],
+                      REGION_PINNED, __ATOMIC_RELEASE);
+}
+
+static inline void region_unpin(uint64_t base)
+{
+    __atomic_fetch_and(&g_regions[base >> BACKEND_FILES_ALLOC_MIN_BITS],
+                       ~REGION_PINNED, __ATOMIC_RELEASE);
+}
+
+static inline bool region_pinned(uint64_t g)
+{
+    return __atomic_load_n(&g_regions[g], __ATOMIC_ACQUIRE) & REGION_PINNED;
+}
+
+/**
+ * @brief finds the allocated region containing an address
+ *
+ * @param addr      the address
+ * @param ret_base  returns the base of the region
+ * @param ret_size  returns the size of the region
+ *
+ * @return true if the address lies in an allocated region
+ */
+static bool region_lookup(uint64_t addr, uint64_t *ret_base, uint64_t *ret_size)
+{
+    if (addr >= BACKEND_FILES_SIZE) {
+        return false;
+    }
+
+    for (uint8_t k = BACKEND_FILES_ALLOC_MIN_BITS; k <= BACKEND_FILES_SIZE_BITS;
+         k++) {
+        uint64_t base = addr & ~((1UL << k) - 1);
+        uint64_t size = region_size(base >> BACKEND_FILES_ALLOC_MIN_BITS);
+        if (size && addr < base + size) {
+            *ret_base = base;
+            *ret_size = size;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+/*
+ * ===========================================================================
+ * Region Relocation
+ * ===========================================================================
+ *
+ * The compactor moves a region while it holds the sequence locks of its old
+ * and new place, and relocates the caprefs and derivation records along with
+ * it. Then it rewrites the capabilities stored in the image. Until it is
+ * done, stored capabilities to the old place are forwarded when they are
+ * loaded, copied or swept.
+ *
+ * Operations decode their caprefs before they access the store, a move in
+ * between leaves them with a stale address. They note the number of moves
+ * before decoding and repeat the access if a move happened before they are
+ * done. Operations that cannot be repeated check this under their locks.
+ */
+
+
+static struct {
+    pthread_rwlock_t lock;  ///< held for writing while a region is moved
+    uint64_t moves;         ///< odd while the move state is changed
+    bool active;            ///< stored capabilities are forwarded
+    uint64_t from;          ///< old start address of the moved region
+    uint64_t to;            ///< new start address of the moved region
+    uint64_t size;          ///< size of the moved region
+} g_move = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+
+/* returns the number of moves to pass to move_raced() */
+static inline uint64_t move_begin(void)
+{
+    unsigned spins = 0;
+    while (true) {
+        uint64_t m = __atomic_load_n(&g_move.moves, __ATOMIC_ACQUIRE);
+        if (!(m & 1)) {
+            return m;
+        }
+        if (++spins < BACKEND_FILES_SEQ_SPINS) {
+            CAPSTORE_CPU_RELAX();
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+/* checks whether a region was moved since move_begin() */
+static inline bool move_raced(uint64_t moves)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&g_move.moves, __ATOMIC_RELAXED) != moves;
+}
+
+/* changes the move state, the caller holds the lock for writing */
+static void move_publish(bool active, uint64_t from, uint64_t to,
+                         uint64_t size)
+{
+    __atomic_add_fetch(&g_move.moves, 1, __ATOMIC_SEQ_CST);
+
+    __atomic_store_n(&g_move.from, from, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_move.to, to, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_move.size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_move.active, active, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&g_move.moves, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief forwards a stored capability to the new place of a moved region
+ *
+ * @param comp  the compressed capability, updated if it was forwarded
+ *
+ * @return true if the capability was forwarded
+ */
+static bool move_forward(uint64_t *comp)
+{
+    uint64_t m, from, to, size;
+    bool active;
+    do {
+        m = move_begin();
+        active = __atomic_load_n(&g_move.active, __ATOMIC_RELAXED);
+        from = __atomic_load_n(&g_move.from, __ATOMIC_RELAXED);
+        to = __atomic_load_n(&g_move.to, __ATOMIC_RELAXED);
+        size = __atomic_load_n(&g_move.size, __ATOMIC_RELAXED);
+    } while (move_raced(m));
+
+    if (!active) {
+        return false;
+    }
+
+    struct capability c;
+    capability_decompress(*comp, &c);
+    if (c.base - from >= size) {
+        return false;
+    }
+
+    c.base = c.base - from + to;
+    *comp = capability_compres(&c);
+
+    return true;
+}
+
+
+
+/*
+ * ===========================================================================
+ * Capability to Capref Conversion
+ * ===========================================================================
+ *
+ * A capref is a sealed handle: the index of a slot in the capability table in
+ * the lower and the generation of the slot in the upper 32 bits. Slots hold
+ * the compressed capability and are validated with a single load of the slot.
+ * The generation is odd while the slot is in use and bumped when it is
+ * released, which revokes every capref to it. Generations start at random
+ * values, so caprefs cannot be guessed from the capability they refer to.
+ *
+ * Looking up the capref of a capability uses an open-addressed index from
+ * the compressed capability to its slot. Both are read without locks, only
+ * changes take the table lock.
+ */
+
+
+struct capslot {
+    uint64_t comp;          ///< the compressed capability
+    uint32_t gen;           ///< generation, odd while in use
+    uint32_t pos;           ///< index entry, or free list successor
+    uint32_t seen;          ///< collector cycle the capref was last used in
+};
+
+#define CAPTAB_SLOTS (1U << BACKEND_FILES_CAPTAB_BITS)
+#define CAPTAB_INDEX (2 * CAPTAB_SLOTS)
+#define CAPTAB_EMPTY UINT32_MAX
+#define CAPTAB_TOMB  (UINT32_MAX - 1)
+
+static struct {
+    pthread_mutex_t lock;
+    struct capslot *slots;
+    uint32_t *index;        ///< compressed capability to slot
+    uint32_t free;          ///< head of the free slots, 0 if there is none
+    uint32_t used;          ///< used index entries including tombstones
+    bool revoked;           ///< capabilities were revoked since the last drop
+    uint32_t cycle;         ///< the current cycle of the garbage collector
+} g_captab = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* see the garbage collector, caprefs in use are among its roots */
+static void gc_shade(uint64_t addr);
+
+/* notes that a capref is in use, during a cycle its region stays reachable */
+static inline void captab_touch(uint32_t idx, uint64_t base)
+{
+    struct capslot *s = &g_captab.slots[idx];
+    uint32_t cycle = __atomic_load_n(&g_captab.cycle, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seen, __ATOMIC_RELAXED) != cycle) {
+        __atomic_store_n(&s->seen, cycle, __ATOMIC_RELAXED);
+        gc_shade(base);
+    }
+}
+
+
+static void captab_destroy(void)
+{
+    free(g_captab.slots);
+    free(g_captab.index);
+    g_captab.slots = NULL;
+    g_captab.index = NULL;
+}
+
+static int captab_init(void)
+{
+    g_captab.slots = calloc(CAPTAB_SLOTS, sizeof(struct capslot));
+    g_captab.index = malloc(CAPTAB_INDEX * sizeof(uint32_t));
+    if (g_captab.slots == NULL || g_captab.index == NULL) {
+        free(g_captab.slots);
+        free(g_captab.index);
+        return -ENOMEM;
+    }
+
+    memset(g_captab.index, 0xff, CAPTAB_INDEX * sizeof(uint32_t));
+
+    uint32_t gens[256];
+    for (uint32_t i = 0; i < CAPTAB_SLOTS; i++) {
+        if (i % 256 == 0 && getrandom(gens, sizeof(gens), 0) != sizeof(gens)) {
+            int err = -errno;
+            captab_destroy();
+            return err;
+        }
+        g_captab.slots[i].gen = gens[i % 256] & ~1U;
+        g_captab.slots[i].pos = i + 1;
+    }
+
+    /* slot 0 is never used, no capref is 0 */
+    g_captab.slots[CAPTAB_SLOTS - 1].pos = 0;
+    g_captab.free = 1;
+    g_captab.used = 0;
+
+    return 0;
+}
+
+static inline uint32_t captab_hash(uint64_t comp)
+{
+    return (comp * 0x9e3779b97f4a7c15UL)
+           >> (64 - (BACKEND_FILES_CAPTAB_BITS + 1));
+}
+
+/**
+ * @brief reads a slot of the capability table
+ *
+ * @param idx   index of the slot
+ * @param gen   the expected generation
+ * @param comp  returns the compressed capability
+ *
+ * @return true if the slot is in use with this generation
+ */
+static inline bool captab_read(uint32_t idx, uint32_t gen, uint64_t *comp)
+{
+    if (idx == 0 || idx >= CAPTAB_SLOTS || !(gen & 1)) {
+        return false;
+    }
+
+    struct capslot *s = &g_captab.slots[idx];
+    if (__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != gen) {
+        return false;
+    }
+
+    *comp = __atomic_load_n(&s->comp, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&s->gen, __ATOMIC_RELAXED) == gen;
+}
+
+/* looks up the capref of a capability, misses may be spurious */
+static uint64_t captab_find(uint64_t comp)
+{
+    uint32_t i = captab_hash(comp);
+    for (uint32_t n = 0; n < CAPTAB_INDEX; n++, i = (i + 1) % CAPTAB_INDEX) {
+        uint32_t idx = __atomic_load_n(&g_captab.index[i], __ATOMIC_ACQUIRE);
+        if (idx == CAPTAB_EMPTY) {
+            break;
+        }
+
+        if (idx == CAPTAB_TOMB) {
+            continue;
+        }
+
+        uint32_t gen = __atomic_load_n(&g_captab.slots[idx].gen,
+                                       __ATOMIC_ACQUIRE);
+        uint64_t c;
+        if (captab_read(idx, gen, &c) && c == comp) {
+            return ((uint64_t)gen << 32) | idx;
+        }
+    }
+
+    return 0;
+}
+
+/* rebuilds the index without tombstones, the lock is held */
+static void captab_rehash_locked(void)
+{
+    memset(g_captab.index, 0xff, CAPTAB_INDEX * sizeof(uint32_t));
+    g_captab.used = 0;
+
+    for (uint32_t idx = 1; idx < CAPTAB_SLOTS; idx++) {
+        struct capslot *s = &g_captab.slots[idx];
+        if (!(s->gen & 1)) {
+            continue;
+        }
+
+        uint32_t i = captab_hash(s->comp);
+        while (g_captab.index[i] != CAPTAB_EMPTY) {
+            i = (i + 1) % CAPTAB_INDEX;
+        }
+
+        s->pos = i;
+        __atomic_store_n(&g_captab.index[i], idx, __ATOMIC_RELEASE);
+        g_captab.used++;
+    }
+}
+
+/**
+ * @brief returns the capref of a capability, entering it into the table
+ *
+ * @param comp      the compressed capability
+ * @param capaddr   returns the capref
+ *
+ * @return 0 on success, -ENOMEM if the table is full
+ */
+static int captab_enter(uint64_t comp, uint64_t *capaddr)
+{
+    if ((*capaddr = captab_find(comp))) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_captab.lock);
+
+    if ((*capaddr = captab_find(comp))) {
+        pthread_mutex_unlock(&g_captab.lock);
+        return 0;
+    }
+
+    uint32_t idx = g_captab.free;
+    if (idx == 0) {
+        pthread_mutex_unlock(&g_captab.lock);
+        return -ENOMEM;
+    }
+
+    if (g_captab.used >= CAPTAB_INDEX / 4 * 3) {
+        captab_rehash_locked();
+    }
+
+    uint32_t i = captab_hash(comp);
+    while (g_captab.index[i] != CAPTAB_EMPTY
+           && g_captab.index[i] != CAPTAB_TOMB) {
+        i = (i + 1) % CAPTAB_INDEX;
+    }
+
+    if (g_captab.index[i] == CAPTAB_EMPTY) {
+        g_captab.used++;
+    }
+
+    struct capslot *s = &g_captab.slots[idx];
+    g_captab.free = s->pos;
+
+    uint32_t gen = s->gen + 1;
+    __atomic_store_n(&s->comp, comp, __ATOMIC_RELAXED);
+    s->pos = i;
+    __atomic_store_n(&s->gen, gen, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_captab.index[i], idx, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&g_captab.lock);
+
+    *capaddr = ((uint64_t)gen << 32) | idx;
+
+    return 0;
+}
+
+/* releases a slot, the lock is held and the caller bumps the epoch */
+static void captab_release_locked(uint32_t idx)
+{
+    struct capslot *s = &g_captab.slots[idx];
+
+    __atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_captab.index[s->pos], CAPTAB_TOMB, __ATOMIC_RELEASE);
+
+    s->pos = g_captab.free;
+    g_captab.free = idx;
+}
+
+/**
+ * @brief invalidates a capref
+ *
+ * @param capaddr   the capref
+ * @param comp      returns the compressed capability it referred to
+ *
+ * @return 0 on success, -EINVAL if the capref was not valid
+ */
+static int captab_release(uint64_t capaddr, uint64_t *comp)
+{
+    int err = -EINVAL;
+
+    pthread_mutex_lock(&g_captab.lock);
+
+    if (captab_read((uint32_t)capaddr, capaddr >> 32, comp)) {
+        captab_release_locked((uint32_t)capaddr);
+        __atomic_add_fetch(&g_deriv.epoch, 1, __ATOMIC_RELEASE);
+        err = 0;
+    }
+
+    pthread_mutex_unlock(&g_captab.lock);
+
+    return err;
+}
+
+/**
+ * @brief invalidates the caprefs to painted regions
+ *
+ * @return the number of invalidated caprefs
+ */
+static long captab_drop_painted(void)
+{
+    long dropped = 0;
+
+    pthread_mutex_lock(&g_captab.lock);
+
+    for (uint32_t idx = 1; idx < CAPTAB_SLOTS; idx++) {
+        struct capslot *s = &g_captab.slots[idx];
+        if (!(s->gen & 1)) {
+            continue;
+        }
+
+        struct capability c;
+        capability_decompress(s->comp, &c);
+        if (revmap_test(c.base)) {
+            captab_release_locked(idx);
+            dropped++;
+        }
+    }
+
+    if (dropped) {
+        __atomic_add_fetch(&g_deriv.epoch, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&g_captab.lock);
+
+    return dropped;
+}
+
+/**
+ * @brief invalidates the caprefs to revoked capabilities
+ *
+ * @return the number of invalidated caprefs
+ *
+ * Only the revoked capability loses its slot on revocation, the capabilities
+ * minted from it fail their derivation check but would keep their slots.
+ */
+static long captab_drop_revoked(void)
+{
+    if (!__atomic_exchange_n(&g_captab.revoked, false, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+
+    long dropped = 0;
+
+    /* checked without the table lock, it nests inside the derivation lock */
+    for (uint32_t idx = 1; idx < CAPTAB_SLOTS; idx++) {
+        struct capslot *s = &g_captab.slots[idx];
+        uint32_t gen = __atomic_load_n(&s->gen, __ATOMIC_ACQUIRE);
+        uint64_t comp;
+        if (!captab_read(idx, gen, &comp) || !derivation_check(comp)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&g_captab.lock);
+        if (s->gen == gen) {
+            captab_release_locked(idx);
+            dropped++;
+        }
+        pthread_mutex_unlock(&g_captab.lock);
+    }
+
+    if (dropped) {
+        __atomic_add_fetch(&g_deriv.epoch, 1, __ATOMIC_RELEASE);
+    }
+
+    return dropped;
+}
+
+/**
+ * @brief points the caprefs into a region to its new place
+ *
+ * @param from  old start address of the region
+ * @param to    new start address of the region
+ * @param size  size of the region in bytes
+ *
+ * The caprefs stay valid. Their slots are updated in place and entered into
+ * the index under the new capability.
+ */
+static void captab_relocate(uint64_t from, uint64_t to, uint64_t size)
+{
+    pthread_mutex_lock(&g_captab.lock);
+
+    for (uint32_t idx = 1; idx < CAPTAB_SLOTS; idx++) {
+        struct capslot *s = &g_captab.slots[idx];
+        if (!(s->gen & 1)) {
+            continue;
+        }
+
+        struct capability c;
+        capability_decompress(s->comp, &c);
+        if (c.base < from || c.base >= from + size) {
+            continue;
+        }
+
+        c.base = c.base - from + to;
+        uint64_t comp = capability_compres(&c);
+
+        __atomic_store_n(&g_captab.index[s->pos], CAPTAB_TOMB,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&s->comp, comp, __ATOMIC_RELEASE);
+
+        if (g_captab.used >= CAPTAB_INDEX / 4 * 3) {
+            captab_rehash_locked();
+            continue;
+        }
+
+        uint32_t i = captab_hash(comp);
+        while (g_captab.index[i] != CAPTAB_EMPTY
+               && g_captab.index[i] != CAPTAB_TOMB) {
+            i = (i + 1) % CAPTAB_INDEX;
+        }
+
+        if (g_captab.index[i] == CAPTAB_EMPTY) {
+            g_captab.used++;
+        }
+
+        s->pos = i;
+        __atomic_store_n(&g_captab.index[i], idx, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&g_captab.lock);
+}
+
+/**
+ * @brief recently decoded capabilities of this thread
+ *
+ * An entry is valid while the revocation epoch it was filled in is current.
+ */
+static __thread struct {
+    uint64_t capaddr;
+    uint64_t epoch;
+    struct capability c;
+} capref_cache[1 << BACKEND_FILES_CAP_CACHE_BITS];
+
+/* decodes a capref, from the cache of this thread if it is still valid */
+static int capref_lookup(capfs_capref_t cap, struct capability *ret_cap)
+{
+    uint64_t epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+
+    size_t slot = (cap.capaddr * 0x9e3779b97f4a7c15UL)
+                  >> (64 - BACKEND_FILES_CAP_CACHE_BITS);
+    if (capref_cache[slot].capaddr == cap.capaddr
+        && capref_cache[slot].epoch == epoch) {
+        *ret_cap = capref_cache[slot].c;
+        captab_touch((uint32_t)cap.capaddr, ret_cap->base);
+        return 0;
+    }
+
+    uint64_t comp;
+    if (!captab_read((uint32_t)cap.capaddr, cap.capaddr >> 32, &comp)) {
+        return -1;
+    }
+
+    if (derivation_check(comp)) {
+        return -1;
+    }
+
+    capability_decompress(comp, ret_cap);
+
+    captab_touch((uint32_t)cap.capaddr, ret_cap->base);
+
+    /* the slot is released by the sweeper, the region is freed already */
+    if (revmap_test(ret_cap->base)) {
+        return -1;
+    }
+
+    capref_cache[slot].capaddr = cap.capaddr;
+    capref_cache[slot].epoch = epoch;
+    capref_cache[slot].c = *ret_cap;
+
+    return 0;
+}
+
+int capref_to_capability(capfs_capref_t cap, struct capability *ret_cap)
+{
+    CAPFS_PROBE(capref_decode__entry, cap.capaddr);
+    int err = capref_lookup(cap, ret_cap);
+    CAPFS_PROBE(capref_decode__return, cap.capaddr, err);
+
+    return err;
+}
+
+int capability_to_capref(struct capability *cap, capfs_capref_t *ret_cap)
+{
+    CAPFS_PROBE(capref_encode__entry, cap->base, cap->size, cap->perms);
+    int err = captab_enter(capability_compres(cap), &ret_cap->capaddr);
+    if (!err) {
+        captab_touch((uint32_t)ret_cap->capaddr, cap->base);
+    }
+    CAPFS_PROBE(capref_encode__return, err ? 0 : ret_cap->capaddr, err);
+
+    return err;
+}
+
+/**
+ * @brief decodes a capability into bounds that remember the revocation epoch
+ */
+static int capref_to_bounds(capfs_capref_t cap, struct capfs_capbounds *bounds)
+{
+    /* loaded first, a revocation racing with the decode forces a recheck */
+    uint64_t epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return -1;
+    }
+
+    bounds->base = c.base;
+    bounds->size = c.size;
+    bounds->perms = c.perms;
+    bounds->epoch = epoch;
+    bounds->cap = cap;
+
+    return 0;
+}
+
+/**
+ * @brief checks bounds decoded before the last revocation or move
+ *
+ * @return 0 if still valid, -EACCES if revoked, -ESTALE if moved
+ */
+static int capbounds_revalidate(const struct capfs_capbounds *bounds)
+{
+    if (bounds->size == 0) {
+        return 0;
+    }
+
+    struct capability c;
+    if (capref_to_capability(bounds->cap, &c) || revmap_test(c.base)) {
+        return -EACCES;
+    }
+
+    if (c.base != bounds->base || c.size != bounds->size
+        || c.perms != bounds->perms) {
+        return -ESTALE;
+    }
+
+    return 0;
+}
+
+/* checks whether a region was revoked or freed since the epoch was loaded */
+static inline bool capbounds_raced(uint64_t epoch)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&g_deriv.epoch, __ATOMIC_RELAXED) != epoch;
+}
+
+/**
+ * @brief checks an access to [offset, offset + bytes) of a capability
+ *
+ * @param size      size of the capability
+ * @param perms     permissions of the capability
+ * @param want      permissions required by the access
+ * @param offset    offset of the access
+ * @param bytes     size of the access
+ *
+ * @return 0 if allowed, -EACCES on missing permissions, -1 if out of bounds
+ */
+static inline int capability_check_access(uint64_t size, capfs_capperms_t perms,
+                                          capfs_capperms_t want, off_t offset,
+                                          size_t bytes)
+{
+    if ((perms & want) != want) {
+        return -EACCES;
+    }
+
+    if (offset < 0 || (uint64_t)offset > size || bytes > size - offset) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief checks an access through decoded bounds
+ *
+ * See capability_check_access(). Bounds decoded before a revocation are
+ * checked against the derivation records again.
+ */
+static inline int capbounds_check_access(const struct capfs_capbounds *bounds,
+                                         capfs_capperms_t want, off_t offset,
+                                         size_t bytes)
+{
+    int err = capability_check_access(bounds->size, bounds->perms, want,
+                                      offset, bytes);
+    if (err) {
+        return err;
+    }
+
+    if (bounds->epoch != __atomic_load_n(&g_deriv.epoch, __ATOMIC_RELAXED)) {
+        return capbounds_revalidate(bounds);
+    }
+
+    return 0;
+}
+
+
+/*
+ * ============================================================================
+ * Meta data
+ * ============================================================================
+ */
+
+#define PTR2OFFSET(ptr) (((ptr) / (sizeof(uint32_t) * 8)) * sizeof(uint32_t))
+
+static int image_rawread(uint64_t offset, void *rbuf, size_t bytes)
+{
+    char *p = rbuf;
+    while (bytes) {
+        ssize_t r = pread(g_st.fd, p, bytes, offset);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (r == 0) {
+            return -1;
+        }
+
+        p += r;
+        offset += r;
+        bytes -= r;
+    }
+
+    return 0;
+}
+
+static int image_rawwrite(uint64_t offset, const void *wbuf, size_t bytes)
+{
+    const char *p = wbuf;
+    while (bytes) {
+        ssize_t r = pwrite(g_st.fd, p, bytes, offset);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        p += r;
+        offset += r;
+        bytes -= r;
+    }
+
+    return 0;
+}
+
+static int image_rawv(uint64_t offset, struct iovec *iov, int iovcnt,
+                      bool write)
+{
+    while (iovcnt) {
+        ssize_t r = write ? pwritev(g_st.fd, iov, iovcnt, offset)
+                          : preadv(g_st.fd, iov, iovcnt, offset);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (r == 0) {
+            return -1;
+        }
+
+        offset += r;
+
+        /* skip the completed buffers and advance into a partial one */
+        while (iovcnt && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+
+    return 0;
+}
+
+/* the meta data word of the pointer slot in mapped mode */
+static inline uint32_t *metadata_word(uint64_t ptr)
+{
+    return (uint32_t *)(g_st.map + PTR2OFFSET(ptr));
+}
+
+static int metadata_rawread(uint64_t ptr, uint32_t *md)
+{
+    assert(PTR2OFFSET(ptr) < BACKEND_FILES_DATA_OFFSET);
+
+    if (g_st.fd < 0) {
+        return -1;
+    }
+
+    CAPFS_PROBE(metadata_read__entry, ptr);
+
+    int err = 0;
+    if (g_st.map != NULL) {
+        *md = __atomic_load_n(metadata_word(ptr), __ATOMIC_ACQUIRE);
+    } else {
+        err = image_rawread(PTR2OFFSET(ptr), md, sizeof(*md));
+    }
+
+    CAPFS_PROBE(metadata_read__return, ptr, err ? 0 : *md, err);
+
+    return err;
+}
+
+static int metadata_rawwrite(uint64_t ptr, uint32_t md)
+{
+    assert(PTR2OFFSET(ptr) < BACKEND_FILES_DATA_OFFSET);
+
+    if (g_st.fd < 0) {
+        return -1;
+    }
+
+    CAPFS_PROBE(metadata_write__entry, ptr, md);
+
+    int err = 0;
+    if (g_st.map != NULL) {
+        __atomic_store_n(metadata_word(ptr), md, __ATOMIC_RELEASE);
+    } else {
+        err = image_rawwrite(PTR2OFFSET(ptr), &md, sizeof(md));
+    }
+
+    CAPFS_PROBE(metadata_write__return, ptr, md, err);
+
+    return err;
+}
+
+/**
+ * @brief checks whether the pointer slot at an address holds a capability
+ *
+ * @param addr  address in the store
+ */
+static int metadata_is_capability(uint64_t addr)
+{
+    uint64_t ptr = addr / sizeof(uintptr_t);
+
+    /* must be pointer aligned */
+    if (addr % sizeof(uintptr_t)) {
+        return 0;
+    }
+
+    uint32_t md = 0;
+    if (metadata_rawread(ptr, &md)) {
+        return 0;
+    }
+
+    return (md & (1U << ptr % 32)) != 0;
+}
+
+/**
+ * @brief sets or clears the valid bits of all pointer slots in [from, to)
+ */
+static int metadata_valid_bits_generic(uint64_t from, uint64_t to, bool set)
+{
+    assert(from <= to);
+
+    if (g_st.fd < 0) {
+        return -1;
+    }
+
+    uint64_t ptr_from = from / sizeof(uintptr_t);
+    uint64_t ptr_to = (to + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+
+    while (ptr_from < ptr_to) {
+        uint64_t bit = ptr_from % 32;
+        uint64_t nbits = 32 - bit;
+        if (nbits > ptr_to - ptr_from) {
+            nbits = ptr_to - ptr_from;
+        }
+
+        uint32_t mask = (nbits == 32) ? 0xffffffff
+                                      : (((1U << nbits) - 1) << bit);
+
+        if (g_st.map != NULL) {
+            if (set) {
+                __atomic_fetch_or(metadata_word(ptr_from), mask, __ATOMIC_RELEASE);
+            } else {
+                __atomic_fetch_and(metadata_word(ptr_from), ~mask,
+                                   __ATOMIC_RELEASE);
+            }
+            ptr_from += nbits;
+            continue;
+        }
+
+        uint32_t md = 0;
+        if (mask != 0xffffffff && metadata_rawread(ptr_from, &md)) {
+            return -1;
+        }
+
+        md = (set ? md | mask : md & ~mask);
+
+        if (metadata_rawwrite(ptr_from, md)) {
+            return -1;
+        }
+
+        ptr_from += nbits;
+    }
+
+    return 0;
+}
+
+
+static int metadata_clear_valid_bits(uint64_t from, uint64_t to)
+{
+    return metadata_valid_bits_generic(from, to, false);
+}
+
+static int metadata_set_valid_bits(uint64_t from, uint64_t to)
+{
+    return metadata_valid_bits_generic(from, to, true);
+}
+
+/**
+ * @brief copies the valid bits of [src, src + bytes) to [dst, dst + bytes)
+ *
+ * @param src       source address in the store
+ * @param dst       destination address in the store
+ * @param bytes     number of bytes copied
+ *
+ * @return 0 on success, -1 on failure
+ *
+ * Only pointer slots that are completely covered by the copy keep their
+ * valid bit, and only if source and destination have the same alignment.
+ * All other touched slots of the destination are cleared. The source bits
+ * are read before the destination is modified, so the ranges may overlap.
+ */
+static int metadata_copy_valid_bits(uint64_t src, uint64_t dst, size_t bytes)
+{
+    const uint64_t slot = sizeof(uintptr_t);
+
+    uint64_t first = (src + slot - 1) / slot;
+    uint64_t end = (src + bytes) / slot;
+
+    uint32_t *sbits = NULL;
+    uint64_t sw = first / 32;
+    if (((src ^ dst) % slot) == 0 && first < end) {
+        size_t nwords = (end - 1) / 32 - sw + 1;
+        sbits = malloc(nwords * sizeof(uint32_t));
+        if (sbits == NULL) {
+            return -1;
+        }
+
+        if (image_rawread(sw * sizeof(uint32_t), sbits,
+                          nwords * sizeof(uint32_t))) {
+            free(sbits);
+            return -1;
+        }
+
+        /* the common case: no capabilities in the source range */
+        uint32_t any = 0;
+        for (size_t i = 0; i < nwords; i++) {
+            any |= sbits[i];
+        }
+
+        if (!any) {
+            free(sbits);
+            sbits = NULL;
+        }
+    }
+
+    if (metadata_clear_valid_bits(dst, dst + bytes)) {
+        free(sbits);
+        return -1;
+    }
+
+    if (sbits == NULL) {
+        return 0;
+    }
+
+    uint64_t nslots = end - first;
+    uint64_t dfirst = (dst + (first * slot - src)) / slot;
+    uint64_t dw = dfirst / 32;
+    size_t nwords = (dfirst + nslots - 1) / 32 - dw + 1;
+
+    uint32_t *dbits = malloc(nwords * sizeof(uint32_t));
+    if (dbits == NULL
+        || image_rawread(dw * sizeof(uint32_t), dbits, nwords * sizeof(uint32_t))) {
+        free(dbits);
+        free(sbits);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < nslots; i++) {
+        uint64_t s = first + i - sw * 32;
+        if (sbits[s / 32] & (1U << (s % 32))) {
+            uint64_t d = dfirst + i - dw * 32;
+            dbits[d / 32] |= (1U << (d % 32));
+        }
+    }
+
+    int err = image_rawwrite(dw * sizeof(uint32_t), dbits,
+                             nwords * sizeof(uint32_t));
+
+    free(dbits);
+    free(sbits);
+
+    return err;
+}
+
+
+
+/*
+ * ============================================================================
+ * Capability Scanning
+ * ============================================================================
+ */
+
+
+/**
+ * @brief reports the set valid bits of a meta data word pair
+ *
+ * @param w         64 valid bits, bit 0 is the pointer slot ptr
+ * @param ptr       the pointer slot of bit 0
+ * @param from      first pointer slot to report
+ * @param to        end of the pointer slots to report
+ * @param addrs     returns the addresses of the capabilities
+ * @param n         number of reported addresses so far
+ * @param max       capacity of addrs
+ *
+ * @return new number of reported addresses
+ */
+static inline size_t metadata_scan_bits(uint64_t w, uint64_t ptr,
+                                        uint64_t from, uint64_t to,
+                                        uint64_t *addrs, size_t n, size_t max)
+{
+    while (w && n < max) {
+        uint64_t p = ptr + __builtin_ctzll(w);
+        w &= w - 1;
+        if (p >= from && p < to) {
+            addrs[n++] = p * sizeof(uintptr_t);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * @brief finds the set valid bits in an array of meta data words
+ *
+ * @param md        the meta data words, an even number of them
+ * @param nwords    the number of meta data words
+ * @param ptr       the pointer slot of the first bit of md
+ * @param from      first pointer slot to report
+ * @param to        end of the pointer slots to report
+ * @param addrs     returns the addresses of the capabilities
+ * @param n         number of reported addresses so far
+ * @param max       capacity of addrs
+ *
+ * @return new number of reported addresses
+ */
+static size_t metadata_scan_generic(const uint32_t *md, size_t nwords,
+                                    uint64_t ptr, uint64_t from, uint64_t to,
+                                    uint64_t *addrs, size_t n, size_t max)
+{
+    for (size_t i = 0; i < nwords && n < max; i += 2) {
+        uint64_t w = md[i] | ((uint64_t)md[i + 1] << 32);
+        if (w) {
+            n = metadata_scan_bits(w, ptr + i * 32, from, to, addrs, n, max);
+        }
+    }
+
+    return n;
+}
+
+#if defined(__x86_64__)
+/* as metadata_scan_generic(), skipping 256 empty slots per compare */
+__attribute__((target("avx2")))
+static size_t metadata_scan_avx2(const uint32_t *md, size_t nwords,
+                                 uint64_t ptr, uint64_t from, uint64_t to,
+                                 uint64_t *addrs, size_t n, size_t max)
+{
+    size_t i = 0;
+    for (; i + 8 <= nwords && n < max; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(md + i));
+        if (_mm256_testz_si256(v, v)) {
+            continue;
+        }
+
+        n = metadata_scan_generic(md + i, 8, ptr + i * 32, from, to, addrs,
+                                  n, max);
+    }
+
+    return metadata_scan_generic(md + i, nwords - i, ptr + i * 32, from, to,
+                                 addrs, n, max);
+}
+#endif
+
+/**
+ * @brief finds the set valid bits in an array of meta data words
+ *
+ * See metadata_scan_generic(). Uses AVX2 if the CPU supports it.
+ */
+static size_t metadata_scan(const uint32_t *md, size_t nwords, uint64_t ptr,
+                            uint64_t from, uint64_t to, uint64_t *addrs,
+                            size_t n, size_t max)
+{
+#if defined(__x86_64__)
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+
+    if (avx2) {
+        return metadata_scan_avx2(md, nwords, ptr, from, to, addrs, n, max);
+    }
+#endif
+
+    return metadata_scan_generic(md, nwords, ptr, from, to, addrs, n, max);
+}
+
+
+/*
+ * ============================================================================
+ * Sequence Locks
+ * ============================================================================
+ *
+ * A capability and its valid bit are stored in different places of the image.
+ * Every range of the store has a sequence lock. Stores of capabilities and
+ * data, which clear the valid bits, hold the locks of the ranges they modify
+ * and so never interleave. Loads of capabilities do not take the lock, but
+ * retry if the sequence changed while they read the valid bit and the data.
+ */
+
+
+static struct {
+    uint32_t seq;
+} __attribute__((aligned(CAPFS_CACHELINE_SIZE)))
+g_seq[BACKEND_FILES_SIZE >> BACKEND_FILES_SEQ_BITS];
+
+
+/* waits for a store holding a lock, the holder may have been preempted */
+static inline void capstore_seq_wait(unsigned *spins)
+{
+    if (++(*spins) < BACKEND_FILES_SEQ_SPINS) {
+        CAPSTORE_CPU_RELAX();
+    } else {
+        sched_yield();
+    }
+}
+
+
+/**
+ * @brief acquires or releases the sequence locks of up to two ranges
+ *
+ * @param from1     start of the first range
+ * @param to1       end of the first range
+ * @param from2     start of the second range
+ * @param to2       end of the second range
+ * @param lock      true to acquire the locks, false to release them
+ *
+ * The locks are taken in ascending order, so callers locking several ranges
+ * cannot deadlock. Empty ranges are ignored.
+ */
+static void capstore_seq_ranges(uint64_t from1, uint64_t to1, uint64_t from2,
+                                uint64_t to2, bool lock)
+{
+    const uint64_t n = sizeof(g_seq) / sizeof(g_seq[0]);
+
+    /* [f, l) are the locks of a range, clamped to the store */
+    uint64_t f1 = from1 >> BACKEND_FILES_SEQ_BITS;
+    uint64_t l1 = (from1 < to1) ? ((to1 - 1) >> BACKEND_FILES_SEQ_BITS) + 1 : f1;
+    uint64_t f2 = from2 >> BACKEND_FILES_SEQ_BITS;
+    uint64_t l2 = (from2 < to2) ? ((to2 - 1) >> BACKEND_FILES_SEQ_BITS) + 1 : f2;
+
+    uint64_t first = (f1 < f2) ? f1 : f2;
+    uint64_t last = (l1 > l2) ? l1 : l2;
+    if (last > n) {
+        last = n;
+    }
+
+    for (uint64_t i = first; i < last; i++) {
+        if (!((i >= f1 && i < l1) || (i >= f2 && i < l2))) {
+            continue;
+        }
+
+        if (!lock) {
+            __atomic_fetch_add(&g_seq[i].seq, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        unsigned spins = 0;
+        while (true) {
+            uint32_t s = __atomic_load_n(&g_seq[i].seq, __ATOMIC_RELAXED);
+            if (!(s & 1)
+                && __atomic_compare_exchange_n(&g_seq[i].seq, &s, s + 1, true,
+                                               __ATOMIC_ACQUIRE,
+                                               __ATOMIC_RELAXED)) {
+                break;
+            }
+            capstore_seq_wait(&spins);
+        }
+    }
+}
+
+static inline void capstore_write_lock(uint64_t from, uint64_t to)
+{
+    capstore_seq_ranges(from, to, from, to, true);
+}
+
+static inline void capstore_write_unlock(uint64_t from, uint64_t to)
+{
+    capstore_seq_ranges(from, to, from, to, false);
+}
+
+/**
+ * @brief starts a lock-free read of an address
+ *
+ * @return the sequence to pass to capstore_read_retry()
+ */
+static inline uint32_t capstore_read_begin(uint64_t addr)
+{
+    uint32_t *seq = &g_seq[addr >> BACKEND_FILES_SEQ_BITS].seq;
+    unsigned spins = 0;
+    while (true) {
+        uint32_t s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (!(s & 1)) {
+            return s;
+        }
+        capstore_seq_wait(&spins);
+    }
+}
+
+/**
+ * @brief checks whether a lock-free read raced with a store and must retry
+ */
+static inline bool capstore_read_retry(uint64_t addr, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&g_seq[addr >> BACKEND_FILES_SEQ_BITS].seq,
+                           __ATOMIC_RELAXED) != s;
+}
+
+
+
+static inline uint64_t capstore_addr2offset(uintptr_t addr)
+{
+    return addr + BACKEND_FILES_DATA_OFFSET;
+}
+
+
+/*
+ * ============================================================================
+ * Mapped Regions
+ * ============================================================================
+ *
+ * Clients never map the image. A region mapped by a client is copied into a
+ * memfd of its own, its shadow, and only the shadow is handed out. While the
+ * shadow exists it holds the data of the region: accesses of the daemon are
+ * redirected to it, and the region is pinned. The tags of a region are
+ * cleared when it is mapped writable and no tags are set while it is, so
+ * stores through the mapping cannot forge a capability. The data is written
+ * back to the image whenever a writable mapping is released.
+ *
+ * Shadows are created and removed holding the sequence lock of their region
+ * first, then the shadow lock for writing. Redirected accesses hold the shadow
+ * lock for reading.
+ */
+
+struct shadow {
+    uint64_t       base;        ///< start address of the region
+    uint64_t       size;        ///< size of the region in bytes
+    uint64_t       id;          ///< identifies the shadow in mappings
+    int            fd;          ///< the memfd holding the data
+    int            rofd;        ///< read-only descriptor of the memfd
+    char          *mem;         ///< mapping of the memfd in the daemon
+    uint32_t       refs;        ///< number of mappings
+    uint32_t       writers;     ///< number of writable mappings
+    struct shadow *next;
+};
+
+static struct {
+    pthread_rwlock_t lock;
+    uint32_t count;             ///< number of shadows, read without the lock
+    uint64_t ids;               ///< last handed out identifier
+    struct shadow *list;
+} g_shadow = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+/* checks whether any region is mapped, without taking the lock */
+static inline bool shadow_any(void)
+{
+    return __atomic_load_n(&g_shadow.count, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* finds the shadow containing an address or the next one above it */
+static struct shadow *shadow_next_locked(uint64_t addr)
+{
+    struct shadow *next = NULL;
+    for (struct shadow *sh = g_shadow.list; sh; sh = sh->next) {
+        if (sh->base + sh->size > addr && (!next || sh->base < next->base)) {
+            next = sh;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * @brief reads or writes a range of the store, redirecting to shadows
+ *
+ * @param addr      start address in the store
+ * @param buf       the buffer to read into or write from
+ * @param bytes     number of bytes to transfer
+ * @param write     true to write the range, false to read it
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int shadow_rw(uint64_t addr, void *buf, size_t bytes, bool write)
+{
+    int err = 0;
+    char *p = buf;
+
+    pthread_rwlock_rdlock(&g_shadow.lock);
+
+    while (bytes && !err) {
+        struct shadow *sh = shadow_next_locked(addr);
+
+        size_t chunk = bytes;
+        if (sh && sh->base <= addr) {
+            if (chunk > sh->base + sh->size - addr) {
+                chunk = sh->base + sh->size - addr;
+            }
+            char *mem = sh->mem + (addr - sh->base);
+            memcpy(write ? mem : p, write ? p : mem, chunk);
+        } else {
+            if (sh && chunk > sh->base - addr) {
+                chunk = sh->base - addr;
+            }
+            err = write ? image_rawwrite(capstore_addr2offset(addr), p, chunk)
+                        : image_rawread(capstore_addr2offset(addr), p, chunk);
+        }
+
+        addr += chunk;
+        p += chunk;
+        bytes -= chunk;
+    }
+
+    pthread_rwlock_unlock(&g_shadow.lock);
+
+    return err;
+}
+
+/* reads a range of the store, from the shadows of mapped regions */
+static inline int shadow_read(uint64_t addr, void *rbuf, size_t bytes)
+{
+    if (shadow_any()) {
+        return shadow_rw(addr, rbuf, bytes, false);
+    }
+
+    return image_rawread(capstore_addr2offset(addr), rbuf, bytes);
+}
+
+/* writes a range of the store, to the shadows of mapped regions */
+static inline int shadow_write(uint64_t addr, const void *wbuf, size_t bytes)
+{
+    if (shadow_any()) {
+        return shadow_rw(addr, (void *)wbuf, bytes, true);
+    }
+
+    return image_rawwrite(capstore_addr2offset(addr), wbuf, bytes);
+}
+
+/* zeroes the shadowed parts of a range */
+static void shadow_zero(uint64_t addr, size_t bytes)
+{
+    pthread_rwlock_rdlock(&g_shadow.lock);
+
+    for (struct shadow *sh = g_shadow.list; sh; sh = sh->next) {
+        uint64_t end = sh->base + sh->size;
+        uint64_t from = (addr > sh->base) ? addr : sh->base;
+        uint64_t to = (addr + bytes < end) ? addr + bytes : end;
+        if (from < to) {
+            memset(sh->mem + (from - sh->base), 0, to - from);
+        }
+    }
+
+    pthread_rwlock_unlock(&g_shadow.lock);
+}
+
+/* checks whether a range overlaps a region that is mapped writable */
+static bool shadow_writable(uint64_t addr, size_t bytes)
+{
+    if (!shadow_any()) {
+        return false;
+    }
+
+    bool writable = false;
+
+    pthread_rwlock_rdlock(&g_shadow.lock);
+
+    struct shadow *sh = shadow_next_locked(addr);
+    for (; sh && sh->base < addr + bytes; sh = shadow_next_locked(sh->base
+                                                                 + sh->size)) {
+        if (sh->writers) {
+            writable = true;
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&g_shadow.lock);
+
+    return writable;
+}
+
+/* finds a shadow by its identifier, the caller holds the shadow lock */
+static struct shadow **shadow_find_locked(uint64_t id)
+{
+    struct shadow **psh = &g_shadow.list;
+    while (*psh && (*psh)->id != id) {
+        psh = &(*psh)->next;
+    }
+
+    return psh;
+}
+
+/* removes a shadow from the list, the caller holds the shadow lock */
+static void shadow_unlink_locked(struct shadow **psh)
+{
+    struct shadow *sh = *psh;
+    *psh = sh->next;
+    __atomic_sub_fetch(&g_shadow.count, 1, __ATOMIC_RELEASE);
+
+    /* the mappings of the clients keep the memfd alive */
+    munmap(sh->mem, sh->size);
+    close(sh->rofd);
+    close(sh->fd);
+    free(sh);
+}
+
+/* drops the shadow of a freed region without writing it back */
+static void shadow_detach(uint64_t base)
+{
+    if (!shadow_any()) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&g_shadow.lock);
+
+    struct shadow **psh = &g_shadow.list;
+    while (*psh && (*psh)->base != base) {
+        psh = &(*psh)->next;
+    }
+
+    if (*psh) {
+        LOG("detached shadow of region base=%lx\n", base);
+        shadow_unlink_locked(psh);
+    }
+
+    pthread_rwlock_unlock(&g_shadow.lock);
+}
+
+/* finds the region containing an address, if it is shadowed */
+static bool shadow_covers(uint64_t addr, uint64_t *ret_end)
+{
+    if (!shadow_any()) {
+        return false;
+    }
+
+    pthread_rwlock_rdlock(&g_shadow.lock);
+
+    struct shadow *sh = shadow_next_locked(addr);
+    bool covered = sh && sh->base <= addr;
+    if (covered) {
+        *ret_end = sh->base + sh->size;
+    }
+
+    pthread_rwlock_unlock(&g_shadow.lock);
+
+    return covered;
+}
+
+
+
+static int capstore_rawread(uint64_t offset, void *rbuf, size_t bytes)
+{
+    if (g_st.fd < 0) {
+        LOGA("no file set\n");
+        return -1;
+    }
+
+    if (offset + bytes > g_st.data_size) {
+        LOGA("outside of data range\n");
+        return -1;
+    }
+
+    CAPFS_PROBE(capstore_read__entry, offset, bytes);
+    int err = shadow_read(offset, rbuf, bytes);
+    CAPFS_PROBE(capstore_read__return, offset, bytes, err);
+
+    return err;
+}
+
+static int capstore_rawwrite(uint64_t offset, const void *wbuf, size_t bytes)
+{
+    if (g_st.fd < 0) {
+        return -1;
+    }
+
+    if (offset + bytes > g_st.data_size) {
+        return -1;
+    }
+
+    CAPFS_PROBE(capstore_write__entry, offset, bytes);
+    int err = shadow_write(offset, wbuf, bytes);
+    CAPFS_PROBE(capstore_write__return, offset, bytes, err);
+
+    return err;
+}
+
+/* loads the pointer slot at an aligned address */
+static int capstore_rawload(uint64_t addr, uint64_t *data)
+{
+    if (g_st.map != NULL && !shadow_any()) {
+        char *slot = g_st.map + capstore_addr2offset(addr);
+        *data = __atomic_load_n((uint64_t *)slot, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return capstore_rawread(addr, data, sizeof(*data));
+}
+
+/* stores to the pointer slot at an aligned address */
+static int capstore_rawstore(uint64_t addr, uint64_t data)
+{
+    if (g_st.map != NULL && !shadow_any()) {
+        char *slot = g_st.map + capstore_addr2offset(addr);
+        __atomic_store_n((uint64_t *)slot, data, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return capstore_rawwrite(addr, &data, sizeof(data));
+}
+
+/**
+ * @brief finds the capabilities stored in a range of the store
+ *
+ * @param from      start address of the range
+ * @param to        end address of the range
+ * @param addrs     returns the addresses of the capabilities in ascending order
+ * @param max       capacity of addrs
+ *
+ * @return number of found capabilities, or -1 on failure
+ *
+ * If max capabilities are returned, there may be more after the last one.
+ * Capabilities stored or cleared during the scan may or may not be reported.
+ */
+static long capstore_scan(uint64_t from, uint64_t to, uint64_t *addrs,
+                          size_t max)
+{
+    if (g_st.fd < 0 || from > to || to > g_st.data_size) {
+        return -1;
+    }
+
+    /* only slots entirely within the range can hold a capability */
+    uint64_t pfrom = (from + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+    uint64_t pto = to / sizeof(uintptr_t);
+    if (pfrom >= pto || max == 0) {
+        return 0;
+    }
+
+    /* scan whole pairs of meta data words */
+    uint64_t wfrom = (pfrom / 64) * 2;
+    uint64_t wto = ((pto + 63) / 64) * 2;
+
+    if (g_st.map != NULL) {
+        const uint32_t *md = metadata_word(wfrom * 32);
+        return metadata_scan(md, wto - wfrom, wfrom * 32, pfrom, pto, addrs, 0,
+                             max);
+    }
+
+    uint32_t md[BACKEND_FILES_SCAN_WORDS];
+    size_t n = 0;
+    for (uint64_t w = wfrom; w < wto && n < max; w += BACKEND_FILES_SCAN_WORDS) {
+        size_t nwords = wto - w;
+        if (nwords > BACKEND_FILES_SCAN_WORDS) {
+            nwords = BACKEND_FILES_SCAN_WORDS;
+        }
+
+        if (image_rawread(w * sizeof(uint32_t), md, nwords * sizeof(uint32_t))) {
+            return -1;
+        }
+
+        n = metadata_scan(md, nwords, w * 32, pfrom, pto, addrs, n, max);
+    }
+
+    return n;
+}
+
+/**
+ * @brief copies non-overlapping memory using non-temporal stores
+ *
+ * @param dst       the destination
+ * @param src       the source
+ * @param bytes     number of bytes to copy
+ *
+ * Large copies stream the destination past the caches, so moving data
+ * within the store does not evict the working set of the daemon.
+ */
+static void capstore_memcpy_nt(char *dst, const char *src, size_t bytes)
+{
+#if defined(__SSE2__)
+    if (bytes >= BACKEND_FILES_COPY_NT_MIN) {
+        size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        bytes -= head;
+
+        for (; bytes >= 64; bytes -= 64, src += 64, dst += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(src +  0));
+            __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+            __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+            _mm_stream_si128((__m128i *)(dst +  0), a);
+            _mm_stream_si128((__m128i *)(dst + 16), b);
+            _mm_stream_si128((__m128i *)(dst + 32), c);
+            _mm_stream_si128((__m128i *)(dst + 48), d);
+        }
+
+        /* order the streaming stores before anything that follows */
+        _mm_sfence();
+    }
+#endif
+
+    memcpy(dst, src, bytes);
+}
+
+/**
+ * @brief copies data within the capability store
+ *
+ * @param src       source address in the store
+ * @param dst       destination address in the store
+ * @param bytes     number of bytes to copy
+ *
+ * @return 0 on success, -1 on failure
+ *
+ * In mapped mode the data is copied through the mapping of the image. Else
+ * the copy is done by the kernel using copy_file_range() on the image file
+ * which allows file systems supporting reflinks to share the blocks instead
+ * of copying them. Overlapping ranges or file systems that do not support
+ * copy_file_range() fall back to a bounce buffer.
+ */
+static int capstore_rawcopy(uint64_t src, uint64_t dst, size_t bytes)
+{
+    if (g_st.fd < 0) {
+        return -1;
+    }
+
+    if (src + bytes > g_st.data_size || dst + bytes > g_st.data_size) {
+        return -1;
+    }
+
+    if (src == dst || bytes == 0) {
+        return 0;
+    }
+
+    bool overlap = (src < dst + bytes) && (dst < src + bytes);
+
+    /* mapped regions are copied through their shadows */
+    bool direct = !shadow_any();
+
+    if (direct && g_st.map != NULL) {
+        char *base = g_st.map + BACKEND_FILES_DATA_OFFSET;
+        if (overlap) {
+            memmove(base + dst, base + src, bytes);
+        } else {
+            capstore_memcpy_nt(base + dst, base + src, bytes);
+        }
+        return 0;
+    }
+
+    if (direct && !overlap) {
+        loff_t in = capstore_addr2offset(src);
+        loff_t out = capstore_addr2offset(dst);
+        while (bytes) {
+            ssize_t r = copy_file_range(g_st.fd, &in, g_st.fd, &out, bytes, 0);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                    || errno == EOPNOTSUPP) {
+                    break;
+                }
+                return -1;
+            }
+
+            if (r == 0) {
+                break;
+            }
+
+            bytes -= r;
+        }
+
+        src = in - BACKEND_FILES_DATA_OFFSET;
+        dst = out - BACKEND_FILES_DATA_OFFSET;
+    }
+
+    /* fallback: bounce buffer, copy backwards if dst is above an overlapping src */
+    char buf[BACKEND_FILES_COPY_CHUNK];
+    bool backwards = overlap && (dst > src);
+    while (bytes) {
+        size_t chunk = (bytes < sizeof(buf)) ? bytes : sizeof(buf);
+        uint64_t s = backwards ? src + bytes - chunk : src;
+        uint64_t d = backwards ? dst + bytes - chunk : dst;
+
+        if (shadow_read(s, buf, chunk)) {
+            return -1;
+        }
+
+        if (shadow_write(d, buf, chunk)) {
+            return -1;
+        }
+
+        if (!backwards) {
+            src += chunk;
+            dst += chunk;
+        }
+        bytes -= chunk;
+    }
+
+    return 0;
+}
+
+
+
+
+/* overwrites a range of the store with zeroes */
+static int capstore_rawzero(uint64_t offset, size_t bytes)
+{
+    static const char zeroes[4096] = {0};
+
+    while (bytes) {
+        size_t chunk = (bytes < sizeof(zeroes)) ? bytes : sizeof(zeroes);
+        if (image_rawwrite(capstore_addr2offset(offset), zeroes, chunk)) {
+            return -1;
+        }
+        offset += chunk;
+        bytes -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief zeroes a range of the capability store and releases its storage
+ *
+ * @param offset    start address in the store
+ * @param bytes     number of bytes to zero
+ *
+ * @return 0 on success, -1 on failure
+ *
+ * This punches a hole into the image file, so reading the range returns
+ * zeroes and seeking for data skips it. If the file system of the image does
+ * not support punching holes, the range is overwritten with zeroes.
+ */
+static int capstore_rawpunch(uint64_t offset, size_t bytes)
+{
+    if (g_st.fd < 0) {
+        return -1;
+    }
+
+    if (offset + bytes > g_st.data_size) {
+        return -1;
+    }
+
+    int err = 0;
+
+    capstore_write_lock(offset, offset + bytes);
+
+    if (metadata_clear_valid_bits(offset, offset + bytes)) {
+        err = -1;
+    } else if (fallocate(g_st.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         capstore_addr2offset(offset), bytes)) {
+        err = capstore_rawzero(offset, bytes);
+    }
+
+    if (!err && shadow_any()) {
+        shadow_zero(offset, bytes);
+    }
+
+    capstore_write_unlock(offset, offset + bytes);
+
+    return err;
+}
+
+/**
+ * @brief finds the next data or hole in the capability store
+ *
+ * @param offset    start address in the store
+ * @param whence    SEEK_DATA or SEEK_HOLE
+ *
+ * @return address of the next data or hole, or negative error number
+ */
+static off_t capstore_rawseek(uint64_t offset, int whence)
+{
+    if (g_st.fd < 0) {
+        return -EIO;
+    }
+
+    /* the shadow of a mapped region has no holes */
+    uint64_t end;
+    if (shadow_covers(offset, &end)) {
+        return (whence == SEEK_DATA) ? (off_t)offset : (off_t)end;
+    }
+
+    off_t r = lseek(g_st.fd, capstore_addr2offset(offset), whence);
+    if (r < 0) {
+        return -errno;
+    }
+
+    if ((uint64_t)r < BACKEND_FILES_DATA_OFFSET) {
+        return -EIO;
+    }
+
+    return r - BACKEND_FILES_DATA_OFFSET;
+}
+
+
+/*
+ * ============================================================================
+ * Revocation Sweeper
+ * ============================================================================
+ *
+ * The sweeper runs in the background and walks the store in slices. Each
+ * slice is locked while its capabilities are checked, so a store racing with
+ * the sweep either completes before the slice is swept or sees the painted
+ * region. After a complete pass the regions that were in quarantine when the
+ * pass started are returned to the allocator.
+ */
+
+
+struct quarantine {
+    uint64_t base;
+    uint64_t size;
+    struct quarantine *next;
+};
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;            ///< signalled when there is work
+    pthread_cond_t done;            ///< signalled when a pass completed
+    bool running;                   ///< the thread has been started
+    bool stop;                      ///< the thread should exit
+    uint64_t passes;                ///< number of completed passes
+    uint64_t epoch;                 ///< revocation epoch of the last pass
+    struct quarantine *pending;     ///< regions freed during the current pass
+    struct quarantine *sweeping;    ///< regions swept by the current pass
+} g_sweep = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .epoch = 1,
+};
+
+
+/**
+ * @brief invalidates the stale capabilities stored in a range
+ *
+ * @param from      start address of the range
+ * @param to        end address of the range
+ *
+ * @return the number of invalidated capabilities
+ *
+ * Capabilities to a region that is being moved are forwarded to its new
+ * place. The caller holds the sequence locks of the range.
+ */
+static long sweep_range_locked(uint64_t from, uint64_t to)
+{
+    uint64_t addrs[BACKEND_FILES_SWEEP_BATCH];
+    uint64_t comps[BACKEND_FILES_SWEEP_BATCH];
+    uint64_t bases[BACKEND_FILES_SWEEP_BATCH];
+    long cleared = 0;
+
+    while (from < to) {
+        long n = capstore_scan(from, to, addrs, BACKEND_FILES_SWEEP_BATCH);
+        if (n <= 0) {
+            break;
+        }
+
+        uint64_t next = addrs[n - 1] + sizeof(uint64_t);
+
+        long m = 0;
+        for (long i = 0; i < n; i++) {
+            if (capstore_rawload(addrs[i], &comps[m]) == 0) {
+                addrs[m++] = addrs[i];
+            }
+        }
+
+        for (long i = 0; i < m; i++) {
+            if (move_forward(&comps[i])) {
+                capstore_rawstore(addrs[i], comps[i]);
+            }
+        }
+
+        capability_decompress_bases(comps, m, bases);
+
+        for (long i = 0; i < m; i++) {
+            if (revmap_test(bases[i]) || derivation_check(comps[i])) {
+                metadata_clear_valid_bits(addrs[i],
+                                          addrs[i] + sizeof(uint64_t));
+                cleared++;
+            }
+        }
+
+        if (n < BACKEND_FILES_SWEEP_BATCH) {
+            break;
+        }
+
+        from = next;
+    }
+
+    return cleared;
+}
+
+/* requests a pass of the sweeper */
+static void sweep_kick(void)
+{
+    pthread_mutex_lock(&g_sweep.lock);
+    pthread_cond_signal(&g_sweep.work);
+    pthread_mutex_unlock(&g_sweep.lock);
+}
+
+/* puts a freed region into quarantine, the caller painted it already */
+static int sweep_quarantine(uint64_t base, uint64_t size)
+{
+    struct quarantine *q = malloc(sizeof(*q));
+    if (q == NULL) {
+        return -ENOMEM;
+    }
+
+    q->base = base;
+    q->size = size;
+
+    pthread_mutex_lock(&g_sweep.lock);
+    q->next = g_sweep.pending;
+    g_sweep.pending = q;
+    pthread_cond_signal(&g_sweep.work);
+    pthread_mutex_unlock(&g_sweep.lock);
+
+    return 0;
+}
+
+/**
+ * @brief frees a region whose base has been claimed in the revocation bitmap
+ *
+ * @param base      base of the region
+ * @param size      size of the region
+ * @param capaddr   capref used to free the region or 0
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The region is painted and goes into quarantine. Without the sweeper it is
+ * returned to the allocator right away.
+ */
+static int sweep_release(uint64_t base, uint64_t size, uint64_t capaddr)
+{
+    int err;
+
+    revmap_paint(base, size, true);
+
+    /* accesses that checked the region before it was painted notice it */
+    __atomic_add_fetch(&g_deriv.epoch, 1, __ATOMIC_SEQ_CST);
+
+    /* clients that still map the region keep their copy of it */
+    shadow_detach(base);
+
+    if ((err = capstore_rawpunch(base, size))) {
+        revmap_paint(base, size, false);
+        return err;
+    }
+
+    derivation_drop_region(base, size);
+    region_forget(base);
+
+    uint64_t comp;
+    if (capaddr) {
+        captab_release(capaddr, &comp);
+    }
+
+    if (g_sweep.running && !sweep_quarantine(base, size)) {
+        return 0;
+    }
+
+    captab_drop_painted();
+    revmap_paint(base, size, false);
+
+    return capfs_buddy_free_range(&g_st.heap, base, size);
+}
+
+/**
+ * @brief waits until no revoked capability is left in the store
+ *
+ * @return true if the store holds no revoked or freed capabilities
+ *
+ * The caller makes sure no further regions are freed or revoked.
+ */
+static bool sweep_drain(void)
+{
+    pthread_mutex_lock(&g_sweep.lock);
+
+    while (g_sweep.running && !g_sweep.stop
+           && (g_sweep.pending != NULL || g_sweep.sweeping != NULL
+               || g_sweep.epoch != __atomic_load_n(&g_deriv.epoch,
+                                                   __ATOMIC_ACQUIRE))) {
+        pthread_cond_signal(&g_sweep.work);
+        pthread_cond_wait(&g_sweep.done, &g_sweep.lock);
+    }
+
+    bool drained = g_sweep.running && !g_sweep.stop;
+
+    pthread_mutex_unlock(&g_sweep.lock);
+
+    return drained;
+}
+
+/**
+ * @brief waits until the regions in quarantine have been released
+ *
+ * @return true if regions were released since the call
+ */
+static bool sweep_wait(void)
+{
+    pthread_mutex_lock(&g_sweep.lock);
+
+    bool waited = false;
+    uint64_t target = g_sweep.passes + 2;
+    while (g_sweep.running && !g_sweep.stop
+           && (g_sweep.pending != NULL || g_sweep.sweeping != NULL)
+           && g_sweep.passes < target) {
+        pthread_cond_signal(&g_sweep.work);
+        pthread_cond_wait(&g_sweep.done, &g_sweep.lock);
+        waited = true;
+    }
+
+    pthread_mutex_unlock(&g_sweep.lock);
+
+    return waited;
+}
+
+static void *sweep_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&g_sweep.lock);
+
+    while (true) {
+        while (!g_sweep.stop && g_sweep.pending == NULL
+               && g_sweep.epoch == __atomic_load_n(&g_deriv.epoch,
+                                                   __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&g_sweep.work, &g_sweep.lock);
+        }
+
+        if (g_sweep.stop) {
+            break;
+        }
+
+        g_sweep.sweeping = g_sweep.pending;
+        g_sweep.pending = NULL;
+        uint64_t epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+
+        pthread_mutex_unlock(&g_sweep.lock);
+
+        long cleared = 0;
+        for (uint64_t addr = 0; addr < g_st.data_size;
+             addr += BACKEND_FILES_SWEEP_SLICE) {
+            uint64_t end = addr + BACKEND_FILES_SWEEP_SLICE;
+
+            capstore_write_lock(addr, end);
+            cleared += sweep_range_locked(addr, end);
+            capstore_write_unlock(addr, end);
+
+            if (__atomic_load_n(&g_sweep.stop, __ATOMIC_RELAXED)) {
+                break;
+            }
+
+            usleep(BACKEND_FILES_SWEEP_PAUSE_USEC);
+        }
+
+        pthread_mutex_lock(&g_sweep.lock);
+
+        if (g_sweep.stop) {
+            break;
+        }
+
+        /* nothing points into the swept regions any more */
+        long dropped = captab_drop_painted() + captab_drop_revoked();
+        while (g_sweep.sweeping != NULL) {
+            struct quarantine *q = g_sweep.sweeping;
+            g_sweep.sweeping = q->next;
+
+            revmap_paint(q->base, q->size, false);
+            if (capfs_buddy_free_range(&g_st.heap, q->base, q->size)) {
+                LOGE("releasing region base=%lx failed\n", q->base);
+            }
+            free(q);
+        }
+
+        LOG("sweep pass %lu invalidated %ld capabilities, %ld caprefs\n",
+            g_sweep.passes, cleared, dropped);
+
+        g_sweep.epoch = epoch;
+        g_sweep.passes++;
+        pthread_cond_broadcast(&g_sweep.done);
+    }
+
+    pthread_cond_broadcast(&g_sweep.done);
+    pthread_mutex_unlock(&g_sweep.lock);
+
+    return NULL;
+}
+
+static int sweep_start(void)
+{
+    g_sweep.stop = false;
+    g_sweep.epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+
+    int err = pthread_create(&g_sweep.thread, NULL, sweep_thread, NULL);
+    if (err) {
+        return -err;
+    }
+
+    g_sweep.running = true;
+
+    return 0;
+}
+
+static void sweep_stop(void)
+{
+    if (!g_sweep.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_sweep.lock);
+    g_sweep.stop = true;
+    pthread_cond_broadcast(&g_sweep.work);
+    pthread_mutex_unlock(&g_sweep.lock);
+
+    pthread_join(g_sweep.thread, NULL);
+    g_sweep.running = false;
+
+    /* the store is going away, the quarantine is dropped */
+    struct quarantine *lists[2] = { g_sweep.pending, g_sweep.sweeping };
+    for (int i = 0; i < 2; i++) {
+        while (lists[i] != NULL) {
+            struct quarantine *q = lists[i];
+            lists[i] = q->next;
+            revmap_paint(q->base, q->size, false);
+            free(q);
+        }
+    }
+    g_sweep.pending = NULL;
+    g_sweep.sweeping = NULL;
+}
+
+
+
+/*
+ * ============================================================================
+ * Garbage Collection
+ * ============================================================================
+ *
+ * The collector reclaims allocated regions that no capability stored in the
+ * image refers to. Marking starts at the file system root record and follows
+ * the stored capabilities found via the valid bits on several threads. It
+ * runs concurrently with I/O: regions allocated during a cycle are marked
+ * right away, and storing or copying a capability during a cycle marks the
+ * region it points to.
+ *
+ * Besides the root record, the roots are the regions of the caprefs used
+ * since the previous cycle started, of the open file handles and the mapped
+ * regions. Using a capref during a cycle marks its region like storing it.
+ * A capref that has not been used for a whole cycle does not keep its region
+ * alive, so unreachable regions are condemned first and reclaimed only if the
+ * next cycle finds them unreachable again.
+ */
+
+
+#define GC_IDLE  0
+#define GC_MARK  1
+#define GC_SWEEP 2
+
+#define GC_GRANULES (BACKEND_FILES_SIZE >> BACKEND_FILES_ALLOC_MIN_BITS)
+
+static uint64_t g_gcmarks[GC_GRANULES / 64];
+static uint64_t g_gccondemned[GC_GRANULES / 64];
+
+static struct {
+    pthread_mutex_t lock;           ///< protects the mark stack
+    pthread_cond_t work;            ///< signalled when regions were pushed
+    int phase;                      ///< phase of the current cycle
+    uint64_t *stack;                ///< regions to be scanned
+    size_t depth;                   ///< number of regions on the stack
+    size_t capacity;                ///< capacity of the stack
+    unsigned busy;                  ///< markers scanning a region
+    bool overflow;                  ///< the stack could not grow
+    pthread_mutex_t cycle;          ///< serializes cycles
+    pthread_t thread;
+    pthread_cond_t kick;            ///< wakes the collector thread
+    bool running;                   ///< the thread has been started
+    bool stop;                      ///< the thread should exit
+    bool compact;                   ///< the thread should compact the store
+    uint64_t cycles;                ///< number of completed cycles
+} g_gc = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .cycle = PTHREAD_MUTEX_INITIALIZER,
+    .kick = PTHREAD_COND_INITIALIZER,
+};
+
+
+static inline bool gc_test(const uint64_t *map, uint64_t g)
+{
+    return (__atomic_load_n(&map[g / 64], __ATOMIC_SEQ_CST) >> (g % 64)) & 1;
+}
+
+static inline void gc_clear(uint64_t *map, uint64_t g)
+{
+    __atomic_fetch_and(&map[g / 64], ~(1UL << (g % 64)), __ATOMIC_RELAXED);
+}
+
+/* marks the region starting at a granule, returns true if it was unmarked */
+static inline bool gc_mark(uint64_t g)
+{
+    uint64_t bit = 1UL << (g % 64);
+
+    return !(__atomic_fetch_or(&g_gcmarks[g / 64], bit, __ATOMIC_SEQ_CST) & bit);
+}
+
+/* pushes regions to be scanned, the lock is held */
+static void gc_push_locked(const uint64_t *bases, size_t n)
+{
+    if (g_gc.depth + n > g_gc.capacity) {
+        size_t capacity = (g_gc.capacity ? g_gc.capacity : 1024);
+        while (capacity < g_gc.depth + n) {
+            capacity *= 2;
+        }
+
+        uint64_t *stack = realloc(g_gc.stack, capacity * sizeof(uint64_t));
+        if (stack == NULL) {
+            /* the cycle cannot complete, it will not reclaim anything */
+            g_gc.overflow = true;
+            return;
+        }
+
+        g_gc.stack = stack;
+        g_gc.capacity = capacity;
+    }
+
+    memcpy(g_gc.stack + g_gc.depth, bases, n * sizeof(uint64_t));
+    g_gc.depth += n;
+
+    pthread_cond_broadcast(&g_gc.work);
+}
+
+/**
+ * @brief marks the region an address points into during a cycle
+ *
+ * @param addr  the address
+ *
+ * Called before a capability to addr becomes visible in the store. The
+ * region is scanned if marking is still in progress.
+ */
+static void gc_shade(uint64_t addr)
+{
+    if (__atomic_load_n(&g_gc.phase, __ATOMIC_SEQ_CST) == GC_IDLE) {
+        return;
+    }
+
+    uint64_t base, size;
+    if (region_lookup(addr, &base, &size)
+        && gc_mark(base >> BACKEND_FILES_ALLOC_MIN_BITS)) {
+        pthread_mutex_lock(&g_gc.lock);
+        if (g_gc.phase == GC_MARK) {
+            gc_push_locked(&base, 1);
+        }
+        pthread_mutex_unlock(&g_gc.lock);
+    }
+
+    /* pairs with the check of the mark after claiming the region */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* marks the regions the capabilities stored in a range point into */
+static void gc_shade_range(uint64_t from, uint64_t to)
+{
+    uint64_t addrs[BACKEND_FILES_SWEEP_BATCH];
+    uint64_t comps[BACKEND_FILES_SWEEP_BATCH];
+    uint64_t bases[BACKEND_FILES_SWEEP_BATCH];
+
+    if (__atomic_load_n(&g_gc.phase, __ATOMIC_SEQ_CST) == GC_IDLE) {
+        return;
+    }
+
+    while (from < to) {
+        long n = capstore_scan(from, to, addrs, BACKEND_FILES_SWEEP_BATCH);
+        if (n <= 0) {
+            break;
+        }
+
+        long m = 0;
+        for (long i = 0; i < n; i++) {
+            if (capstore_rawload(addrs[i], &comps[m]) == 0) {
+                m++;
+            }
+        }
+
+        capability_decompress_bases(comps, m, bases);
+
+        for (long i = 0; i < m; i++) {
+            gc_shade(bases[i]);
+        }
+
+        if (n < BACKEND_FILES_SWEEP_BATCH) {
+            break;
+        }
+
+        from = addrs[n - 1] + sizeof(uint64_t);
+    }
+}
+
+/* scans a region and pushes the unmarked regions it points into */
+static void gc_scan(uint64_t from, uint64_t to)
+{
+    uint64_t addrs[BACKEND_FILES_SWEEP_BATCH];
+    uint64_t comps[BACKEND_FILES_SWEEP_BATCH];
+    uint64_t bases[BACKEND_FILES_SWEEP_BATCH];
+
+    while (from < to) {
+        long n = capstore_scan(from, to, addrs, BACKEND_FILES_SWEEP_BATCH);
+        if (n <= 0) {
+            break;
+        }
+
+        long m = 0;
+        for (long i = 0; i < n; i++) {
+            if (capstore_rawload(addrs[i], &comps[m]) == 0) {
+                m++;
+            }
+        }
+
+        capability_decompress_bases(comps, m, bases);
+
+        size_t found = 0;
+        for (long i = 0; i < m; i++) {
+            uint64_t base, size;
+            if (region_lookup(bases[i], &base, &size)
+                && gc_mark(base >> BACKEND_FILES_ALLOC_MIN_BITS)) {
+                bases[found++] = base;
+            }
+        }
+
+        if (found) {
+            pthread_mutex_lock(&g_gc.lock);
+            gc_push_locked(bases, found);
+            pthread_mutex_unlock(&g_gc.lock);
+        }
+
+        if (n < BACKEND_FILES_SWEEP_BATCH) {
+            break;
+        }
+
+        from = addrs[n - 1] + sizeof(uint64_t);
+    }
+}
+
+/* scans regions from the stack until no marker finds new ones */
+static void *gc_marker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&g_gc.lock);
+
+    while (true) {
+        while (g_gc.depth == 0 && g_gc.busy > 0) {
+            pthread_cond_wait(&g_gc.work, &g_gc.lock);
+        }
+
+        if (g_gc.depth == 0) {
+            break;
+        }
+
+        uint64_t base = g_gc.stack[--g_gc.depth];
+        g_gc.busy++;
+
+        pthread_mutex_unlock(&g_gc.lock);
+
+        uint64_t size = region_size(base >> BACKEND_FILES_ALLOC_MIN_BITS);
+        gc_scan(base, base + size);
+
+        pthread_mutex_lock(&g_gc.lock);
+
+        g_gc.busy--;
+        if (g_gc.busy == 0 && g_gc.depth == 0) {
+            pthread_cond_broadcast(&g_gc.work);
+        }
+    }
+
+    pthread_mutex_unlock(&g_gc.lock);
+
+    return NULL;
+}
+
+/* marks the regions of caprefs used in this or the previous cycle */
+static void gc_mark_caprefs(uint32_t cycle)
+{
+    for (uint32_t idx = 1; idx < CAPTAB_SLOTS; idx++) {
+        struct capslot *s = &g_captab.slots[idx];
+        uint32_t gen = __atomic_load_n(&s->gen, __ATOMIC_ACQUIRE);
+        uint32_t seen = __atomic_load_n(&s->seen, __ATOMIC_RELAXED);
+        uint64_t comp;
+        if ((seen == cycle || seen == cycle - 1)
+            && captab_read(idx, gen, &comp)) {
+            struct capability c;
+            capability_decompress(comp, &c);
+            gc_shade(c.base);
+        }
+    }
+}
+
+/* marks the regions of the file and the content of an open handle */
+static void gc_mark_handle(struct capfs_handle *h, void *arg)
+{
+    (void)arg;
+
+    struct capability c;
+    if (capref_to_capability(h->cap, &c) == 0) {
+        gc_shade(c.base);
+    }
+
+    struct capfs_capbounds bounds;
+    cap_fs_handle_get_bounds(h, &bounds);
+    if (bounds.cap.capaddr) {
+        gc_shade(bounds.base);
+    }
+}
+
+/**
+ * @brief runs a cycle of the garbage collector
+ *
+ * @return the number of reclaimed regions
+ */
+static long gc_collect(void)
+{
+    pthread_mutex_lock(&g_gc.cycle);
+
+    memset(g_gcmarks, 0, sizeof(g_gcmarks));
+
+    pthread_mutex_lock(&g_gc.lock);
+    g_gc.depth = 0;
+    g_gc.busy = 0;
+    g_gc.overflow = false;
+    __atomic_store_n(&g_gc.phase, GC_MARK, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&g_gc.lock);
+
+    /* caprefs used from now on are marked by captab_touch() */
+    uint32_t cycle = __atomic_add_fetch(&g_captab.cycle, 1, __ATOMIC_SEQ_CST);
+
+    gc_scan(0, 1UL << BACKEND_FILES_RESERVED_BITS);
+    gc_mark_caprefs(cycle);
+    cap_fs_handle_foreach(gc_mark_handle, NULL);
+
+    for (uint64_t g = 0; g < GC_GRANULES; g++) {
+        if (region_pinned(g)) {
+            gc_shade(g << BACKEND_FILES_ALLOC_MIN_BITS);
+        }
+    }
+
+    pthread_t threads[BACKEND_FILES_GC_THREADS - 1];
+    int nthreads = 0;
+    for (; nthreads < BACKEND_FILES_GC_THREADS - 1; nthreads++) {
+        if (pthread_create(&threads[nthreads], NULL, gc_marker, NULL)) {
+            break;
+        }
+    }
+
+    gc_marker(NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_lock(&g_gc.lock);
+    __atomic_store_n(&g_gc.phase, GC_SWEEP, __ATOMIC_SEQ_CST);
+    bool overflow = g_gc.overflow;
+    pthread_mutex_unlock(&g_gc.lock);
+
+    long reclaimed = 0;
+    for (uint64_t g = 0; g < GC_GRANULES && !overflow; g++) {
+        uint64_t size = region_size(g);
+        if (size == 0) {
+            continue;
+        }
+
+        if (gc_test(g_gcmarks, g)) {
+            gc_clear(g_gccondemned, g);
+            continue;
+        }
+
+        if (!gc_test(g_gccondemned, g)) {
+            __atomic_fetch_or(&g_gccondemned[g / 64], 1UL << (g % 64),
+                              __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint64_t base = g << BACKEND_FILES_ALLOC_MIN_BITS;
+        if (!revmap_claim(base)) {
+            continue;
+        }
+
+        /* a capability to the region may just have been stored */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (gc_test(g_gcmarks, g)) {
+            revmap_paint(base, 1UL << BACKEND_FILES_ALLOC_MIN_BITS, false);
+            continue;
+        }
+
+        gc_clear(g_gccondemned, g);
+        if (sweep_release(base, size, 0) == 0) {
+            LOG("reclaimed unreachable region base=%lx, size=%lx\n", base,
+                size);
+            reclaimed++;
+        }
+    }
+
+    __atomic_store_n(&g_gc.phase, GC_IDLE, __ATOMIC_SEQ_CST);
+    g_gc.cycles++;
+
+    pthread_mutex_unlock(&g_gc.cycle);
+
+    return reclaimed;
+}
+
+/* notes a newly allocated region, it survives a cycle in progress */
+static void gc_track(uint64_t base, uint64_t size)
+{
+    uint64_t g = base >> BACKEND_FILES_ALLOC_MIN_BITS;
+
+    gc_clear(g_gccondemned, g);
+    region_track(base, size);
+
+    if (__atomic_load_n(&g_gc.phase, __ATOMIC_SEQ_CST) != GC_IDLE) {
+        gc_mark(g);
+    }
+}
+
+static void *gc_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&g_gc.lock);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += BACKEND_FILES_GC_INTERVAL_SEC;
+
+    while (!g_gc.stop) {
+        int err = 0;
+        while (!g_gc.stop && !g_gc.compact && err == 0) {
+            err = pthread_cond_timedwait(&g_gc.kick, &g_gc.lock, &ts);
+        }
+
+        if (g_gc.stop) {
+            break;
+        }
+
+        if (g_gc.compact) {
+            g_gc.compact = false;
+            pthread_mutex_unlock(&g_gc.lock);
+            capfs_backend_compact(CAPFS_BACKEND_COMPACT_ONLINE);
+            pthread_mutex_lock(&g_gc.lock);
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += BACKEND_FILES_GC_INTERVAL_SEC;
+
+        pthread_mutex_unlock(&g_gc.lock);
+        long reclaimed = gc_collect();
+        LOG("collection cycle %lu reclaimed %ld regions\n", g_gc.cycles,
+            reclaimed);
+        pthread_mutex_lock(&g_gc.lock);
+    }
+
+    pthread_mutex_unlock(&g_gc.lock);
+
+    return NULL;
+}
+
+static int gc_start(void)
+{
+    g_gc.stop = false;
+
+    int err = pthread_create(&g_gc.thread, NULL, gc_thread, NULL);
+    if (err) {
+        return -err;
+    }
+
+    g_gc.running = true;
+
+    return 0;
+}
+
+/* requests an online compaction from the collector thread */
+static bool gc_kick_compact(void)
+{
+    if (!g_gc.running) {
+        return false;
+    }
+
+    pthread_mutex_lock(&g_gc.lock);
+    g_gc.compact = true;
+    pthread_cond_signal(&g_gc.kick);
+    pthread_mutex_unlock(&g_gc.lock);
+
+    return true;
+}
+
+static void gc_stop(void)
+{
+    if (!g_gc.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_gc.lock);
+    g_gc.stop = true;
+    pthread_cond_broadcast(&g_gc.kick);
+    pthread_mutex_unlock(&g_gc.lock);
+
+    pthread_join(g_gc.thread, NULL);
+    g_gc.running = false;
+
+    free(g_gc.stack);
+    g_gc.stack = NULL;
+    g_gc.capacity = 0;
+}
+
+
+
+/*
+ * ============================================================================
+ * Compaction
+ * ============================================================================
+ *
+ * Compaction moves allocated regions into the lowest free block below them
+ * that holds them, starting at the end of the store, so the free space
+ * coalesces there. Every move relocates the region as described above and
+ * then releases its old place like a freed region. The move lock is held
+ * for writing only while the region is copied and when its old place is
+ * released, not while the stored capabilities are rewritten. Cycles of the
+ * garbage collector do not run during a compaction.
+ *
+ * Allocations that fail because the free space is too fragmented do not
+ * compact, they kick the collector thread to run an online compaction.
+ */
+
+
+/**
+ * @brief moves a region to a free place below it
+ *
+ * @param from      start address of the region
+ *
+ * @return 1 if the region was moved, 0 if not, or error number on failure
+ *
+ * The caller holds the cycle lock of the garbage collector. Mapped regions
+ * are pinned and stay in place.
+ */
+static int compact_move(uint64_t from)
+{
+    uint64_t g = from >> BACKEND_FILES_ALLOC_MIN_BITS;
+    uint64_t size = region_size(g);
+    if (size == 0 || region_pinned(g)) {
+        return 0;
+    }
+
+    uint64_t to;
+    if (capfs_buddy_alloc_range_below(&g_st.heap, size, from, &to)) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&g_move.lock);
+
+    /* the region may have been freed or mapped in the meantime */
+    if (region_size(g) != size || region_pinned(g)) {
+        pthread_rwlock_unlock(&g_move.lock);
+        capfs_buddy_free_range(&g_st.heap, to, size);
+        return 0;
+    }
+
+    capstore_seq_ranges(from, from + size, to, to + size, true);
+
+    int err = metadata_copy_valid_bits(from, to, size);
+    if (!err) {
+        err = capstore_rawcopy(from, to, size);
+    }
+
+    if (err) {
+        capstore_seq_ranges(from, from + size, to, to + size, false);
+        pthread_rwlock_unlock(&g_move.lock);
+        capfs_buddy_free_range(&g_st.heap, to, size);
+        return -EIO;
+    }
+
+    gc_track(to, size);
+    captab_relocate(from, to, size);
+    derivation_relocate(from, to, size);
+    move_publish(true, from, to, size);
+    __atomic_add_fetch(&g_deriv.epoch, 1, __ATOMIC_RELEASE);
+
+    capstore_seq_ranges(from, from + size, to, to + size, false);
+
+    pthread_rwlock_unlock(&g_move.lock);
+
+    /*
+     * Forward the stored capabilities one slice at a time, then nothing
+     * refers to from. Operations proceed meanwhile: caprefs decode to the
+     * new place already and stale capabilities are forwarded when loaded.
+     */
+    for (uint64_t addr = 0; addr < g_st.data_size;
+         addr += BACKEND_FILES_SWEEP_SLICE) {
+        uint64_t end = addr + BACKEND_FILES_SWEEP_SLICE;
+
+        capstore_write_lock(addr, end);
+        sweep_range_locked(addr, end);
+        capstore_write_unlock(addr, end);
+    }
+
+    pthread_rwlock_wrlock(&g_move.lock);
+
+    move_publish(false, 0, 0, 0);
+
+    /* frees cannot race, they hold the lock for reading */
+    err = revmap_claim(from) ? sweep_release(from, size, 0) : -EINVAL;
+
+    pthread_rwlock_unlock(&g_move.lock);
+
+    LOG("moved region base=%lx to %lx, size=%lx\n", from, to, size);
+
+    return err ? err : 1;
+}
+
+/**
+ * @brief moves allocated regions towards the start of the store
+ *
+ * @param mode  CAPFS_BACKEND_COMPACT_ONLINE or CAPFS_BACKEND_COMPACT_OFFLINE
+ *
+ * @return the number of moved regions or error number on failure
+ *
+ * An online compaction pauses between regions. Mapped regions are never
+ * moved, clients may access them at any time.
+ */
+long capfs_backend_compact(int mode)
+{
+    CAPFS_STATS_SCOPE(BE_COMPACT);
+
+    if (mode != CAPFS_BACKEND_COMPACT_ONLINE
+        && mode != CAPFS_BACKEND_COMPACT_OFFLINE) {
+        return -EINVAL;
+    }
+
+    if (g_st.fd < 0) {
+        return -EIO;
+    }
+
+    bool offline = (mode == CAPFS_BACKEND_COMPACT_OFFLINE);
+
+    pthread_mutex_lock(&g_gc.cycle);
+
+    long moved = 0;
+    for (uint64_t g = GC_GRANULES; g-- > 0;) {
+        if (region_size(g) == 0) {
+            continue;
+        }
+
+        int r = compact_move(g << BACKEND_FILES_ALLOC_MIN_BITS);
+        if (r < 0) {
+            if (moved == 0) {
+                moved = r;
+            }
+            break;
+        }
+
+        moved += r;
+        if (r && !offline) {
+            usleep(BACKEND_FILES_COMPACT_PAUSE_USEC);
+        }
+    }
+
+    pthread_mutex_unlock(&g_gc.cycle);
+
+    LOG("compaction moved %ld regions\n", moved);
+
+    return moved;
+}
+
+
+
+/*
+ * ============================================================================
+ * Region Recovery
+ * ============================================================================
+ *
+ * The allocator and the region table are not stored in the image. When an
+ * existing image is kept, the regions are recovered from the capabilities
+ * reachable from the root record: a stored capability that does not lie in
+ * a region recovered so far is taken as a region of its own. Capabilities
+ * are taken by decreasing size, so a minted capability falls into the region
+ * it was minted from. Caprefs and derivation records start afresh.
+ *
+ * The revocation state is not stored either. A clean stop sweeps the store
+ * until no revoked or freed capability is left and then sets the clean
+ * marker, which is cleared again while the image is in use. Only an image
+ * with the marker set is kept.
+ */
+
+
+struct recovered {
+    uint64_t base;
+    uint64_t size;
+};
+
+static struct {
+    struct recovered *caps;     ///< the capabilities found so far
+    size_t count;               ///< number of capabilities found
+    size_t capacity;            ///< capacity of the array
+    uint64_t *scanned;          ///< granules scanned already
+} g_recover;
+
+#define RECOVER_SCANNED(g) ((g_recover.scanned[(g) / 64] >> ((g) % 64)) & 1)
+
+/* notes the capabilities stored in a range */
+static int recover_scan(uint64_t from, uint64_t to)
+{
+    uint64_t addrs[BACKEND_FILES_SWEEP_BATCH];
+
+    while (from < to) {
+        long n = capstore_scan(from, to, addrs, BACKEND_FILES_SWEEP_BATCH);
+        if (n <= 0) {
+            break;
+        }
+
+        if (g_recover.count + n > g_recover.capacity) {
+            size_t capacity = g_recover.capacity ? g_recover.capacity : 1024;
+            while (capacity < g_recover.count + n) {
+                capacity *= 2;
+            }
+            struct recovered *caps = realloc(g_recover.caps,
+                                             capacity * sizeof(*caps));
+            if (caps == NULL) {
+                return -ENOMEM;
+            }
+            g_recover.caps = caps;
+            g_recover.capacity = capacity;
+        }
+
+        for (long i = 0; i < n; i++) {
+            uint64_t comp;
+            struct capability c;
+            if (capstore_rawload(addrs[i], &comp)) {
+                continue;
+            }
+            capability_decompress(comp, &c);
+            if (c.size && c.base >= (1UL << BACKEND_FILES_RESERVED_BITS)
+                && c.base < BACKEND_FILES_SIZE
+                && c.size <= BACKEND_FILES_SIZE - c.base) {
+                g_recover.caps[g_recover.count++] =
+                    (struct recovered){ c.base, c.size };
+            }
+        }
+
+        if (n < BACKEND_FILES_SWEEP_BATCH) {
+            break;
+        }
+
+        from = addrs[n - 1] + sizeof(uint64_t);
+    }
+
+    return 0;
+}
+
+/* notes the capabilities stored in the granules of a range not scanned yet */
+static int recover_scan_once(uint64_t base, uint64_t size)
+{
+    uint64_t g = base >> BACKEND_FILES_ALLOC_MIN_BITS;
+    uint64_t end = (base + size + CAPABILITY_MASK(BACKEND_FILES_ALLOC_MIN_BITS))
+                   >> BACKEND_FILES_ALLOC_MIN_BITS;
+
+    while (g < end) {
+        if (RECOVER_SCANNED(g)) {
+            g++;
+            continue;
+        }
+
+        uint64_t first = g;
+        while (g < end && !RECOVER_SCANNED(g)) {
+            g_recover.scanned[g / 64] |= 1UL << (g % 64);
+            g++;
+        }
+
+        int err = recover_scan(first << BACKEND_FILES_ALLOC_MIN_BITS,
+                               g << BACKEND_FILES_ALLOC_MIN_BITS);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int recover_cmp(const void *a, const void *b)
+{
+    const struct recovered *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return (x->base > y->base) - (x->base < y->base);
+}
+
+/**
+ * @brief recovers the allocated regions of an existing image
+ *
+ * @return the number of recovered regions or error number on failure
+ */
+static long recover_regions(void)
+{
+    long recovered = 0;
+    int err;
+
+    g_recover.scanned = calloc(GC_GRANULES / 64, sizeof(uint64_t));
+    if (g_recover.scanned == NULL) {
+        return -ENOMEM;
+    }
+
+    /* the capabilities found are scanned in turn, each granule once */
+    err = recover_scan_once(0, 1UL << BACKEND_FILES_RESERVED_BITS);
+    for (size_t i = 0; !err && i < g_recover.count; i++) {
+        err = recover_scan_once(g_recover.caps[i].base,
+                                g_recover.caps[i].size);
+    }
+
+    if (err) {
+        recovered = err;
+        goto out;
+    }
+
+    qsort(g_recover.caps, g_recover.count, sizeof(g_recover.caps[0]),
+          recover_cmp);
+
+    uint64_t mask = CAPABILITY_MASK(BACKEND_FILES_ALLOC_MIN_BITS);
+    for (size_t i = 0; i < g_recover.count; i++) {
+        uint64_t base = g_recover.caps[i].base & ~mask;
+        uint64_t end = (g_recover.caps[i].base + g_recover.caps[i].size
+                        + mask) & ~mask;
+
+        uint64_t rbase, rsize;
+        if (region_lookup(base, &rbase, &rsize) && end <= rbase + rsize) {
+            continue;
+        }
+
+        if (capfs_buddy_reserve_range(&g_st.heap, base, end - base)) {
+            LOGW("cannot recover region base=%lx, size=%lx\n", base,
+                 end - base);
+            continue;
+        }
+
+        region_track(base, end - base);
+        recovered++;
+    }
+
+out:
+    free(g_recover.caps);
+    free(g_recover.scanned);
+    memset(&g_recover, 0, sizeof(g_recover));
+
+    return recovered;
+}
+
+
+
+/*
+ * ============================================================================
+ * Backend initialization
+ * ============================================================================
+ */
+
+
+static const char *g_image = BACKEND_FILES_PATH;
+static bool g_image_keep = false;
+
+/**
+ * @brief sets the image the backend stores the file system in
+ *
+ * @param path  path of the image, NULL for the default
+ * @param keep  keep the file system held by an existing image
+ */
+void capfs_backend_set_image(const char *path, bool keep)
+{
+    g_image = path ? path : BACKEND_FILES_PATH;
+    g_image_keep = keep;
+}
+
+/* checks and clears the clean marker of a kept image */
+static int image_claim(void)
+{
+    uint64_t marker;
+    if (capstore_rawread(BACKEND_FILES_CLEAN_ADDR, &marker, sizeof(marker))) {
+        return -EIO;
+    }
+
+    if (marker != BACKEND_FILES_CLEAN_MAGIC) {
+        return -EINVAL;
+    }
+
+    marker = 0;
+    if (capstore_rawwrite(BACKEND_FILES_CLEAN_ADDR, &marker, sizeof(marker))
+        || fdatasync(g_st.fd)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* sets the clean marker once no revoked capability is left in the store */
+static void image_release(void)
+{
+    if (!sweep_drain()) {
+        LOGW("the image was not swept, it cannot be kept\n");
+        return;
+    }
+
+    uint64_t marker = BACKEND_FILES_CLEAN_MAGIC;
+    if (capstore_rawwrite(BACKEND_FILES_CLEAN_ADDR, &marker, sizeof(marker))) {
+        LOGW("setting the clean marker of the image failed\n");
+    }
+}
+
+
+/**
+ * @brief initializes the backend
+ *
+ * @param conn      the FUSE connection information
+ * @param cfg       the FUSE configuration
+ *
+ * @return pointer to allocated backend data structure
+ *
+ * Note this also obtains the root capability for the backend
+ */
+void *capfs_backend_init(struct fuse_conn_info * conn,
+                         struct fuse_config * cfg)
+{
+    int err;
+
+    LOG("Initializing backend conn=%p, cfg=%p\n", conn, cfg);
+
+    (void)conn;
+    (void)cfg;
+
+
+    bool created = false;
+
+    LOG("Attempt to open file '%s'\n", g_image);
+    g_st.fd = open(g_image, O_RDWR);
+    if (g_st.fd < 0) {
+        LOGI("The file does not exist.. creating...\n");
+        created = true;
+        g_st.fd = open(g_image, O_RDWR | O_CREAT, 0644);
+        if (g_st.fd < 0) {
+            PANIC(errno, "%s\n", "ERROR while opening file");
+        }
+
+        LOG("Truncate file to %" PRIu64" bytes\n", BACKEND_FILES_TOTAL_SIZE);
+        if((err = ftruncate(g_st.fd, BACKEND_FILES_TOTAL_SIZE))) {
+            PANIC(err, "%s\n", "ERROR while truncating file");
+        }
+    } else if (!g_image_keep) {
+        LOGI("Discarding the file system of the image\n");
+        if (ftruncate(g_st.fd, 0)
+            || ftruncate(g_st.fd, BACKEND_FILES_TOTAL_SIZE)) {
+            PANIC(errno, "%s\n", "ERROR while truncating file");
+        }
+    }
+
+    struct stat st;
+    if (fstat(g_st.fd, &st)) {
+        PANIC(errno, "%s\n", "ERROR while obtaining file size");
+    }
+
+    if((uint64_t)st.st_size != BACKEND_FILES_TOTAL_SIZE) {
+        PANIC(EINVAL, "bad file size: %" PRIu64 " expected %" PRIu64 "\n",
+              (uint64_t)st.st_size, BACKEND_FILES_TOTAL_SIZE);
+    };
+
+
+    g_st.data_size = BACKEND_FILES_SIZE;
+
+    g_st.map = NULL;
+    if (BACKEND_FILES_MAPPED) {
+        void *map = mmap(NULL, BACKEND_FILES_TOTAL_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, g_st.fd, 0);
+        if (map == MAP_FAILED) {
+            LOGW("mapping the image failed, copies use copy_file_range()\n");
+        } else {
+            g_st.map = map;
+        }
+    }
+
+    if ((err = derivation_init())) {
+        PANIC(-err, "%s\n", "ERROR while allocating the derivation records");
+    }
+
+    if ((err = captab_init())) {
+        PANIC(-err, "%s\n", "ERROR while initializing the capability table");
+    }
+
+    if ((err = capfs_buddy_init(&g_st.heap, BACKEND_FILES_ALLOC_MIN_BITS,
+                                BACKEND_FILES_SIZE_BITS))) {
+        PANIC(-err, "%s\n", "ERROR while initializing the region allocator");
+    }
+
+    /* the start of the store holds the file system root record */
+    if ((err = capfs_buddy_reserve(&g_st.heap, 0, BACKEND_FILES_RESERVED_BITS))) {
+        PANIC(-err, "%s\n", "ERROR while reserving the root record");
+    }
+
+    if (g_image_keep && !created) {
+        if ((err = image_claim())) {
+            PANIC(-err, "%s\n", "ERROR the image was not stopped cleanly");
+        }
+
+        long recovered = recover_regions();
+        if (recovered < 0) {
+            PANIC((int)-recovered, "%s\n",
+                  "ERROR while recovering the regions");
+        }
+        LOGI("recovered %ld regions of the image\n", recovered);
+    }
+
+    /* create the root capability */
+
+    struct capability rootcap = {0, BACKEND_FILES_SIZE,
+                                 CAPFS_CAPABILITY_PERM_READ |
+                                 CAPFS_CAPABILITY_PERM_WRITE |
+                                 CAPFS_CAPABILITY_PERM_EXEC};
+
+    LOGA("setting root capability\n");
+    if ((err = capability_to_capref(&rootcap, &capfs_root_capability))) {
+        PANIC(-err, "%s\n", "ERROR while entering the root capability");
+    }
+
+    if ((err = sweep_start())) {
+        PANIC(-err, "%s\n", "ERROR while starting the revocation sweeper");
+    }
+
+    if ((err = gc_start())) {
+        PANIC(-err, "%s\n", "ERROR while starting the garbage collector");
+    }
+
+
+    return NULL;
+}
+
+
+/**
+ * @brief destroys the backend
+ *
+ * @param st    pointer to the returned backend data structure of init()
+ *
+ * @return error number TODO: possible error values
+ */
+int capfs_backend_destroy(void *st)
+{
+    (void)st;
+
+    gc_stop();
+    image_release();
+    sweep_stop();
+
+    if (g_st.map != NULL) {
+        munmap(g_st.map, BACKEND_FILES_TOTAL_SIZE);
+        g_st.map = NULL;
+    }
+
+    if (g_st.fd >= 0) {
+        close(g_st.fd);
+        g_st.fd = -1;
+    }
+
+    capfs_buddy_destroy(&g_st.heap);
+
+    captab_destroy();
+    derivation_destroy();
+
+    return 0;
 }
 
 
@@ -437,262 +3881,1387 @@ int capfs_backend_destroy(void *st)
  */
 
 /**
- * @brief obtains the permissions of the capability
+ * @brief obtains the permissions of the capability
+ *
+ * @param cap   capability to obtain the permissions for
+ *
+ * @return capability permissions, CAPFS_CAPABILITY_PERM_NONE if the
+ *         capability is not valid
+ */
+capfs_capperms_t  capfs_backend_cap_get_perms(capfs_capref_t cap)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_GET_PERMS);
+
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return CAPFS_CAPABILITY_PERM_NONE;
+    }
+
+    return c.perms;
+}
+
+/**
+ * @brief obtains the size of the capability
+ *
+ * @param cap   the capablity to obtain the size from
+ *
+ * @return size of the capabilty, 0 if the capability is not valid
+ */
+uint64_t capfs_backend_cap_get_size(capfs_capref_t cap)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_GET_SIZE);
+
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return 0;
+    }
+
+    return c.size;
+}
+
+/**
+ * @brief decodes the bounds and permissions of a capability
+ *
+ * @param cap       the capability to decode
+ * @param bounds    returns the decoded bounds
+ *
+ * @return zero on SUCCESS or error number on failure
+ */
+int capfs_backend_cap_decode(capfs_capref_t cap,
+                             struct capfs_capbounds *bounds)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_DECODE);
+
+    if (capref_to_bounds(cap, bounds)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * ===========================================================================
+ * Capability Operations
+ * ===========================================================================
+ */
+
+
+/* see capfs_backend_cap_mint(), the move lock is held for reading */
+static int capability_mint(capfs_capref_t cap, uintptr_t offset, size_t bytes,
+                           capfs_capperms_t perms, capfs_capref_t *ret_cap)
+{
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return -EACCES;
+    }
+
+    if (perms & ~c.perms) {
+        return -EACCES;
+    }
+
+    if (offset > c.size || bytes > c.size - offset) {
+        return -EINVAL;
+    }
+
+    if (!capability_representable(c.base + offset, bytes)) {
+        return -EINVAL;
+    }
+
+    struct capability nc = { c.base + offset, bytes, perms };
+
+    uint64_t pcomp = capability_compres(&c);
+    uint64_t ncomp = capability_compres(&nc);
+    if (ncomp == pcomp) {
+        *ret_cap = cap;
+        return 0;
+    }
+
+    int err = 0;
+
+    pthread_rwlock_wrlock(&g_deriv.lock);
+
+    uint32_t p = derivation_lookup(pcomp);
+    if (p == DERIV_NONE) {
+        p = derivation_insert(pcomp, DERIV_NONE);
+    }
+
+    uint32_t n = derivation_lookup(ncomp);
+    if (p == DERIV_NONE) {
+        err = -ENOMEM;
+    } else if (n == DERIV_NONE) {
+        if (derivation_insert(ncomp, p) == DERIV_NONE) {
+            err = -ENOMEM;
+        }
+    } else {
+        /* the same capability was minted before, it may have been revoked */
+        for (; n != DERIV_NONE; n = g_deriv.records[n].parent) {
+            if (g_deriv.records[n].revoked) {
+                err = -EACCES;
+                break;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&g_deriv.lock);
+
+    if (err) {
+        return err;
+    }
+
+    LOG("minted capability base=%lx, size=%zu, perms=%x\n", nc.base, bytes,
+        perms);
+
+    return capability_to_capref(&nc, ret_cap);
+}
+
+/**
+ * @brief creates a new capability based on the previous one
+ *
+ * @param cap       the capability to be minted
+ * @param offset    offset into the capability
+ * @param bytes     size of the new capbility in bytes
+ * @param perms     permissions of the new capability
+ * @param ret_cap   returned capability
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The new capability must lie within the bounds of cap and have a subset of
+ * its permissions. Its base and size must be representable, see
+ * capability_representable().
+ */
+int capfs_backend_cap_mint(capfs_capref_t cap, uintptr_t offset, size_t bytes,
+                           capfs_capperms_t perms, capfs_capref_t *ret_cap)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_MINT);
+
+    /* the capability must not move between its decode and the new record */
+    pthread_rwlock_rdlock(&g_move.lock);
+    int err = capability_mint(cap, offset, bytes, perms, ret_cap);
+    pthread_rwlock_unlock(&g_move.lock);
+
+    return err;
+}
+
+/* see capfs_backend_cap_revoke(), the move lock is held for reading */
+static int capability_revoke(capfs_capref_t cap)
+{
+    if (cap.capaddr == capfs_root_capability.capaddr) {
+        return -EPERM;
+    }
+
+    /* the capref dies with its slot, its descendants with the record */
+    uint64_t comp;
+    int err = captab_release(cap.capaddr, &comp);
+    if (err) {
+        return err;
+    }
+
+    pthread_rwlock_wrlock(&g_deriv.lock);
+
+    uint32_t i = derivation_lookup(comp);
+    if (i == DERIV_NONE) {
+        i = derivation_insert(comp, DERIV_NONE);
+    }
+
+    if (i == DERIV_NONE) {
+        err = -ENOMEM;
+    } else {
+        g_deriv.records[i].revoked = true;
+        __atomic_store_n(&g_captab.revoked, true, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&g_deriv.epoch, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_rwlock_unlock(&g_deriv.lock);
+
+    if (err) {
+        return err;
+    }
+
+    /* the slots of derived capabilities go with the next sweep */
+    if (g_sweep.running) {
+        sweep_kick();
+    } else {
+        captab_drop_revoked();
+    }
+
+    return err;
+}
+
+/**
+ * @brief revokes a capability and all capabilities minted from it
+ *
+ * @param cap   the capability to be revoked
+ *
+ * @return zero on SUCCESS or error number on failure
+ */
+int capfs_backend_cap_revoke(capfs_capref_t cap)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_REVOKE);
+
+    pthread_rwlock_rdlock(&g_move.lock);
+    int err = capability_revoke(cap);
+    pthread_rwlock_unlock(&g_move.lock);
+
+    return err;
+}
+
+
+
+/*
+ * ===========================================================================
+ * Capability Allocation
+ * ===========================================================================
+ */
+
+
+/**
+ * @brief allocates a new region and returns a capability to it
+ *
+ * @param bytes     minimum size of the region in bytes
+ * @param perms     permissions of the returned capability
+ * @param ret_cap   returns the capability to the region
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The size of the region is rounded up to the smallest block of the
+ * allocator and to the precision of the capability encoding. If the free
+ * space is too fragmented, this kicks a compaction and returns -ENOSPC.
+ */
+int capfs_backend_cap_alloc(size_t bytes, capfs_capperms_t perms,
+                            capfs_capref_t *ret_cap)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_ALLOC);
+
+    int err;
+
+    if (bytes == 0 || bytes > g_st.data_size) {
+        return -ENOSPC;
+    }
+
+    /* rounded to the smallest block and the precision of the encoding */
+    uint64_t size = (bytes + CAPABILITY_MASK(BACKEND_FILES_ALLOC_MIN_BITS))
+                    & ~CAPABILITY_MASK(BACKEND_FILES_ALLOC_MIN_BITS);
+    size = capability_round_size(size);
+
+    uint64_t base;
+    while ((err = capfs_buddy_alloc_range(&g_st.heap, size, &base))) {
+        if (err != -ENOSPC) {
+            return err;
+        }
+
+        /* freed regions may still be in quarantine */
+        if (sweep_wait()) {
+            continue;
+        }
+
+        /* or the free space is too fragmented, a later request may succeed */
+        if (capfs_buddy_free_bytes(&g_st.heap) >= size && gc_kick_compact()) {
+            LOGW("free space too fragmented for %lx bytes\n", size);
+        }
+        return err;
+    }
+
+    LOG("allocated region base=%lx, size=%lx\n", base, size);
+
+    struct capability c = { base, size, perms };
+
+    pthread_rwlock_rdlock(&g_move.lock);
+    gc_track(base, size);
+    err = capability_to_capref(&c, ret_cap);
+    pthread_rwlock_unlock(&g_move.lock);
+
+    return err;
+}
+
+/**
+ * @brief frees a region previously obtained by capfs_backend_cap_alloc()
+ *
+ * @param cap   the capability to the entire region
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * A region mapped writable is not freed, this returns -EBUSY.
+ */
+int capfs_backend_cap_free(capfs_capref_t cap)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_FREE);
+
+    int err = -EINVAL;
+
+    /* the region must not move between its decode and the release */
+    pthread_rwlock_rdlock(&g_move.lock);
+
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        err = -1;
+    } else if (!(c.perms & CAPFS_CAPABILITY_PERM_WRITE)) {
+        err = -EACCES;
+    } else if (shadow_writable(c.base, c.size)) {
+        /* a client may still store to the region */
+        err = -EBUSY;
+    } else if (capfs_buddy_is_allocated(&g_st.heap, c.base, c.size)
+               && revmap_claim(c.base)) {
+        /* a region in quarantine has been freed already */
+        err = sweep_release(c.base, c.size, cap.capaddr);
+    }
+
+    pthread_rwlock_unlock(&g_move.lock);
+
+    return err;
+}
+
+/**
+ * @brief reclaims allocated regions that are no longer reachable
+ *
+ * @return the number of reclaimed regions or error number on failure
+ */
+long capfs_backend_collect(void)
+{
+    CAPFS_STATS_SCOPE(BE_COLLECT);
+
+    return gc_collect();
+}
+
+
+
+/*
+ * ===========================================================================
+ * Load and store capabilities
+ * ===========================================================================
+ */
+
+
+/* see capfs_backend_get_cap(), a racing move may leave a stale result */
+static int capstore_get_cap(capfs_capref_t cap, off_t offset,
+                            capfs_capref_t *retcap)
+{
+    int err;
+
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return -1;
+    }
+
+    err = capability_check_access(c.size, c.perms, CAPFS_CAPABILITY_PERM_READ,
+                                  offset, sizeof(capfs_capref_t));
+    if (err) {
+        return err;
+    }
+
+    uint64_t addr = c.base + offset;
+    if (addr % sizeof(uint64_t)) {
+        return -EINVAL;
+    }
+
+    if (addr + sizeof(uint64_t) > g_st.data_size) {
+        return -1;
+    }
+
+    uint64_t data = 0;
+    bool valid;
+    uint32_t seq;
+    do {
+        seq = capstore_read_begin(addr);
+
+        valid = metadata_is_capability(addr);
+        if (!valid) {
+            continue;
+        }
+
+        if ((err = capstore_rawload(addr, &data))) {
+            return err;
+        }
+
+        move_forward(&data);
+    } while (capstore_read_retry(addr, seq));
+
+    if (!valid) {
+        return -EACCES;
+    }
+
+    struct capability nc;
+    capability_decompress(data, &nc);
+
+    /* the sweeper may not have reached the stored capability yet */
+    if (revmap_test(nc.base) || derivation_check(data)) {
+        return -EACCES;
+    }
+
+    return capability_to_capref(&nc, retcap);
+}
+
+/**
+ * @brief loads a capability inside another capability
+ *
+ * @param cap       the capability
+ * @param offset    offset into the capability in byes
+ * @param retcap    returns the capability if any
+ *
+ * @return error number TODO: possible error values
+ */
+int capfs_backend_get_cap(capfs_capref_t cap,
+                          off_t offset, capfs_capref_t *retcap)
+{
+    CAPFS_STATS_SCOPE(BE_GET_CAP);
+
+    int err;
+    uint64_t moves;
+    do {
+        moves = move_begin();
+        err = capstore_get_cap(cap, offset, retcap);
+    } while (move_raced(moves));
+
+    return err;
+}
+
+/* see capfs_backend_put_cap(), a racing move may store to the old place */
+static int capstore_put_cap(capfs_capref_t cap, off_t offset,
+                            capfs_capref_t newcap)
+{
+    int err;
+
+
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return -1;
+    }
+
+    err = capability_check_access(c.size, c.perms, CAPFS_CAPABILITY_PERM_WRITE,
+                                  offset, sizeof(uint64_t));
+    if (err) {
+        return err;
+    }
+
+    struct capability nc;
+    if (capref_to_capability(newcap, &nc)) {
+        return -1;
+    }
+
+
+    uint64_t addr = c.base + offset;
+    if (addr % sizeof(uint64_t)) {
+        return -EINVAL;
+    }
+
+    if (addr + sizeof(uint64_t) > g_st.data_size) {
+        return -1;
+    }
+
+    uint64_t data = capability_compres(&nc);
+
+    capstore_write_lock(addr, addr + sizeof(data));
+
+    gc_shade(nc.base);
+
+    /* checked under the lock, see the revocation sweeper */
+    if (revmap_test(nc.base)) {
+        err = -EACCES;
+    } else if (shadow_writable(addr, sizeof(data))) {
+        /* the tags of a region mapped writable stay clear */
+        err = -EBUSY;
+    } else {
+        err = capstore_rawstore(addr, data);
+    }
+
+    if (!err) {
+        err = metadata_set_valid_bits(addr, addr + sizeof(data));
+    }
+
+    capstore_write_unlock(addr, addr + sizeof(data));
+
+    return err;
+}
+
+/**
+ * @brief stores a capability inside another capability
+ *
+ * @param cap       the capability
+ * @param offset    offset into the capability in bytes
+ * @param newcap    the capability to be stored
+ *
+ * @return error number TODO: possible error values
+ */
+int capfs_backend_put_cap(capfs_capref_t cap,
+                          off_t offset, capfs_capref_t newcap)
+{
+    CAPFS_STATS_SCOPE(BE_PUT_CAP);
+
+    /* storing again is harmless, the old place is released after a move */
+    int err;
+    uint64_t moves;
+    do {
+        moves = move_begin();
+        err = capstore_put_cap(cap, offset, newcap);
+    } while (move_raced(moves));
+
+    return err;
+}
+
+/* see capfs_backend_cap_scan() */
+static long capstore_cap_scan(capfs_capref_t cap, off_t offset, size_t bytes,
+                              off_t *offsets, size_t count)
+{
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return -1;
+    }
+
+    int err = capability_check_access(c.size, c.perms,
+                                      CAPFS_CAPABILITY_PERM_READ, offset, bytes);
+    if (err) {
+        return err;
+    }
+
+    /* the addresses are converted into offsets in place */
+    _Static_assert(sizeof(off_t) == sizeof(uint64_t), "off_t must be 64-bit");
+    uint64_t *addrs = (uint64_t *)offsets;
+
+    long n = capstore_scan(c.base + offset, c.base + offset + bytes, addrs,
+                           count);
+    for (long i = 0; i < n; i++) {
+        offsets[i] = (off_t)(addrs[i] - c.base);
+    }
+
+    return n;
+}
+
+/**
+ * @brief finds the capabilities stored inside a capability
+ *
+ * @param cap       the capability to scan
+ * @param offset    offset into the capability to start at
+ * @param bytes     number of bytes to scan
+ * @param offsets   returns the offsets of the stored capabilities
+ * @param count     capacity of offsets
+ *
+ * @return number of found capabilities or error number
+ */
+long capfs_backend_cap_scan(capfs_capref_t cap, off_t offset, size_t bytes,
+                            off_t *offsets, size_t count)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_SCAN);
+
+    long n;
+    uint64_t moves;
+    do {
+        moves = move_begin();
+        n = capstore_cap_scan(cap, offset, bytes, offsets, count);
+    } while (move_raced(moves));
+
+    return n;
+}
+
+
+/*
+ * ===========================================================================
+ * Read and write capability data
+ * ===========================================================================
+ */
+
+
+/**
+ * @brief reads data from a capability
+ *
+ * @param cap       the capability
+ * @param offset    offset into the capability
+ * @param rbuf      buffer to store the read data
+ * @param bytes     size of the read buffer in bytes
+ *
+ * @return read bytes or error number TODO: possible error values
+ */
+long capfs_backend_read(capfs_capref_t cap, off_t offset,
+                       char *rbuf, size_t bytes)
+{
+    CAPFS_STATS_SCOPE(BE_READ);
+
+    long r;
+    do {
+        struct capfs_capbounds b;
+        if (capref_to_bounds(cap, &b)) {
+            LOGA("capability conversion failed\n");
+            return -1;
+        }
+
+        r = capfs_backend_read_decoded(&b, offset, rbuf, bytes);
+    } while (r == -ESTALE);
+
+    return r;
+}
+
+/**
+ * @brief reads data from a decoded capability
+ *
+ * @param bounds    the decoded capability
+ * @param offset    offset into the capability
+ * @param rbuf      buffer to store the read data
+ * @param bytes     size of the read buffer in bytes
+ *
+ * @return read bytes or error number, -ESTALE if the region was moved
+ */
+long capfs_backend_read_decoded(const struct capfs_capbounds *bounds,
+                                off_t offset, char *rbuf, size_t bytes)
+{
+    CAPFS_STATS_SCOPE(BE_READ_DECODED);
+
+    LOG("offset=%li, bytes=%zu, rbuf=%p\n", offset, bytes, (void *)rbuf);
+
+    uint64_t moves = move_begin();
+    uint64_t epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+
+    int err = capbounds_check_access(bounds, CAPFS_CAPABILITY_PERM_READ,
+                                     offset, bytes);
+    if (err) {
+        return err;
+    }
+
+    if(capstore_rawread(bounds->base + offset, rbuf, bytes)) {
+        return -1;
+    }
+
+    /*
+     * the old place of a moved region is only released after the move, a
+     * region freed during the read may have been punched already
+     */
+    if ((move_raced(moves) || capbounds_raced(epoch))
+        && (err = capbounds_revalidate(bounds))) {
+        return err;
+    }
+
+    return bytes;
+}
+
+/**
+ * @brief writes data into a capability
+ *
+ * @param cap       the capability
+ * @param offset    offset into the capability
+ * @param wbuf      buffer containing data to be written
+ * @param bytes     size of the buffer in bytes
+ *
+ * @return written bytes or error number TODO: possible error values
+ */
+long capfs_backend_write(capfs_capref_t cap, off_t offset,
+                        const char *wbuf, size_t bytes)
+{
+    CAPFS_STATS_SCOPE(BE_WRITE);
+
+    long r;
+    do {
+        struct capfs_capbounds b;
+        if (capref_to_bounds(cap, &b)) {
+            return -1;
+        }
+
+        r = capfs_backend_write_decoded(&b, offset, wbuf, bytes);
+    } while (r == -ESTALE);
+
+    return r;
+}
+
+/**
+ * @brief writes data into a decoded capability
+ *
+ * @param bounds    the decoded capability
+ * @param offset    offset into the capability
+ * @param wbuf      buffer containing data to be written
+ * @param bytes     size of the buffer in bytes
+ *
+ * @return written bytes or error number, -ESTALE if the region was moved
+ */
+long capfs_backend_write_decoded(const struct capfs_capbounds *bounds,
+                                 off_t offset, const char *wbuf, size_t bytes)
+{
+    CAPFS_STATS_SCOPE(BE_WRITE_DECODED);
+
+    LOG("offset=%li, bytes=%zu, wbuf=%p\n", offset, bytes,
+        (void *)wbuf);
+
+    uint64_t moves = move_begin();
+    uint64_t epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+
+    int err = capbounds_check_access(bounds, CAPFS_CAPABILITY_PERM_WRITE,
+                                     offset, bytes);
+    if (err) {
+        return err;
+    }
+
+    uint64_t addr = bounds->base + offset;
+
+    capstore_write_lock(addr, addr + bytes);
+
+    metadata_clear_valid_bits(addr, addr + bytes);
+    err = capstore_rawwrite(addr, wbuf, bytes);
+
+    capstore_write_unlock(addr, addr + bytes);
+
+    if (err) {
+        return -1;
+    }
+
+    /* a write to the old place of a moved or freed region is lost */
+    if ((move_raced(moves) || capbounds_raced(epoch))
+        && (err = capbounds_revalidate(bounds))) {
+        return err;
+    }
+
+    return bytes;
+}
+
+
+/* transfers a run of adjacent pieces starting at an address of the store */
+static int capstore_rawv_run(uint64_t start, struct iovec *vec, int n,
+                             bool write)
+{
+    if (!shadow_any()) {
+        return image_rawv(capstore_addr2offset(start), vec, n, write);
+    }
+
+    for (int i = 0; i < n; i++) {
+        int err = write ? shadow_write(start, vec[i].iov_base, vec[i].iov_len)
+                        : shadow_read(start, vec[i].iov_base, vec[i].iov_len);
+        if (err) {
+            return err;
+        }
+        start += vec[i].iov_len;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief transfers a run and checks the decoded capabilities again
  *
- * @param cap   capability to obtain the permissions for
+ * If a region was revoked or freed since the epoch was loaded, all decoded
+ * capabilities are revalidated and the epoch is loaded again.
  *
- * @return capability permissicapfs_backend_cap_get_sizeons
+ * @return 0 on success, -1 on I/O errors, or the revalidation error
  */
-capfs_capperms_t  capfs_backend_cap_get_perms(capfs_capref_t cap)
+static int capstore_rawv_flush(uint64_t start, uint64_t next,
+                               struct iovec *vec, int n, bool write,
+                               const struct capfs_capbounds *caps,
+                               uint64_t *epoch)
 {
-    struct capability c;
-    capref_to_capability(cap, &c);
+    int err;
+    if (write) {
+        capstore_write_lock(start, next);
+        metadata_clear_valid_bits(start, next);
+        err = capstore_rawv_run(start, vec, n, true);
+        capstore_write_unlock(start, next);
+    } else {
+        err = capstore_rawv_run(start, vec, n, false);
+    }
 
-    return c.perms;
+    if (err) {
+        return -1;
+    }
+
+    if (capbounds_raced(*epoch)) {
+        *epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < BACKEND_FILES_IOV_CAPS; i++) {
+            if ((err = capbounds_revalidate(&caps[i]))) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
 }
 
 /**
- * @brief obtains the size of the capability
+ * @brief reads or writes many pieces of capabilities
  *
- * @param cap   the capablity to obtain the size from
+ * @param iov       the pieces
+ * @param iovcnt    the number of pieces
+ * @param write     true to write the pieces, false to read them
  *
- * @return size of the capabilty
+ * @return transferred bytes or error number, -ESTALE if a region was moved
  */
-uint64_t capfs_backend_cap_get_size(capfs_capref_t cap)
+static long capstore_rawv(const struct capfs_backend_iovec *iov, int iovcnt,
+                          bool write)
 {
-    struct capability c;
-    capref_to_capability(cap, &c);
+    capfs_capperms_t perm = write ? CAPFS_CAPABILITY_PERM_WRITE
+                                  : CAPFS_CAPABILITY_PERM_READ;
+
+    /*
+     * recently decoded capabilities, so each one is checked only once. A
+     * capability is only evicted after the run holding its pieces is done,
+     * so every transferred piece is covered by the revalidation of a run.
+     */
+    struct capfs_capbounds caps[BACKEND_FILES_IOV_CAPS];
+    memset(caps, 0, sizeof(caps));
+
+    struct iovec vec[BACKEND_FILES_IOV_MAX];
+    uint64_t start = 0;
+    uint64_t next = 0;
+    int n = 0;
+    long total = 0;
+    int err;
 
-    return c.size;
+    if (iovcnt < 0) {
+        return -EINVAL;
+    }
+
+    if (g_st.fd < 0) {
+        return -1;
+    }
+
+    /* loaded first, a revocation racing with the transfer forces a recheck */
+    uint64_t epoch = __atomic_load_n(&g_deriv.epoch, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i <= iovcnt; i++) {
+        uint64_t addr = 0;
+
+        if (i < iovcnt) {
+            const struct capfs_backend_iovec *v = &iov[i];
+            if (v->bytes == 0) {
+                continue;
+            }
+
+            uint32_t slot = (v->cap.capaddr ^ (v->cap.capaddr >> 17))
+                            % BACKEND_FILES_IOV_CAPS;
+            struct capfs_capbounds *b = &caps[slot];
+            if (b->cap.capaddr != v->cap.capaddr || b->size == 0) {
+                if (n && b->size != 0) {
+                    err = capstore_rawv_flush(start, next, vec, n, write,
+                                              caps, &epoch);
+                    if (err) {
+                        return err;
+                    }
+                    total += next - start;
+                    n = 0;
+                }
+                if (capref_to_bounds(v->cap, b)) {
+                    memset(b, 0, sizeof(*b));
+                    return -EINVAL;
+                }
+                if (!(b->perms & perm)) {
+                    return -EACCES;
+                }
+            }
+
+            if (v->offset < 0 || (uint64_t)v->offset > b->size
+                || v->bytes > b->size - v->offset) {
+                return -1;
+            }
+
+            addr = b->base + v->offset;
+            if (addr + v->bytes > g_st.data_size) {
+                return -1;
+            }
+
+            /* extend the current run if the piece is adjacent */
+            if (n && addr == next && n < BACKEND_FILES_IOV_MAX) {
+                vec[n].iov_base = v->buf;
+                vec[n].iov_len = v->bytes;
+                next += v->bytes;
+                n++;
+                continue;
+            }
+        }
+
+        if (n) {
+            err = capstore_rawv_flush(start, next, vec, n, write, caps,
+                                      &epoch);
+            if (err) {
+                return err;
+            }
+            total += next - start;
+            n = 0;
+        }
+
+        if (i < iovcnt) {
+            vec[0].iov_base = iov[i].buf;
+            vec[0].iov_len = iov[i].bytes;
+            start = addr;
+            next = addr + iov[i].bytes;
+            n = 1;
+        }
+    }
+
+    return total;
 }
 
+/**
+ * @brief reads data from many capabilities
+ *
+ * @param iov       the pieces to read
+ * @param iovcnt    the number of pieces
+ *
+ * @return read bytes or error number
+ */
+long capfs_backend_readv(const struct capfs_backend_iovec *iov, int iovcnt)
+{
+    CAPFS_STATS_SCOPE(BE_READV);
+
+    long r;
+    uint64_t moves;
+    do {
+        moves = move_begin();
+        r = capstore_rawv(iov, iovcnt, false);
+    } while (r == -ESTALE || move_raced(moves));
 
+    return r;
+}
 
-/*
- * ===========================================================================
- * Load and store capabilities
- * ===========================================================================
+/**
+ * @brief writes data into many capabilities
+ *
+ * @param iov       the pieces to write
+ * @param iovcnt    the number of pieces
+ *
+ * @return written bytes or error number
  */
+long capfs_backend_writev(const struct capfs_backend_iovec *iov, int iovcnt)
+{
+    CAPFS_STATS_SCOPE(BE_WRITEV);
+
+    /* writing the same data again is harmless */
+    long r;
+    uint64_t moves;
+    do {
+        moves = move_begin();
+        r = capstore_rawv(iov, iovcnt, true);
+    } while (r == -ESTALE || move_raced(moves));
+
+    return r;
+}
 
 
 /**
- * @brief loads a capability inside another capability
+ * @brief copies data from one capability into another
  *
- * @param cap       the capability
- * @param offset    offset into the capability in byes
- * @param retcap    returns the capability if any
+ * @param src           the source capability
+ * @param src_offset    offset into the source capability
+ * @param dst           the destination capability
+ * @param dst_offset    offset into the destination capability
+ * @param bytes         number of bytes to copy
  *
- * @return error number TODO: possible error values
+ * @return copied bytes or error number
  */
-int capfs_backend_get_cap(capfs_capref_t cap,
-                          off_t offset, capfs_capref_t *retcap)
+long capfs_backend_copy(capfs_capref_t src, off_t src_offset,
+                        capfs_capref_t dst, off_t dst_offset, size_t bytes)
 {
-    int err;
+    CAPFS_STATS_SCOPE(BE_COPY);
 
-    struct capability c;
-    if (capref_to_capability(cap, &c)) {
+    /* overlapping copies cannot be repeated, a racing move is checked first */
+    uint64_t moves = move_begin();
+
+    struct capability sc, dc;
+    if (capref_to_capability(src, &sc) || capref_to_capability(dst, &dc)) {
         return -1;
     }
 
-    if (!(c.perms & CAPFS_CAPABILITY_PERM_READ)) {
+    if (!(sc.perms & CAPFS_CAPABILITY_PERM_READ)) {
+        return -EACCES;
+    }
+
+    if (!(dc.perms & CAPFS_CAPABILITY_PERM_WRITE)) {
         return -EACCES;
     }
 
+    LOG("src_offset=%li, dst_offset=%li, bytes=%zu\n", src_offset, dst_offset,
+        bytes);
 
-    if ((offset + sizeof(capfs_capref_t) >= c.size)) {
+    if (src_offset < 0 || dst_offset < 0) {
         return -1;
     }
 
-    if (!metadata_is_capability(offset)) {
-        return -EACCES;
+    if (src_offset + bytes > sc.size || dst_offset + bytes > dc.size) {
+        return -1;
     }
 
-    uint64_t data = 0;
-    err = capstore_rawread(c.base + offset, (void *)&data, sizeof(uint64_t));
-    if (err != 0) {
-        return err;
+    uint64_t src_addr = sc.base + src_offset;
+    uint64_t dst_addr = dc.base + dst_offset;
+
+    /* the source is locked as well, its valid bits must match its data */
+    capstore_seq_ranges(src_addr, src_addr + bytes, dst_addr, dst_addr + bytes,
+                        true);
+
+    if (move_raced(moves)) {
+        capstore_seq_ranges(src_addr, src_addr + bytes, dst_addr,
+                            dst_addr + bytes, false);
+        return capfs_backend_copy(src, src_offset, dst, dst_offset, bytes);
     }
 
-    struct capability nc;
-    capability_decompress(data, &nc);
+    int err = metadata_copy_valid_bits(src_addr, dst_addr, bytes);
+    if (!err && shadow_writable(dst_addr, bytes)) {
+        /* a client may overwrite the copied capabilities at any time */
+        err = metadata_clear_valid_bits(dst_addr, dst_addr + bytes);
+    }
+    if (!err) {
+        err = capstore_rawcopy(src_addr, dst_addr, bytes);
+    }
 
-    return capability_to_capref(&nc, retcap);
-};
+    /* the source may not have been swept or forwarded yet */
+    if (!err) {
+        gc_shade_range(dst_addr, dst_addr + bytes);
+        sweep_range_locked(dst_addr, dst_addr + bytes);
+    }
+
+    capstore_seq_ranges(src_addr, src_addr + bytes, dst_addr, dst_addr + bytes,
+                        false);
+
+    if (err) {
+        return -1;
+    }
+
+    return bytes;
+}
+
+
+/* see capfs_backend_punch() */
+static int capstore_punch(capfs_capref_t cap, off_t offset, size_t bytes)
+{
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return -1;
+    }
+
+    if (!(c.perms & CAPFS_CAPABILITY_PERM_WRITE)) {
+        return -EACCES;
+    }
+
+    if (offset < 0 || offset + bytes > c.size) {
+        return -EINVAL;
+    }
+
+    return capstore_rawpunch(c.base + offset, bytes);
+}
 
 /**
- * @brief stores a capability inside another capability
+ * @brief zeroes a range of the capability and releases its storage
  *
  * @param cap       the capability
- * @param offset    offset into the capability in bytes
- * @param newcap    the capability to be stored
+ * @param offset    offset into the capability
+ * @param bytes     number of bytes to zero
  *
- * @return error number TODO: possible error values
+ * @return ERR_OK on success error value on failure
  */
-int capfs_backend_put_cap(capfs_capref_t cap,
-                          off_t offset, capfs_capref_t newcap)
+int capfs_backend_punch(capfs_capref_t cap, off_t offset, size_t bytes)
 {
+    CAPFS_STATS_SCOPE(BE_PUNCH);
+
     int err;
+    uint64_t moves;
+    do {
+        moves = move_begin();
+        err = capstore_punch(cap, offset, bytes);
+    } while (move_raced(moves));
+
+    return err;
+}
 
+/**
+ * @brief zeroes the entire capability
+ *
+ * @param cap   the capability to be zeroed
+ *
+ * @return ERR_OK on success error value on failure
+ *
+ * Note this is equivalent to capfs_backend_write with a zeroed buffer of
+ * size of the capability.
+ */
+int capfs_backend_zero(capfs_capref_t cap)
+{
+    CAPFS_STATS_SCOPE(BE_ZERO);
 
     struct capability c;
     if (capref_to_capability(cap, &c)) {
         return -1;
     }
 
-    if (!(c.perms & CAPFS_CAPABILITY_PERM_WRITE)) {
+    return capfs_backend_punch(cap, 0, c.size);
+}
+
+/* see capfs_backend_seek() */
+static off_t capstore_seek(capfs_capref_t cap, off_t offset, int whence)
+{
+    struct capability c;
+    if (capref_to_capability(cap, &c)) {
+        return -EINVAL;
+    }
+
+    if (!(c.perms & CAPFS_CAPABILITY_PERM_READ)) {
         return -EACCES;
     }
 
+    if (offset < 0 || (uint64_t)offset >= c.size) {
+        return -ENXIO;
+    }
 
-    if ((offset + sizeof(uint64_t) >= c.size)) {
-        return -1;
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
     }
 
-    struct capability nc;
-    if (capref_to_capability(newcap, &nc)) {
-        return -1;
+    off_t r = capstore_rawseek(c.base + offset, whence);
+    if (r == -ENXIO || (r >= 0 && (uint64_t)r >= c.base + c.size)) {
+        /* the end of the capability counts as a hole */
+        return (whence == SEEK_DATA) ? -ENXIO : (off_t)c.size;
     }
 
+    if (r < 0) {
+        return r;
+    }
 
-    uint64_t data = capability_compres(&nc);
+    return r - c.base;
+}
 
-    err = capstore_rawwrite(c.base + offset, (void *)&data, sizeof(uint64_t));
-    if (err) {
-        return err;
-    }
+/**
+ * @brief finds the next data or hole in a capability
+ *
+ * @param cap       the capability
+ * @param offset    offset into the capability to start searching
+ * @param whence    SEEK_DATA or SEEK_HOLE
+ *
+ * @return offset of the next data or hole, or negative error number
+ */
+off_t capfs_backend_seek(capfs_capref_t cap, off_t offset, int whence)
+{
+    CAPFS_STATS_SCOPE(BE_SEEK);
+
+    off_t r;
+    uint64_t moves;
+    do {
+        moves = move_begin();
+        r = capstore_seek(cap, offset, whence);
+    } while (move_raced(moves));
 
-    return metadata_set_valid_bits(c.base + offset, c.base + offset);
+    return r;
 }
 
 
 /*
  * ===========================================================================
- * Read and write capability data
+ * Direct Access
  * ===========================================================================
  */
 
 
 /**
- * @brief reads data from a capability
+ * @brief creates or references the shadow of a region
  *
- * @param cap       the capability
- * @param offset    offset into the capability
- * @param rbuf      buffer to store the read data
- * @param bytes     size of the read buffer in bytes
+ * @param base      start address of the region
+ * @param size      size of the region
+ * @param write     true if the region is mapped writable
+ * @param ret_sh    returns the shadow
  *
- * @return read bytes or error number TODO: possible error values
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The caller holds the move lock for reading.
  */
-long capfs_backend_read(capfs_capref_t cap, off_t offset,
-                       char *rbuf, size_t bytes)
+static int shadow_get(uint64_t base, uint64_t size, bool write,
+                      struct shadow *ret_sh)
 {
-    struct capability c;
-    if (capref_to_capability(cap, &c)) {
-        LOGA("capability conversion failed\n");
-        return -1;
-    }
+    int err = 0;
 
-    dump_capability(&c);
+    capstore_write_lock(base, base + size);
+    pthread_rwlock_wrlock(&g_shadow.lock);
 
-    if (!(c.perms & CAPFS_CAPABILITY_PERM_READ)) {
-        return -EACCES;
+    struct shadow *sh = g_shadow.list;
+    while (sh && sh->base != base) {
+        sh = sh->next;
     }
 
-    LOG("offset=%li, bytes=%zu, rbuf=%p\n", offset, bytes, rbuf);
+    if (sh == NULL) {
+        sh = calloc(1, sizeof(*sh));
+        if (sh == NULL) {
+            err = -ENOMEM;
+            goto out;
+        }
 
-    if (offset < 0) {
-        return -1;
+        sh->base = base;
+        sh->size = size;
+        sh->mem = MAP_FAILED;
+        sh->rofd = -1;
+        sh->fd = memfd_create("capfs-region", MFD_CLOEXEC);
+        if (sh->fd < 0 || ftruncate(sh->fd, size)) {
+            err = -errno;
+            goto out_free;
+        }
+
+        sh->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sh->fd,
+                       0);
+        if (sh->mem == MAP_FAILED) {
+            err = -errno;
+            goto out_free;
+        }
+
+        if (image_rawread(capstore_addr2offset(base), sh->mem, size)) {
+            err = -EIO;
+            goto out_free;
+        }
+
+        /* a descriptor of its own, so read-only mappings stay read-only */
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", sh->fd);
+        sh->rofd = open(path, O_RDONLY | O_CLOEXEC);
+        if (sh->rofd < 0) {
+            err = -errno;
+            goto out_free;
+        }
+
+        region_pin(base);
+
+        sh->id = ++g_shadow.ids;
+        sh->next = g_shadow.list;
+        g_shadow.list = sh;
+        __atomic_add_fetch(&g_shadow.count, 1, __ATOMIC_RELEASE);
+
+        LOG("shadowed region base=%lx, size=%lx\n", base, size);
     }
 
-    if (offset + bytes >= c.size) {
-        LOG("cap size: %lx, requested range %lx..%lx",
-            c.size, offset, offset+bytes);
-        return -1;
+    /* stores through the mapping must not be taken for capabilities */
+    if (write && sh->writers++ == 0) {
+        metadata_clear_valid_bits(base, base + size);
     }
 
+    sh->refs++;
+    *ret_sh = *sh;
 
+    goto out;
 
-    assert(offset + bytes < c.size);
-    if(capstore_rawread(c.base + offset, rbuf, bytes)) {
-        return -1;
+out_free:
+    if (sh->mem != MAP_FAILED) {
+        munmap(sh->mem, size);
     }
+    if (sh->fd >= 0) {
+        close(sh->fd);
+    }
+    free(sh);
+out:
+    pthread_rwlock_unlock(&g_shadow.lock);
+    capstore_write_unlock(base, base + size);
 
-    return bytes;
+    return err;
 }
 
 /**
- * @brief writes data into a capability
+ * @brief maps the region of a capability
  *
- * @param cap       the capability
- * @param offset    offset into the capability
- * @param wbuf      buffer containing data to be written
- * @param bytes     size of the buffer in bytes
+ * @param cap   the capability to the entire region
+ * @param perms the access rights of the mapping
+ * @param map   returns the mapping information
  *
- * @return written bytes or error number TODO: possible error values
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The descriptor refers to a copy of the region only, never to the image.
+ * While the region is mapped, it is not moved and its tags are kept clear
+ * if the mapping is writable; a writable mapping is written back when it is
+ * released with capfs_backend_cap_unmap().
  */
-long capfs_backend_write(capfs_capref_t cap, off_t offset,
-                        const char *wbuf, size_t bytes)
+int capfs_backend_cap_map(capfs_capref_t cap, capfs_capperms_t perms,
+                          struct capfs_backend_mapping *map)
 {
+    CAPFS_STATS_SCOPE(BE_CAP_MAP);
+
+    if (g_st.fd < 0) {
+        return -EIO;
+    }
+
+    int err;
+
+    pthread_rwlock_rdlock(&g_move.lock);
+
     struct capability c;
+    uint64_t base, size;
     if (capref_to_capability(cap, &c)) {
-        return -1;
+        err = -EINVAL;
+    } else if ((perms & c.perms) != perms
+               || !(perms & CAPFS_CAPABILITY_PERM_READ)) {
+        err = -EACCES;
+    } else if (!region_lookup(c.base, &base, &size) || base != c.base
+               || size != c.size) {
+        /* only whole regions are mapped, a page may hold others */
+        err = -EINVAL;
+    } else if (revmap_test(c.base)) {
+        err = -EACCES;
+    } else {
+        bool write = perms & CAPFS_CAPABILITY_PERM_WRITE;
+
+        struct shadow sh = {0};
+        err = shadow_get(base, size, write, &sh);
+        if (!err) {
+            map->fd = write ? sh.fd : sh.rofd;
+            map->offset = 0;
+            map->length = size;
+            map->perms = perms;
+            map->id = sh.id;
+        }
     }
 
-    if (!(c.perms & CAPFS_CAPABILITY_PERM_WRITE)) {
-        return -EACCES;
-    }
+    pthread_rwlock_unlock(&g_move.lock);
 
-    LOG("offset=%li, bytes=%zu, rbuf=%p\n", offset, bytes, wbuf);
+    return err;
+}
 
-    if (offset < 0) {
-        return -1;
-    }
+/**
+ * @brief releases a mapping obtained by capfs_backend_cap_map()
+ *
+ * @param map   the mapping information
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * Releasing a writable mapping writes the region back. The shadow of the
+ * region is removed with its last mapping.
+ */
+int capfs_backend_cap_unmap(const struct capfs_backend_mapping *map)
+{
+    CAPFS_STATS_SCOPE(BE_CAP_UNMAP);
 
-    if (offset + bytes >= c.size) {
-        return -1;
+    pthread_rwlock_rdlock(&g_shadow.lock);
+    struct shadow *sh = *shadow_find_locked(map->id);
+    uint64_t base = sh ? sh->base : 0;
+    uint64_t size = sh ? sh->size : 0;
+    pthread_rwlock_unlock(&g_shadow.lock);
+
+    /* the region has been freed */
+    if (sh == NULL) {
+        return 0;
     }
 
-    metadata_clear_valid_bits(c.base + offset, c.base + offset + bytes);
+    int err = 0;
 
-    assert(offset + bytes < c.size);
+    /* shadowed regions are not moved, but they may be freed meanwhile */
+    capstore_write_lock(base, base + size);
+    pthread_rwlock_wrlock(&g_shadow.lock);
 
-    if(capstore_rawwrite(c.base + offset, wbuf, bytes)) {
-        return -1;
-    }
+    struct shadow **psh = shadow_find_locked(map->id);
+    if ((sh = *psh) != NULL) {
+        if (map->perms & CAPFS_CAPABILITY_PERM_WRITE) {
+            if (image_rawwrite(capstore_addr2offset(base), sh->mem, size)) {
+                err = -EIO;
+            }
+            metadata_clear_valid_bits(base, base + size);
+            sh->writers--;
+        }
 
-    return bytes;
-}
+        if (--sh->refs == 0) {
+            region_unpin(base);
+            shadow_unlink_locked(psh);
+        }
+    }
 
+    pthread_rwlock_unlock(&g_shadow.lock);
+    capstore_write_unlock(base, base + size);
 
-static const char zero[256] = {0};
+    return err;
+}
 
 /**
- * @brief zeroes the entire capability
- *
- * @param cap   the capability to be zeroed
+ * @brief checks whether the region of a capability is mapped writable
  *
- * @return ERR_OK on success error value on failure
+ * @param cap   the capability
  *
- * Note this is equivalent to capfs_backend_write with a zeroed buffer of
- * size of the capability.
+ * @return true if a client may store to the region
  */
-int capfs_backend_zero(capfs_capref_t cap)
+bool capfs_backend_cap_mapped(capfs_capref_t cap)
 {
     struct capability c;
     if (capref_to_capability(cap, &c)) {
-        return -1;
-    }
-
-    if (!(c.perms & CAPFS_CAPABILITY_PERM_WRITE)) {
-        return -EACCES;
-    }
-
-    for (size_t offset = 0; offset < c.size; offset += 256) {
-        if (c.size > offset + 256) {
-            capfs_backend_write(cap, offset, zero, 256);
-        } else {
-            capfs_backend_write(cap, offset, zero, c.size - offset);
-        }
+        return false;
     }
 
-    return 0;
-}
\ No newline at end of file
+    return shadow_writable(c.base, c.size);
+}
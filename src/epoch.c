@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+
+#include <capfs_internal.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/*
+ * ============================================================================
+ * Epoch page
+ * ============================================================================
+ *
+ * The page lives in a sealed memfd. The daemon keeps its writable mapping,
+ * clients can only map it read-only.
+ */
+
+#define EPOCH_PAGE_SIZE ((sizeof(struct capfs_epoch_page) + 4095) & ~4095UL)
+
+struct epoch_state {
+    int                      fd;    ///< the memfd of the epoch page
+    struct capfs_epoch_page *page;  ///< the mapped epoch page
+};
+
+static struct epoch_state epoch = { .fd = -1 };
+
+
+/**
+ * @brief creates the shared epoch page
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_epoch_init(void)
+{
+    int err;
+
+    if (epoch.page) {
+        return 0;
+    }
+
+    epoch.fd = memfd_create("capfs-epoch", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (epoch.fd < 0) {
+        return -errno;
+    }
+
+    if (ftruncate(epoch.fd, EPOCH_PAGE_SIZE)) {
+        err = -errno;
+        goto err_out;
+    }
+
+    void *p = mmap(NULL, EPOCH_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   epoch.fd, 0);
+    if (p == MAP_FAILED) {
+        err = -errno;
+        goto err_out;
+    }
+
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if (fcntl(epoch.fd, F_ADD_SEALS, seals)) {
+        LOGW("WARNING: sealing the epoch page failed with %i\n", errno);
+    }
+
+    epoch.page = p;
+
+    return 0;
+
+err_out:
+    close(epoch.fd);
+    epoch.fd = -1;
+    return err;
+}
+
+/**
+ * @brief frees the shared epoch page
+ */
+void capfs_epoch_destroy(void)
+{
+    if (epoch.page == NULL) {
+        return;
+    }
+
+    munmap(epoch.page, EPOCH_PAGE_SIZE);
+    close(epoch.fd);
+    epoch.page = NULL;
+    epoch.fd = -1;
+}
+
+/**
+ * @brief advances the epoch of a file
+ *
+ * @param file  the capability of the file whose capabilities or meta data
+ *              have changed
+ */
+void capfs_epoch_bump(capfs_capref_t file)
+{
+    if (epoch.page == NULL) {
+        return;
+    }
+
+    __atomic_fetch_add(&epoch.page->slots[capfs_epoch_slot(file)], 1,
+                       __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief obtains the current epoch of a file
+ *
+ * @param file  the capability of the file
+ *
+ * @return the epoch of the slot of the file
+ */
+uint64_t capfs_epoch_get(capfs_capref_t file)
+{
+    if (epoch.page == NULL) {
+        return 0;
+    }
+
+    return __atomic_load_n(&epoch.page->slots[capfs_epoch_slot(file)],
+                           __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief advances the global epoch, invalidating all cached results
+ */
+void capfs_epoch_bump_all(void)
+{
+    if (epoch.page == NULL) {
+        return;
+    }
+
+    __atomic_fetch_add(&epoch.page->global, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief hands out the descriptor of the epoch page
+ *
+ * @param res   returns the descriptor of the epoch page
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_epoch_share(union capfs_ioctl_res *res)
+{
+    if (epoch.page == NULL) {
+        return -ENOTSUP;
+    }
+
+    res->epoch_setup.pid = getpid();
+    res->epoch_setup.fd = epoch.fd;
+    res->epoch_setup.size = EPOCH_PAGE_SIZE;
+
+    return 0;
+}
@@ -38,14 +38,20 @@
 #include <stdint.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 
 #define CAPFS_FILE_NAME_MAX 127
 
+#define CAPFS_FS_LOCK_BITS 6    ///< number of content locks is 2^bits
+
 #define CAPFS_FS_FILE_ROOT_HEADER "CAP-FS "
 #define CAPFS_FS_FILE_ROOT_VERSION1 0x0100
+#define CAPFS_FS_FILE_ROOT_VERSION2 0x0200  ///< compressed capability bounds
 
 #define CAPFS_FS_FILE_MAGIC 0x00cafebabe00UL
 
+#define CAPFS_FS_ROOT_PERMS 0755
+
 
 struct capfs_file
 {
@@ -72,6 +78,12 @@ struct capfs_file
 
 static struct capfs_file g_fs_root;
 
+/* content locks, shared by the files hashing to the same lock */
+static pthread_rwlock_t g_fs_locks[1 << CAPFS_FS_LOCK_BITS];
+
+_Static_assert(offsetof(struct capfs_file, content) % sizeof(uint64_t) == 0,
+               "the content capability must be aligned to be stored");
+
 
 /**
  * @brief formats the space pointed to by capability for use as a file system
@@ -84,7 +96,7 @@ int capfs_filesystem_format(capfs_capref_t root)
 {
     int err;
 
-    LOGA("Formatting file system...\n");
+    LOGI("Formatting file system...\n");
 
     err = capfs_backend_zero(root);
     if (err) {
@@ -93,13 +105,16 @@ int capfs_filesystem_format(capfs_capref_t root)
     }
 
     struct capfs_file fs_root;
+    memset(&fs_root, 0, sizeof(fs_root));
 
     LOGA("Initializing file system root block..\n");
 
     fs_root.size = capfs_backend_cap_get_size(root);
     fs_root.magic = CAPFS_FS_FILE_MAGIC;
+    fs_root.type = CAP_FS_FILETYPE_ROOT;
     fs_root.name[0] = '/';
     fs_root.name[1] = 0;
+    fs_root.root.version = CAPFS_FS_FILE_ROOT_VERSION2;
 
     memcpy((void *)&fs_root.root.header, CAPFS_FS_FILE_ROOT_HEADER, 8);
 
@@ -108,6 +123,37 @@ int capfs_filesystem_format(capfs_capref_t root)
         return -1;
     }
 
+    /* every path may now resolve differently */
+    capfs_epoch_bump_all();
+
+    return 0;
+}
+
+/**
+ * @brief rebuilds the reverse index from the file records
+ *
+ * @param root  root capability of the file system
+ *
+ * @return ERR_OK on success, error value on failure
+ *
+ * The index is not stored in the file system. It is rebuilt when mounting by
+ * recording the regions of every file record reachable from the root, and
+ * kept up to date when regions are allocated and freed afterwards.
+ */
+static int capfs_filesystem_index_rebuild(capfs_capref_t root)
+{
+    int err;
+
+    capfs_index_clear();
+
+    if ((err = capfs_index_insert(root, root))) {
+        return err;
+    }
+
+    if (g_fs_root.content.capaddr) {
+        return capfs_index_insert(g_fs_root.content, root);
+    }
+
     return 0;
 }
 
@@ -120,24 +166,44 @@ int capfs_filesystem_format(capfs_capref_t root)
  */
 int capfs_filesystem_init(capfs_capref_t root)
 {
+    for (size_t i = 0; i < sizeof(g_fs_locks) / sizeof(g_fs_locks[0]); i++) {
+        pthread_rwlock_init(&g_fs_locks[i], NULL);
+    }
+
+    capfs_index_init();
+
+    if (capfs_epoch_init()) {
+        LOGW("WARNING: epoch page unavailable, clients cannot cache\n");
+    }
 
-    if (capfs_filesystem_format(root)) {
-        PANIC(0, "%s", "ssdfsdf\n");
+    /* an image that holds a file system already is used as it is */
+    if (capfs_backend_read(root, 0, (void *)&g_fs_root, sizeof(g_fs_root)) !=
+            sizeof(g_fs_root) || g_fs_root.magic != CAPFS_FS_FILE_MAGIC) {
+        int err = capfs_filesystem_format(root);
+        if (err) {
+            LOGE("ERROR - formatting the file system failed with %i\n", err);
+            return err;
+        }
     }
 
     LOGA("initializing filesystem\n");
     if (capfs_backend_read(root, 0, (void *)&g_fs_root, sizeof(g_fs_root)) !=
             sizeof(g_fs_root)) {
-        LOGA("ERROR - Root capability was invalid.\n");
+        LOGE("ERROR - Root capability was invalid.\n");
         return -EINVAL;
     }
 
     if (g_fs_root.magic != CAPFS_FS_FILE_MAGIC) {
-        LOG("ERROR - Magic Number not found %" PRIx64 " expected %" PRIx64 "\n",
-            g_fs_root.magic, CAPFS_FS_FILE_MAGIC );
+        LOGE("ERROR - Magic Number not found %" PRIx64 " expected %" PRIx64 "\n",
+             g_fs_root.magic, CAPFS_FS_FILE_MAGIC );
         return -EINVAL;
     }
 
+    if (capfs_backend_get_cap(root, offsetof(struct capfs_file, content),
+                              &g_fs_root.content)) {
+        g_fs_root.content.capaddr = 0;
+    }
+
     if (strncmp(g_fs_root.root.header, CAPFS_FS_FILE_ROOT_HEADER, 8)) {
         LOG("Header not match: '%s' expected '%s'\n", g_fs_root.root.header,
             CAPFS_FS_FILE_ROOT_HEADER);
@@ -150,8 +216,11 @@ int capfs_filesystem_init(capfs_capref_t root)
     }
 
     switch(g_fs_root.root.version) {
-        case CAPFS_FS_FILE_ROOT_VERSION1:
+        case CAPFS_FS_FILE_ROOT_VERSION2:
             break;
+        case CAPFS_FS_FILE_ROOT_VERSION1:
+            LOGE("ERROR - capabilities use the old encoding\n");
+            return -EINVAL;
         default:
             LOG("Unsupported version: 0x%x\n", g_fs_root.root.version);
             break;
@@ -159,7 +228,7 @@ int capfs_filesystem_init(capfs_capref_t root)
 
     /* todo: initialize the heap */
 
-    return 0;
+    return capfs_filesystem_index_rebuild(root);
 }
 
 #define CAPFS_FS_SEPARATOR '/'
@@ -277,6 +346,135 @@ int capfs_filesystem_resolve_path(capfs_capref_t root,
 }
 
 
+/// the maximum number of path components shared between batched lookups
+#define CAPFS_FS_PATH_DEPTH_MAX 64
+
+struct capfs_resolve_item {
+    const char *path;
+    size_t      idx;
+};
+
+static int capfs_resolve_item_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct capfs_resolve_item *)a)->path,
+                  ((const struct capfs_resolve_item *)b)->path);
+}
+
+/**
+ * @brief resolves many paths relative to a given root in one pass
+ *
+ * @param root      the root capability to start resolving from
+ * @param paths     the paths to resolve
+ * @param count     the number of paths
+ * @param ret_caps  returns the caps to the files of the paths
+ * @param ret_errs  returns the error value of each path
+ *
+ * @return ERR_OK on success or error value on failure
+ *
+ * The paths are resolved in lexical order, so every path only walks the
+ * components following the directories it shares with the previous one.
+ */
+int capfs_filesystem_resolve_paths(capfs_capref_t root,
+                                   const char * const * paths, size_t count,
+                                   capfs_capref_t * ret_caps, int * ret_errs)
+{
+    int err;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    struct capfs_resolve_item *items = calloc(count, sizeof(*items));
+    if (!items) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        items[i].path = paths[i] ? paths[i] : "";
+        items[i].idx = i;
+    }
+
+    qsort(items, count, sizeof(*items), capfs_resolve_item_cmp);
+
+    /* the walk of the previous path: dirs[d] is the cap after d components */
+    capfs_capref_t dirs[CAPFS_FS_PATH_DEPTH_MAX + 1];
+    size_t ends[CAPFS_FS_PATH_DEPTH_MAX];
+    size_t depth = 0;
+    const char *prev = "";
+
+    dirs[0] = root;
+
+    char name[CAPFS_FILE_NAME_MAX + 1];
+
+    for (size_t i = 0; i < count; i++) {
+        const char *path = items[i].path;
+
+        size_t common = 0;
+        while (path[common] && path[common] == prev[common]) {
+            common++;
+        }
+
+        err = 0;
+        size_t d = 0;
+        size_t pos = 0;
+        while (!err) {
+            while (path[pos] == CAPFS_FS_SEPARATOR) {
+                pos++;
+            }
+            if (path[pos] == 0) {
+                break;
+            }
+
+            size_t end = pos;
+            while (path[end] && path[end] != CAPFS_FS_SEPARATOR) {
+                end++;
+            }
+
+            if (d == CAPFS_FS_PATH_DEPTH_MAX) {
+                err = -ENAMETOOLONG;
+                break;
+            }
+
+            /* the component is the same as in the previous path */
+            if (d < depth && ends[d] == end && end <= common) {
+                d++;
+                pos = end;
+                continue;
+            }
+
+            if (end - pos > CAPFS_FILE_NAME_MAX) {
+                err = -ENAMETOOLONG;
+                break;
+            }
+
+            memcpy(name, path + pos, end - pos);
+            name[end - pos] = 0;
+
+            if ((err = capfs_filessystem_resolve_one(dirs[d], name, &dirs[d + 1]))) {
+                break;
+            }
+
+            ends[d] = end;
+            d++;
+            pos = end;
+        }
+
+        /* only the components walked successfully can be shared */
+        depth = d;
+        prev = path;
+
+        ret_errs[items[i].idx] = err;
+        if (!err) {
+            ret_caps[items[i].idx] = dirs[d];
+        }
+    }
+
+    free(items);
+
+    return 0;
+}
+
+
 char *capfs_filesystem_get_direntry(capfs_capref_t dircap, off_t offset)
 {
     (void)dircap;
@@ -285,6 +483,34 @@ char *capfs_filesystem_get_direntry(capfs_capref_t dircap, off_t offset)
 
 }
 
+/**
+ * @brief reads the file record of a file capability
+ *
+ * @param file  the capability of the file
+ * @param f     returns the file record
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+static int capfs_filesystem_read_file(capfs_capref_t file,
+                                      struct capfs_file *f)
+{
+    if (capfs_backend_read(file, 0, (void *)f, sizeof(*f)) != sizeof(*f)) {
+        return -EIO;
+    }
+
+    if (f->magic != CAPFS_FS_FILE_MAGIC) {
+        return -EINVAL;
+    }
+
+    /* the content is stored as a capability, see capfs_filesystem_reserve() */
+    if (capfs_backend_get_cap(file, offsetof(struct capfs_file, content),
+                              &f->content)) {
+        f->content.capaddr = 0;
+    }
+
+    return 0;
+}
+
 /**
  * @brief obtains the meta data associated to the file
  *
@@ -296,21 +522,365 @@ char *capfs_filesystem_get_direntry(capfs_capref_t dircap, off_t offset)
 int capfs_filesystem_get_metadata(capfs_capref_t file,
                                   struct capfs_filesystem_meta_data *md)
 {
-    (void)file;
-    (void)md;
-    return -1;
+    int err;
+
+    struct capfs_file f;
+    if ((err = capfs_filesystem_read_file(file, &f))) {
+        return err;
+    }
+
+    md->type = f.type;
+    md->bytes = f.size;
+
+    switch(f.type) {
+        case CAP_FS_FILETYPE_ROOT :
+            md->perms = CAPFS_FS_ROOT_PERMS;
+            break;
+        case CAP_FS_FILETYPE_DIRECTORY :
+            md->perms = f.directory.permission;
+            break;
+        default:
+            md->perms = f.file.permission;
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief looks up the file an operation applies to
+ *
+ * @param path  the file path
+ * @param fi    FUSE file info, may be NULL
+ * @param file  returns the capability of the file
+ * @param md    returns the meta data of the file
+ *
+ * @return ERR_OK on success, -EBADF if the file handle is stale, -ENOENT if
+ *         the path does not resolve
+ *
+ * The open file handle is used if there is one, the path is resolved
+ * otherwise. The size of a regular file is always read from its record. The
+ * type of the file is left to the caller to check.
+ */
+int capfs_filesystem_lookup(const char *path, struct fuse_file_info *fi,
+                            capfs_capref_t *file,
+                            struct capfs_filesystem_meta_data *md)
+{
+    if (fi && fi->fh) {
+        struct capfs_handle *h = cap_fs_handle_get(fi->fh);
+        if (!h) {
+            return -EBADF;
+        }
+        *file = h->cap;
+        md->type = h->type;
+        md->bytes = h->size;
+        md->perms = h->perms;
+        /* other handles may have extended the file since it was opened */
+        if (h->type == CAP_FS_FILETYPE_FILE
+            && capfs_filesystem_get_size(h->cap, &md->bytes)) {
+            return -EIO;
+        }
+        return 0;
+    }
+
+    if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, file)
+        || capfs_filesystem_get_metadata(*file, md)) {
+        return -ENOENT;
+    }
+
+    return 0;
 }
 
 /**
- * @brief
- * @param cap_file
- * @param cap_content
- * @return
+ * @brief reads the number of used bytes of a file
+ *
+ * @param file  the capability of the file
+ * @param bytes returns the size of the file in bytes
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_filesystem_get_size(capfs_capref_t file, size_t *bytes)
+{
+    uint64_t size;
+    if (capfs_backend_read(file, offsetof(struct capfs_file, size),
+                           (void *)&size, sizeof(size)) != sizeof(size)) {
+        return -EIO;
+    }
+
+    *bytes = size;
+
+    return 0;
+}
+
+/**
+ * @brief grows the number of used bytes of a file
+ *
+ * @param file  the capability of the file
+ * @param bytes the number of bytes the file must have at least
+ *
+ * @return ERR_OK on success, error value on failure
+ *
+ * Writes through different handles extend the file concurrently, the size
+ * is therefore only ever raised, under the content lock held exclusively.
+ */
+int capfs_filesystem_extend(capfs_capref_t file, size_t bytes)
+{
+    int err = 0;
+
+    capfs_filesystem_lock(file, true);
+
+    uint64_t size;
+    if (capfs_backend_read(file, offsetof(struct capfs_file, size),
+                           (void *)&size, sizeof(size)) != sizeof(size)) {
+        err = -EIO;
+    } else if (size < bytes) {
+        size = bytes;
+        if (capfs_backend_write(file, offsetof(struct capfs_file, size),
+                                (void *)&size, sizeof(size)) != sizeof(size)) {
+            err = -EIO;
+        } else {
+            capfs_epoch_bump(file);
+        }
+    }
+
+    capfs_filesystem_unlock(file);
+
+    return err;
+}
+
+/**
+ * @brief obtains the capability to the content of a file
+ *
+ * @param cap_file      the capability of the file
+ * @param cap_content   returns the capability of the file content
+ *
+ * @return ERR_OK on success, -ENODATA if the file has no content yet,
+ *         error value on failure
  */
 int capfs_filesystem_get_content_cap(capfs_capref_t cap_file,
                                      capfs_capref_t *cap_content)
 {
-    (void)cap_file;
-    (void)cap_content;
-    return -1;
-}
\ No newline at end of file
+    int err;
+
+    struct capfs_file f;
+    if ((err = capfs_filesystem_read_file(cap_file, &f))) {
+        return err;
+    }
+
+    if (f.content.capaddr == 0) {
+        return -ENODATA;
+    }
+
+    *cap_content = f.content;
+
+    return 0;
+}
+
+/**
+ * @brief obtains the decoded bounds of the content of a file
+ *
+ * @param file      the capability of the file
+ * @param bounds    returns the bounds of the file content
+ *
+ * @return ERR_OK on success, -ENODATA if the file has no content yet,
+ *         error value on failure
+ */
+int capfs_filesystem_get_content_bounds(capfs_capref_t file,
+                                        struct capfs_capbounds *bounds)
+{
+    int err;
+
+    capfs_capref_t content;
+    if ((err = capfs_filesystem_get_content_cap(file, &content))) {
+        return err;
+    }
+
+    if (capfs_backend_cap_decode(content, bounds)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief decodes the content of a file again after an access failed
+ *
+ * @param file      the capability of the file
+ * @param bounds    the bounds the access failed with, updated
+ * @param err       the error of the access
+ *
+ * @return ERR_OK if the access should be repeated with the updated bounds,
+ *         the error of the access otherwise
+ *
+ * Accesses through cached bounds fail with -ESTALE if the content was moved
+ * by a compaction, and with -EACCES if it was replaced by a larger region and
+ * freed. The content capability is read again from the file record in both
+ * cases. A denied access is final if the content has not changed.
+ */
+int capfs_filesystem_refresh_bounds(capfs_capref_t file,
+                                    struct capfs_capbounds *bounds, int err)
+{
+    if (err != -ESTALE && err != -EACCES) {
+        return err;
+    }
+
+    struct capfs_capbounds fresh;
+    if (capfs_filesystem_get_content_bounds(file, &fresh)) {
+        return (err == -ESTALE) ? -EIO : err;
+    }
+
+    if (err == -EACCES && fresh.cap.capaddr == bounds->cap.capaddr
+        && fresh.base == bounds->base && fresh.size == bounds->size
+        && fresh.perms == bounds->perms) {
+        return err;
+    }
+
+    *bounds = fresh;
+
+    return 0;
+}
+
+/**
+ * @brief obtains the content lock of a file
+ *
+ * @param file  the capability of the file
+ *
+ * @return the lock of the file
+ *
+ * Different capabilities of the same file record share the lock, it is
+ * looked up by the address of the record.
+ */
+static pthread_rwlock_t *capfs_filesystem_lock_of(capfs_capref_t file)
+{
+    uint64_t key = file.capaddr;
+
+    struct capfs_capbounds b;
+    if (capfs_backend_cap_decode(file, &b) == 0) {
+        key = b.base;
+    }
+
+    key = (key >> 6) * 0x9e3779b97f4a7c15UL;
+    return &g_fs_locks[key >> (64 - CAPFS_FS_LOCK_BITS)];
+}
+
+/**
+ * @brief locks the content of a file
+ *
+ * @param file      the capability of the file
+ * @param exclusive true to replace the content, false to access it
+ */
+void capfs_filesystem_lock(capfs_capref_t file, bool exclusive)
+{
+    if (exclusive) {
+        pthread_rwlock_wrlock(capfs_filesystem_lock_of(file));
+    } else {
+        pthread_rwlock_rdlock(capfs_filesystem_lock_of(file));
+    }
+}
+
+/**
+ * @brief unlocks the content of a file
+ *
+ * @param file  the capability of the file
+ */
+void capfs_filesystem_unlock(capfs_capref_t file)
+{
+    pthread_rwlock_unlock(capfs_filesystem_lock_of(file));
+}
+
+/**
+ * @brief replaces the content of a file by a larger region
+ *
+ * @param file  the capability of the file
+ * @param bytes the number of bytes the content must hold
+ *
+ * @return ERR_OK on success, error value on failure
+ *
+ * The caller holds the content lock of the file exclusively.
+ */
+static int capfs_filesystem_reserve_locked(capfs_capref_t file, size_t bytes)
+{
+    int err;
+
+    /* read under the lock, a racing reserve may have grown the content */
+    struct capfs_file f;
+    if ((err = capfs_filesystem_read_file(file, &f))) {
+        return err;
+    }
+
+    if (f.type != CAP_FS_FILETYPE_FILE) {
+        return -EINVAL;
+    }
+
+    bool has_content = (f.content.capaddr != 0);
+    if (has_content && capfs_backend_cap_get_size(f.content) >= bytes) {
+        return 0;
+    }
+
+    /* the stores of the client would be lost with the old region */
+    if (has_content && capfs_backend_cap_mapped(f.content)) {
+        return -EBUSY;
+    }
+
+    LOG("growing content of '%s' to %zu bytes\n", f.name, bytes);
+
+    capfs_capref_t content;
+    err = capfs_backend_cap_alloc(bytes, CAPFS_CAPABILITY_PERM_READ
+                                         | CAPFS_CAPABILITY_PERM_WRITE,
+                                  &content);
+    if (err) {
+        return err;
+    }
+
+    if (has_content && f.size
+        && capfs_backend_copy(f.content, 0, content, 0, f.size) != (long)f.size) {
+        capfs_backend_cap_free(content);
+        return -EIO;
+    }
+
+    /* stored with its valid bits, the region stays reachable */
+    if ((err = capfs_backend_put_cap(file, offsetof(struct capfs_file, content),
+                                     content))) {
+        capfs_backend_cap_free(content);
+        return err;
+    }
+
+    if (has_content) {
+        capfs_index_remove(f.content);
+        capfs_backend_cap_free(f.content);
+    }
+
+    capfs_index_insert(content, file);
+
+    /* the content capability has been replaced */
+    capfs_epoch_bump(file);
+
+    return 0;
+}
+
+/**
+ * @brief ensures the content of a file can hold a number of bytes
+ *
+ * @param file  the capability of the file
+ * @param bytes the number of bytes the content must hold
+ *
+ * @return ERR_OK on success, error value on failure
+ *
+ * If the current content region is too small, a new region is allocated, the
+ * used bytes of the file are copied over and the old region is freed. The
+ * size of the file is not changed. The content lock of the file is held
+ * exclusively, so writes holding it shared do not land in the old region
+ * after it has been copied.
+ *
+ * The content of a file mapped writable by a client is not replaced, this
+ * returns -EBUSY.
+ */
+int capfs_filesystem_reserve(capfs_capref_t file, size_t bytes)
+{
+    /* concurrent reserves would each replace and free the content */
+    capfs_filesystem_lock(file, true);
+    int err = capfs_filesystem_reserve_locked(file, bytes);
+    capfs_filesystem_unlock(file);
+
+    return err;
+}
@@ -42,8 +42,14 @@
  */
 int capfs_op_access(const char * path, int mask)
 {
+    CAPFS_STATS_SCOPE(OP_ACCESS);
+
     LOG("path='%s, mask=0x%x'\n", path, mask);
 
+    if (capfs_stats_path(path) != CAPFS_STATS_PATH_NONE) {
+        return 0;
+    }
+
     capfs_capref_t cap;
     if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, &cap)) {
         return -ENOENT;
@@ -47,6 +47,8 @@
 int capfs_op_chmod(const char * path, mode_t mode,
                    struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_CHMOD);
+
     LOG("path='%s'\n", path);
 
     (void)path;
@@ -48,6 +48,8 @@
 int capfs_op_chown(const char * path, uid_t uid, gid_t gid,
                    struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_CHOWN);
+
     LOG("path='%s'\n", path);
 
     (void)path;
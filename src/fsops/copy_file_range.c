@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capfs_internal.h>
+
+#include <assert.h>
+#include <errno.h>
+
+
+/**
+ * @brief Copy a range of data from one file to another.
+ *
+ * @param path_in       the source file path
+ * @param fi_in         FUSE file info of the source file
+ * @param offset_in     offset to read from
+ * @param path_out      the destination file path
+ * @param fi_out        FUSE file info of the destination file
+ * @param offset_out    offset to write to
+ * @param size          bytes to copy
+ * @param flags         copy_file_range flags, must be zero
+ *
+ * @return Returns the number of bytes copied
+ *         0 if offset_in was at or beyond the end of the source file.
+ *
+ * The data is copied inside the backend and never travels through the kernel
+ * or the FUSE request buffers. See copy_file_range(2) for details.
+ */
+ssize_t capfs_op_copy_file_range(const char * path_in,
+                                 struct fuse_file_info * fi_in,
+                                 off_t offset_in, const char * path_out,
+                                 struct fuse_file_info * fi_out,
+                                 off_t offset_out, size_t size, int flags)
+{
+    CAPFS_STATS_SCOPE(OP_COPY_FILE_RANGE);
+
+    int err;
+
+    LOG("path_in='%s', path_out='%s'\n", path_in, path_out);
+
+    assert(path_in);
+    assert(path_out);
+
+    if (flags) {
+        return -EINVAL;
+    }
+
+    capfs_capref_t file_in, file_out;
+    struct capfs_filesystem_meta_data md_in, md_out;
+    if ((err = capfs_filesystem_lookup(path_in, fi_in, &file_in, &md_in))
+        || (err = capfs_filesystem_lookup(path_out, fi_out, &file_out,
+                                          &md_out))) {
+        return err;
+    }
+
+    if (md_in.type != CAP_FS_FILETYPE_FILE
+        || md_out.type != CAP_FS_FILETYPE_FILE) {
+        return -EINVAL;
+    }
+
+    size_t fsize_in = md_in.bytes;
+    size_t fsize_out = md_out.bytes;
+
+    if (fsize_in <= (size_t)offset_in) {
+        return 0;
+    }
+
+    if ((size_t)offset_out > fsize_out) {
+        return -EINVAL;
+    }
+
+    if (size > fsize_in - offset_in) {
+        size = fsize_in - offset_in;
+    }
+
+    if ((err = capfs_filesystem_reserve(file_out, offset_out + size))) {
+        return err;
+    }
+
+    /* the destination content is not replaced while it is written */
+    capfs_filesystem_lock(file_out, false);
+
+    long copied = -EIO;
+    capfs_capref_t content_in, content_out;
+    if (!capfs_filesystem_get_content_cap(file_in, &content_in)
+        && !capfs_filesystem_get_content_cap(file_out, &content_out)) {
+        copied = capfs_backend_copy(content_in, offset_in, content_out,
+                                    offset_out, size);
+    }
+
+    capfs_filesystem_unlock(file_out);
+
+    if (copied == -1) {
+        /* the backend reports a generic failure as -1, which is -EPERM */
+        return -EIO;
+    } else if (copied < 0) {
+        return copied;
+    }
+
+    if (offset_out + (size_t)copied > fsize_out) {
+        if (capfs_filesystem_extend(file_out, offset_out + copied)) {
+            return -EIO;
+        }
+
+        struct capfs_handle *h;
+        if (fi_out && (h = cap_fs_handle_get(fi_out->fh))) {
+            struct capfs_capbounds bounds;
+            if (!capfs_filesystem_get_content_bounds(file_out, &bounds)) {
+                cap_fs_handle_set_bounds(h, &bounds);
+            }
+        }
+    }
+
+    return copied;
+}
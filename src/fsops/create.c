@@ -41,6 +41,8 @@
 int capfs_op_create(const char * path, mode_t mode,
                     struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_CREATE);
+
     LOG("path='%s'\n", path);
 
     (void)path;
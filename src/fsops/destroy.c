@@ -36,7 +36,14 @@ void capfs_op_destroy(void* private_data)
 {
     LOG("private_data=%p\n", private_data);
 
+    capfs_ring_shutdown_all();
+    capfs_inval_destroy();
+    capfs_index_destroy();
+    capfs_epoch_destroy();
+
     if (!capfs_backend_destroy(private_data)) {
-        LOG("WARNING: backend destroy failed, pdata=%p...\n", private_data);
+        LOGW("WARNING: backend destroy failed, pdata=%p...\n", private_data);
     }
+
+    capfs_log_stop();
 }
\ No newline at end of file
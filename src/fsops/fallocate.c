@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capfs_internal.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+
+
+/**
+ * @brief Allocates, punches or zeroes space of a file.
+ *
+ * @param path      the file path
+ * @param mode      the fallocate mode flags
+ * @param offset    start of the range
+ * @param length    length of the range in bytes
+ * @param fi        FUSE file info
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * Preallocation grows the content region of the file using the region
+ * allocator so later writes do not need to relocate the content. Punching a
+ * hole and zeroing a range release the backing storage of the range, which
+ * is then reported as a hole by lseek(SEEK_HOLE). See fallocate(2) for
+ * details.
+ */
+int capfs_op_fallocate(const char * path, int mode, off_t offset,
+                       off_t length, struct fuse_file_info * fi)
+{
+    CAPFS_STATS_SCOPE(OP_FALLOCATE);
+
+    int err;
+
+    LOG("path='%s', mode=0x%x, offset=%li, length=%li\n", path, mode, offset,
+        length);
+
+    assert(path);
+
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE
+                 | FALLOC_FL_ZERO_RANGE)) {
+        return -EOPNOTSUPP;
+    }
+
+    bool punch = (mode & FALLOC_FL_PUNCH_HOLE);
+    bool zero = (mode & FALLOC_FL_ZERO_RANGE);
+    if ((punch && !(mode & FALLOC_FL_KEEP_SIZE)) || (punch && zero)) {
+        return -EOPNOTSUPP;
+    }
+
+    capfs_capref_t cap;
+    struct capfs_filesystem_meta_data md;
+    if ((err = capfs_filesystem_lookup(path, fi, &cap, &md))) {
+        return err;
+    }
+
+    if (md.type != CAP_FS_FILETYPE_FILE) {
+        return -ENODEV;
+    }
+
+    size_t fsize = md.bytes;
+
+    size_t end = offset + length;
+
+    if (punch) {
+        /* only the used part of the file can contain data */
+        if ((size_t)offset >= fsize) {
+            return 0;
+        }
+        if (end > fsize) {
+            end = fsize;
+        }
+    } else if ((err = capfs_filesystem_reserve(cap, end))) {
+        return err;
+    }
+
+    if (punch || zero) {
+        capfs_filesystem_lock(cap, false);
+
+        capfs_capref_t content;
+        err = capfs_filesystem_get_content_cap(cap, &content);
+        if (!err) {
+            err = capfs_backend_punch(content, offset, end - offset);
+        }
+
+        capfs_filesystem_unlock(cap);
+
+        if (err) {
+            return -EIO;
+        }
+    }
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > fsize) {
+        if (capfs_filesystem_extend(cap, end)) {
+            return -EIO;
+        }
+    }
+
+    /* the content may have been moved to a larger region */
+    struct capfs_handle *h;
+    if (fi && (h = cap_fs_handle_get(fi->fh))) {
+        struct capfs_capbounds bounds;
+        if (!capfs_filesystem_get_content_bounds(cap, &bounds)) {
+            cap_fs_handle_set_bounds(h, &bounds);
+        }
+    }
+
+    return 0;
+}
@@ -44,6 +44,8 @@
  */
 int capfs_op_flush(const char * path, struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_FLUSH);
+
     LOG("path='%s'\n", path);
 
     (void)path;
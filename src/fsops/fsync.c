@@ -50,6 +50,8 @@
 int capfs_op_fsync(const char * path, int isdatasync,
                    struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_FSYNC);
+
     LOG("path='%s'\n", path);
 
     (void)path;
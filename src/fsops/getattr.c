@@ -47,21 +47,44 @@
 int capfs_op_getattr(const char * path, struct stat * stbuf,
                      struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_GETATTR);
+
     assert(path);
     assert(stbuf);
 
-    LOG("path='%s', fh=%p\n", path, (fi ? (struct capfs_handle *)fi->fh : NULL));
+    LOG("path='%s', fh=%" PRIx64 "\n", path, (fi ? fi->fh : 0));
+
+    /* the virtual files are not part of the file system */
+    switch (capfs_stats_path(path)) {
+        case CAPFS_STATS_PATH_DIR:
+            stbuf->st_mode = S_IFDIR | 0555;
+            stbuf->st_nlink = 2;
+            return 0;
+        case CAPFS_STATS_PATH_FILE:
+            stbuf->st_mode = S_IFREG | 0644;
+            stbuf->st_nlink = 1;
+            return 0;
+        default:
+            break;
+    }
 
     capfs_filetype_t t = CAP_FS_FILETYPE_NONE;
     size_t sz = 0;
     int perms = 0;
+    capfs_capref_t cap;
     if (fi && fi->fh) {
-        struct capfs_handle *h = (struct capfs_handle *)fi->fh;
+        struct capfs_handle *h = cap_fs_handle_get(fi->fh);
+        if (!h) {
+            return -EBADF;
+        }
+        cap = h->cap;
         t = h->type;
         sz = h->size;
         perms = h->perms;
+        if (t == CAP_FS_FILETYPE_FILE && capfs_filesystem_get_size(cap, &sz)) {
+            return -EIO;
+        }
     } else {
-        capfs_capref_t cap;
         if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, &cap)) {
             return -ENOENT;
         }
@@ -97,5 +120,8 @@ int capfs_op_getattr(const char * path, struct stat * stbuf,
             return -ENOENT;
     }
 
+    /* the kernel now caches the attributes of this path */
+    capfs_inval_track(path, cap);
+
     return 0;
 }
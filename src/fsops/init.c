@@ -48,7 +48,16 @@ void *capfs_op_init(struct fuse_conn_info * conn,
 {
     int err;
 
+    /* after fuse_main() daemonized, so the log thread survives */
+    if ((err = capfs_log_init())) {
+        LOGW("starting the log thread failed with %i\n", err);
+    }
+
     LOG("conn=%p, cfg=%p\n", conn, cfg);
+
+    if ((err = capfs_stats_init())) {
+        LOGW("allocating the statistics failed with %i\n", err);
+    }
     (void) conn;
 
     /* TODO: set the options accordningly */
@@ -60,5 +69,15 @@ void *capfs_op_init(struct fuse_conn_info * conn,
         PANIC(err, "%s", "Filesystem initialization failed");
     }
 
+    /*
+     * changes the kernel does not see are notified, so it can cache longer;
+     * there is no FUSE context when the operations are replayed
+     */
+    struct fuse_context *ctx = fuse_get_context();
+    if (ctx && !capfs_inval_init(ctx->fuse, CAPFS_INVAL_CACHE_TIMEOUT)) {
+        cfg->attr_timeout = CAPFS_INVAL_CACHE_TIMEOUT;
+        cfg->entry_timeout = CAPFS_INVAL_CACHE_TIMEOUT;
+    }
+
     return backend_state;
 }
@@ -28,6 +28,260 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/* serializes mapping the content of handles */
+static pthread_mutex_t g_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief hands out a descriptor of the content of a file
+ *
+ * @param fi    fuse file info of the open file
+ * @param msg   the ioctl message
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * The descriptor refers to a copy of the content region only, so the client
+ * reaches neither other files nor the tags of the store through it. It is
+ * writable if the file is open for writing; the stores reach the file when
+ * the handle is released, and the file cannot grow until then.
+ */
+static int capfs_ioctl_map(struct fuse_file_info *fi, struct capfs_ioctl_msg *msg)
+{
+    int err = 0;
+
+    struct capfs_handle *h;
+    if (!fi || !fi->fh || !(h = cap_fs_handle_get(fi->fh))) {
+        return -EBADF;
+    }
+
+    if (h->type != CAP_FS_FILETYPE_FILE) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&g_map_lock);
+
+    /* a handle maps its content once, a second request gets the same */
+    if (h->map.id) {
+        goto out_res;
+    }
+
+    capfs_capref_t content;
+    if (capfs_filesystem_get_content_cap(h->cap, &content)) {
+        size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+        if ((err = capfs_filesystem_reserve(h->cap, pagesize))) {
+            goto out;
+        }
+    }
+
+    capfs_filesystem_lock(h->cap, false);
+
+    struct capfs_capbounds bounds;
+    if (capfs_filesystem_get_content_cap(h->cap, &content)
+        || capfs_backend_cap_decode(content, &bounds)) {
+        err = -EIO;
+    } else {
+        cap_fs_handle_set_bounds(h, &bounds);
+
+        capfs_capperms_t perms = CAPFS_CAPABILITY_PERM_READ;
+        if ((bounds.perms & CAPFS_CAPABILITY_PERM_WRITE)
+            && (h->flags & O_ACCMODE) != O_RDONLY) {
+            perms |= CAPFS_CAPABILITY_PERM_WRITE;
+        }
+
+        err = capfs_backend_cap_map(content, perms, &h->map);
+    }
+
+    capfs_filesystem_unlock(h->cap);
+
+    if (err) {
+        h->map.id = 0;
+        goto out;
+    }
+
+out_res:
+    msg->res.map.pid = getpid();
+    msg->res.map.fd = h->map.fd;
+    msg->res.map.prot = PROT_READ;
+    if (h->map.perms & CAPFS_CAPABILITY_PERM_WRITE) {
+        msg->res.map.prot |= PROT_WRITE;
+    }
+    msg->res.map.offset = h->map.offset;
+    msg->res.map.length = h->map.length;
+
+    size_t size;
+    if ((err = capfs_filesystem_get_size(h->cap, &size))) {
+        goto out;
+    }
+    msg->res.map.size = size;
+
+out:
+    pthread_mutex_unlock(&g_map_lock);
+
+    return err;
+}
+
+
+/**
+ * @brief finds the file a capability belongs to
+ *
+ * @param msg   the ioctl message
+ *
+ * @return 0 on success, negative error number on failure
+ */
+static int capfs_ioctl_identify(struct capfs_ioctl_msg *msg)
+{
+    int err;
+
+    capfs_capref_t file;
+    uint64_t offset, epoch;
+    if ((err = capfs_index_lookup(msg->args.identify.cap, &file, &offset,
+                                  &epoch))) {
+        return err;
+    }
+
+    struct capfs_filesystem_meta_data md;
+    if (capfs_filesystem_get_metadata(file, &md)) {
+        return -ENOENT;
+    }
+
+    msg->res.identify.type = md.type;
+    msg->res.identify.file = file;
+    msg->res.identify.offset = offset;
+    msg->res.identify.epoch = epoch;
+
+    return 0;
+}
+
+
+/**
+ * @brief obtains the meta data of a file
+ *
+ * @param cap   the capability of the file
+ * @param msg   the ioctl message
+ *
+ * @return 0 on success, negative error number on failure
+ */
+static int capfs_ioctl_stat(capfs_capref_t cap, struct capfs_ioctl_msg *msg)
+{
+    /* loaded first, a change while reading makes the result stale */
+    uint64_t epoch = capfs_epoch_get(cap);
+
+    struct capfs_filesystem_meta_data md;
+    if (capfs_filesystem_get_metadata(cap, &md)) {
+        return -ENOENT;
+    }
+
+    msg->res.stat.type = md.type;
+    msg->res.stat.file = cap;
+    msg->res.stat.size = md.bytes;
+    msg->res.stat.perms = md.perms;
+    msg->res.stat.epoch = epoch;
+
+    return 0;
+}
+
+
+/**
+ * @brief obtains the capabilities of a batch of paths
+ *
+ * @param path  the path the ioctl is issued on
+ * @param cap   the capability of that path
+ * @param ft    the file type of that path
+ * @param b     the batch message
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * All paths of the batch are resolved in one pass, the status of each entry
+ * is returned in the entry.
+ */
+static int capfs_ioctl_get_cap_batch(const char *path, capfs_capref_t cap,
+                                     capfs_filetype_t ft,
+                                     struct capfs_ioctl_batch *b)
+{
+    if (b->count > CAPFS_IOCTL_BATCH_MAX) {
+        return -EINVAL;
+    }
+
+    /* the strings are untrusted, make sure the last one is terminated */
+    b->strtab[CAPFS_IOCTL_BATCH_STRTAB - 1] = 0;
+
+    const char *paths[CAPFS_IOCTL_BATCH_MAX] = { NULL };
+    char *joined[CAPFS_IOCTL_BATCH_MAX];
+    uint32_t idx[CAPFS_IOCTL_BATCH_MAX];
+    capfs_capref_t caps[CAPFS_IOCTL_BATCH_MAX];
+    int errs[CAPFS_IOCTL_BATCH_MAX];
+    size_t n = 0;
+
+    bool isdir = (ft == CAP_FS_FILETYPE_DIRECTORY || ft == CAP_FS_FILETYPE_ROOT);
+
+    b->resolved = 0;
+
+    for (uint32_t i = 0; i < b->count; i++) {
+        struct capfs_ioctl_batch_entry *e = &b->entries[i];
+
+        if (e->path == CAPFS_IOCTL_BATCH_SELF) {
+            e->cap = cap;
+            e->status = 0;
+            b->resolved++;
+            continue;
+        }
+
+        if (e->path >= CAPFS_IOCTL_BATCH_STRTAB) {
+            e->status = -EINVAL;
+            continue;
+        }
+
+        const char *p = b->strtab + e->path;
+        joined[n] = NULL;
+
+        if (p[0] != '/') {
+            if (!isdir) {
+                e->status = -ENOTDIR;
+                continue;
+            }
+
+            size_t len = strlen(path) + strlen(p) + 2;
+            if (!(joined[n] = malloc(len))) {
+                e->status = -ENOMEM;
+                continue;
+            }
+            snprintf(joined[n], len, "%s/%s", path, p);
+            p = joined[n];
+        }
+
+        paths[n] = p;
+        idx[n] = i;
+        n++;
+    }
+
+    int err = capfs_filesystem_resolve_paths(CAPFS_ROOTCAP, paths, n, caps, errs);
+
+    for (size_t i = 0; i < n; i++) {
+        struct capfs_ioctl_batch_entry *e = &b->entries[idx[i]];
+
+        struct capfs_filesystem_meta_data md;
+        if (err || errs[i]) {
+            e->status = err ? err : errs[i];
+        } else if (capfs_filesystem_get_metadata(caps[i], &md)) {
+            e->status = -ENOENT;
+        } else {
+            e->cap = caps[i];
+            e->status = 0;
+            b->resolved++;
+        }
+
+        free(joined[i]);
+    }
+
+    return err;
+}
 
 
 /**
@@ -48,26 +302,46 @@
  * NULL; for _IOC_WRITE data is being written by the user; for _IOC_READ it is 
  * being read, and if both are set the data is bidirectional. In all non-NULL 
  * cases, the area is _IOC_SIZE(cmd) bytes in size.
+ *
+ * CAPFS commands are built with CAPFS_IOCTL_CMD() and exchange a
+ * struct capfs_ioctl_msg, the operation is the command number. Batches use
+ * CAPFS_IOCTL_BATCH_CMD and a struct capfs_ioctl_batch instead.
  */
 int capfs_op_ioctl(const char *path, int cmd, void *arg,
                    struct fuse_file_info *fi, unsigned int flags, void *data)
 {
-    LOG("path='%s', cmd=%i\n", path, cmd);
+    CAPFS_STATS_SCOPE(OP_IOCTL);
+
+    LOG("path='%s', cmd=%x\n", path, cmd);
 
     assert(path);
 
     (void) arg;
-    (void) fi;
 
     if (flags & FUSE_IOCTL_COMPAT)
         return -ENOSYS;
 
+    unsigned int op = _IOC_NR((unsigned int)cmd);
+    size_t msgsize = (op == CAPFS_IOCTL_OP_GET_CAP_BATCH)
+                         ? sizeof(struct capfs_ioctl_batch)
+                         : sizeof(struct capfs_ioctl_msg);
+
+    if (_IOC_TYPE((unsigned int)cmd) != CAPFS_IOCTL_MAGIC
+        || _IOC_SIZE((unsigned int)cmd) != msgsize || data == NULL) {
+        return -ENOTTY;
+    }
+
+    struct capfs_ioctl_msg *msg = data;
 
     capfs_filetype_t ft;
     capfs_capref_t cap;
     if (fi && fi->fh) {
-        cap = ((struct capfs_handle *)fi->fh)->cap;
-        ft = ((struct capfs_handle *)fi->fh)->type;
+        struct capfs_handle *h = cap_fs_handle_get(fi->fh);
+        if (!h) {
+            return -EBADF;
+        }
+        cap = h->cap;
+        ft = h->type;
     } else {
         if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, &cap)) {
             return -ENOENT;
@@ -101,16 +375,36 @@ int capfs_op_ioctl(const char *path, int cmd, void *arg,
             return -EINVAL;
     }
 
-    switch (cmd) {
+    int err;
+    switch (op) {
         case CAPFS_IOCTL_OP_GET_CAP:
-            if (data) {
-                *(capfs_capref_t *) data = cap;
-            }
+            msg->res.get_cap.cap = cap;
+            msg->res.get_cap.status = 0;
             return 0;
         case CAPFS_IOCTL_OP_SET_CAP:
             return -EINVAL;
         case CAPFS_IOCTL_OP_IDENTIFY:
-            return -EINVAL;
+            err = capfs_ioctl_identify(msg);
+            msg->res.identify.status = err;
+            return err;
+        case CAPFS_IOCTL_OP_MAP:
+            err = capfs_ioctl_map(fi, msg);
+            msg->res.map.status = err;
+            return err;
+        case CAPFS_IOCTL_OP_GET_CAP_BATCH:
+            return capfs_ioctl_get_cap_batch(path, cap, ft, data);
+        case CAPFS_IOCTL_OP_RING_SETUP:
+            err = capfs_ring_create(fuse_get_context()->pid, &msg->res);
+            msg->res.ring_setup.status = err;
+            return err;
+        case CAPFS_IOCTL_OP_EPOCH_SETUP:
+            err = capfs_epoch_share(&msg->res);
+            msg->res.epoch_setup.status = err;
+            return err;
+        case CAPFS_IOCTL_OP_STAT:
+            err = capfs_ioctl_stat(cap, msg);
+            msg->res.stat.status = err;
+            return err;
         default:
             return -EINVAL;
     }
@@ -44,6 +44,8 @@
  */
 int capfs_op_link(const char *from, const char *to)
 {
+    CAPFS_STATS_SCOPE(OP_LINK);
+
     LOG("from='%s', to='%s'\n", from, to);
 
     (void)from;
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capfs_internal.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+
+/**
+ * @brief Find the next data or hole in a file.
+ *
+ * @param path      the file path
+ * @param off       offset to start searching from
+ * @param whence    SEEK_DATA or SEEK_HOLE
+ * @param fi        FUSE file info
+ *
+ * @return the offset of the next data or hole, negative error number on
+ *         failure
+ *
+ * The kernel handles SEEK_SET, SEEK_CUR and SEEK_END by itself and only asks
+ * for SEEK_DATA and SEEK_HOLE. Those are answered from the allocation state
+ * of the content region, so sparse aware tools skip holes without reading
+ * them. See lseek(2) for details.
+ */
+off_t capfs_op_lseek(const char * path, off_t off, int whence,
+                     struct fuse_file_info * fi)
+{
+    CAPFS_STATS_SCOPE(OP_LSEEK);
+
+    int err;
+
+    LOG("path='%s', off=%li, whence=%i\n", path, off, whence);
+
+    assert(path);
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+
+    capfs_capref_t cap;
+    struct capfs_filesystem_meta_data md;
+    if ((err = capfs_filesystem_lookup(path, fi, &cap, &md))) {
+        return err;
+    }
+
+    if (md.type != CAP_FS_FILETYPE_FILE) {
+        return -EINVAL;
+    }
+
+    size_t fsize = md.bytes;
+
+    if (off < 0 || (size_t)off >= fsize) {
+        return -ENXIO;
+    }
+
+    capfs_capref_t content;
+    if (capfs_filesystem_get_content_cap(cap, &content)) {
+        /* a file without content is a single hole */
+        return (whence == SEEK_DATA) ? -ENXIO : off;
+    }
+
+    off_t r = capfs_backend_seek(content, off, whence);
+    if (r == -ENXIO) {
+        return (whence == SEEK_DATA) ? -ENXIO : (off_t)fsize;
+    }
+
+    if (r < 0) {
+        return r;
+    }
+
+    if ((size_t)r >= fsize) {
+        return (whence == SEEK_DATA) ? -ENXIO : (off_t)fsize;
+    }
+
+    return r;
+}
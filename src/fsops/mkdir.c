@@ -43,6 +43,8 @@
  */
 int capfs_op_mkdir(const char * path, mode_t mode)
 {
+    CAPFS_STATS_SCOPE(OP_MKDIR);
+
     LOG("path='%s'\n", path);
 
     (void)path;
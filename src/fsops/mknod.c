@@ -44,6 +44,8 @@
  */
 int capfs_op_mknod(const char * path, mode_t mode, dev_t rdev)
 {
+    CAPFS_STATS_SCOPE(OP_MKNOD);
+
     LOG("path='%s'\n", path);
 
     (void)path;
@@ -28,8 +28,36 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 
 
+/* opens the stats file, a reader sees the statistics as of the open */
+static int open_stats(struct fuse_file_info * fi)
+{
+    uint64_t fh;
+    struct capfs_handle *h = cap_fs_handle_alloc(&fh);
+    if (!h) {
+        return -ENFILE;
+    }
+
+    h->flags = fi->flags;
+
+    if ((fi->flags & O_ACCMODE) != O_WRONLY) {
+        h->stats = capfs_stats_render(&h->size);
+        if (h->stats == NULL) {
+            cap_fs_handle_free(fh);
+            return -ENOMEM;
+        }
+    }
+
+    /* the file has no size, reads go past the page cache */
+    fi->direct_io = 1;
+    fi->fh = fh;
+
+    return 0;
+}
+
 /**
  * @brief Open a file.
  * @param path  path to the file
@@ -45,10 +73,16 @@
  */
 int capfs_op_open(const char * path, struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_OPEN);
+
     LOG("path='%s'\n", path);
 
     assert(path);
 
+    if (capfs_stats_path(path) == CAPFS_STATS_PATH_FILE) {
+        return open_stats(fi);
+    }
+
     capfs_capref_t cap;
     if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, &cap)) {
         return -EINVAL;
@@ -64,17 +98,25 @@ int capfs_op_open(const char * path, struct fuse_file_info * fi)
         return -EINVAL;
     }
 
-    struct capfs_handle *h = cap_fs_handle_alloc();
+    uint64_t fh;
+    struct capfs_handle *h = cap_fs_handle_alloc(&fh);
     if (!h) {
-        return -ENOMEM;
+        return -ENFILE;
     }
 
     h->cap = cap;
     h->type = md.type;
     h->size = md.bytes;
     h->perms = md.perms;
+    h->flags = fi->flags;
+
+    /* resolve the content once, reads and writes use the decoded bounds */
+    struct capfs_capbounds bounds;
+    if (!capfs_filesystem_get_content_bounds(cap, &bounds)) {
+        cap_fs_handle_set_bounds(h, &bounds);
+    }
 
-    fi->fh = (uint64_t)h;
+    fi->fh = fh;
 
     return 0;
 }
@@ -40,6 +40,8 @@
  */
 int capfs_op_opendir(const char * path, struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_OPENDIR);
+
     LOG("path='%s'\n", path);
 
     assert(path);
@@ -64,9 +66,10 @@ int capfs_op_opendir(const char * path, struct fuse_file_info * fi)
             return -EINVAL;
     }
 
-    struct capfs_handle *h = cap_fs_handle_alloc();
+    uint64_t fh;
+    struct capfs_handle *h = cap_fs_handle_alloc(&fh);
     if (!h) {
-        return -ENOMEM;
+        return -ENFILE;
     }
 
     h->cap = cap;
@@ -74,7 +77,7 @@ int capfs_op_opendir(const char * path, struct fuse_file_info * fi)
     h->size = md.bytes;
     h->perms = md.perms;
 
-    fi->fh = (uint64_t)h;
+    fi->fh = fh;
 
     return 0;
 }
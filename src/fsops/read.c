@@ -28,6 +28,38 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* reads the rendered statistics, rendering them if the file is not open */
+static int read_stats(struct capfs_handle *h, char * rbuf, size_t size,
+                      off_t offset)
+{
+    size_t len;
+    char *text = h ? h->stats : capfs_stats_render(&len);
+    if (text == NULL) {
+        return h ? -EBADF : -ENOMEM;
+    }
+
+    if (h) {
+        len = h->size;
+    }
+
+    if ((size_t)offset >= len) {
+        size = 0;
+    } else if (size > len - offset) {
+        size = len - offset;
+    }
+
+    memcpy(rbuf, text + offset, size);
+
+    if (!h) {
+        free(text);
+    }
+
+    return (int)size;
+}
 
 
 /**
@@ -46,40 +78,57 @@
 int capfs_op_read(const char * path, char * rbuf, size_t size, off_t offset,
                   struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_READ);
+
+    int err;
+
     LOG("path='%s'\n", path);
 
     assert(path);
 
+    if (capfs_stats_path(path) == CAPFS_STATS_PATH_FILE) {
+        return read_stats(fi && fi->fh ? cap_fs_handle_get(fi->fh) : NULL,
+                          rbuf, size, offset);
+    }
 
     capfs_capref_t cap;
-    size_t fsize;
-    capfs_filetype_t ft;
-
-    if (fi && fi->fh) {
-        struct capfs_handle *h = (struct capfs_handle *)fi->fh;
-        cap = h->cap;
-        fsize = h->size;
-        ft = h->type;
-    } else {
-        if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, &cap)) {
-            return -ENOENT;
-        }
-        struct capfs_filesystem_meta_data md;
-        if (capfs_filesystem_get_metadata(cap, &md)) {
-            return -ENOENT;
-        }
-        fsize = md.bytes;
-        ft = md.type;
+    struct capfs_filesystem_meta_data md;
+    if ((err = capfs_filesystem_lookup(path, fi, &cap, &md))) {
+        return err;
     }
 
-    if (ft != CAP_FS_FILETYPE_FILE) {
+    if (md.type != CAP_FS_FILETYPE_FILE) {
         return -EACCES;
     }
 
-    if (fsize < (size_t)offset) {
+    size_t fsize = md.bytes;
+    if (fsize <= (size_t)offset) {
         return 0;
     }
 
+    if (size > fsize - offset) {
+        size = fsize - offset;
+    }
+
+    /* open files read through the bounds decoded by open */
+    struct capfs_capbounds bounds;
+    struct capfs_handle *h = (fi && fi->fh) ? cap_fs_handle_get(fi->fh) : NULL;
+    if (h) {
+        cap_fs_handle_get_bounds(h, &bounds);
+    } else if (capfs_filesystem_get_content_bounds(cap, &bounds)) {
+        return -EIO;
+    }
+
+    long r;
+    while ((r = capfs_backend_read_decoded(&bounds, offset, rbuf, size)) < 0) {
+        /* the content was moved or replaced, decode it again */
+        if ((r = capfs_filesystem_refresh_bounds(cap, &bounds, r))) {
+            break;
+        }
+        if (h) {
+            cap_fs_handle_set_bounds(h, &bounds);
+        }
+    }
 
-    return capfs_backend_read(cap, offset, rbuf, size);
-}
\ No newline at end of file
+    return r;
+}
@@ -53,6 +53,8 @@ int capfs_op_readdir(const char * path, void * dbuf, fuse_fill_dir_t filler,
                      off_t offset, struct fuse_file_info * fi,
                      enum fuse_readdir_flags flags)
 {
+    CAPFS_STATS_SCOPE(OP_READDIR);
+
     assert(path);
     assert(dbuf);
     assert(filler);
@@ -65,8 +67,12 @@ int capfs_op_readdir(const char * path, void * dbuf, fuse_fill_dir_t filler,
     capfs_capref_t cap;
     capfs_filetype_t ft;
     if (fi && fi->fh) {
-        cap = ((struct capfs_handle *)fi->fh)->cap;
-        ft = ((struct capfs_handle *)fi->fh)->type;
+        struct capfs_handle *h = cap_fs_handle_get(fi->fh);
+        if (!h) {
+            return -EBADF;
+        }
+        cap = h->cap;
+        ft = h->type;
     } else {
 
         if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, &cap)) {
@@ -47,6 +47,8 @@
  */
 int capfs_op_readlink(const char * path, char * linkbuf, size_t size)
 {
+    CAPFS_STATS_SCOPE(OP_READLINK);
+
     LOG("path='%s'\n", path);
 
     (void)path;
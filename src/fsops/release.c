@@ -28,6 +28,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 
 /**
  * @brief Release is called when FUSE is completely done with a file. 
@@ -45,10 +46,30 @@
  */
 int capfs_op_release(const char * path, struct fuse_file_info * fi)
 {
-    LOG("path='%s'\n", path);
+    CAPFS_STATS_SCOPE(OP_RELEASE);
 
-    (void)path;
-    (void)fi;
+    LOG("path='%s', fh=%" PRIx64 "\n", path, (fi ? fi->fh : 0));
 
-    NYI();
+    if (fi && fi->fh) {
+        /* stores through a mapping bypassed the kernel's page cache */
+        struct capfs_handle *h = cap_fs_handle_get(fi->fh);
+        if (h && h->map.id) {
+            if (capfs_backend_cap_unmap(&h->map)) {
+                LOGE("writing back the mapping of fh=%" PRIx64 " failed\n",
+                     fi->fh);
+            }
+            if (h->map.perms & CAPFS_CAPABILITY_PERM_WRITE) {
+                capfs_inval_file(h->cap);
+            }
+        }
+
+        if (h) {
+            free(h->stats);
+        }
+
+        cap_fs_handle_free(fi->fh);
+        fi->fh = 0;
+    }
+
+    return 0;
 }
@@ -46,10 +46,13 @@
  */
 int capfs_op_releasedir(const char * path, struct fuse_file_info * fi)
 {
-    LOG("path='%s', fh=%p\n", path, (fi ? (struct capfs_handle *)(fi->fh) : NULL));
+    CAPFS_STATS_SCOPE(OP_RELEASEDIR);
+
+    LOG("path='%s', fh=%" PRIx64 "\n", path, (fi ? fi->fh : 0));
 
     if (fi && fi->fh) {
-        cap_fs_handle_free((struct capfs_handle *)(fi->fh));
+        cap_fs_handle_free(fi->fh);
+        fi->fh = 0;
     }
 
     return 0;
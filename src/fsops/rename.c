@@ -45,6 +45,8 @@
  */
 int capfs_op_rename(const char * from, const char * to, unsigned int flags)
 {
+    CAPFS_STATS_SCOPE(OP_RENAME);
+
     LOG("from='%s', to='%s'\n", from, to);
 
     (void)from;
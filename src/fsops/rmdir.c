@@ -42,6 +42,8 @@
  */
 int capfs_op_rmdir(const char * path)
 {
+    CAPFS_STATS_SCOPE(OP_RMDIR);
+
     LOG("path='%s'\n", path);
 
     (void)path;
@@ -44,6 +44,8 @@
  */
 int capfs_op_statfs(const char * path, struct statvfs * buf)
 {
+    CAPFS_STATS_SCOPE(OP_STATFS);
+
     LOG("path='%s'\n", path);
 
     (void)path;
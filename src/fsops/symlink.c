@@ -46,6 +46,8 @@
  */
 int capfs_op_symlink(const char * from, const char * to)
 {
+    CAPFS_STATS_SCOPE(OP_SYMLINK);
+
     LOG("from='%s', to='%s'\n", from, to);
 
     (void)from;
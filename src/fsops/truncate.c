@@ -45,8 +45,16 @@
 int capfs_op_truncate(const char * path, off_t size,
                       struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_TRUNCATE);
+
     LOG("path='%s'\n", path);
 
+    /* opening the stats file with O_TRUNC resets them */
+    if (capfs_stats_path(path) == CAPFS_STATS_PATH_FILE) {
+        capfs_stats_reset();
+        return 0;
+    }
+
     (void)path;
     (void)fi;
     (void)size;
@@ -43,6 +43,8 @@
  */
 int capfs_op_unlink(const char * path)
 {
+    CAPFS_STATS_SCOPE(OP_UNLINK);
+
     LOG("path='%s'\n", path);
     
     (void)path;
@@ -50,6 +50,8 @@
 int capfs_op_utimens(const char * path, const struct timespec tv[2],
                      struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_UTIMENS);
+
     LOG("path='%s'\n", path);
 
     (void)path;
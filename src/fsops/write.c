@@ -45,42 +45,89 @@
 int capfs_op_write(const char * path, const char * wbuf, size_t size,
                    off_t offset, struct fuse_file_info * fi)
 {
+    CAPFS_STATS_SCOPE(OP_WRITE);
+
+    int err;
+
     LOG("path='%s'\n", path);
 
     assert(path);
 
+    /* writing anything to the stats file resets them */
+    if (capfs_stats_path(path) == CAPFS_STATS_PATH_FILE) {
+        capfs_stats_reset();
+        return size;
+    }
+
     capfs_capref_t cap;
-    size_t fsize;
-    capfs_filetype_t ft;
-
-    if (fi && fi->fh) {
-        struct capfs_handle *h = (struct capfs_handle *)fi->fh;
-        cap = h->cap;
-        fsize = h->size;
-        ft = h->type;
-    } else {
-        if (capfs_filesystem_resolve_path(CAPFS_ROOTCAP, path, &cap)) {
-            return -ENOENT;
-        }
-        struct capfs_filesystem_meta_data md;
-        if (capfs_filesystem_get_metadata(cap, &md)) {
-            return -ENOENT;
-        }
-        fsize = md.bytes;
-        ft = md.type;
+    struct capfs_filesystem_meta_data md;
+    if ((err = capfs_filesystem_lookup(path, fi, &cap, &md))) {
+        return err;
     }
 
     /* check whether the path is in fact a file */
-    if (ft != CAP_FS_FILETYPE_FILE) {
+    if (md.type != CAP_FS_FILETYPE_FILE) {
         return -EACCES;
     }
 
+    size_t fsize = md.bytes;
     if ((size_t)offset > fsize) {
         return -EINVAL;
     }
 
-    LOG("invoke store to cap (%lx, %lu, %p, %lu)\n", cap.capaddr, offset, 
-        wbuf, size);
+    struct capfs_handle *h = (fi && fi->fh) ? cap_fs_handle_get(fi->fh) : NULL;
+
+    /* the content is not replaced while it is written */
+    capfs_filesystem_lock(cap, false);
+
+    /* the cached bounds of the handle are used unless the content grows */
+    struct capfs_capbounds bounds = { .size = 0 };
+    if (h) {
+        cap_fs_handle_get_bounds(h, &bounds);
+    }
+
+    if (offset + size > bounds.size) {
+        capfs_filesystem_unlock(cap);
+        if ((err = capfs_filesystem_reserve(cap, offset + size))) {
+            return err;
+        }
+        capfs_filesystem_lock(cap, false);
+
+        if (capfs_filesystem_get_content_bounds(cap, &bounds)) {
+            capfs_filesystem_unlock(cap);
+            return -EIO;
+        }
+        if (h) {
+            cap_fs_handle_set_bounds(h, &bounds);
+        }
+    }
+
+    LOG("invoke store to cap (%lx, %lu, %p, %lu)\n", cap.capaddr, offset,
+        (void *)wbuf, size);
+
+    long written;
+    while ((written = capfs_backend_write_decoded(&bounds, offset, wbuf, size))
+           < 0) {
+        /* the content was moved or replaced, decode it again */
+        written = capfs_filesystem_refresh_bounds(cap, &bounds, written);
+        if (written) {
+            break;
+        }
+        if (h) {
+            cap_fs_handle_set_bounds(h, &bounds);
+        }
+    }
+
+    capfs_filesystem_unlock(cap);
+
+    if (written <= 0) {
+        return written;
+    }
+
+    if (offset + (size_t)written > fsize
+        && capfs_filesystem_extend(cap, offset + written)) {
+        return -EIO;
+    }
 
-    return capfs_backend_write(cap, offset, wbuf, size);
-}
\ No newline at end of file
+    return written;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* don't declare *pt* functions  */
+
+#include <capfs_internal.h>
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+
+/*
+ * ============================================================================
+ * Handle table
+ * ============================================================================
+ *
+ * The file handle value stored in fi->fh is (generation << 32 | index). The
+ * generation starts at one and is bumped when the entry is freed, so a file
+ * handle is never zero and stale handles no longer match their entry.
+ *
+ * Free entries are kept in a small per-thread cache first. Overflowing
+ * entries go to a global lock-free stack, and entries that have never been
+ * used are handed out by bumping a counter. None of these paths allocate.
+ */
+
+#define HANDLE_NIL              UINT32_MAX
+#define HANDLE_LOCAL_CACHE_SIZE 32
+
+#define HANDLE_INDEX(fh) ((uint32_t)(fh))
+#define HANDLE_GEN(fh)   ((uint32_t)((fh) >> 32))
+#define HANDLE_MAKE(gen, idx) (((uint64_t)(gen) << 32) | (idx))
+
+static struct capfs_handle handle_table[CAPFS_HANDLE_TABLE_SIZE];
+
+/// the head of the global free stack: (counter << 32 | index)
+static _Atomic uint64_t handle_free_head = HANDLE_NIL;
+
+/// the number of entries that have been handed out at least once
+static _Atomic uint32_t handle_next_unused = 0;
+
+/// per-thread cache of free entries
+static __thread uint32_t handle_local[HANDLE_LOCAL_CACHE_SIZE];
+static __thread uint32_t handle_local_count = 0;
+
+static pthread_key_t handle_key;
+static pthread_once_t handle_key_once = PTHREAD_ONCE_INIT;
+
+
+static void handle_global_push(uint32_t idx)
+{
+    uint64_t head = atomic_load(&handle_free_head);
+    uint64_t next;
+    do {
+        handle_table[idx].next = (uint32_t)head;
+        next = (((head >> 32) + 1) << 32) | idx;
+    } while (!atomic_compare_exchange_weak(&handle_free_head, &head, next));
+}
+
+static uint32_t handle_global_pop(void)
+{
+    uint64_t head = atomic_load(&handle_free_head);
+    uint64_t next;
+    do {
+        if ((uint32_t)head == HANDLE_NIL) {
+            return HANDLE_NIL;
+        }
+        next = (((head >> 32) + 1) << 32) | handle_table[(uint32_t)head].next;
+    } while (!atomic_compare_exchange_weak(&handle_free_head, &head, next));
+
+    return (uint32_t)head;
+}
+
+/**
+ * @brief returns the cached entries of an exiting thread to the global stack
+ */
+static void handle_local_flush(void *arg)
+{
+    (void)arg;
+
+    while (handle_local_count) {
+        handle_global_push(handle_local[--handle_local_count]);
+    }
+}
+
+static void handle_key_init(void)
+{
+    pthread_key_create(&handle_key, handle_local_flush);
+}
+
+
+/**
+ * @brief allocates a new cap_fs_handle struct
+ *
+ * @param fh    returns the file handle value to be stored in fi->fh
+ *
+ * @return pointer to the zeroed handle, NULL if the table is full
+ */
+struct capfs_handle *cap_fs_handle_alloc(uint64_t *fh)
+{
+    uint32_t idx;
+
+    if (handle_local_count) {
+        idx = handle_local[--handle_local_count];
+    } else if ((idx = handle_global_pop()) == HANDLE_NIL) {
+        idx = atomic_fetch_add(&handle_next_unused, 1);
+        if (idx >= CAPFS_HANDLE_TABLE_SIZE) {
+            atomic_fetch_sub(&handle_next_unused, 1);
+            return NULL;
+        }
+    }
+
+    struct capfs_handle *h = &handle_table[idx];
+
+    uint32_t gen = atomic_load_explicit(&h->gen, memory_order_relaxed);
+    if (gen == 0) {
+        gen = 1;
+    }
+
+    memset(h, 0, offsetof(struct capfs_handle, gen));
+    atomic_store_explicit(&h->gen, gen, memory_order_release);
+
+    *fh = HANDLE_MAKE(gen, idx);
+
+    return h;
+}
+
+/**
+ * @brief obtains the handle for a file handle value
+ *
+ * @param fh    the file handle value
+ *
+ * @return pointer to the handle, NULL if the file handle is stale or invalid
+ */
+struct capfs_handle *cap_fs_handle_get(uint64_t fh)
+{
+    uint32_t idx = HANDLE_INDEX(fh);
+    if (idx >= CAPFS_HANDLE_TABLE_SIZE) {
+        return NULL;
+    }
+
+    struct capfs_handle *h = &handle_table[idx];
+    if (atomic_load_explicit(&h->gen, memory_order_acquire) != HANDLE_GEN(fh)) {
+        return NULL;
+    }
+
+    return h;
+}
+
+
+/**
+ * @brief frees a allocated cap_fs_handle struct
+ *
+ * @param fh    the file handle value
+ */
+void cap_fs_handle_free(uint64_t fh)
+{
+    uint32_t idx = HANDLE_INDEX(fh);
+    if (idx >= CAPFS_HANDLE_TABLE_SIZE) {
+        return;
+    }
+
+    struct capfs_handle *h = &handle_table[idx];
+
+    /* invalidate the handle, generation zero is never handed out */
+    uint32_t gen = HANDLE_GEN(fh);
+    uint32_t next = (gen + 1) ? gen + 1 : 1;
+    if (!atomic_compare_exchange_strong(&h->gen, &gen, next)) {
+        LOGW("WARNING: freeing stale file handle %" PRIx64 "\n", fh);
+        return;
+    }
+
+    /* free entries are skipped by cap_fs_handle_foreach() */
+    __atomic_store_n(&h->type, CAP_FS_FILETYPE_NONE, __ATOMIC_RELAXED);
+
+    if (handle_local_count == HANDLE_LOCAL_CACHE_SIZE) {
+        /* move half of the cache to the global stack */
+        while (handle_local_count > HANDLE_LOCAL_CACHE_SIZE / 2) {
+            handle_global_push(handle_local[--handle_local_count]);
+        }
+    } else if (handle_local_count == 0) {
+        pthread_once(&handle_key_once, handle_key_init);
+        pthread_setspecific(handle_key, handle_local);
+    }
+
+    handle_local[handle_local_count++] = idx;
+}
+
+/**
+ * @brief calls a function for every handle in use
+ *
+ * @param fn    the function
+ * @param arg   argument passed to the function
+ */
+void cap_fs_handle_foreach(void (*fn)(struct capfs_handle *h, void *arg),
+                           void *arg)
+{
+    uint32_t n = atomic_load(&handle_next_unused);
+    for (uint32_t idx = 0; idx < n && idx < CAPFS_HANDLE_TABLE_SIZE; idx++) {
+        struct capfs_handle *h = &handle_table[idx];
+        if (__atomic_load_n(&h->type, __ATOMIC_RELAXED)
+            != CAP_FS_FILETYPE_NONE) {
+            fn(h, arg);
+        }
+    }
+}
+
+
+/*
+ * ============================================================================
+ * Content bounds
+ * ============================================================================
+ *
+ * The decoded content bounds are shared by all operations on a file handle
+ * and replaced when the content moves. They are copied word by word under a
+ * sequence lock: readers retry if the sequence was odd or has changed,
+ * writers make it odd while they store.
+ */
+
+#define HANDLE_BOUNDS_WORDS (sizeof(struct capfs_capbounds) / sizeof(uint64_t))
+
+_Static_assert(sizeof(struct capfs_capbounds) % sizeof(uint64_t) == 0,
+               "the bounds are copied in words");
+
+/**
+ * @brief reads the cached content bounds of a handle
+ *
+ * @param h         the handle
+ * @param bounds    returns the bounds
+ */
+void cap_fs_handle_get_bounds(struct capfs_handle *h,
+                              struct capfs_capbounds *bounds)
+{
+    uint64_t *src = (uint64_t *)&h->bounds;
+    uint64_t *dst = (uint64_t *)bounds;
+
+    while (true) {
+        uint32_t seq = atomic_load_explicit(&h->bounds_seq,
+                                            memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        for (size_t i = 0; i < HANDLE_BOUNDS_WORDS; i++) {
+            dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&h->bounds_seq,
+                                 memory_order_relaxed) == seq) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief replaces the cached content bounds of a handle
+ *
+ * @param h         the handle
+ * @param bounds    the new bounds
+ */
+void cap_fs_handle_set_bounds(struct capfs_handle *h,
+                              const struct capfs_capbounds *bounds)
+{
+    const uint64_t *src = (const uint64_t *)bounds;
+    uint64_t *dst = (uint64_t *)&h->bounds;
+
+    /* writers are serialized by taking the sequence odd */
+    uint32_t seq = atomic_load_explicit(&h->bounds_seq, memory_order_relaxed);
+    while ((seq & 1)
+           || !atomic_compare_exchange_weak_explicit(&h->bounds_seq, &seq,
+                                                     seq + 1,
+                                                     memory_order_acquire,
+                                                     memory_order_relaxed)) {
+        if (seq & 1) {
+            sched_yield();
+            seq = atomic_load_explicit(&h->bounds_seq, memory_order_relaxed);
+        }
+    }
+
+    atomic_thread_fence(memory_order_release);
+
+    for (size_t i = 0; i < HANDLE_BOUNDS_WORDS; i++) {
+        __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    }
+
+    atomic_store_explicit(&h->bounds_seq, seq + 2, memory_order_release);
+}
@@ -52,6 +52,18 @@ typedef uint8_t capfs_capperms_t;
  */
 
 
+/**
+ * @brief sets the image the backend stores the file system in
+ *
+ * @param path  path of the image, NULL for the default
+ * @param keep  keep the file system held by an existing image
+ *
+ * This must be called before capfs_backend_init(). A missing image is
+ * created. An existing image is discarded unless it is kept, and only an
+ * image that was stopped cleanly can be kept.
+ */
+void capfs_backend_set_image(const char *path, bool keep);
+
 /**
  * @brief initializes the backend
  *
@@ -103,6 +115,9 @@ extern capfs_capref_t capfs_root_capability;
  * @param retcap    returns the capability if any
  *
  * @return error number TODO: possible error values
+ *
+ * The offset must be pointer aligned. If the slot does not hold a capability
+ * -EACCES is returned. Loads are atomic with respect to stores.
  */
 int capfs_backend_get_cap(capfs_capref_t cap,
                           off_t offset, capfs_capref_t *retcap);
@@ -115,10 +130,30 @@ int capfs_backend_get_cap(capfs_capref_t cap,
  * @param newcap    the capability to be stored
  *
  * @return error number TODO: possible error values
+ *
+ * The offset must be pointer aligned. Writing data over the slot later
+ * invalidates the stored capability.
  */
 int capfs_backend_put_cap(capfs_capref_t cap,
                           off_t offset, capfs_capref_t newcap);
 
+/**
+ * @brief finds the capabilities stored inside a capability
+ *
+ * @param cap       the capability to scan
+ * @param offset    offset into the capability to start at
+ * @param bytes     number of bytes to scan
+ * @param offsets   returns the offsets of the stored capabilities
+ * @param count     capacity of offsets
+ *
+ * @return number of found capabilities or error number
+ *
+ * The offsets are returned in ascending order. If count offsets are returned
+ * the scan may be continued after the last one.
+ */
+long capfs_backend_cap_scan(capfs_capref_t cap, off_t offset, size_t bytes,
+                            off_t *offsets, size_t count);
+
 
 /*
  * ===========================================================================
@@ -126,12 +161,39 @@ int capfs_backend_put_cap(capfs_capref_t cap,
  * ===========================================================================
  */
 
+/**
+ * @brief the decoded bounds of a capability
+ *
+ * Callers that use the same capability many times, e.g. through an open file
+ * handle, decode it once with capfs_backend_cap_decode() and pass the decoded
+ * bounds to the *_decoded functions which skip the capref conversion.
+ */
+struct capfs_capbounds {
+    uint64_t          base;     ///< start address of the capability
+    uint64_t          size;     ///< size of the capability in bytes
+    capfs_capperms_t perms;    ///< permissions of the capability
+    uint64_t          epoch;    ///< backend revocation epoch of the decode
+    capfs_capref_t   cap;      ///< the decoded capability
+};
+
+/**
+ * @brief decodes the bounds and permissions of a capability
+ *
+ * @param cap       the capability to decode
+ * @param bounds    returns the decoded bounds
+ *
+ * @return zero on SUCCESS or error number on failure
+ */
+int capfs_backend_cap_decode(capfs_capref_t cap,
+                             struct capfs_capbounds *bounds);
+
 /**
  * @brief obtains the permissions of the capability
  *
  * @param cap   capability to obtain the permissions for
  *
- * @return capability permissions
+ * @return capability permissions, CAPFS_CAPABILITY_PERM_NONE if the
+ *         capability is not valid
  */
 capfs_capperms_t  capfs_backend_cap_get_perms(capfs_capref_t cap);
 
@@ -140,7 +202,7 @@ capfs_capperms_t  capfs_backend_cap_get_perms(capfs_capref_t cap);
  *
  * @param cap   the capablity to obtain the size from
  *
- * @return size of the capabilty
+ * @return size of the capabilty, 0 if the capability is not valid
  */
 uint64_t capfs_backend_cap_get_size(capfs_capref_t cap);
 
@@ -160,10 +222,93 @@ uint64_t capfs_backend_cap_get_size(capfs_capref_t cap);
  * @param ret_cap   returned capability
  *
  * @return zero on SUCCESS or error number on failure
+ *
+ * The new capability must lie within the bounds of cap and must not have
+ * permissions cap does not have. The backend records the derivation, so
+ * revoking cap also revokes the new capability. Bounds the backend cannot
+ * represent are rejected with -EINVAL.
  */
 int capfs_backend_cap_mint(capfs_capref_t cap, uintptr_t offset, size_t bytes,
                            capfs_capperms_t perms, capfs_capref_t *ret_cap);
 
+/**
+ * @brief revokes a capability and all capabilities minted from it
+ *
+ * @param cap   the capability to be revoked
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * Using a revoked capability fails. Revocation is constant time, the
+ * capabilities derived from cap are not visited.
+ */
+int capfs_backend_cap_revoke(capfs_capref_t cap);
+
+
+/*
+ * ===========================================================================
+ * Capability Allocation
+ * ===========================================================================
+ */
+
+/**
+ * @brief allocates a new region and returns a capability to it
+ *
+ * @param bytes     minimum size of the region in bytes
+ * @param perms     permissions of the returned capability
+ * @param ret_cap   returns the capability to the region
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The region may be larger than requested, use capfs_backend_cap_get_size()
+ * to obtain its actual size. If the free space is too fragmented, this
+ * returns -ENOSPC and compacts the store in the background.
+ */
+int capfs_backend_cap_alloc(size_t bytes, capfs_capperms_t perms,
+                            capfs_capref_t *ret_cap);
+
+/**
+ * @brief frees a region previously obtained by capfs_backend_cap_alloc()
+ *
+ * @param cap   the capability to the entire region
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * A region mapped writable with capfs_backend_cap_map() is not freed, this
+ * returns -EBUSY. Read-only mappings keep a copy of the freed region.
+ */
+int capfs_backend_cap_free(capfs_capref_t cap);
+
+/**
+ * @brief reclaims allocated regions that are no longer reachable
+ *
+ * @return the number of reclaimed regions or error number on failure
+ *
+ * Runs a cycle of the garbage collector, which also runs periodically in the
+ * background. A region is reclaimed by the second consecutive cycle that
+ * cannot reach it from the file system root through stored capabilities.
+ */
+long capfs_backend_collect(void);
+
+/**
+ * @brief compaction of allocated regions, see capfs_backend_compact()
+ */
+#define CAPFS_BACKEND_COMPACT_ONLINE  0   ///< concurrently with I/O
+#define CAPFS_BACKEND_COMPACT_OFFLINE 1   ///< the file system is idle
+
+/**
+ * @brief moves allocated regions towards the start of the store
+ *
+ * @param mode  CAPFS_BACKEND_COMPACT_ONLINE or CAPFS_BACKEND_COMPACT_OFFLINE
+ *
+ * @return the number of moved regions or error number on failure
+ *
+ * Every capability and capref to a moved region is relocated along with it.
+ * Online compaction pauses between regions. Decoded bounds of a moved region
+ * become stale, the *_decoded functions then return -ESTALE and the caller
+ * decodes the capability again. Regions obtained with capfs_backend_cap_map()
+ * are never moved.
+ */
+long capfs_backend_compact(int mode);
 
 
 /*
@@ -186,6 +331,21 @@ int capfs_backend_cap_mint(capfs_capref_t cap, uintptr_t offset, size_t bytes,
 long capfs_backend_read(capfs_capref_t cap, off_t offset,
                         char *rbuf, size_t bytes);
 
+/**
+ * @brief reads data from a decoded capability
+ *
+ * @param bounds    the decoded capability
+ * @param offset    offset into the capability
+ * @param rbuf      buffer to store the read data
+ * @param bytes     size of the read buffer in bytes
+ *
+ * @return read bytes or error number
+ *
+ * Returns -ESTALE if the region was moved since the bounds were decoded.
+ */
+long capfs_backend_read_decoded(const struct capfs_capbounds *bounds,
+                                off_t offset, char *rbuf, size_t bytes);
+
 /**
  * @brief writes data into a capability
  *
@@ -199,6 +359,76 @@ long capfs_backend_read(capfs_capref_t cap, off_t offset,
 long capfs_backend_write(capfs_capref_t cap, off_t offset,
                          const char *wbuf, size_t bytes);
 
+/**
+ * @brief writes data into a decoded capability
+ *
+ * @param bounds    the decoded capability
+ * @param offset    offset into the capability
+ * @param wbuf      buffer containing data to be written
+ * @param bytes     size of the buffer in bytes
+ *
+ * @return written bytes or error number
+ *
+ * Returns -ESTALE if the region was moved since the bounds were decoded.
+ */
+long capfs_backend_write_decoded(const struct capfs_capbounds *bounds,
+                                 off_t offset, const char *wbuf, size_t bytes);
+
+
+/**
+ * @brief a piece of a vectored read or write
+ */
+struct capfs_backend_iovec {
+    capfs_capref_t cap;        ///< the capability
+    off_t           offset;     ///< offset into the capability
+    void           *buf;        ///< the buffer to read into or write from
+    size_t          bytes;      ///< number of bytes to transfer
+};
+
+/**
+ * @brief reads data from many capabilities
+ *
+ * @param iov       the pieces to read
+ * @param iovcnt    the number of pieces
+ *
+ * @return read bytes or error number
+ *
+ * Each distinct capability is decoded and checked once. Pieces that are
+ * adjacent in the backing store are transferred with a single request. On
+ * failure, some of the pieces may have been read.
+ */
+long capfs_backend_readv(const struct capfs_backend_iovec *iov, int iovcnt);
+
+/**
+ * @brief writes data into many capabilities
+ *
+ * @param iov       the pieces to write
+ * @param iovcnt    the number of pieces
+ *
+ * @return written bytes or error number
+ *
+ * See capfs_backend_readv(). The pieces are written in order.
+ */
+long capfs_backend_writev(const struct capfs_backend_iovec *iov, int iovcnt);
+
+
+/**
+ * @brief copies data from one capability into another
+ *
+ * @param src           the source capability
+ * @param src_offset    offset into the source capability
+ * @param dst           the destination capability
+ * @param dst_offset    offset into the destination capability
+ * @param bytes         number of bytes to copy
+ *
+ * @return copied bytes or error number
+ *
+ * The data is copied within the backend and does not pass through the
+ * caller's buffers. Capabilities stored in the source range are copied as
+ * well if they remain pointer aligned in the destination.
+ */
+long capfs_backend_copy(capfs_capref_t src, off_t src_offset,
+                        capfs_capref_t dst, off_t dst_offset, size_t bytes);
 
 
 /**
@@ -213,4 +443,90 @@ long capfs_backend_write(capfs_capref_t cap, off_t offset,
  */
 int capfs_backend_zero(capfs_capref_t cap);
 
+
+/**
+ * @brief zeroes a range of the capability and releases its storage
+ *
+ * @param cap       the capability
+ * @param offset    offset into the capability
+ * @param bytes     number of bytes to zero
+ *
+ * @return ERR_OK on success error value on failure
+ *
+ * After punching, the range reads as zeroes, holds no capabilities and is
+ * reported as a hole by capfs_backend_seek().
+ */
+int capfs_backend_punch(capfs_capref_t cap, off_t offset, size_t bytes);
+
+/**
+ * @brief finds the next data or hole in a capability
+ *
+ * @param cap       the capability
+ * @param offset    offset into the capability to start searching
+ * @param whence    SEEK_DATA or SEEK_HOLE
+ *
+ * @return offset of the next data or hole, or negative error number
+ *
+ * This follows the semantics of lseek(2): -ENXIO is returned if there is no
+ * more data after offset, and the end of the capability is an implicit hole.
+ */
+off_t capfs_backend_seek(capfs_capref_t cap, off_t offset, int whence);
+
+
+/*
+ * ===========================================================================
+ * Direct Access
+ * ===========================================================================
+ */
+
+/**
+ * @brief describes where the memory of a capability can be mapped from
+ */
+struct capfs_backend_mapping {
+    int               fd;       ///< descriptor backing the capability
+    uint64_t          offset;   ///< offset of the capability in the descriptor
+    uint64_t          length;   ///< length of the capability in bytes
+    capfs_capperms_t perms;    ///< permissions of the mapping
+    uint64_t          id;       ///< identifies the mapping, 0 if there is none
+};
+
+/**
+ * @brief maps the region of a capability
+ *
+ * @param cap   the capability to the entire region
+ * @param perms the access rights of the mapping, a subset of the capability's
+ * @param map   returns the mapping information
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * The descriptor refers to a copy of the region only, never to the whole
+ * store, and it is writable only if perms grant writing. The region stays in
+ * place until every mapping is released. Loads and stores to the mapped range
+ * bypass the backend; while the region is mapped writable its tag bits are
+ * clear, no capability is stored to it and it is not freed (-EBUSY). Stores
+ * reach the region when the mapping is released.
+ */
+int capfs_backend_cap_map(capfs_capref_t cap, capfs_capperms_t perms,
+                          struct capfs_backend_mapping *map);
+
+/**
+ * @brief releases a mapping obtained by capfs_backend_cap_map()
+ *
+ * @param map   the mapping information
+ *
+ * @return zero on SUCCESS or error number on failure
+ *
+ * Releasing a writable mapping writes the stores through it back to the region.
+ */
+int capfs_backend_cap_unmap(const struct capfs_backend_mapping *map);
+
+/**
+ * @brief checks whether the region of a capability is mapped writable
+ *
+ * @param cap   the capability
+ *
+ * @return true if a client may store to the region
+ */
+bool capfs_backend_cap_mapped(capfs_capref_t cap);
+
 #endif //CAP_FS_BACKEND_H_H
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_BUDDY_H
+#define CAP_FS_BUDDY_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * @brief a binary buddy allocator for address ranges
+ *
+ * The allocator manages the range [0, 2^max_order) in blocks that are powers
+ * of two between 2^min_order and 2^max_order bytes. Every block is naturally
+ * aligned to its size. The allocator only keeps book about the addresses, it
+ * never touches the memory itself.
+ */
+struct capfs_buddy {
+    uint8_t          min_order;     ///< order of the smallest block
+    uint8_t          max_order;     ///< order of the entire range
+    uint64_t         nblocks;       ///< number of smallest blocks
+    uint8_t         *state;         ///< state of each smallest block
+    uint32_t        *next;          ///< free list successor
+    uint32_t        *prev;          ///< free list predecessor
+    uint32_t        *freelist;      ///< free list head for each order
+    uint64_t         free_bytes;    ///< number of free bytes
+    pthread_mutex_t  lock;          ///< protects the allocator state
+};
+
+/**
+ * @brief initializes the buddy allocator with a single free block
+ *
+ * @param b         the buddy allocator
+ * @param min_order order of the smallest block
+ * @param max_order order of the entire range
+ *
+ * @return 0 on success, -ENOMEM on failure
+ */
+int capfs_buddy_init(struct capfs_buddy *b, uint8_t min_order,
+                     uint8_t max_order);
+
+/**
+ * @brief releases the state of the buddy allocator
+ *
+ * @param b     the buddy allocator
+ */
+void capfs_buddy_destroy(struct capfs_buddy *b);
+
+/**
+ * @brief returns the order of the smallest block that holds bytes
+ *
+ * @param b     the buddy allocator
+ * @param bytes number of bytes
+ *
+ * @return order of the block
+ */
+uint8_t capfs_buddy_order(struct capfs_buddy *b, size_t bytes);
+
+/**
+ * @brief allocates a block of a given order
+ *
+ * @param b         the buddy allocator
+ * @param order     order of the block to allocate
+ * @param ret_addr  returns the address of the block
+ *
+ * @return 0 on success, -ENOSPC if there is no free block of this order
+ */
+int capfs_buddy_alloc(struct capfs_buddy *b, uint8_t order,
+                      uint64_t *ret_addr);
+
+/**
+ * @brief allocates the block of a given order at a fixed address
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the block, must be aligned to the order
+ * @param order     order of the block
+ *
+ * @return 0 on success, -EBUSY if the range is not free
+ */
+int capfs_buddy_reserve(struct capfs_buddy *b, uint64_t addr, uint8_t order);
+
+/**
+ * @brief frees a previously allocated block
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the block
+ * @param order     order of the block
+ *
+ * @return 0 on success, -EINVAL if the block was not allocated
+ */
+int capfs_buddy_free(struct capfs_buddy *b, uint64_t addr, uint8_t order);
+
+/**
+ * @brief allocates a range that is not a power of two in size
+ *
+ * @param b         the buddy allocator
+ * @param bytes     size of the range, rounded up to the smallest block
+ * @param ret_addr  returns the address of the range
+ *
+ * @return 0 on success, -ENOSPC if there is no free block large enough
+ *
+ * The range is aligned to the smallest power of two that holds it.
+ */
+int capfs_buddy_alloc_range(struct capfs_buddy *b, uint64_t bytes,
+                            uint64_t *ret_addr);
+
+/**
+ * @brief allocates a range at the lowest free address below a limit
+ *
+ * @param b         the buddy allocator
+ * @param bytes     size of the range, rounded up to the smallest block
+ * @param limit     the range must start below this address
+ * @param ret_addr  returns the address of the range
+ *
+ * @return 0 on success, -ENOSPC if there is no such free block
+ *
+ * The range is aligned like one returned by capfs_buddy_alloc_range().
+ */
+int capfs_buddy_alloc_range_below(struct capfs_buddy *b, uint64_t bytes,
+                                  uint64_t limit, uint64_t *ret_addr);
+
+/**
+ * @brief frees a range allocated by capfs_buddy_alloc_range()
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the range
+ * @param bytes     size of the range
+ *
+ * @return 0 on success, -EINVAL if the range was not allocated
+ */
+int capfs_buddy_free_range(struct capfs_buddy *b, uint64_t addr,
+                           uint64_t bytes);
+
+/**
+ * @brief allocates a range at a fixed address
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the range, aligned to the smallest block
+ * @param bytes     size of the range, a multiple of the smallest block
+ *
+ * @return 0 on success, -EBUSY if the range is not free
+ *
+ * The range is split into blocks like one returned by
+ * capfs_buddy_alloc_range(), so it is freed with capfs_buddy_free_range().
+ */
+int capfs_buddy_reserve_range(struct capfs_buddy *b, uint64_t addr,
+                              uint64_t bytes);
+
+/**
+ * @brief checks whether a range is allocated
+ *
+ * @param b         the buddy allocator
+ * @param addr      address of the range
+ * @param bytes     size of the range
+ *
+ * @return true if the range was allocated as a block of this size or by
+ *         capfs_buddy_alloc_range()
+ */
+bool capfs_buddy_is_allocated(struct capfs_buddy *b, uint64_t addr,
+                              uint64_t bytes);
+
+/**
+ * @brief returns the number of free bytes
+ *
+ * @param b     the buddy allocator
+ */
+uint64_t capfs_buddy_free_bytes(struct capfs_buddy *b);
+
+#endif //CAP_FS_BUDDY_H
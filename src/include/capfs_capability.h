@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_CAPABILITY_H
+#define CAP_FS_CAPABILITY_H 1
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Encoding of the capabilities stored by the files backend.
+ *
+ * A compressed capability is a 64-bit value:
+ *
+ *   63     56 55    50 49       38 37                       0
+ *  +---------+--------+-----------+--------------------------+
+ *  |  perms  |   E    |  length   |           base           |
+ *  +---------+--------+-----------+--------------------------+
+ *
+ * Base and length are stored shifted right by the exponent E, so both are
+ * multiples of 2^E. The exponent is the smallest one with which the length
+ * fits its 12-bit mantissa and the base its 38-bit mantissa. This makes the
+ * encoding of a capability unique and rounds a length up by less than 1/2048.
+ */
+
+#define CAPABILITY_BASE_BITS    (38)
+#define CAPABILITY_LENGTH_BITS  (12)
+#define CAPABILITY_EXP_BITS     (6)
+#define CAPABILITY_LENGTH_SHIFT (CAPABILITY_BASE_BITS)
+#define CAPABILITY_EXP_SHIFT    (CAPABILITY_LENGTH_SHIFT + CAPABILITY_LENGTH_BITS)
+#define CAPABILITY_PERMS_SHIFT  (CAPABILITY_EXP_SHIFT + CAPABILITY_EXP_BITS)
+
+#define CAPABILITY_MASK(bits) ((1UL << (bits)) - 1)
+
+struct capability {
+    uint64_t base;
+    uint64_t size;
+    uint8_t  perms;     ///< the capfs_capperms_t of the capability
+};
+
+/* returns the exponent used to encode a capability */
+static inline uint8_t capability_exponent(uint64_t base, uint64_t size)
+{
+    uint8_t e = 0;
+    if (size >> CAPABILITY_LENGTH_BITS) {
+        e = 64 - __builtin_clzl(size) - CAPABILITY_LENGTH_BITS;
+    }
+
+    /* large lengths leave room for any base, the shift must stay below 64 */
+    if (e < 64 - CAPABILITY_BASE_BITS && base >> (CAPABILITY_BASE_BITS + e)) {
+        e = 64 - __builtin_clzl(base) - CAPABILITY_BASE_BITS;
+    }
+
+    return e;
+}
+
+/**
+ * @brief checks whether a region can be described by a capability
+ *
+ * @param base  base address of the region
+ * @param size  size of the region in bytes
+ *
+ * @return true if base and size are multiples of 2^E
+ */
+static inline bool capability_representable(uint64_t base, uint64_t size)
+{
+    if (size == 0) {
+        return false;
+    }
+
+    uint8_t e = capability_exponent(base, size);
+
+    return ((base | size) & CAPABILITY_MASK(e)) == 0;
+}
+
+/* rounds a size up to the next one that can be represented */
+static inline uint64_t capability_round_size(uint64_t size)
+{
+    uint64_t mask = CAPABILITY_MASK(capability_exponent(0, size));
+
+    return (size + mask) & ~mask;
+}
+
+/* decodes a compressed capability */
+static inline void capability_decompress(uint64_t comp, struct capability *cap)
+{
+    uint8_t e = (comp >> CAPABILITY_EXP_SHIFT)
+                & CAPABILITY_MASK(CAPABILITY_EXP_BITS);
+
+    cap->base = (comp & CAPABILITY_MASK(CAPABILITY_BASE_BITS)) << e;
+    cap->size = ((comp >> CAPABILITY_LENGTH_SHIFT)
+                 & CAPABILITY_MASK(CAPABILITY_LENGTH_BITS)) << e;
+    cap->perms = (uint8_t)(comp >> CAPABILITY_PERMS_SHIFT);
+}
+
+/* encodes a capability, which must be representable */
+static inline uint64_t capability_compres(struct capability *cap)
+{
+    assert(capability_representable(cap->base, cap->size));
+
+    uint8_t e = capability_exponent(cap->base, cap->size);
+
+    return (cap->base >> e) | ((cap->size >> e) << CAPABILITY_LENGTH_SHIFT)
+           | ((uint64_t)e << CAPABILITY_EXP_SHIFT)
+           | ((uint64_t)cap->perms << CAPABILITY_PERMS_SHIFT);
+}
+
+#endif //CAP_FS_CAPABILITY_H
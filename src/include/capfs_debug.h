@@ -28,26 +28,179 @@
 #define CAP_FS_DEBUG_H 1
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <inttypes.h>
 
 #define PRIxCAP "%" PRIx64
 #define PRI_CAP(x) ((x).capaddr)
 
+
+/*
+ * ============================================================================
+ * Log levels
+ * ============================================================================
+ *
+ * Messages above CAPFS_LOG_LEVEL are compiled out, the build sets it with the
+ * log_level option. Messages above capfs_log_level are dropped at runtime,
+ * it is set from the CAPFS_LOG_LEVEL environment variable.
+ */
+
+#define CAPFS_LOG_NONE  0
+#define CAPFS_LOG_ERROR 1
+#define CAPFS_LOG_WARN  2
+#define CAPFS_LOG_INFO  3
+#define CAPFS_LOG_DEBUG 4
+
+#ifndef CAPFS_LOG_LEVEL
+#define CAPFS_LOG_LEVEL CAPFS_LOG_INFO
+#endif
+
+/**
+ * @brief the maximum level of messages that are logged
+ */
+extern int capfs_log_level;
+
+
+/*
+ * ============================================================================
+ * Log records
+ * ============================================================================
+ *
+ * The arguments of a message are captured in binary and formatted by the log
+ * thread. Strings are copied, as they may not outlive the call.
+ */
+
+#define CAPFS_LOG_MAX_ARGS  8
+#define CAPFS_LOG_STR_BYTES 96
+
+#define CAPFS_LOG_ARG_INT    0
+#define CAPFS_LOG_ARG_STR    1
+#define CAPFS_LOG_ARG_FLOAT  2
+#define CAPFS_LOG_ARG_DOUBLE 3
+
+/**
+ * @brief the captured arguments of a message
+ */
+struct capfs_log_args {
+    uint8_t  count;                         ///< number of arguments
+    uint8_t  types[CAPFS_LOG_MAX_ARGS];     ///< CAPFS_LOG_ARG_*
+    uint16_t strbytes;                      ///< used bytes of strs
+    uint64_t args[CAPFS_LOG_MAX_ARGS];      ///< values, offsets into strs
+    char     strs[CAPFS_LOG_STR_BYTES];     ///< copied strings
+};
+
+/**
+ * @brief captures an argument of a message
+ *
+ * @param la    the captured arguments
+ * @param type  CAPFS_LOG_ARG_* type of the argument
+ * @param val   pointer to the value of the argument
+ * @param size  size of the value
+ */
+void capfs_log_arg(struct capfs_log_args *la, int type, const void *val,
+                   size_t size);
+
+/**
+ * @brief logs a message
+ *
+ * @param level     level of the message
+ * @param func      function that logs the message
+ * @param line      line of the message
+ * @param format    printf() format of the message, must be a literal
+ * @param la        the captured arguments
+ *
+ * The message goes into a ring buffer of the calling thread, which never
+ * blocks. If the ring is full the message is dropped and counted.
+ */
+void capfs_log_emit(int level, const char *func, unsigned line,
+                    const char *format, const struct capfs_log_args *la);
+
+/**
+ * @brief starts the log thread
+ *
+ * @return 0 on success, negative errno on failure
+ *
+ * Until the log thread runs, messages are written synchronously.
+ */
+int capfs_log_init(void);
+
+/**
+ * @brief waits until all logged messages have been written
+ */
+void capfs_log_flush(void);
+
+/**
+ * @brief writes the remaining messages and stops the log thread
+ */
+void capfs_log_stop(void);
+
+/* character pointers are copied as strings; cast buffers to (void *) for %p */
+#define CAPFS_LOG_TYPE(x) _Generic((x) + 0,                               \
+    char *:       CAPFS_LOG_ARG_STR,                                      \
+    const char *: CAPFS_LOG_ARG_STR,                                      \
+    float:        CAPFS_LOG_ARG_FLOAT,                                    \
+    double:       CAPFS_LOG_ARG_DOUBLE,                                   \
+    default:      CAPFS_LOG_ARG_INT)
+
+#define CAPFS_LOG_PUSH(la, x)                                             \
+    { __typeof__((x) + 0) _v = (x);                                       \
+      capfs_log_arg(&(la), CAPFS_LOG_TYPE(_v), &_v, sizeof(_v)); }
+
+#define CAPFS_LOG_PUSH0(la)
+#define CAPFS_LOG_PUSH1(la, a) CAPFS_LOG_PUSH(la, a)
+#define CAPFS_LOG_PUSH2(la, a, ...) \
+    CAPFS_LOG_PUSH(la, a) CAPFS_LOG_PUSH1(la, __VA_ARGS__)
+#define CAPFS_LOG_PUSH3(la, a, ...) \
+    CAPFS_LOG_PUSH(la, a) CAPFS_LOG_PUSH2(la, __VA_ARGS__)
+#define CAPFS_LOG_PUSH4(la, a, ...) \
+    CAPFS_LOG_PUSH(la, a) CAPFS_LOG_PUSH3(la, __VA_ARGS__)
+#define CAPFS_LOG_PUSH5(la, a, ...) \
+    CAPFS_LOG_PUSH(la, a) CAPFS_LOG_PUSH4(la, __VA_ARGS__)
+#define CAPFS_LOG_PUSH6(la, a, ...) \
+    CAPFS_LOG_PUSH(la, a) CAPFS_LOG_PUSH5(la, __VA_ARGS__)
+#define CAPFS_LOG_PUSH7(la, a, ...) \
+    CAPFS_LOG_PUSH(la, a) CAPFS_LOG_PUSH6(la, __VA_ARGS__)
+#define CAPFS_LOG_PUSH8(la, a, ...) \
+    CAPFS_LOG_PUSH(la, a) CAPFS_LOG_PUSH7(la, __VA_ARGS__)
+
+#define CAPFS_LOG_SELECT(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+
+#define CAPFS_LOG_PUSHN(la, ...)                                          \
+    CAPFS_LOG_SELECT(_0, ##__VA_ARGS__, CAPFS_LOG_PUSH8, CAPFS_LOG_PUSH7, \
+                     CAPFS_LOG_PUSH6, CAPFS_LOG_PUSH5, CAPFS_LOG_PUSH4,   \
+                     CAPFS_LOG_PUSH3, CAPFS_LOG_PUSH2, CAPFS_LOG_PUSH1,   \
+                     CAPFS_LOG_PUSH0)(la, ##__VA_ARGS__)
+
+
+/* logs a message of a level */
+#define LOGL(level, format, args...)                                      \
+    do {                                                                  \
+        if ((level) <= CAPFS_LOG_LEVEL && (level) <= capfs_log_level) {  \
+            struct capfs_log_args _la;                                    \
+            _la.count = 0;                                                \
+            _la.strbytes = 0;                                             \
+            CAPFS_LOG_PUSHN(_la, ##args)                                  \
+            capfs_log_emit(level, __FUNCTION__, __LINE__, format, &_la);  \
+        }                                                                 \
+    } while (0)
+
+#define LOGE(format, args...) LOGL(CAPFS_LOG_ERROR, format, ##args)
+#define LOGW(format, args...) LOGL(CAPFS_LOG_WARN, format, ##args)
+#define LOGI(format, args...) LOGL(CAPFS_LOG_INFO, format, ##args)
+
 /* debugging utility */
-#define LOG(format, args...)                        \
-    do {fprintf(stderr, "## cap-fs # %s:%u # " format, \
-        __FUNCTION__, __LINE__, args); } while(0)
+#define LOG(format, args...) LOGL(CAPFS_LOG_DEBUG, format, ##args)
 
 
 /* debugging utility */
-#define LOGA(format)                        \
-    do {fprintf(stderr, "## cap-fs # %s:%u # " format, \
-        __FUNCTION__, __LINE__); } while(0)
+#define LOGA(format) LOGL(CAPFS_LOG_DEBUG, format)
 
 
 /* debugging utility */
 #define PANIC(err, format, args...)                        \
-    do {fprintf(stderr, "## cap-fs # %s:%u # %u " format, \
+    do {capfs_log_flush();                                 \
+        fprintf(stderr, "## cap-fs # %s:%u # %u " format, \
         __FUNCTION__, __LINE__, err, args);                 \
         exit(err); } while(0)
 
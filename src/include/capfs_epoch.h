@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_EPOCH_H
+#define CAP_FS_EPOCH_H 1
+
+#include <capfs.h>
+
+/**
+ * @brief creates the shared epoch page
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_epoch_init(void);
+
+/**
+ * @brief frees the shared epoch page
+ */
+void capfs_epoch_destroy(void);
+
+/**
+ * @brief advances the epoch of a file
+ *
+ * @param file  the capability of the file whose capabilities or meta data
+ *              have changed
+ */
+void capfs_epoch_bump(capfs_capref_t file);
+
+/**
+ * @brief obtains the current epoch of a file
+ *
+ * @param file  the capability of the file
+ *
+ * @return the epoch of the slot of the file
+ */
+uint64_t capfs_epoch_get(capfs_capref_t file);
+
+/**
+ * @brief advances the global epoch, invalidating all cached results
+ */
+void capfs_epoch_bump_all(void);
+
+/**
+ * @brief hands out the descriptor of the epoch page
+ *
+ * @param res   returns the descriptor of the epoch page
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_epoch_share(union capfs_ioctl_res *res);
+
+#endif //CAP_FS_EPOCH_H
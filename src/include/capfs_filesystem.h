@@ -30,9 +30,13 @@
 
 #include <inttypes.h>
 #include <assert.h>
+#include <stdbool.h>
 
 #include <capfs.h>
 
+struct fuse_file_info;
+struct capfs_capbounds;
+
 struct capfs_filesystem_meta_data
 {
     int perms;                  ///< permissions for this file
@@ -47,6 +51,8 @@ struct capfs_filesystem_meta_data
  * @param root capability to the root of the file system
  *
  * @return ERR_OK on success, error value on failure
+ *
+ * The space is formatted only if it does not hold a file system yet.
  */
 int capfs_filesystem_init(capfs_capref_t root);
 
@@ -73,6 +79,23 @@ int capfs_filesystem_resolve_path(capfs_capref_t root,
                                   const char * path,
                                   capfs_capref_t * ret_cap);
 
+/**
+ * @brief resolves many paths relative to a given root in one pass
+ *
+ * @param root      the root capability to start resolving from
+ * @param paths     the paths to resolve
+ * @param count     the number of paths
+ * @param ret_caps  returns the caps to the files of the paths
+ * @param ret_errs  returns the error value of each path
+ *
+ * @return ERR_OK on success or error value on failure
+ *
+ * Lookups of directories shared between the paths are done only once.
+ */
+int capfs_filesystem_resolve_paths(capfs_capref_t root,
+                                   const char * const * paths, size_t count,
+                                   capfs_capref_t * ret_caps, int * ret_errs);
+
 
 /**
  * @brief obtains the meta data associated to the file
@@ -87,14 +110,116 @@ int capfs_filesystem_get_metadata(capfs_capref_t file,
 
 
 /**
- * @brief
- * @param cap_file
- * @param cap_content
- * @return
+ * @brief looks up the file an operation applies to
+ *
+ * @param path  the file path
+ * @param fi    FUSE file info, may be NULL
+ * @param file  returns the capability of the file
+ * @param md    returns the meta data of the file
+ *
+ * @return ERR_OK on success, -EBADF if the file handle is stale, -ENOENT if
+ *         the path does not resolve
+ */
+int capfs_filesystem_lookup(const char *path, struct fuse_file_info *fi,
+                            capfs_capref_t *file,
+                            struct capfs_filesystem_meta_data *md);
+
+
+/**
+ * @brief reads the number of used bytes of a file
+ *
+ * @param file  the capability of the file
+ * @param bytes returns the size of the file in bytes
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_filesystem_get_size(capfs_capref_t file, size_t *bytes);
+
+/**
+ * @brief grows the number of used bytes of a file
+ *
+ * @param file  the capability of the file
+ * @param bytes the number of bytes the file must have at least
+ *
+ * @return ERR_OK on success, error value on failure
+ *
+ * The size is read and updated under the content lock of the file, which the
+ * caller must not hold. A file that has grown larger meanwhile is not shrunk.
+ */
+int capfs_filesystem_extend(capfs_capref_t file, size_t bytes);
+
+
+/**
+ * @brief obtains the capability to the content of a file
+ *
+ * @param cap_file      the capability of the file
+ * @param cap_content   returns the capability of the file content
+ *
+ * @return ERR_OK on success, -ENODATA if the file has no content yet,
+ *         error value on failure
  */
 int capfs_filesystem_get_content_cap(capfs_capref_t cap_file,
                                      capfs_capref_t *cap_content);
 
+/**
+ * @brief obtains the decoded bounds of the content of a file
+ *
+ * @param file      the capability of the file
+ * @param bounds    returns the bounds of the file content
+ *
+ * @return ERR_OK on success, -ENODATA if the file has no content yet,
+ *         error value on failure
+ */
+int capfs_filesystem_get_content_bounds(capfs_capref_t file,
+                                        struct capfs_capbounds *bounds);
+
+/**
+ * @brief decodes the content of a file again after an access failed
+ *
+ * @param file      the capability of the file
+ * @param bounds    the bounds the access failed with, updated
+ * @param err       the error of the access
+ *
+ * @return ERR_OK if the access should be repeated with the updated bounds,
+ *         the error of the access otherwise
+ *
+ * Handles content moved by a compaction (-ESTALE) and content replaced by
+ * capfs_filesystem_reserve() (-EACCES).
+ */
+int capfs_filesystem_refresh_bounds(capfs_capref_t file,
+                                    struct capfs_capbounds *bounds, int err);
+
+/**
+ * @brief ensures the content of a file can hold a number of bytes
+ *
+ * @param file  the capability of the file
+ * @param bytes the number of bytes the content must hold
+ *
+ * @return ERR_OK on success, error value on failure
+ *
+ * Must not be called while holding the content lock of the file. Returns
+ * -EBUSY if the content must grow while a client maps it writable.
+ */
+int capfs_filesystem_reserve(capfs_capref_t file, size_t bytes);
+
+/**
+ * @brief locks the content of a file
+ *
+ * @param file      the capability of the file
+ * @param exclusive true to replace the content, false to access it
+ *
+ * Writes through a content capability hold the lock shared, the content is
+ * replaced by capfs_filesystem_reserve() with the lock held exclusively.
+ */
+void capfs_filesystem_lock(capfs_capref_t file, bool exclusive);
+
+/**
+ * @brief unlocks the content of a file
+ *
+ * @param file  the capability of the file
+ */
+void capfs_filesystem_unlock(capfs_capref_t file);
+
 /**
  * @brief obtains a directory entry for a given offset in a directory cap
  *
@@ -97,6 +97,18 @@ int capfs_op_write(const char * path, const char * wbuf, size_t size,
 
 int capfs_op_open(const char * path, struct fuse_file_info * fi);
 
+ssize_t capfs_op_copy_file_range(const char * path_in,
+                                 struct fuse_file_info * fi_in,
+                                 off_t offset_in, const char * path_out,
+                                 struct fuse_file_info * fi_out,
+                                 off_t offset_out, size_t size, int flags);
+
+int capfs_op_fallocate(const char * path, int mode, off_t offset,
+                       off_t length, struct fuse_file_info * fi);
+
+off_t capfs_op_lseek(const char * path, off_t off, int whence,
+                     struct fuse_file_info * fi);
+
 int capfs_op_statfs(const char * path, struct statvfs * buf);
 
 int capfs_op_create(const char * path, mode_t mode,
@@ -31,32 +31,94 @@
 #include <capfs.h>
 #include <stdlib.h>
 
+/**
+ * @brief the size of a cache line, handle table entries are padded to it
+ */
+#define CAPFS_CACHELINE_SIZE 64
+
+/**
+ * @brief the maximum number of open handles
+ */
+#define CAPFS_HANDLE_TABLE_SIZE (1 << 16)
+
 /**
  * @brief this stores/caches addition information for file handles
  *
- * this structure is allcated and populated on open/opendir/create
+ * this structure is allcated and populated on open/opendir/create. The
+ * entries live in a preallocated table and are identified by a file handle
+ * value that combines the table index with a generation counter, so stale
+ * handles are detected instead of dereferenced.
  */
 struct capfs_handle {
     capfs_filetype_t type;
     size_t            size;
     capfs_capref_t   cap;
     int               perms;
-};
+    struct capfs_capbounds bounds;   ///< decoded bounds of the content cap
+    _Atomic uint32_t  bounds_seq; ///< odd while the bounds are replaced
+    int               flags;      ///< the open(2) flags of the file
+    struct capfs_backend_mapping map; ///< the content mapped by the client
+    char             *stats;      ///< rendered statistics of the stats file
+    _Atomic uint32_t  gen;        ///< generation of the table entry
+    uint32_t          next;       ///< next free entry in the table
+} __attribute__((aligned(CAPFS_CACHELINE_SIZE)));
 
 /**
  * @brief allocates a new cap_fs_handle struct
+ *
+ * @param fh    returns the file handle value to be stored in fi->fh
+ *
+ * @return pointer to the zeroed handle, NULL if the table is full
+ */
+struct capfs_handle *cap_fs_handle_alloc(uint64_t *fh);
+
+/**
+ * @brief obtains the handle for a file handle value
+ *
+ * @param fh    the file handle value
+ *
+ * @return pointer to the handle, NULL if the file handle is stale or invalid
+ */
+struct capfs_handle *cap_fs_handle_get(uint64_t fh);
+
+/**
+ * @brief reads the cached content bounds of a handle
+ *
+ * @param h         the handle
+ * @param bounds    returns the bounds
+ *
+ * The bounds are replaced concurrently by operations on the same file
+ * handle, they are read under a sequence lock and never torn.
+ */
+void cap_fs_handle_get_bounds(struct capfs_handle *h,
+                              struct capfs_capbounds *bounds);
+
+/**
+ * @brief replaces the cached content bounds of a handle
+ *
+ * @param h         the handle
+ * @param bounds    the new bounds
  */
-static inline struct capfs_handle *cap_fs_handle_alloc() {
-    return calloc(1, sizeof(struct capfs_handle));
-}
+void cap_fs_handle_set_bounds(struct capfs_handle *h,
+                              const struct capfs_capbounds *bounds);
 
 /**
  * @brief frees a allocated cap_fs_handle struct
+ *
+ * @param fh    the file handle value
+ */
+void cap_fs_handle_free(uint64_t fh);
+
+/**
+ * @brief calls a function for every handle in use
+ *
+ * @param fn    the function
+ * @param arg   argument passed to the function
+ *
+ * Handles are allocated and freed concurrently, the function may be called
+ * for a handle that is just being freed and misses handles allocated meanwhile.
  */
-static inline void  cap_fs_handle_free(struct capfs_handle *h) {
-    if (h) {
-        free(h);
-    }
-}
+void cap_fs_handle_foreach(void (*fn)(struct capfs_handle *h, void *arg),
+                           void *arg);
 
 #endif //CAP_FS_HANDLE_H_H
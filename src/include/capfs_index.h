@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_INDEX_H
+#define CAP_FS_INDEX_H 1
+
+#include <capfs.h>
+
+/**
+ * @brief initializes the reverse index from capabilities to files
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_index_init(void);
+
+/**
+ * @brief frees the reverse index
+ */
+void capfs_index_destroy(void);
+
+/**
+ * @brief removes all regions from the reverse index
+ */
+void capfs_index_clear(void);
+
+/**
+ * @brief records that a region belongs to a file
+ *
+ * @param region    the capability to the entire region
+ * @param file      the capability of the file record owning the region
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_index_insert(capfs_capref_t region, capfs_capref_t file);
+
+/**
+ * @brief removes a region from the reverse index
+ *
+ * @param region    the capability to the entire region
+ *
+ * @return ERR_OK on success, -ENOENT if the region is not indexed
+ */
+int capfs_index_remove(capfs_capref_t region);
+
+/**
+ * @brief finds the file owning the region a capability points into
+ *
+ * @param cap       the capability to identify
+ * @param file      returns the capability of the owning file record
+ * @param offset    returns the offset of the capability into the region
+ * @param epoch     returns the epoch of the file the result is valid for
+ *
+ * @return ERR_OK on success, -ENOENT if no file owns the capability
+ *
+ * Regions are disjoint and kept in a balanced tree ordered by their base, so
+ * a lookup takes O(log n) in the number of regions. Changes to the regions of
+ * a file advance its epoch.
+ */
+int capfs_index_lookup(capfs_capref_t cap, capfs_capref_t *file,
+                       uint64_t *offset, uint64_t *epoch);
+
+#endif //CAP_FS_INDEX_H
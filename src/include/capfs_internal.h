@@ -43,10 +43,16 @@
 
 /* capfs internal includes */
 #include <capfs_debug.h>
-#include <capfs_handle.h>
 #include <capfs_backend.h>
+#include <capfs_handle.h>
 #include <capfs_fsops.h>
 #include <capfs_filesystem.h>
+#include <capfs_invalidate.h>
+#include <capfs_ring.h>
+#include <capfs_index.h>
+#include <capfs_epoch.h>
+#include <capfs_stats.h>
+#include <capfs_trace.h>
 
 
 #include <stdbool.h>
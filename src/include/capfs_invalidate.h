@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_INVALIDATE_H
+#define CAP_FS_INVALIDATE_H 1
+
+#include <capfs.h>
+
+struct fuse;
+
+/**
+ * @brief the attribute and entry timeout used for the kernel caches in seconds
+ *
+ * Long timeouts are safe because changes that the kernel does not see are
+ * pushed to it through invalidation notifications.
+ */
+#define CAPFS_INVAL_CACHE_TIMEOUT 10.0
+
+
+/**
+ * @brief initializes the invalidation subsystem
+ *
+ * @param fuse      the FUSE handle used to send notifications
+ * @param timeout   the attribute and entry timeout of the kernel in seconds
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_inval_init(struct fuse *fuse, double timeout);
+
+/**
+ * @brief stops the invalidation subsystem
+ */
+void capfs_inval_destroy(void);
+
+/**
+ * @brief records that the kernel caches the attributes or entry of a path
+ *
+ * @param path  the path returned to the kernel
+ * @param file  the capability of the file
+ */
+void capfs_inval_track(const char *path, capfs_capref_t file);
+
+/**
+ * @brief notifies the kernel that a path has changed
+ *
+ * @param path  the path that has changed
+ *
+ * The notification is only sent if the kernel may still cache the path.
+ */
+void capfs_inval_path(const char *path);
+
+/**
+ * @brief notifies the kernel that a file has changed through a capability
+ *
+ * @param file  the capability of the file that has changed
+ */
+void capfs_inval_file(capfs_capref_t file);
+
+#endif //CAP_FS_INVALIDATE_H
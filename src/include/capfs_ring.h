@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_RING_H
+#define CAP_FS_RING_H 1
+
+#include <capfs.h>
+
+/**
+ * @brief the time the ring worker spins for new submissions before sleeping
+ *
+ * The spin time adapts between these bounds depending on whether the client
+ * submitted again shortly after the worker went to sleep.
+ */
+#define CAPFS_RING_SPIN_MIN_USEC 10
+#define CAPFS_RING_SPIN_MAX_USEC 1000
+
+/**
+ * @brief the number of rings a client and all clients together may have
+ *
+ * Every ring holds a worker thread and its shared memory until the client
+ * exits, so a client cannot exhaust the daemon by setting up rings.
+ */
+#define CAPFS_RING_MAX_PER_CLIENT 1
+#define CAPFS_RING_MAX            64
+
+
+/**
+ * @brief creates a ring for a client and starts its worker
+ *
+ * @param client    the process id of the client
+ * @param res       returns the descriptors of the ring
+ *
+ * @return ERR_OK on success, error value on failure
+ *
+ * The worker stops when the client shuts the ring down or exits. Returns
+ * -EBUSY if the client or all clients together have too many rings.
+ */
+int capfs_ring_create(pid_t client, union capfs_ioctl_res *res);
+
+/**
+ * @brief stops the workers of all rings and frees them
+ */
+void capfs_ring_shutdown_all(void);
+
+#endif //CAP_FS_RING_H
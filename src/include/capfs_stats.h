@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_STATS_H
+#define CAP_FS_STATS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <capfs_probe.h>
+
+/**
+ * @brief the hidden directory of the virtual files
+ */
+#define CAPFS_STATS_DIR "/.capfs"
+
+/**
+ * @brief the virtual file with the statistics, writing it resets them
+ */
+#define CAPFS_STATS_PATH CAPFS_STATS_DIR "/stats"
+
+#define CAPFS_STATS_PATH_NONE 0
+#define CAPFS_STATS_PATH_FILE 1
+#define CAPFS_STATS_PATH_DIR  2
+
+/**
+ * @brief the timed operations, the FUSE callbacks and the backend calls
+ *
+ * Each has an identifier, the name of its probes and the name it is reported
+ * under.
+ */
+#define CAPFS_STATS_LIST(X)                                               \
+    X(OP_GETATTR,         getattr,               "op.getattr")            \
+    X(OP_ACCESS,          access,                "op.access")             \
+    X(OP_OPENDIR,         opendir,               "op.opendir")            \
+    X(OP_READDIR,         readdir,               "op.readdir")            \
+    X(OP_RELEASEDIR,      releasedir,            "op.releasedir")         \
+    X(OP_READLINK,        readlink,              "op.readlink")           \
+    X(OP_MKNOD,           mknod,                 "op.mknod")              \
+    X(OP_MKDIR,           mkdir,                 "op.mkdir")              \
+    X(OP_SYMLINK,         symlink,               "op.symlink")            \
+    X(OP_UNLINK,          unlink,                "op.unlink")             \
+    X(OP_RMDIR,           rmdir,                 "op.rmdir")              \
+    X(OP_RENAME,          rename,                "op.rename")             \
+    X(OP_LINK,            link,                  "op.link")               \
+    X(OP_CHMOD,           chmod,                 "op.chmod")              \
+    X(OP_CHOWN,           chown,                 "op.chown")              \
+    X(OP_TRUNCATE,        truncate,              "op.truncate")           \
+    X(OP_UTIMENS,         utimens,               "op.utimens")            \
+    X(OP_OPEN,            open,                  "op.open")               \
+    X(OP_FLUSH,           flush,                 "op.flush")              \
+    X(OP_FSYNC,           fsync,                 "op.fsync")              \
+    X(OP_RELEASE,         release,               "op.release")            \
+    X(OP_READ,            read,                  "op.read")               \
+    X(OP_WRITE,           write,                 "op.write")              \
+    X(OP_STATFS,          statfs,                "op.statfs")             \
+    X(OP_CREATE,          create,                "op.create")             \
+    X(OP_IOCTL,           ioctl,                 "op.ioctl")              \
+    X(OP_COPY_FILE_RANGE, copy_file_range,       "op.copy_file_range")    \
+    X(OP_FALLOCATE,       fallocate,             "op.fallocate")          \
+    X(OP_LSEEK,           lseek,                 "op.lseek")              \
+    X(BE_GET_CAP,         backend_get_cap,       "backend.get_cap")       \
+    X(BE_PUT_CAP,         backend_put_cap,       "backend.put_cap")       \
+    X(BE_CAP_SCAN,        backend_cap_scan,      "backend.cap_scan")      \
+    X(BE_CAP_DECODE,      backend_cap_decode,    "backend.cap_decode")    \
+    X(BE_CAP_GET_PERMS,   backend_cap_get_perms, "backend.cap_get_perms") \
+    X(BE_CAP_GET_SIZE,    backend_cap_get_size,  "backend.cap_get_size")  \
+    X(BE_CAP_MINT,        backend_cap_mint,      "backend.cap_mint")      \
+    X(BE_CAP_REVOKE,      backend_cap_revoke,    "backend.cap_revoke")    \
+    X(BE_CAP_ALLOC,       backend_cap_alloc,     "backend.cap_alloc")     \
+    X(BE_CAP_FREE,        backend_cap_free,      "backend.cap_free")      \
+    X(BE_CAP_MAP,         backend_cap_map,       "backend.cap_map")       \
+    X(BE_CAP_UNMAP,       backend_cap_unmap,     "backend.cap_unmap")     \
+    X(BE_COLLECT,         backend_collect,       "backend.collect")       \
+    X(BE_COMPACT,         backend_compact,       "backend.compact")       \
+    X(BE_READ,            backend_read,          "backend.read")          \
+    X(BE_READ_DECODED,    backend_read_decoded,  "backend.read_decoded")  \
+    X(BE_WRITE,           backend_write,         "backend.write")         \
+    X(BE_WRITE_DECODED,   backend_write_decoded, "backend.write_decoded") \
+    X(BE_READV,           backend_readv,         "backend.readv")         \
+    X(BE_WRITEV,          backend_writev,        "backend.writev")        \
+    X(BE_COPY,            backend_copy,          "backend.copy")          \
+    X(BE_ZERO,            backend_zero,          "backend.zero")          \
+    X(BE_PUNCH,           backend_punch,         "backend.punch")         \
+    X(BE_SEEK,            backend_seek,          "backend.seek")
+
+#define CAPFS_STATS_ENUM(id, probe, name) CAPFS_STATS_##id,
+
+/**
+ * @brief identifies a timed operation
+ */
+enum capfs_stats_id {
+    CAPFS_STATS_LIST(CAPFS_STATS_ENUM)
+    CAPFS_STATS_MAX
+};
+
+/**
+ * @brief a timed operation in progress
+ */
+struct capfs_stats_scope {
+    uint64_t start;             ///< when it started in nanoseconds
+};
+
+/**
+ * @brief obtains the current time for timing an operation
+ *
+ * @return monotonic time in nanoseconds
+ */
+static inline uint64_t capfs_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief records the latency of an operation
+ *
+ * @param id    the operation
+ * @param ns    its latency in nanoseconds
+ */
+void capfs_stats_record(enum capfs_stats_id id, uint64_t ns);
+
+/*
+ * every operation fires the probes <probe>__entry when it starts and
+ * <probe>__return with its latency in nanoseconds when it returns
+ */
+#define CAPFS_STATS_FUNCS(id, probe, name)                                \
+    static inline uint64_t capfs_stats_begin_##id(void)                   \
+    {                                                                     \
+        CAPFS_PROBE(probe##__entry);                                      \
+        return capfs_stats_now();                                         \
+    }                                                                     \
+    static inline void capfs_stats_end_##id(struct capfs_stats_scope *s)  \
+    {                                                                     \
+        uint64_t ns = capfs_stats_now() - s->start;                       \
+        CAPFS_PROBE(probe##__return, ns);                                 \
+        capfs_stats_record(CAPFS_STATS_##id, ns);                         \
+    }
+
+CAPFS_STATS_LIST(CAPFS_STATS_FUNCS)
+
+/* times the rest of the enclosing block, on every return path */
+#define CAPFS_STATS_SCOPE(id)                                            \
+    struct capfs_stats_scope _stats_scope                                \
+        __attribute__((cleanup(capfs_stats_end_##id))) =                 \
+        { capfs_stats_begin_##id() }
+
+/**
+ * @brief allocates the per-CPU statistics
+ *
+ * @return 0 on success, negative errno on failure
+ *
+ * Operations are not recorded before.
+ */
+int capfs_stats_init(void);
+
+/**
+ * @brief clears the statistics
+ */
+void capfs_stats_reset(void);
+
+/**
+ * @brief renders the statistics as text
+ *
+ * @param size  returns the length of the text
+ *
+ * @return the text to be freed with free(), NULL if out of memory
+ */
+char *capfs_stats_render(size_t *size);
+
+/**
+ * @brief obtains the name an operation is reported under
+ *
+ * @param id    the operation
+ *
+ * @return the name, "unknown" for an invalid identifier
+ */
+const char *capfs_stats_name(enum capfs_stats_id id);
+
+/**
+ * @brief checks for the paths of the virtual files
+ *
+ * @param path  the path to check
+ *
+ * @return CAPFS_STATS_PATH_FILE, CAPFS_STATS_PATH_DIR or CAPFS_STATS_PATH_NONE
+ */
+int capfs_stats_path(const char *path);
+
+#endif //CAP_FS_STATS_H
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAP_FS_TRACE_H
+#define CAP_FS_TRACE_H 1
+
+#include <stdint.h>
+
+/**
+ * @brief the magic value at the start of a trace file, "CAPFSTR1"
+ */
+#define CAPFS_TRACE_MAGIC 0x3152545346504143UL
+
+/**
+ * @brief the version of the trace file format
+ */
+#define CAPFS_TRACE_VERSION 1
+
+/**
+ * @brief the environment variable with the trace file to record to
+ */
+#define CAPFS_TRACE_ENV "CAPFS_TRACE"
+
+/**
+ * @brief the header of a trace file
+ */
+struct capfs_trace_header {
+    uint64_t magic;         ///< CAPFS_TRACE_MAGIC
+    uint32_t version;       ///< CAPFS_TRACE_VERSION
+    uint32_t recsize;       ///< size of a record without its paths
+    uint64_t realtime;      ///< wall clock time the trace started, in ns
+};
+
+/**
+ * @brief a traced FUSE operation, followed by its paths
+ *
+ * The meaning of the argument fields depends on the operation:
+ *
+ *  - offset:  offset of read, write, readdir, fallocate, lseek and the source
+ *             of copy_file_range, the size of truncate, rdev of mknod, the
+ *             access time of utimens in seconds
+ *  - offset2: the destination offset of copy_file_range, the modification
+ *             time of utimens in seconds
+ *  - size:    bytes of read, write, readlink, copy_file_range and fallocate
+ *  - arg:     mode of mknod, mkdir, chmod, create and fallocate, flags of
+ *             open, opendir, rename, readdir and copy_file_range, mask of
+ *             access, whence of lseek, isdatasync of fsync, uid of chown,
+ *             command of ioctl, nanoseconds of the access time of utimens
+ *  - arg2:    open flags of create, gid of chown, flags of ioctl,
+ *             nanoseconds of the modification time of utimens
+ */
+struct capfs_trace_record {
+    uint64_t start;         ///< start in ns since the trace began
+    uint64_t latency;       ///< how long it took in ns
+    uint64_t fh;            ///< file handle passed in or handed out
+    uint64_t fh2;           ///< destination file handle of copy_file_range
+    uint64_t offset;        ///< see above
+    uint64_t offset2;       ///< see above
+    uint64_t size;          ///< see above
+    int64_t  result;        ///< the return value of the operation
+    uint32_t arg;           ///< see above
+    uint32_t arg2;          ///< see above
+    uint16_t op;            ///< CAPFS_STATS_OP_* identifier of the operation
+    uint16_t pathlen;       ///< bytes of the path that follows
+    uint16_t path2len;      ///< bytes of the second path that follows it
+    uint16_t reserved;      ///< zero
+};
+
+/**
+ * @brief starts recording the operations of a FUSE operations table
+ *
+ * @param path  the trace file to create
+ * @param ops   the operations, replaced by recording wrappers
+ *
+ * @return 0 on success, negative errno on failure
+ *
+ * Every operation is recorded when it completes. The trace is closed when
+ * the destroy operation returns.
+ */
+int capfs_trace_start(const char *path, struct fuse_operations *ops);
+
+#endif //CAP_FS_TRACE_H
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capfs_internal.h>
+
+#include <errno.h>
+
+#include <glib.h>
+
+
+/*
+ * ============================================================================
+ * Reverse index
+ * ============================================================================
+ *
+ * Every region handed out by the backend for the file system, i.e. file
+ * records and file contents, is recorded with the file owning it. The
+ * regions do not overlap, hence the tree is ordered by base and a lookup
+ * searches for the region containing an address.
+ *
+ * The backend may move regions when it compacts the store. Their caprefs
+ * stay valid, so the tree is rebuilt from them once the backend epoch
+ * advanced and a region is not found. An entry that is found is checked
+ * against the current bounds of its region, a region moved away leaves a
+ * stale entry behind that a region moved or allocated in its place hits.
+ */
+
+struct index_region {
+    uint64_t        base;       ///< start address of the region
+    uint64_t        size;       ///< size of the region in bytes
+    capfs_capref_t region;     ///< the capability to the region
+    capfs_capref_t file;       ///< the file record owning the region
+};
+
+struct index_state {
+    GRWLock  lock;              ///< protects the tree
+    GTree   *regions;           ///< struct index_region, ordered by base
+    uint64_t epoch;             ///< backend epoch the bases were decoded in
+};
+
+static struct index_state revidx;
+
+
+static gint index_region_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const struct index_region *ra = a;
+    const struct index_region *rb = b;
+
+    (void)data;
+
+    return (ra->base > rb->base) - (ra->base < rb->base);
+}
+
+static gint index_region_search(gconstpointer key, gconstpointer addr)
+{
+    const struct index_region *r = key;
+    uint64_t a = *(const uint64_t *)addr;
+
+    if (a < r->base) {
+        return -1;
+    }
+    if (a - r->base >= r->size) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static gboolean index_region_rekey(gpointer key, gpointer value,
+                                   gpointer data)
+{
+    const struct index_region *r = value;
+    GTree *regions = data;
+
+    (void)key;
+
+    /* regions that no longer decode have been freed */
+    struct capfs_capbounds b;
+    if (capfs_backend_cap_decode(r->region, &b) == 0) {
+        struct index_region *n = g_new(struct index_region, 1);
+        *n = *r;
+        n->base = b.base;
+        n->size = b.size;
+        g_tree_replace(regions, n, n);
+    }
+
+    return FALSE;
+}
+
+/* checks that an entry still has the bounds of its region */
+static bool index_region_current(const struct index_region *r)
+{
+    struct capfs_capbounds b;
+    return capfs_backend_cap_decode(r->region, &b) == 0 && b.base == r->base
+           && b.size == r->size;
+}
+
+static gint index_region_overlap(gconstpointer key, gconstpointer range)
+{
+    const struct index_region *r = key;
+    const struct index_region *o = range;
+
+    if (o->base + o->size <= r->base) {
+        return -1;
+    }
+    if (o->base >= r->base + r->size) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* decodes the bases of all regions again, the lock is held for writing */
+static void index_rekey_locked(uint64_t epoch)
+{
+    if (epoch < revidx.epoch) {
+        epoch = revidx.epoch;
+    }
+
+    GTree *regions = g_tree_new_full(index_region_cmp, NULL, NULL, g_free);
+    g_tree_foreach(revidx.regions, index_region_rekey, regions);
+    g_tree_destroy(revidx.regions);
+
+    revidx.regions = regions;
+    revidx.epoch = epoch;
+}
+
+/* finds the region a capability lies in, the lock is held */
+static int index_lookup_locked(const struct capfs_capbounds *b,
+                               capfs_capref_t *file, uint64_t *offset,
+                               uint64_t *epoch)
+{
+    struct index_region *r = g_tree_search(revidx.regions, index_region_search,
+                                           &b->base);
+    if (r && !index_region_current(r)) {
+        return -ESTALE;
+    }
+
+    /* the whole capability has to lie within the region */
+    if (r == NULL || b->size > r->size - (b->base - r->base)) {
+        return -ENOENT;
+    }
+
+    *file = r->file;
+    if (offset) {
+        *offset = b->base - r->base;
+    }
+    if (epoch) {
+        *epoch = capfs_epoch_get(r->file);
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief initializes the reverse index from capabilities to files
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_index_init(void)
+{
+    if (revidx.regions) {
+        return 0;
+    }
+
+    g_rw_lock_init(&revidx.lock);
+
+    /* the key is the value, only free it once */
+    revidx.regions = g_tree_new_full(index_region_cmp, NULL, NULL, g_free);
+
+    return 0;
+}
+
+/**
+ * @brief frees the reverse index
+ */
+void capfs_index_destroy(void)
+{
+    if (revidx.regions == NULL) {
+        return;
+    }
+
+    g_tree_destroy(revidx.regions);
+    revidx.regions = NULL;
+    g_rw_lock_clear(&revidx.lock);
+}
+
+/**
+ * @brief removes all regions from the reverse index
+ */
+void capfs_index_clear(void)
+{
+    if (revidx.regions == NULL) {
+        return;
+    }
+
+    g_rw_lock_writer_lock(&revidx.lock);
+    g_tree_destroy(revidx.regions);
+    revidx.regions = g_tree_new_full(index_region_cmp, NULL, NULL, g_free);
+    g_rw_lock_writer_unlock(&revidx.lock);
+}
+
+/**
+ * @brief records that a region belongs to a file
+ *
+ * @param region    the capability to the entire region
+ * @param file      the capability of the file record owning the region
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_index_insert(capfs_capref_t region, capfs_capref_t file)
+{
+    if (revidx.regions == NULL) {
+        return -EINVAL;
+    }
+
+    struct capfs_capbounds b;
+    if (capfs_backend_cap_decode(region, &b)) {
+        return -EINVAL;
+    }
+
+    struct index_region *r = g_new(struct index_region, 1);
+    r->base = b.base;
+    r->size = b.size;
+    r->region = region;
+    r->file = file;
+
+    g_rw_lock_writer_lock(&revidx.lock);
+    /* regions in the range may have been moved away or freed */
+    struct index_region *o = g_tree_search(revidx.regions,
+                                           index_region_overlap, r);
+    if (o && !index_region_current(o)) {
+        index_rekey_locked(b.epoch);
+    }
+    /* the entries left in the range are replaced */
+    while ((o = g_tree_search(revidx.regions, index_region_overlap, r))) {
+        capfs_epoch_bump(o->file);
+        g_tree_remove(revidx.regions, o);
+    }
+    g_tree_insert(revidx.regions, r, r);
+    capfs_epoch_bump(file);
+    g_rw_lock_writer_unlock(&revidx.lock);
+
+    return 0;
+}
+
+/**
+ * @brief removes a region from the reverse index
+ *
+ * @param region    the capability to the entire region
+ *
+ * @return ERR_OK on success, -ENOENT if the region is not indexed
+ */
+int capfs_index_remove(capfs_capref_t region)
+{
+    if (revidx.regions == NULL) {
+        return -EINVAL;
+    }
+
+    struct capfs_capbounds b;
+    if (capfs_backend_cap_decode(region, &b)) {
+        return -EINVAL;
+    }
+
+    struct index_region key = { .base = b.base };
+
+    int err = -ENOENT;
+
+    g_rw_lock_writer_lock(&revidx.lock);
+    struct index_region *r = g_tree_lookup(revidx.regions, &key);
+    if ((r == NULL && b.epoch > revidx.epoch)
+        || (r && r->region.capaddr != region.capaddr)) {
+        index_rekey_locked(b.epoch);
+        r = g_tree_lookup(revidx.regions, &key);
+    }
+    if (r) {
+        capfs_epoch_bump(r->file);
+        g_tree_remove(revidx.regions, &key);
+        err = 0;
+    }
+    g_rw_lock_writer_unlock(&revidx.lock);
+
+    return err;
+}
+
+/**
+ * @brief finds the file owning the region a capability points into
+ *
+ * @param cap       the capability to identify
+ * @param file      returns the capability of the owning file record
+ * @param offset    returns the offset of the capability into the region
+ * @param epoch     returns the epoch of the file the result is valid for
+ *
+ * @return ERR_OK on success, -ENOENT if no file owns the capability
+ *
+ * The epoch is read while holding the lock, so a change to the regions after
+ * the lookup always advances it past the returned value.
+ */
+int capfs_index_lookup(capfs_capref_t cap, capfs_capref_t *file,
+                       uint64_t *offset, uint64_t *epoch)
+{
+    if (revidx.regions == NULL) {
+        return -ENOENT;
+    }
+
+    struct capfs_capbounds b;
+    if (capfs_backend_cap_decode(cap, &b)) {
+        return -EINVAL;
+    }
+
+    g_rw_lock_reader_lock(&revidx.lock);
+    int err = index_lookup_locked(&b, file, offset, epoch);
+    bool stale = (err == -ESTALE || (err && b.epoch > revidx.epoch));
+    g_rw_lock_reader_unlock(&revidx.lock);
+
+    if (stale) {
+        g_rw_lock_writer_lock(&revidx.lock);
+        err = index_lookup_locked(&b, file, offset, epoch);
+        if (err == -ESTALE || (err && b.epoch > revidx.epoch)) {
+            index_rekey_locked(b.epoch);
+            err = index_lookup_locked(&b, file, offset, epoch);
+        }
+        g_rw_lock_writer_unlock(&revidx.lock);
+    }
+
+    return (err == -ESTALE) ? -ENOENT : err;
+}
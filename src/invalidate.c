@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* don't declare *pt* functions  */
+
+#include <capfs_internal.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+
+
+/*
+ * ============================================================================
+ * Kernel cache tracking
+ * ============================================================================
+ *
+ * Every path that is handed to the kernel with attributes is recorded with
+ * the time its cache entry expires. A change the kernel did not see only
+ * results in a notification if the path is still cached. Notifications are
+ * sent from a worker thread because sending them from within a request
+ * handler may deadlock with the kernel holding locks for that request.
+ */
+
+/// the number of tracked insertions after which expired entries are purged
+#define INVAL_PURGE_INTERVAL 4096
+
+struct inval_entry {
+    gint64         expires;     ///< monotonic time the kernel cache expires
+    capfs_capref_t file;        ///< the capability of the file
+};
+
+struct inval_state {
+    struct fuse *fuse;          ///< the FUSE handle for notifications
+    gint64       timeout;       ///< kernel cache timeout in microseconds
+    GMutex       lock;          ///< protects the tables
+    GHashTable  *paths;         ///< path -> struct inval_entry
+    GHashTable  *files;         ///< file capaddr -> path
+    guint        inserts;       ///< insertions since the last purge
+    GAsyncQueue *queue;         ///< paths to be invalidated
+    GThread     *worker;        ///< thread sending the notifications
+};
+
+static struct inval_state inval;
+
+/// sentinel to stop the worker thread
+static char inval_stop[] = "";
+
+
+static gpointer inval_worker(gpointer arg)
+{
+    (void)arg;
+
+    while (true) {
+        char *path = g_async_queue_pop(inval.queue);
+        if (path == inval_stop) {
+            break;
+        }
+
+        LOG("invalidating '%s'\n", path);
+
+        int err = fuse_invalidate_path(inval.fuse, path);
+        if (err && err != -ENOENT) {
+            LOGW("WARNING: invalidation of '%s' failed with %i\n", path, err);
+        }
+
+        g_free(path);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief drops the file mapping of a tracked path, must hold the lock
+ */
+static void inval_forget_file(const char *path, struct inval_entry *e)
+{
+    const char *fpath = g_hash_table_lookup(inval.files, &e->file.capaddr);
+    if (fpath && !strcmp(fpath, path)) {
+        g_hash_table_remove(inval.files, &e->file.capaddr);
+    }
+}
+
+static gboolean inval_expired(gpointer key, gpointer value, gpointer now)
+{
+    struct inval_entry *e = value;
+    if (e->expires > *(gint64 *)now) {
+        return FALSE;
+    }
+
+    inval_forget_file(key, e);
+
+    return TRUE;
+}
+
+static guint64 *inval_file_key(capfs_capref_t file)
+{
+    guint64 *key = g_new(guint64, 1);
+    *key = file.capaddr;
+    return key;
+}
+
+
+/**
+ * @brief initializes the invalidation subsystem
+ *
+ * @param fuse      the FUSE handle used to send notifications
+ * @param timeout   the attribute and entry timeout of the kernel in seconds
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_inval_init(struct fuse *fuse, double timeout)
+{
+    if (fuse == NULL) {
+        return -EINVAL;
+    }
+
+    inval.fuse = fuse;
+    inval.timeout = (gint64)(timeout * G_USEC_PER_SEC);
+    g_mutex_init(&inval.lock);
+    inval.paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    inval.files = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                        g_free);
+    inval.queue = g_async_queue_new();
+    inval.worker = g_thread_new("capfs-inval", inval_worker, NULL);
+
+    return 0;
+}
+
+/**
+ * @brief stops the invalidation subsystem
+ */
+void capfs_inval_destroy(void)
+{
+    if (inval.worker == NULL) {
+        return;
+    }
+
+    g_async_queue_push(inval.queue, inval_stop);
+    g_thread_join(inval.worker);
+    inval.worker = NULL;
+
+    g_async_queue_unref(inval.queue);
+    g_hash_table_destroy(inval.paths);
+    g_hash_table_destroy(inval.files);
+    g_mutex_clear(&inval.lock);
+}
+
+/**
+ * @brief records that the kernel caches the attributes or entry of a path
+ *
+ * @param path  the path returned to the kernel
+ * @param file  the capability of the file
+ */
+void capfs_inval_track(const char *path, capfs_capref_t file)
+{
+    if (inval.worker == NULL || path == NULL) {
+        return;
+    }
+
+    gint64 now = g_get_monotonic_time();
+
+    struct inval_entry *e = g_new(struct inval_entry, 1);
+    e->expires = now + inval.timeout;
+    e->file = file;
+
+    g_mutex_lock(&inval.lock);
+
+    g_hash_table_replace(inval.paths, g_strdup(path), e);
+    g_hash_table_replace(inval.files, inval_file_key(file), g_strdup(path));
+
+    if (++inval.inserts >= INVAL_PURGE_INTERVAL) {
+        inval.inserts = 0;
+        g_hash_table_foreach_remove(inval.paths, inval_expired, &now);
+    }
+
+    g_mutex_unlock(&inval.lock);
+}
+
+/**
+ * @brief notifies the kernel that a path has changed
+ *
+ * @param path  the path that has changed
+ *
+ * The notification is only sent if the kernel may still cache the path.
+ */
+void capfs_inval_path(const char *path)
+{
+    if (inval.worker == NULL || path == NULL) {
+        return;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    bool cached = false;
+
+    g_mutex_lock(&inval.lock);
+
+    struct inval_entry *e = g_hash_table_lookup(inval.paths, path);
+    if (e) {
+        cached = (e->expires > now);
+        inval_forget_file(path, e);
+        g_hash_table_remove(inval.paths, path);
+    }
+
+    g_mutex_unlock(&inval.lock);
+
+    if (cached) {
+        g_async_queue_push(inval.queue, g_strdup(path));
+    }
+}
+
+/**
+ * @brief notifies the kernel that a file has changed through a capability
+ *
+ * @param file  the capability of the file that has changed
+ */
+void capfs_inval_file(capfs_capref_t file)
+{
+    if (inval.worker == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&inval.lock);
+    char *path = g_strdup(g_hash_table_lookup(inval.files, &file.capaddr));
+    g_mutex_unlock(&inval.lock);
+
+    if (path) {
+        capfs_inval_path(path);
+        g_free(path);
+    }
+}
@@ -0,0 +1,1049 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * libcapfs: client side of the CAPFS ioctl interface
+ */
+
+#define _GNU_SOURCE
+
+#include <capfs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(struct capfs_ioctl_batch) < (1 << _IOC_SIZEBITS),
+               "the batch does not fit into the ioctl size field");
+
+/*
+ * ============================================================================
+ * Descriptor cache
+ * ============================================================================
+ *
+ * capfs_ioctl_path() keeps the files it opens in a direct-mapped cache, so
+ * repeated ioctls on the same path do not open and close the file every time.
+ * A slot is locked while its descriptor is in use, hence an eviction never
+ * closes a descriptor another thread is issuing an ioctl on.
+ */
+
+/// the number of slots in the descriptor cache, must be a power of two
+#define LIBCAPFS_FD_CACHE_SIZE 256
+
+struct fd_cache_slot {
+    pthread_mutex_t lock;
+    char           *path;   ///< the cached path, NULL if the slot is empty
+    int             fd;     ///< the open descriptor of the path
+};
+
+static struct fd_cache_slot fd_cache[LIBCAPFS_FD_CACHE_SIZE];
+static pthread_once_t fd_cache_once = PTHREAD_ONCE_INIT;
+
+static void fd_cache_init(void)
+{
+    for (size_t i = 0; i < LIBCAPFS_FD_CACHE_SIZE; i++) {
+        pthread_mutex_init(&fd_cache[i].lock, NULL);
+        fd_cache[i].path = NULL;
+        fd_cache[i].fd = -1;
+    }
+}
+
+static struct fd_cache_slot *fd_cache_slot(const char *path)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *c = path; *c; c++) {
+        h = (h ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+
+    return &fd_cache[h & (LIBCAPFS_FD_CACHE_SIZE - 1)];
+}
+
+static void fd_cache_evict(struct fd_cache_slot *s)
+{
+    if (s->path) {
+        close(s->fd);
+        free(s->path);
+        s->path = NULL;
+        s->fd = -1;
+    }
+}
+
+/**
+ * @brief obtains the cached descriptor of a path, must hold the slot lock
+ */
+static int fd_cache_get(struct fd_cache_slot *s, const char *path)
+{
+    if (s->path && !strcmp(s->path, path)) {
+        return s->fd;
+    }
+
+    /* directories and read-only files can only be opened for reading */
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && (errno == EISDIR || errno == EACCES || errno == EROFS)) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+
+    char *p = strdup(path);
+    if (p == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    fd_cache_evict(s);
+    s->path = p;
+    s->fd = fd;
+
+    return fd;
+}
+
+
+/*
+ * ============================================================================
+ * CAPFS IOCTL Functions
+ * ============================================================================
+ */
+
+
+/**
+ * @brief issues a CAPFS ioctl on an open file
+ *
+ * @param fd    descriptor of a file or directory in a CAPFS mount
+ * @param op    the operation to execute
+ * @param args  the arguments of the operation, may be NULL
+ * @param res   returns the result of the operation, may be NULL
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_ioctl(int fd, capfs_ioctl_op_t op,
+                union capfs_ioctl_args * args, union capfs_ioctl_res * res)
+{
+    struct capfs_ioctl_msg msg;
+    memset(&msg, 0, sizeof(msg));
+
+    if (args) {
+        msg.args = *args;
+    }
+
+    if (ioctl(fd, CAPFS_IOCTL_CMD(op), &msg) < 0) {
+        return -errno;
+    }
+
+    if (res) {
+        *res = msg.res;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief issues a CAPFS ioctl on a path
+ *
+ * @param path  path of a file or directory in a CAPFS mount
+ * @param op    the operation to execute
+ * @param args  the arguments of the operation, may be NULL
+ * @param res   returns the result of the operation, may be NULL
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * The file is kept open for subsequent calls on the same path, use
+ * capfs_close_path() once the path is removed or replaced.
+ */
+int capfs_ioctl_path(const char * path, capfs_ioctl_op_t op,
+                     union capfs_ioctl_args * args, union capfs_ioctl_res * res)
+{
+    if (path == NULL) {
+        return -EINVAL;
+    }
+
+    pthread_once(&fd_cache_once, fd_cache_init);
+
+    struct fd_cache_slot *s = fd_cache_slot(path);
+
+    pthread_mutex_lock(&s->lock);
+
+    int err = fd_cache_get(s, path);
+    if (err >= 0) {
+        err = capfs_ioctl(err, op, args, res);
+        if (err == -EBADF) {
+            /* the file has been released, try once more with a fresh one */
+            fd_cache_evict(s);
+            err = fd_cache_get(s, path);
+            if (err >= 0) {
+                err = capfs_ioctl(err, op, args, res);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return err;
+}
+
+/**
+ * @brief issues a batch and copies out the results
+ */
+static int capfs_get_caps_flush(int fd, struct capfs_ioctl_batch *b,
+                                const size_t *idx, capfs_capref_t *caps,
+                                int *status, long *resolved)
+{
+    if (b->count == 0) {
+        return 0;
+    }
+
+    if (ioctl(fd, CAPFS_IOCTL_BATCH_CMD, b) < 0) {
+        return -errno;
+    }
+
+    for (uint32_t i = 0; i < b->count; i++) {
+        status[idx[i]] = b->entries[i].status;
+        if (b->entries[i].status == 0) {
+            caps[idx[i]] = b->entries[i].cap;
+        }
+    }
+
+    *resolved += b->resolved;
+    b->count = 0;
+
+    return 0;
+}
+
+/**
+ * @brief obtains the capabilities of many files with batched ioctls
+ *
+ * @param dir       a directory in a CAPFS mount, relative paths start there
+ * @param paths     the paths of the files
+ * @param count     the number of paths
+ * @param caps      returns the capability of each path
+ * @param status    returns the status of each path
+ *
+ * @return the number of resolved paths, negative error number on failure
+ *
+ * The paths are packed into as few CAPFS_IOCTL_OP_GET_CAP_BATCH requests as
+ * the batch limits allow. A NULL path refers to @p dir itself.
+ */
+long capfs_get_caps(const char * dir, const char * const * paths, size_t count,
+                    capfs_capref_t * caps, int * status)
+{
+    if (dir == NULL || (count && (!paths || !caps || !status))) {
+        return -EINVAL;
+    }
+
+    struct capfs_ioctl_batch *b = malloc(sizeof(*b));
+    if (b == NULL) {
+        return -ENOMEM;
+    }
+
+    size_t idx[CAPFS_IOCTL_BATCH_MAX];
+    size_t used = 0;
+    long resolved = 0;
+
+    pthread_once(&fd_cache_once, fd_cache_init);
+
+    struct fd_cache_slot *s = fd_cache_slot(dir);
+
+    pthread_mutex_lock(&s->lock);
+
+    int err = fd_cache_get(s, dir);
+    int fd = err;
+
+    b->count = 0;
+    for (size_t i = 0; err >= 0 && i < count; i++) {
+        size_t len = paths[i] ? strlen(paths[i]) + 1 : 0;
+        if (len > CAPFS_IOCTL_BATCH_STRTAB) {
+            status[i] = -ENAMETOOLONG;
+            continue;
+        }
+
+        if (b->count == CAPFS_IOCTL_BATCH_MAX
+            || used + len > CAPFS_IOCTL_BATCH_STRTAB) {
+            err = capfs_get_caps_flush(fd, b, idx, caps, status, &resolved);
+            used = 0;
+        }
+
+        struct capfs_ioctl_batch_entry *e = &b->entries[b->count];
+        memset(e, 0, sizeof(*e));
+        if (paths[i]) {
+            e->path = (uint32_t)used;
+            memcpy(b->strtab + used, paths[i], len);
+            used += len;
+        } else {
+            e->path = CAPFS_IOCTL_BATCH_SELF;
+        }
+        idx[b->count++] = i;
+    }
+
+    if (err >= 0) {
+        err = capfs_get_caps_flush(fd, b, idx, caps, status, &resolved);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    free(b);
+
+    return (err < 0) ? err : resolved;
+}
+
+/**
+ * @brief closes the cached descriptor of a path
+ *
+ * @param path  the path passed to capfs_ioctl_path()
+ */
+void capfs_close_path(const char * path)
+{
+    if (path == NULL) {
+        return;
+    }
+
+    pthread_once(&fd_cache_once, fd_cache_init);
+
+    struct fd_cache_slot *s = fd_cache_slot(path);
+
+    pthread_mutex_lock(&s->lock);
+    if (s->path && !strcmp(s->path, path)) {
+        fd_cache_evict(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * @brief closes all cached descriptors
+ */
+void capfs_close_all(void)
+{
+    pthread_once(&fd_cache_once, fd_cache_init);
+
+    for (size_t i = 0; i < LIBCAPFS_FD_CACHE_SIZE; i++) {
+        pthread_mutex_lock(&fd_cache[i].lock);
+        fd_cache_evict(&fd_cache[i]);
+        pthread_mutex_unlock(&fd_cache[i].lock);
+    }
+}
+
+
+/*
+ * ============================================================================
+ * Direct Access
+ * ============================================================================
+ */
+
+/**
+ * @brief duplicates a descriptor of another process
+ *
+ * @param pid       the process holding the descriptor
+ * @param remote    the descriptor in that process
+ * @param prot      the protection the descriptor is needed for
+ *
+ * @return the new descriptor, negative error number on failure
+ */
+static int capfs_fd_import(pid_t pid, int remote, int prot)
+{
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+        int fd = syscall(SYS_pidfd_getfd, pidfd, remote, 0);
+        close(pidfd);
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+#endif
+
+    /* older kernels, or without PTRACE_MODE_ATTACH rights on the daemon */
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)pid, remote);
+
+    int fd = open(path, ((prot & PROT_WRITE) ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief maps the content of an open CAPFS file into the address space
+ *
+ * @param fd        descriptor of the file
+ * @param prot      the PROT_* flags of the mapping
+ * @param addr      returns the address of the mapping
+ * @param length    returns the length of the mapping in bytes
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * Loads and stores to the mapping do not go through the file system. Stores
+ * reach the file when it is closed, see CAPFS_IOCTL_OP_MAP. Use capfs_unmap()
+ * to remove the mapping.
+ */
+int capfs_map(int fd, int prot, void **addr, size_t *length)
+{
+    int err;
+
+    union capfs_ioctl_res res;
+    if ((err = capfs_ioctl(fd, CAPFS_IOCTL_OP_MAP, NULL, &res))) {
+        return err;
+    }
+
+    if (prot & ~res.map.prot) {
+        return -EACCES;
+    }
+
+    int content = capfs_fd_import(res.map.pid, res.map.fd, prot);
+    if (content < 0) {
+        return content;
+    }
+
+    void *p = mmap(NULL, res.map.length, prot, MAP_SHARED, content,
+                   (off_t)res.map.offset);
+    err = -errno;
+
+    /* the mapping keeps its own reference to the file */
+    close(content);
+
+    if (p == MAP_FAILED) {
+        return err;
+    }
+
+    *addr = p;
+    *length = res.map.length;
+
+    return 0;
+}
+
+/**
+ * @brief removes a mapping established by capfs_map()
+ *
+ * @param addr      the address of the mapping
+ * @param length    the length of the mapping in bytes
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_unmap(void *addr, size_t length)
+{
+    if (munmap(addr, length)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+
+/*
+ * ============================================================================
+ * Submission/Completion Rings
+ * ============================================================================
+ */
+
+/// the number of polls for a completion before blocking on the eventfd
+#define LIBCAPFS_RING_SPIN 4096
+
+struct capfs_ring {
+    void                   *mem;        ///< the mapped shared memory
+    size_t                  size;       ///< size of the shared memory
+    struct capfs_ring_hdr  *hdr;        ///< the ring header
+    struct capfs_ring_sqe  *sqes;       ///< the submission queue
+    struct capfs_ring_cqe  *cqes;       ///< the completion queue
+    char                   *data;       ///< the data area
+    size_t                  data_size;  ///< size of the data area
+    int                     sq_event;   ///< wakes up the daemon
+    int                     cq_event;   ///< wakes us up
+    uint32_t                sq_tail;    ///< tail including unsubmitted entries
+    uint32_t                cq_head;    ///< the next completion to consume
+};
+
+/**
+ * @brief sets up a submission/completion ring with the daemon
+ *
+ * @param fd    descriptor of a file or directory in a CAPFS mount
+ * @param ring  returns the ring
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_ring_setup(int fd, struct capfs_ring **ring)
+{
+    int err;
+
+    union capfs_ioctl_res res;
+    if ((err = capfs_ioctl(fd, CAPFS_IOCTL_OP_RING_SETUP, NULL, &res))) {
+        return err;
+    }
+
+    struct capfs_ring *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        return -ENOMEM;
+    }
+
+    r->sq_event = capfs_fd_import(res.ring_setup.pid, res.ring_setup.sq_event,
+                                  PROT_WRITE);
+    r->cq_event = capfs_fd_import(res.ring_setup.pid, res.ring_setup.cq_event,
+                                  PROT_WRITE);
+    int memfd = capfs_fd_import(res.ring_setup.pid, res.ring_setup.fd,
+                                PROT_READ | PROT_WRITE);
+
+    r->mem = MAP_FAILED;
+    if (r->sq_event < 0 || r->cq_event < 0 || memfd < 0) {
+        err = (memfd < 0) ? memfd : (r->sq_event < 0) ? r->sq_event : r->cq_event;
+    } else {
+        r->size = res.ring_setup.size;
+        r->mem = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        err = (r->mem == MAP_FAILED) ? -errno : 0;
+    }
+
+    if (memfd >= 0) {
+        close(memfd);
+    }
+
+    if (err) {
+        capfs_ring_destroy(r);
+        return err;
+    }
+
+    r->hdr = r->mem;
+    r->sqes = (void *)((char *)r->mem + r->hdr->sq_offset);
+    r->cqes = (void *)((char *)r->mem + r->hdr->cq_offset);
+    r->data = (char *)r->mem + r->hdr->data_offset;
+    r->data_size = r->hdr->data_size;
+    r->sq_tail = r->hdr->sq_tail;
+    r->cq_head = r->hdr->cq_head;
+
+    *ring = r;
+
+    return 0;
+}
+
+/**
+ * @brief closes a ring, outstanding operations are dropped
+ *
+ * @param ring  the ring
+ */
+void capfs_ring_destroy(struct capfs_ring *ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    if (ring->mem != MAP_FAILED && ring->mem != NULL) {
+        __atomic_fetch_or(&ring->hdr->flags, CAPFS_RING_SHUTDOWN,
+                          __ATOMIC_SEQ_CST);
+        uint64_t one = 1;
+        if (write(ring->sq_event, &one, sizeof(one)) < 0) {
+            /* the daemon is gone already */
+        }
+        munmap(ring->mem, ring->size);
+    }
+
+    if (ring->sq_event >= 0) {
+        close(ring->sq_event);
+    }
+    if (ring->cq_event >= 0) {
+        close(ring->cq_event);
+    }
+
+    free(ring);
+}
+
+/**
+ * @brief obtains the data area of a ring
+ *
+ * @param ring  the ring
+ * @param size  returns the size of the data area in bytes
+ *
+ * @return pointer to the data area, buffers are passed as offsets into it
+ */
+void *capfs_ring_data(struct capfs_ring *ring, size_t *size)
+{
+    if (size) {
+        *size = ring->data_size;
+    }
+
+    return ring->data;
+}
+
+/**
+ * @brief obtains the next free submission queue entry
+ *
+ * @param ring  the ring
+ *
+ * @return pointer to the zeroed entry, NULL if too many are in flight
+ *
+ * At most CAPFS_RING_ENTRIES operations can be in flight, so the daemon
+ * always finds room for their completions.
+ */
+struct capfs_ring_sqe *capfs_ring_get_sqe(struct capfs_ring *ring)
+{
+    uint32_t entries = ring->hdr->entries;
+    if (ring->sq_tail - ring->cq_head >= entries) {
+        return NULL;
+    }
+
+    struct capfs_ring_sqe *sqe = &ring->sqes[ring->sq_tail & (entries - 1)];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_tail++;
+
+    return sqe;
+}
+
+/**
+ * @brief hands the entries obtained since the last call to the daemon
+ *
+ * @param ring  the ring
+ *
+ * @return the number of submitted entries, negative error number on failure
+ */
+int capfs_ring_submit(struct capfs_ring *ring)
+{
+    struct capfs_ring_hdr *hdr = ring->hdr;
+
+    uint32_t n = ring->sq_tail - hdr->sq_tail;
+    if (n == 0) {
+        return 0;
+    }
+
+    __atomic_store_n(&hdr->sq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+
+    /* pairs with the fence of the daemon setting SQ_NEED_WAKEUP */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t flags = __atomic_load_n(&hdr->flags, __ATOMIC_RELAXED);
+    if (flags & CAPFS_RING_SHUTDOWN) {
+        return -EPIPE;
+    }
+
+    if (flags & CAPFS_RING_SQ_NEED_WAKEUP) {
+        uint64_t one = 1;
+        if (write(ring->sq_event, &one, sizeof(one)) < 0) {
+            return -errno;
+        }
+    }
+
+    return (int)n;
+}
+
+/**
+ * @brief obtains a completion if there is one
+ *
+ * @param ring  the ring
+ * @param cqe   returns the completion
+ *
+ * @return 0 on success, -EAGAIN if there is no completion
+ */
+int capfs_ring_peek_cqe(struct capfs_ring *ring, struct capfs_ring_cqe *cqe)
+{
+    struct capfs_ring_hdr *hdr = ring->hdr;
+
+    if (ring->cq_head == __atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE)) {
+        return -EAGAIN;
+    }
+
+    *cqe = ring->cqes[ring->cq_head & (hdr->entries - 1)];
+    ring->cq_head++;
+
+    __atomic_store_n(&hdr->cq_head, ring->cq_head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * @brief waits for a completion
+ *
+ * @param ring  the ring
+ * @param cqe   returns the completion
+ *
+ * @return 0 on success, negative error number on failure
+ *
+ * The completion queue is polled for a while before blocking on the eventfd,
+ * so short operations complete without a context switch.
+ */
+int capfs_ring_wait_cqe(struct capfs_ring *ring, struct capfs_ring_cqe *cqe)
+{
+    struct capfs_ring_hdr *hdr = ring->hdr;
+
+    if (ring->cq_head == ring->sq_tail) {
+        return -EINVAL;
+    }
+
+    while (true) {
+        for (int i = 0; i < LIBCAPFS_RING_SPIN; i++) {
+            if (!capfs_ring_peek_cqe(ring, cqe)) {
+                return 0;
+            }
+        }
+
+        __atomic_fetch_or(&hdr->flags, CAPFS_RING_CQ_NEED_WAKEUP,
+                          __ATOMIC_SEQ_CST);
+
+        /* a completion may have raced with setting the flag */
+        int err = capfs_ring_peek_cqe(ring, cqe);
+        if (err && (__atomic_load_n(&hdr->flags, __ATOMIC_ACQUIRE)
+                    & CAPFS_RING_SHUTDOWN)) {
+            err = -EPIPE;
+        } else if (err) {
+            uint64_t cnt;
+            if (read(ring->cq_event, &cnt, sizeof(cnt)) < 0 && errno != EINTR) {
+                err = -errno;
+            }
+        }
+
+        __atomic_fetch_and(&hdr->flags, ~CAPFS_RING_CQ_NEED_WAKEUP,
+                           __ATOMIC_RELAXED);
+
+        if (err != -EAGAIN) {
+            return err;
+        }
+    }
+}
+
+
+/*
+ * ============================================================================
+ * Capability and meta data cache
+ * ============================================================================
+ *
+ * Results are stored with the epochs they are valid for. A hit only loads
+ * the current epochs from the shared page and compares them. Path lookups
+ * depend on the global epoch, identify and stat results also on the epoch of
+ * the file which the daemon returns with the result.
+ */
+
+/// the number of entries of each cache table, must be a power of two
+#define LIBCAPFS_CACHE_SIZE 4096
+
+/// the number of locks protecting the cache tables
+#define LIBCAPFS_CACHE_LOCKS 64
+
+struct cache_path_entry {
+    char           *path;       ///< the path, NULL if the entry is empty
+    capfs_capref_t cap;        ///< the capability of the path
+    uint64_t        global;     ///< the global epoch of the result
+};
+
+struct cache_identify_entry {
+    bool                   valid;   ///< the entry holds a result
+    capfs_capref_t        cap;     ///< the identified capability
+    union capfs_ioctl_res  res;     ///< the result of the identify
+    uint64_t               global;  ///< the global epoch of the result
+};
+
+struct cache_stat_entry {
+    char                  *path;    ///< the path, NULL if the entry is empty
+    union capfs_ioctl_res  res;     ///< the result of the stat
+    uint64_t               global;  ///< the global epoch of the result
+};
+
+struct capfs_cache {
+    int                            fd;      ///< descriptor in the mount
+    const struct capfs_epoch_page *page;    ///< the shared epoch page
+    size_t                         size;    ///< size of the epoch page
+    pthread_mutex_t                locks[LIBCAPFS_CACHE_LOCKS];
+    struct cache_path_entry        paths[LIBCAPFS_CACHE_SIZE];
+    struct cache_identify_entry    idents[LIBCAPFS_CACHE_SIZE];
+    struct cache_stat_entry        stats[LIBCAPFS_CACHE_SIZE];
+};
+
+static inline uint64_t cache_global(struct capfs_cache *cache)
+{
+    return __atomic_load_n(&cache->page->global, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t cache_file(struct capfs_cache *cache,
+                                  capfs_capref_t file)
+{
+    return __atomic_load_n(&cache->page->slots[capfs_epoch_slot(file)],
+                           __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t cache_hash_path(const char *path)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *c = path; *c; c++) {
+        h = (h ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+
+    return (uint32_t)(h ^ (h >> 32)) & (LIBCAPFS_CACHE_SIZE - 1);
+}
+
+static inline uint32_t cache_hash_cap(capfs_capref_t cap)
+{
+    return (uint32_t)((cap.capaddr * 0x9e3779b97f4a7c15ULL) >> 40)
+           & (LIBCAPFS_CACHE_SIZE - 1);
+}
+
+static inline pthread_mutex_t *cache_lock(struct capfs_cache *cache,
+                                          uint32_t idx)
+{
+    return &cache->locks[idx & (LIBCAPFS_CACHE_LOCKS - 1)];
+}
+
+/**
+ * @brief creates a cache for a CAPFS mount
+ *
+ * @param path      a file or directory in the CAPFS mount
+ * @param cache     returns the cache
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_cache_create(const char * path, struct capfs_cache **cache)
+{
+    int err;
+
+    struct capfs_cache *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return -ENOMEM;
+    }
+
+    c->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (c->fd < 0) {
+        err = -errno;
+        free(c);
+        return err;
+    }
+
+    union capfs_ioctl_res res;
+    if ((err = capfs_ioctl(c->fd, CAPFS_IOCTL_OP_EPOCH_SETUP, NULL, &res))) {
+        goto err_out;
+    }
+
+    int fd = capfs_fd_import(res.epoch_setup.pid, res.epoch_setup.fd, PROT_READ);
+    if (fd < 0) {
+        err = fd;
+        goto err_out;
+    }
+
+    void *p = mmap(NULL, res.epoch_setup.size, PROT_READ, MAP_SHARED, fd, 0);
+    err = -errno;
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        goto err_out;
+    }
+
+    c->page = p;
+    c->size = res.epoch_setup.size;
+
+    for (size_t i = 0; i < LIBCAPFS_CACHE_LOCKS; i++) {
+        pthread_mutex_init(&c->locks[i], NULL);
+    }
+
+    *cache = c;
+
+    return 0;
+
+err_out:
+    close(c->fd);
+    free(c);
+    return err;
+}
+
+/**
+ * @brief destroys a cache
+ *
+ * @param cache     the cache
+ */
+void capfs_cache_destroy(struct capfs_cache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < LIBCAPFS_CACHE_SIZE; i++) {
+        free(cache->paths[i].path);
+        free(cache->stats[i].path);
+    }
+
+    for (size_t i = 0; i < LIBCAPFS_CACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+
+    munmap((void *)cache->page, cache->size);
+    close(cache->fd);
+    free(cache);
+}
+
+/**
+ * @brief obtains the capability of a path, using the cache if possible
+ *
+ * @param cache     the cache
+ * @param path      path of a file or directory in the CAPFS mount
+ * @param cap       returns the capability
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_cache_get_cap(struct capfs_cache *cache, const char * path,
+                        capfs_capref_t *cap)
+{
+    int err;
+
+    if (path == NULL) {
+        return -EINVAL;
+    }
+
+    uint32_t idx = cache_hash_path(path);
+    struct cache_path_entry *e = &cache->paths[idx];
+    pthread_mutex_t *lock = cache_lock(cache, idx);
+
+    pthread_mutex_lock(lock);
+    if (e->path && e->global == cache_global(cache) && !strcmp(e->path, path)) {
+        *cap = e->cap;
+        pthread_mutex_unlock(lock);
+        return 0;
+    }
+    pthread_mutex_unlock(lock);
+
+    /* a change while the request is in flight makes the result stale */
+    uint64_t global = cache_global(cache);
+
+    union capfs_ioctl_res res;
+    if ((err = capfs_ioctl_path(path, CAPFS_IOCTL_OP_GET_CAP, NULL, &res))) {
+        return err;
+    }
+
+    *cap = res.get_cap.cap;
+
+    char *p = strdup(path);
+    if (p == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(lock);
+    free(e->path);
+    e->path = p;
+    e->cap = res.get_cap.cap;
+    e->global = global;
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
+/**
+ * @brief identifies a capability, using the cache if possible
+ *
+ * @param cache     the cache
+ * @param cap       the capability
+ * @param res       returns the result as of CAPFS_IOCTL_OP_IDENTIFY
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_cache_identify(struct capfs_cache *cache, capfs_capref_t cap,
+                         union capfs_ioctl_res *res)
+{
+    int err;
+
+    uint32_t idx = cache_hash_cap(cap);
+    struct cache_identify_entry *e = &cache->idents[idx];
+    pthread_mutex_t *lock = cache_lock(cache, idx);
+
+    pthread_mutex_lock(lock);
+    if (e->valid && e->cap.capaddr == cap.capaddr
+        && e->global == cache_global(cache)
+        && e->res.identify.epoch == cache_file(cache, e->res.identify.file)) {
+        *res = e->res;
+        pthread_mutex_unlock(lock);
+        return 0;
+    }
+    pthread_mutex_unlock(lock);
+
+    uint64_t global = cache_global(cache);
+
+    union capfs_ioctl_args args;
+    memset(&args, 0, sizeof(args));
+    args.identify.cap = cap;
+
+    if ((err = capfs_ioctl(cache->fd, CAPFS_IOCTL_OP_IDENTIFY, &args, res))) {
+        return err;
+    }
+
+    pthread_mutex_lock(lock);
+    e->valid = true;
+    e->cap = cap;
+    e->res = *res;
+    e->global = global;
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
+/**
+ * @brief obtains the type, size and permissions of a path, using the cache
+ *        if possible
+ *
+ * @param cache     the cache
+ * @param path      path of a file or directory in the CAPFS mount
+ * @param res       returns the result as of CAPFS_IOCTL_OP_STAT
+ *
+ * @return 0 on success, negative error number on failure
+ */
+int capfs_cache_stat(struct capfs_cache *cache, const char * path,
+                     union capfs_ioctl_res *res)
+{
+    int err;
+
+    if (path == NULL) {
+        return -EINVAL;
+    }
+
+    uint32_t idx = cache_hash_path(path);
+    struct cache_stat_entry *e = &cache->stats[idx];
+    pthread_mutex_t *lock = cache_lock(cache, idx);
+
+    pthread_mutex_lock(lock);
+    if (e->path && e->global == cache_global(cache)
+        && e->res.stat.epoch == cache_file(cache, e->res.stat.file)
+        && !strcmp(e->path, path)) {
+        *res = e->res;
+        pthread_mutex_unlock(lock);
+        return 0;
+    }
+    pthread_mutex_unlock(lock);
+
+    uint64_t global = cache_global(cache);
+
+    if ((err = capfs_ioctl_path(path, CAPFS_IOCTL_OP_STAT, NULL, res))) {
+        return err;
+    }
+
+    char *p = strdup(path);
+    if (p == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(lock);
+    free(e->path);
+    e->path = p;
+    e->res = *res;
+    e->global = global;
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
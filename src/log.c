@@ -0,0 +1,891 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capfs_internal.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*
+ * ============================================================================
+ * Log rings
+ * ============================================================================
+ *
+ * Every thread that logs owns a ring of records it alone produces into, the
+ * log thread alone consumes from it. Rings are pushed onto a global list and
+ * are only unlinked by the log thread, once their thread exited and they are
+ * empty.
+ */
+
+/// the number of records of a ring, a power of two
+#define LOG_RING_ENTRIES 512
+
+/// the size of the output buffer of the log thread
+#define LOG_OUT_BYTES (64 * 1024)
+
+/// the maximum size of a formatted message
+#define LOG_MSG_BYTES 1024
+
+/// the longest the log thread sleeps when there is nothing to write
+#define LOG_IDLE_MAX_USEC 20000
+
+/// the shortest the log thread sleeps when there is nothing to write
+#define LOG_IDLE_MIN_USEC 500
+
+#define LOG_RING_MASK (LOG_RING_ENTRIES - 1)
+
+#define LOG_PREFIX "## cap-fs # %s:%u # "
+
+/**
+ * @brief a logged message
+ */
+struct log_record {
+    uint64_t time;                  ///< monotonic time in nanoseconds
+    const char *func;               ///< function that logged it
+    const char *format;             ///< format of the message
+    unsigned line;                  ///< line of the message
+    int level;                      ///< level of the message
+    struct capfs_log_args args;     ///< captured arguments
+};
+
+/**
+ * @brief the records of a thread
+ */
+struct log_ring {
+    struct log_ring *next;          ///< next ring on the list
+
+    uint64_t tail __attribute__((aligned(64)));  ///< next record to produce
+    uint64_t drops;                 ///< records dropped because it was full
+    bool dead;                      ///< the thread has exited
+
+    uint64_t head __attribute__((aligned(64)));  ///< next record to write
+    uint64_t dropped;               ///< drops the log thread has reported
+
+    struct log_record recs[LOG_RING_ENTRIES];
+};
+
+/**
+ * @brief the state of the log thread
+ */
+static struct {
+    struct log_ring *rings;         ///< all rings, pushed lock-free
+    pthread_key_t key;              ///< marks the ring of an exiting thread
+    pthread_once_t once;            ///< creates the key
+    bool running;                   ///< the log thread consumes the rings
+    bool stop;                      ///< the log thread should stop
+    pthread_t thread;               ///< the log thread
+    pthread_mutex_t lock;           ///< protects the flush counters
+    pthread_cond_t kick;            ///< wakes up the log thread
+    pthread_cond_t done;            ///< signals a completed flush
+    uint64_t flush_req;             ///< flushes requested
+    uint64_t flush_done;            ///< flushes completed
+    char out[LOG_OUT_BYTES];        ///< output buffer of the log thread
+    size_t outbytes;                ///< used bytes of out
+} g_log = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .kick = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief the ring of the current thread
+ */
+static __thread struct log_ring *t_ring;
+
+int capfs_log_level = CAPFS_LOG_LEVEL;
+
+
+static void ring_release(void *arg)
+{
+    struct log_ring *ring = arg;
+
+    __atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+    if (pthread_key_create(&g_log.key, ring_release)) {
+        g_log.key = (pthread_key_t)-1;
+    }
+}
+
+/* returns the ring of the current thread, NULL if it cannot have one */
+static struct log_ring *ring_get(void)
+{
+    if (t_ring) {
+        return t_ring;
+    }
+
+    pthread_once(&g_log.once, ring_key_create);
+    if (g_log.key == (pthread_key_t)-1) {
+        return NULL;
+    }
+
+    struct log_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    if (pthread_setspecific(g_log.key, ring)) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->next = __atomic_load_n(&g_log.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&g_log.rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    t_ring = ring;
+
+    return ring;
+}
+
+
+/*
+ * ============================================================================
+ * Formatting
+ * ============================================================================
+ *
+ * Records are formatted by the log thread, one conversion at a time, with the
+ * captured value cast to the type its length modifier asks for.
+ */
+
+/* the value of an argument as a signed integer of its captured size */
+static int64_t arg_signed(const struct capfs_log_args *la, unsigned i)
+{
+    switch (la->types[i] >> 4) {
+    case 1:
+        return (int8_t)la->args[i];
+    case 2:
+        return (int16_t)la->args[i];
+    case 4:
+        return (int32_t)la->args[i];
+    default:
+        return (int64_t)la->args[i];
+    }
+}
+
+/* the value of an argument as a double */
+static double arg_double(const struct capfs_log_args *la, unsigned i)
+{
+    if ((la->types[i] & 0xf) == CAPFS_LOG_ARG_FLOAT) {
+        float f;
+        memcpy(&f, &la->args[i], sizeof(f));
+        return f;
+    }
+
+    if ((la->types[i] & 0xf) == CAPFS_LOG_ARG_DOUBLE) {
+        double d;
+        memcpy(&d, &la->args[i], sizeof(d));
+        return d;
+    }
+
+    return (double)arg_signed(la, i);
+}
+
+/* the value of an argument as a string */
+static const char *arg_string(const struct capfs_log_args *la, unsigned i)
+{
+    if ((la->types[i] & 0xf) != CAPFS_LOG_ARG_STR) {
+        return la->args[i] ? "(?)" : "(null)";
+    }
+
+    if (la->args[i] >= CAPFS_LOG_STR_BYTES) {
+        return "";
+    }
+
+    return la->strs + la->args[i];
+}
+
+/* formats one conversion, returns the number of bytes written */
+static size_t format_conv(char *buf, size_t size, const char *spec,
+                          char length, char conv,
+                          const struct capfs_log_args *la, unsigned *ai,
+                          int width, int prec)
+{
+    unsigned i = *ai;
+    int n;
+
+    if (i >= la->count) {
+        n = snprintf(buf, size, "%s", spec);
+        return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+    }
+
+    *ai = i + 1;
+
+    switch (conv) {
+    case 'd':
+    case 'i':
+        switch (length) {
+        case 'H':
+            n = snprintf(buf, size, spec, width, prec,
+                         (signed char)arg_signed(la, i));
+            break;
+        case 'h':
+            n = snprintf(buf, size, spec, width, prec,
+                         (short)arg_signed(la, i));
+            break;
+        case 'l':
+            n = snprintf(buf, size, spec, width, prec,
+                         (long)arg_signed(la, i));
+            break;
+        case 'q':
+            n = snprintf(buf, size, spec, width, prec,
+                         (long long)arg_signed(la, i));
+            break;
+        case 'z':
+            n = snprintf(buf, size, spec, width, prec,
+                         (ssize_t)arg_signed(la, i));
+            break;
+        case 'j':
+            n = snprintf(buf, size, spec, width, prec,
+                         (intmax_t)arg_signed(la, i));
+            break;
+        case 't':
+            n = snprintf(buf, size, spec, width, prec,
+                         (ptrdiff_t)arg_signed(la, i));
+            break;
+        default:
+            n = snprintf(buf, size, spec, width, prec,
+                         (int)arg_signed(la, i));
+            break;
+        }
+        break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        switch (length) {
+        case 'H':
+            n = snprintf(buf, size, spec, width, prec,
+                         (unsigned char)la->args[i]);
+            break;
+        case 'h':
+            n = snprintf(buf, size, spec, width, prec,
+                         (unsigned short)la->args[i]);
+            break;
+        case 'l':
+            n = snprintf(buf, size, spec, width, prec,
+                         (unsigned long)la->args[i]);
+            break;
+        case 'q':
+            n = snprintf(buf, size, spec, width, prec,
+                         (unsigned long long)la->args[i]);
+            break;
+        case 'z':
+            n = snprintf(buf, size, spec, width, prec,
+                         (size_t)la->args[i]);
+            break;
+        case 'j':
+            n = snprintf(buf, size, spec, width, prec,
+                         (uintmax_t)la->args[i]);
+            break;
+        case 't':
+            n = snprintf(buf, size, spec, width, prec,
+                         (size_t)la->args[i]);
+            break;
+        default:
+            n = snprintf(buf, size, spec, width, prec,
+                         (unsigned)la->args[i]);
+            break;
+        }
+        break;
+    case 'c':
+        n = snprintf(buf, size, spec, width, prec, (int)arg_signed(la, i));
+        break;
+    case 'p':
+        n = snprintf(buf, size, spec, width, prec,
+                     (void *)(uintptr_t)la->args[i]);
+        break;
+    case 's':
+        n = snprintf(buf, size, spec, width, prec, arg_string(la, i));
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        n = snprintf(buf, size, spec, width, prec, arg_double(la, i));
+        break;
+    default:
+        n = snprintf(buf, size, "%s", spec);
+        break;
+    }
+
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+/**
+ * @brief formats a record
+ *
+ * @param buf   buffer to format into
+ * @param size  size of the buffer, at least 2 bytes
+ * @param rec   the record to format
+ *
+ * @return the length of the message
+ */
+static size_t format_record(char *buf, size_t size,
+                            const struct log_record *rec)
+{
+    const struct capfs_log_args *la = &rec->args;
+    const char *f = rec->format;
+    unsigned ai = 0;
+    size_t len;
+
+    int n = snprintf(buf, size, LOG_PREFIX, rec->func, rec->line);
+    len = n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+
+    while (*f && len < size - 1) {
+        if (*f != '%') {
+            buf[len++] = *f++;
+            continue;
+        }
+
+        if (f[1] == '%') {
+            buf[len++] = '%';
+            f += 2;
+            continue;
+        }
+
+        /*
+         * the conversion is rebuilt with the width and the precision always
+         * passed as arguments, so all conversions take the same form
+         */
+        char spec[16] = "%";
+        size_t sl = 1;
+        int width = 0, prec = -1;
+        char length = 0;
+
+        f++;
+        while (*f && strchr("-+ #0", *f)) {
+            if (sl < 8) {
+                spec[sl++] = *f;
+            }
+            f++;
+        }
+
+        if (*f == '*') {
+            if (ai < la->count) {
+                width = (int)arg_signed(la, ai++);
+            }
+            f++;
+        } else {
+            while (*f >= '0' && *f <= '9') {
+                width = width * 10 + (*f++ - '0');
+            }
+        }
+
+        if (*f == '.') {
+            f++;
+            prec = 0;
+            if (*f == '*') {
+                if (ai < la->count) {
+                    prec = (int)arg_signed(la, ai++);
+                }
+                f++;
+            } else {
+                while (*f >= '0' && *f <= '9') {
+                    prec = prec * 10 + (*f++ - '0');
+                }
+            }
+        }
+
+        switch (*f) {
+        case 'h':
+            length = 'h';
+            if (*++f == 'h') {
+                length = 'H';
+                f++;
+            }
+            break;
+        case 'l':
+            length = 'l';
+            if (*++f == 'l') {
+                length = 'q';
+                f++;
+            }
+            break;
+        case 'q':
+        case 'L':
+            length = 'q';
+            f++;
+            break;
+        case 'z':
+        case 'j':
+        case 't':
+            length = *f++;
+            break;
+        default:
+            break;
+        }
+
+        if (*f == 0) {
+            break;
+        }
+
+        char conv = *f++;
+
+        spec[sl++] = '*';
+        spec[sl++] = '.';
+        spec[sl++] = '*';
+        switch (length) {
+        case 'H':
+            spec[sl++] = 'h';
+            spec[sl++] = 'h';
+            break;
+        case 'q':
+            spec[sl++] = 'l';
+            spec[sl++] = 'l';
+            break;
+        case 0:
+            break;
+        default:
+            spec[sl++] = length;
+            break;
+        }
+        spec[sl++] = conv;
+        spec[sl] = 0;
+
+        if (conv == 'n') {
+            ai++;
+            continue;
+        }
+
+        len += format_conv(buf + len, size - len, spec, length, conv, la, &ai,
+                           width, prec);
+    }
+
+    buf[len] = 0;
+
+    return len;
+}
+
+static void out_write(const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t w = write(STDERR_FILENO, buf, len);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+static void out_flush(void)
+{
+    out_write(g_log.out, g_log.outbytes);
+    g_log.outbytes = 0;
+}
+
+static void out_record(const struct log_record *rec)
+{
+    if (LOG_OUT_BYTES - g_log.outbytes < LOG_MSG_BYTES) {
+        out_flush();
+    }
+
+    g_log.outbytes += format_record(g_log.out + g_log.outbytes, LOG_MSG_BYTES,
+                                    rec);
+}
+
+
+/*
+ * ============================================================================
+ * Log thread
+ * ============================================================================
+ */
+
+/**
+ * @brief writes the records that are in the rings
+ *
+ * @return the number of records written
+ *
+ * The rings are merged by the time of their records, records logged while
+ * draining are left for the next round.
+ */
+static size_t log_drain(void)
+{
+    struct log_ring *rings = __atomic_load_n(&g_log.rings, __ATOMIC_ACQUIRE);
+    size_t written = 0;
+    size_t nrings = 0;
+
+    for (struct log_ring *r = rings; r; r = r->next) {
+        nrings++;
+    }
+
+    uint64_t tails[nrings ? nrings : 1];
+    size_t i = 0;
+    for (struct log_ring *r = rings; r; r = r->next) {
+        tails[i++] = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    }
+
+    while (true) {
+        struct log_ring *min = NULL;
+        uint64_t mintime = UINT64_MAX;
+
+        i = 0;
+        for (struct log_ring *r = rings; r; r = r->next, i++) {
+            if (r->head == tails[i]) {
+                continue;
+            }
+            struct log_record *rec = &r->recs[r->head & LOG_RING_MASK];
+            if (rec->time < mintime) {
+                mintime = rec->time;
+                min = r;
+            }
+        }
+
+        if (min == NULL) {
+            break;
+        }
+
+        out_record(&min->recs[min->head & LOG_RING_MASK]);
+        __atomic_store_n(&min->head, min->head + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+
+    for (struct log_ring *r = rings; r; r = r->next) {
+        uint64_t drops = __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+        if (drops != r->dropped) {
+            struct log_record rec = {
+                .func = __FUNCTION__,
+                .line = __LINE__,
+                .format = "dropped %lu messages, the log ring was full\n",
+                .args = { .count = 1, .types = { CAPFS_LOG_ARG_INT | 8 << 4 },
+                          .args = { drops - r->dropped } },
+            };
+            out_record(&rec);
+            r->dropped = drops;
+        }
+    }
+
+    out_flush();
+
+    return written;
+}
+
+/* frees the rings of exited threads once they are empty */
+static void log_reap(void)
+{
+    struct log_ring *prev = NULL;
+    struct log_ring *r = __atomic_load_n(&g_log.rings, __ATOMIC_ACQUIRE);
+
+    while (r) {
+        struct log_ring *next = r->next;
+
+        if (!__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE)
+            || r->head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+            prev = r;
+            r = next;
+            continue;
+        }
+
+        /* new rings are only pushed in front of the head */
+        if (prev) {
+            prev->next = next;
+        } else {
+            struct log_ring *expected = r;
+            if (!__atomic_compare_exchange_n(&g_log.rings, &expected, next,
+                                             false, __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE)) {
+                prev = r;
+                r = next;
+                continue;
+            }
+        }
+
+        free(r);
+        r = next;
+    }
+}
+
+static void *log_thread(void *arg)
+{
+    (void)arg;
+
+    useconds_t idle = LOG_IDLE_MIN_USEC;
+
+    pthread_mutex_lock(&g_log.lock);
+
+    while (true) {
+        uint64_t req = g_log.flush_req;
+        bool stop = g_log.stop;
+        pthread_mutex_unlock(&g_log.lock);
+
+        size_t written = log_drain();
+        log_reap();
+
+        pthread_mutex_lock(&g_log.lock);
+        if (g_log.flush_done != req) {
+            g_log.flush_done = req;
+            pthread_cond_broadcast(&g_log.done);
+        }
+
+        if (stop) {
+            break;
+        }
+
+        /* back off while there is nothing to write */
+        idle = written ? LOG_IDLE_MIN_USEC : idle * 2;
+        if (idle > LOG_IDLE_MAX_USEC) {
+            idle = LOG_IDLE_MAX_USEC;
+        }
+
+        if (g_log.flush_req == req && !g_log.stop) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += (long)idle * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&g_log.kick, &g_log.lock, &ts);
+        }
+    }
+
+    pthread_mutex_unlock(&g_log.lock);
+
+    return NULL;
+}
+
+
+/*
+ * ============================================================================
+ * Public interface
+ * ============================================================================
+ */
+
+void capfs_log_arg(struct capfs_log_args *la, int type, const void *val,
+                   size_t size)
+{
+    if (la->count >= CAPFS_LOG_MAX_ARGS) {
+        return;
+    }
+
+    unsigned i = la->count++;
+    la->args[i] = 0;
+
+    if (type != CAPFS_LOG_ARG_STR) {
+        if (size > sizeof(la->args[i])) {
+            size = sizeof(la->args[i]);
+        }
+        memcpy(&la->args[i], val, size);
+        la->types[i] = (uint8_t)(type | size << 4);
+        return;
+    }
+
+    const char *s;
+    memcpy(&s, val, sizeof(s));
+    if (s == NULL) {
+        s = "(null)";
+    }
+
+    la->types[i] = CAPFS_LOG_ARG_STR;
+    if (la->strbytes >= CAPFS_LOG_STR_BYTES) {
+        la->args[i] = CAPFS_LOG_STR_BYTES;
+        return;
+    }
+
+    /* strings longer than the space left are truncated */
+    size_t left = CAPFS_LOG_STR_BYTES - la->strbytes - 1;
+    size_t len = strnlen(s, left);
+    memcpy(la->strs + la->strbytes, s, len);
+    la->strs[la->strbytes + len] = 0;
+    la->args[i] = la->strbytes;
+    la->strbytes += (uint16_t)(len + 1);
+}
+
+void capfs_log_emit(int level, const char *func, unsigned line,
+                    const char *format, const struct capfs_log_args *la)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t time = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    struct log_ring *ring = NULL;
+
+    if (__atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE)) {
+        ring = ring_get();
+    }
+
+    /* without the log thread, the message is written right away */
+    if (ring == NULL) {
+        struct log_record rec = {
+            .time = time, .func = func, .format = format, .line = line,
+            .level = level, .args = *la,
+        };
+        char buf[LOG_MSG_BYTES];
+        out_write(buf, format_record(buf, sizeof(buf), &rec));
+        return;
+    }
+
+    uint64_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+        >= LOG_RING_ENTRIES) {
+        __atomic_store_n(&ring->drops, ring->drops + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_record *rec = &ring->recs[tail & LOG_RING_MASK];
+    rec->time = time;
+    rec->func = func;
+    rec->format = format;
+    rec->line = line;
+    rec->level = level;
+    memcpy(&rec->args, la, offsetof(struct capfs_log_args, strs)
+                           + la->strbytes);
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* a burst wakes up the log thread early, without taking its lock */
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED)
+        == LOG_RING_ENTRIES / 2) {
+        pthread_cond_signal(&g_log.kick);
+    }
+}
+
+/* parses a log level given by name or number, -1 if invalid */
+static int log_level_parse(const char *s)
+{
+    static const char *names[] = {
+        [CAPFS_LOG_NONE] = "none",
+        [CAPFS_LOG_ERROR] = "error",
+        [CAPFS_LOG_WARN] = "warn",
+        [CAPFS_LOG_INFO] = "info",
+        [CAPFS_LOG_DEBUG] = "debug",
+    };
+
+    for (int l = CAPFS_LOG_NONE; l <= CAPFS_LOG_DEBUG; l++) {
+        if (!strcasecmp(s, names[l])) {
+            return l;
+        }
+    }
+
+    char *end;
+    long l = strtol(s, &end, 10);
+    if (*s == 0 || *end != 0 || l < CAPFS_LOG_NONE || l > CAPFS_LOG_DEBUG) {
+        return -1;
+    }
+
+    return (int)l;
+}
+
+int capfs_log_init(void)
+{
+    const char *env = getenv("CAPFS_LOG_LEVEL");
+    if (env) {
+        int level = log_level_parse(env);
+        if (level < 0) {
+            LOGW("invalid log level '%s', using %d\n", env, capfs_log_level);
+        } else {
+            capfs_log_level = level;
+        }
+    }
+
+    if (CAPFS_LOG_LEVEL < capfs_log_level) {
+        LOGW("log level %d is above the build level %d\n", capfs_log_level,
+             CAPFS_LOG_LEVEL);
+    }
+
+    pthread_mutex_lock(&g_log.lock);
+
+    if (g_log.running) {
+        pthread_mutex_unlock(&g_log.lock);
+        return 0;
+    }
+
+    g_log.stop = false;
+
+    int err = pthread_create(&g_log.thread, NULL, log_thread, NULL);
+    if (err) {
+        pthread_mutex_unlock(&g_log.lock);
+        return -err;
+    }
+
+    __atomic_store_n(&g_log.running, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&g_log.lock);
+
+    atexit(capfs_log_stop);
+
+    return 0;
+}
+
+void capfs_log_flush(void)
+{
+    pthread_mutex_lock(&g_log.lock);
+
+    if (!g_log.running || pthread_equal(pthread_self(), g_log.thread)) {
+        pthread_mutex_unlock(&g_log.lock);
+        return;
+    }
+
+    uint64_t req = ++g_log.flush_req;
+    pthread_cond_signal(&g_log.kick);
+
+    while (g_log.running && g_log.flush_done < req) {
+        pthread_cond_wait(&g_log.done, &g_log.lock);
+    }
+
+    pthread_mutex_unlock(&g_log.lock);
+}
+
+void capfs_log_stop(void)
+{
+    pthread_mutex_lock(&g_log.lock);
+
+    if (!g_log.running) {
+        pthread_mutex_unlock(&g_log.lock);
+        return;
+    }
+
+    /* messages logged from here on are written right away */
+    __atomic_store_n(&g_log.running, false, __ATOMIC_RELEASE);
+    g_log.stop = true;
+    pthread_cond_signal(&g_log.kick);
+    pthread_cond_broadcast(&g_log.done);
+
+    pthread_mutex_unlock(&g_log.lock);
+
+    pthread_join(g_log.thread, NULL);
+}
@@ -44,6 +44,21 @@
 int verbosity = 0;
 
 
+/**
+ * @brief the command line options of the CAP-FS
+ */
+struct capfs_options {
+    const char *image;      ///< path of the backend image
+    int keep;               ///< keep the file system held by the image
+};
+
+static const struct fuse_opt capfs_opts[] = {
+    { "--image=%s", offsetof(struct capfs_options, image), 1 },
+    { "--keep-image", offsetof(struct capfs_options, keep), 1 },
+    FUSE_OPT_END
+};
+
+
 
 
 /**
@@ -78,6 +93,9 @@ static struct fuse_operations capfs_ops = {
         .statfs     = capfs_op_statfs,
         .create     = capfs_op_create,
         .ioctl      = capfs_op_ioctl,
+        .copy_file_range = capfs_op_copy_file_range,
+        .fallocate  = capfs_op_fallocate,
+        .lseek      = capfs_op_lseek,
         .destroy    = capfs_op_destroy,
 };
 
@@ -95,6 +113,24 @@ struct cap_fs capfs_st;
 int main(int argc, char * argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    /* the file system is formatted in the image unless it is kept */
+    struct capfs_options opts = { .image = NULL, .keep = 0 };
+    if (fuse_opt_parse(&args, &opts, capfs_opts, NULL) == -1) {
+        return EXIT_FAILURE;
+    }
+    capfs_backend_set_image(opts.image, opts.keep);
+
+    /* records all operations for capfs-replay */
+    const char *trace = getenv(CAPFS_TRACE_ENV);
+    if (trace) {
+        int err = capfs_trace_start(trace, &capfs_ops);
+        if (err) {
+            LOGE("ERROR - recording to '%s' failed with %i\n", trace, err);
+            return EXIT_FAILURE;
+        }
+        LOGI("recording the operations to '%s'\n", trace);
+    }
+
     LOG("%s", "-----------------------------------------------\n");
     LOG("CAP-FS version %s\n", PACKAGE_VERSION);
     LOG("FUSE library version %s\n", fuse_pkgversion());
@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * capfs-replay: replays a trace recorded with CAPFS_TRACE=<file> against the
+ * file system and the backend, without FUSE and without a mount.
+ */
+
+#include <capfs_internal.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/**
+ * @brief the state of the replay
+ */
+static struct {
+    GHashTable *handles;            ///< recorded file handle -> fuse_file_info
+    char *buf;                      ///< buffer of reads and writes
+    size_t bufsize;                 ///< size of the buffer
+    uint64_t ops;                   ///< replayed operations
+    uint64_t skipped;               ///< operations that cannot be replayed
+    uint64_t mismatched;            ///< results that differ from the trace
+    uint64_t recorded;              ///< total latency in the trace
+} g_replay;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i image] [-k] [-t] [-v] trace\n"
+                    "  -i  the backend image\n"
+                    "  -k  keep the file system held by the image\n"
+                    "  -t  replay at the original timing, "
+                    "default is full speed\n"
+                    "  -v  print the operations whose results differ\n",
+            prog);
+}
+
+/* the file info for a recorded handle, a fresh one if it is not open */
+static struct fuse_file_info *replay_fi(uint64_t fh, struct fuse_file_info *tmp)
+{
+    memset(tmp, 0, sizeof(*tmp));
+
+    if (fh == 0) {
+        return tmp;
+    }
+
+    struct fuse_file_info *fi = g_hash_table_lookup(g_replay.handles, &fh);
+
+    return fi ? fi : tmp;
+}
+
+/* remembers the handle an open handed out under its recorded value */
+static void replay_opened(const struct capfs_trace_record *rec,
+                          const struct fuse_file_info *fi)
+{
+    if (rec->result != 0 || rec->fh == 0) {
+        return;
+    }
+
+    guint64 *key = g_new(guint64, 1);
+    *key = rec->fh;
+
+    struct fuse_file_info *copy = g_new(struct fuse_file_info, 1);
+    *copy = *fi;
+
+    g_hash_table_replace(g_replay.handles, key, copy);
+}
+
+static void replay_released(const struct capfs_trace_record *rec)
+{
+    uint64_t fh = rec->fh;
+    g_hash_table_remove(g_replay.handles, &fh);
+}
+
+/* a buffer for reads and writes of a size */
+static char *replay_buf(size_t size)
+{
+    if (size > g_replay.bufsize) {
+        char *buf = realloc(g_replay.buf, size);
+        if (buf == NULL) {
+            return NULL;
+        }
+        /* written data is not recorded, writes store a pattern */
+        memset(buf + g_replay.bufsize, 0xca, size - g_replay.bufsize);
+        g_replay.buf = buf;
+        g_replay.bufsize = size;
+    }
+
+    return g_replay.buf;
+}
+
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf,
+                         off_t off, enum fuse_fill_dir_flags flags)
+{
+    (void)buf;
+    (void)name;
+    (void)stbuf;
+    (void)off;
+    (void)flags;
+
+    return 0;
+}
+
+/**
+ * @brief replays a recorded operation
+ *
+ * @param rec   the record
+ * @param path  the path of the operation
+ * @param path2 the second path of the operation
+ * @param res   returns the result of the replayed operation
+ *
+ * @return 0 if replayed, -ENOTSUP if the operation is not replayed
+ */
+static int replay_op(const struct capfs_trace_record *rec, const char *path,
+                     const char *path2, int64_t *res)
+{
+    struct fuse_file_info tmp, tmp2;
+    struct fuse_file_info *fi = replay_fi(rec->fh, &tmp);
+    struct stat st;
+    struct statvfs stv;
+    struct timespec tv[2];
+    char *buf;
+
+    /* scraping the statistics is not part of the workload */
+    if (capfs_stats_path(path) != CAPFS_STATS_PATH_NONE) {
+        return -ENOTSUP;
+    }
+
+    switch (rec->op) {
+        case CAPFS_STATS_OP_GETATTR:
+            *res = capfs_op_getattr(path, &st, rec->fh ? fi : NULL);
+            break;
+        case CAPFS_STATS_OP_ACCESS:
+            *res = capfs_op_access(path, rec->arg);
+            break;
+        case CAPFS_STATS_OP_OPENDIR:
+            tmp.flags = rec->arg;
+            *res = capfs_op_opendir(path, &tmp);
+            replay_opened(rec, &tmp);
+            break;
+        case CAPFS_STATS_OP_READDIR:
+            /* the entries are dropped by the filler */
+            *res = capfs_op_readdir(path, &st, replay_filler, rec->offset, fi,
+                                    rec->arg);
+            break;
+        case CAPFS_STATS_OP_RELEASEDIR:
+            *res = capfs_op_releasedir(path, fi);
+            replay_released(rec);
+            break;
+        case CAPFS_STATS_OP_READLINK:
+            if ((buf = replay_buf(rec->size)) == NULL) {
+                return -ENOMEM;
+            }
+            *res = capfs_op_readlink(path, buf, rec->size);
+            break;
+        case CAPFS_STATS_OP_MKNOD:
+            *res = capfs_op_mknod(path, rec->arg, rec->offset);
+            break;
+        case CAPFS_STATS_OP_MKDIR:
+            *res = capfs_op_mkdir(path, rec->arg);
+            break;
+        case CAPFS_STATS_OP_SYMLINK:
+            *res = capfs_op_symlink(path, path2);
+            break;
+        case CAPFS_STATS_OP_UNLINK:
+            *res = capfs_op_unlink(path);
+            break;
+        case CAPFS_STATS_OP_RMDIR:
+            *res = capfs_op_rmdir(path);
+            break;
+        case CAPFS_STATS_OP_RENAME:
+            *res = capfs_op_rename(path, path2, rec->arg);
+            break;
+        case CAPFS_STATS_OP_LINK:
+            *res = capfs_op_link(path, path2);
+            break;
+        case CAPFS_STATS_OP_CHMOD:
+            *res = capfs_op_chmod(path, rec->arg, rec->fh ? fi : NULL);
+            break;
+        case CAPFS_STATS_OP_CHOWN:
+            *res = capfs_op_chown(path, rec->arg, rec->arg2,
+                                  rec->fh ? fi : NULL);
+            break;
+        case CAPFS_STATS_OP_TRUNCATE:
+            *res = capfs_op_truncate(path, rec->offset, rec->fh ? fi : NULL);
+            break;
+        case CAPFS_STATS_OP_UTIMENS:
+            tv[0].tv_sec = rec->offset;
+            tv[0].tv_nsec = rec->arg;
+            tv[1].tv_sec = rec->offset2;
+            tv[1].tv_nsec = rec->arg2;
+            *res = capfs_op_utimens(path, tv, rec->fh ? fi : NULL);
+            break;
+        case CAPFS_STATS_OP_OPEN:
+            tmp.flags = rec->arg;
+            *res = capfs_op_open(path, &tmp);
+            replay_opened(rec, &tmp);
+            break;
+        case CAPFS_STATS_OP_FLUSH:
+            *res = capfs_op_flush(path, fi);
+            break;
+        case CAPFS_STATS_OP_FSYNC:
+            *res = capfs_op_fsync(path, rec->arg, fi);
+            break;
+        case CAPFS_STATS_OP_RELEASE:
+            *res = capfs_op_release(path, fi);
+            replay_released(rec);
+            break;
+        case CAPFS_STATS_OP_READ:
+            if ((buf = replay_buf(rec->size)) == NULL) {
+                return -ENOMEM;
+            }
+            *res = capfs_op_read(path, buf, rec->size, rec->offset, fi);
+            break;
+        case CAPFS_STATS_OP_WRITE:
+            if ((buf = replay_buf(rec->size)) == NULL) {
+                return -ENOMEM;
+            }
+            *res = capfs_op_write(path, buf, rec->size, rec->offset, fi);
+            break;
+        case CAPFS_STATS_OP_STATFS:
+            *res = capfs_op_statfs(path, &stv);
+            break;
+        case CAPFS_STATS_OP_CREATE:
+            tmp.flags = rec->arg2;
+            *res = capfs_op_create(path, rec->arg, &tmp);
+            replay_opened(rec, &tmp);
+            break;
+        case CAPFS_STATS_OP_COPY_FILE_RANGE:
+            *res = capfs_op_copy_file_range(path, fi, rec->offset, path2,
+                                            replay_fi(rec->fh2, &tmp2),
+                                            rec->offset2, rec->size,
+                                            rec->arg);
+            break;
+        case CAPFS_STATS_OP_FALLOCATE:
+            *res = capfs_op_fallocate(path, rec->arg, rec->offset, rec->size,
+                                      fi);
+            break;
+        case CAPFS_STATS_OP_LSEEK:
+            *res = capfs_op_lseek(path, rec->offset, rec->arg, fi);
+            break;
+        default:
+            /* ioctls pass memory of the client */
+            return -ENOTSUP;
+    }
+
+    return 0;
+}
+
+/* reads a path of a record */
+static int replay_path(FILE *f, uint16_t len, char *path)
+{
+    if (len && fread(path, len, 1, f) != 1) {
+        return -EIO;
+    }
+
+    path[len] = 0;
+
+    return 0;
+}
+
+static void replay_wait(uint64_t begin, uint64_t start)
+{
+    uint64_t now = capfs_stats_now() - begin;
+    if (now >= start) {
+        return;
+    }
+
+    struct timespec ts = {
+        .tv_sec = (start - now) / 1000000000,
+        .tv_nsec = (start - now) % 1000000000,
+    };
+    while (nanosleep(&ts, &ts) && errno == EINTR) {
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool timing = false, verbose = false, keep = false;
+    const char *image = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:ktvh")) != -1) {
+        switch (opt) {
+            case 'i':
+                image = optarg;
+                break;
+            case 'k':
+                keep = true;
+                break;
+            case 't':
+                timing = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *f = fopen(argv[optind], "r");
+    if (f == NULL) {
+        fprintf(stderr, "cannot open '%s': %s\n", argv[optind],
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct capfs_trace_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CAPFS_TRACE_MAGIC
+        || hdr.version != CAPFS_TRACE_VERSION
+        || hdr.recsize != sizeof(struct capfs_trace_record)) {
+        fprintf(stderr, "'%s' is not a trace of this version\n", argv[optind]);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+
+    struct fuse_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    capfs_backend_set_image(image, keep);
+    void *private_data = capfs_op_init(NULL, &cfg);
+
+    g_replay.handles = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             g_free, g_free);
+
+    /* the statistics show the replay only */
+    capfs_stats_reset();
+
+    static char path[UINT16_MAX + 1], path2[UINT16_MAX + 1];
+    struct capfs_trace_record rec;
+    uint64_t begin = capfs_stats_now();
+    uint64_t last = 0;
+    int err = 0;
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (replay_path(f, rec.pathlen, path)
+            || replay_path(f, rec.path2len, path2)) {
+            err = -EIO;
+            break;
+        }
+
+        if (timing) {
+            replay_wait(begin, rec.start);
+        }
+
+        int64_t res;
+        if (replay_op(&rec, path, path2, &res)) {
+            g_replay.skipped++;
+            continue;
+        }
+
+        g_replay.ops++;
+        g_replay.recorded += rec.latency;
+        last = rec.start + rec.latency;
+
+        if (res != rec.result) {
+            g_replay.mismatched++;
+            if (verbose) {
+                fprintf(stderr, "%s '%s' '%s': %" PRId64 " recorded %" PRId64
+                        "\n", capfs_stats_name(rec.op), path, path2, res,
+                        rec.result);
+            }
+        }
+    }
+
+    uint64_t elapsed = capfs_stats_now() - begin;
+
+    if (err || ferror(f)) {
+        fprintf(stderr, "the trace is truncated\n");
+    }
+    fclose(f);
+
+    size_t len;
+    char *stats = capfs_stats_render(&len);
+    if (stats) {
+        fwrite(stats, 1, len, stdout);
+        free(stats);
+    }
+
+    printf("# replayed %" PRIu64 " operations in %" PRIu64 " ns, "
+           "recorded over %" PRIu64 " ns\n"
+           "# %" PRIu64 " ns spent in the operations when recorded\n"
+           "# %" PRIu64 " skipped, %" PRIu64 " with a different result\n",
+           g_replay.ops, elapsed, last, g_replay.recorded, g_replay.skipped,
+           g_replay.mismatched);
+
+    g_hash_table_destroy(g_replay.handles);
+    free(g_replay.buf);
+
+    capfs_op_destroy(private_data);
+
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+
+#include <capfs_internal.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*
+ * ============================================================================
+ * Ring layout
+ * ============================================================================
+ */
+
+#define RING_ALIGN(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+#define RING_SQ_OFFSET   RING_ALIGN(sizeof(struct capfs_ring_hdr), 4096)
+#define RING_CQ_OFFSET   RING_ALIGN(RING_SQ_OFFSET + CAPFS_RING_ENTRIES \
+                                    * sizeof(struct capfs_ring_sqe), 64)
+#define RING_DATA_OFFSET RING_ALIGN(RING_CQ_OFFSET + CAPFS_RING_ENTRIES \
+                                    * sizeof(struct capfs_ring_cqe), 4096)
+#define RING_SIZE        (RING_DATA_OFFSET + CAPFS_RING_DATA_SIZE)
+
+#define RING_MASK (CAPFS_RING_ENTRIES - 1)
+
+/// the number of submissions copied out of the ring at once
+#define RING_BATCH 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RING_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define RING_CPU_RELAX() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/**
+ * @brief the daemon side of a ring
+ */
+struct ring {
+    struct ring            *next;       ///< next ring in the list
+    pid_t                   client;     ///< the process id of the client
+    pthread_t               thread;     ///< the worker of the ring
+    int                     memfd;      ///< the shared memory
+    int                     sq_event;   ///< wakes up the worker
+    int                     cq_event;   ///< wakes up the client
+    int                     pidfd;      ///< becomes readable on client exit
+    void                   *mem;        ///< the mapped shared memory
+    struct capfs_ring_hdr  *hdr;        ///< the ring header
+    struct capfs_ring_sqe  *sqes;       ///< the submission queue
+    struct capfs_ring_cqe  *cqes;       ///< the completion queue
+    char                   *data;       ///< the data area
+    uint64_t                spin;       ///< current spin time in microseconds
+    _Atomic bool            stop;       ///< the daemon shuts down
+    _Atomic bool            done;       ///< the worker has finished
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings;
+
+
+static inline uint64_t ring_now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ring_free(struct ring *r)
+{
+    if (r->mem && r->mem != MAP_FAILED) {
+        munmap(r->mem, RING_SIZE);
+    }
+    if (r->memfd >= 0) {
+        close(r->memfd);
+    }
+    if (r->sq_event >= 0) {
+        close(r->sq_event);
+    }
+    if (r->cq_event >= 0) {
+        close(r->cq_event);
+    }
+    if (r->pidfd >= 0) {
+        close(r->pidfd);
+    }
+    free(r);
+}
+
+
+/*
+ * ============================================================================
+ * Ring worker
+ * ============================================================================
+ */
+
+/**
+ * @brief checks that a buffer lies within the data area of the ring
+ */
+static inline bool ring_buf_valid(const struct capfs_ring_sqe *sqe)
+{
+    return sqe->buf <= CAPFS_RING_DATA_SIZE
+           && sqe->length <= CAPFS_RING_DATA_SIZE - sqe->buf;
+}
+
+/**
+ * @brief executes a submission against the backend
+ */
+static void ring_execute(struct ring *r, const struct capfs_ring_sqe *sqe,
+                         struct capfs_ring_cqe *cqe)
+{
+    cqe->user_data = sqe->user_data;
+    cqe->cap.capaddr = 0;
+
+    if (sqe->flags || sqe->offset > INT64_MAX) {
+        cqe->res = -EINVAL;
+        return;
+    }
+
+    switch (sqe->op) {
+        case CAPFS_RING_OP_NOP:
+            cqe->res = 0;
+            break;
+        case CAPFS_RING_OP_READ:
+            if (!ring_buf_valid(sqe)) {
+                cqe->res = -EFAULT;
+                break;
+            }
+            cqe->res = capfs_backend_read(sqe->cap, sqe->offset,
+                                          r->data + sqe->buf, sqe->length);
+            break;
+        case CAPFS_RING_OP_WRITE:
+            if (!ring_buf_valid(sqe)) {
+                cqe->res = -EFAULT;
+                break;
+            }
+            cqe->res = capfs_backend_write(sqe->cap, sqe->offset,
+                                           r->data + sqe->buf, sqe->length);
+            break;
+        case CAPFS_RING_OP_GET_CAP:
+            cqe->res = capfs_backend_get_cap(sqe->cap, sqe->offset, &cqe->cap);
+            break;
+        case CAPFS_RING_OP_PUT_CAP:
+            cqe->res = capfs_backend_put_cap(sqe->cap, sqe->offset, sqe->arg);
+            break;
+        default:
+            cqe->res = -EINVAL;
+            break;
+    }
+}
+
+/**
+ * @brief executes a run of reads or writes with one vectored request
+ *
+ * @return the number of submissions executed
+ *
+ * If the vectored request fails, the submissions are executed one by one to
+ * obtain the result of each.
+ */
+static uint32_t ring_execute_vec(struct ring *r, const struct capfs_ring_sqe *sqes,
+                                 uint32_t count, struct capfs_ring_cqe *cqes)
+{
+    struct capfs_backend_iovec iov[RING_BATCH];
+
+    uint32_t op = sqes[0].op;
+    uint32_t n = 0;
+    long total = 0;
+    while (n < count && sqes[n].op == op && !sqes[n].flags
+           && sqes[n].offset <= INT64_MAX && ring_buf_valid(&sqes[n])) {
+        iov[n].cap = sqes[n].cap;
+        iov[n].offset = sqes[n].offset;
+        iov[n].buf = r->data + sqes[n].buf;
+        iov[n].bytes = sqes[n].length;
+        total += sqes[n].length;
+        n++;
+    }
+
+    if (n < 2) {
+        ring_execute(r, &sqes[0], &cqes[0]);
+        return 1;
+    }
+
+    long res = (op == CAPFS_RING_OP_READ) ? capfs_backend_readv(iov, n)
+                                          : capfs_backend_writev(iov, n);
+    for (uint32_t i = 0; i < n; i++) {
+        if (res == total) {
+            cqes[i].user_data = sqes[i].user_data;
+            cqes[i].res = sqes[i].length;
+            cqes[i].cap.capaddr = 0;
+        } else {
+            ring_execute(r, &sqes[i], &cqes[i]);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * @brief the capabilities written by the submissions of a batch
+ *
+ * The kernel caches the pages and attributes of files, so the files changed
+ * by a batch are notified once it is done.
+ */
+struct ring_written {
+    capfs_capref_t caps[RING_BATCH];    ///< distinct written capabilities
+    uint32_t count;                     ///< number of capabilities
+};
+
+/* notifies the kernel of the files changed through the written capabilities */
+static void ring_written_flush(struct ring_written *w)
+{
+    capfs_capref_t files[RING_BATCH];
+    uint32_t nfiles = 0;
+
+    for (uint32_t i = 0; i < w->count; i++) {
+        capfs_capref_t file;
+        if (capfs_index_lookup(w->caps[i], &file, NULL, NULL)) {
+            continue;
+        }
+
+        uint32_t j = 0;
+        while (j < nfiles && files[j].capaddr != file.capaddr) {
+            j++;
+        }
+        if (j == nfiles) {
+            files[nfiles++] = file;
+            capfs_inval_file(file);
+        }
+    }
+
+    w->count = 0;
+}
+
+/* notes the capability a successful write or capability store changed */
+static void ring_written_add(struct ring_written *w,
+                             const struct capfs_ring_sqe *sqe,
+                             const struct capfs_ring_cqe *cqe)
+{
+    if (cqe->res < 0 || (sqe->op != CAPFS_RING_OP_WRITE
+                         && sqe->op != CAPFS_RING_OP_PUT_CAP)) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < w->count; i++) {
+        if (w->caps[i].capaddr == sqe->cap.capaddr) {
+            return;
+        }
+    }
+
+    if (w->count == RING_BATCH) {
+        ring_written_flush(w);
+    }
+
+    w->caps[w->count++] = sqe->cap;
+}
+
+/**
+ * @brief executes all pending submissions
+ *
+ * @return the number of executed submissions
+ */
+static uint32_t ring_process(struct ring *r)
+{
+    struct capfs_ring_hdr *hdr = r->hdr;
+
+    uint32_t head = hdr->sq_head;
+    uint32_t tail = __atomic_load_n(&hdr->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t cq_tail = hdr->cq_tail;
+    uint32_t cq_head = __atomic_load_n(&hdr->cq_head, __ATOMIC_ACQUIRE);
+
+    struct capfs_ring_sqe sqes[RING_BATCH];
+    struct capfs_ring_cqe cqes[RING_BATCH];
+    struct ring_written written = { .count = 0 };
+
+    uint32_t n = 0;
+    while (head != tail && cq_tail - cq_head < CAPFS_RING_ENTRIES) {
+        uint32_t count = tail - head;
+        uint32_t room = CAPFS_RING_ENTRIES - (cq_tail - cq_head);
+        if (count > room) {
+            count = room;
+        }
+        if (count > RING_BATCH) {
+            count = RING_BATCH;
+        }
+
+        /* the client may still write the entries, work on a copy */
+        for (uint32_t i = 0; i < count; i++) {
+            sqes[i] = r->sqes[(head + i) & RING_MASK];
+        }
+
+        for (uint32_t i = 0; i < count;) {
+            if (sqes[i].op == CAPFS_RING_OP_READ
+                || sqes[i].op == CAPFS_RING_OP_WRITE) {
+                i += ring_execute_vec(r, &sqes[i], count - i, &cqes[i]);
+            } else {
+                ring_execute(r, &sqes[i], &cqes[i]);
+                i++;
+            }
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            r->cqes[(cq_tail + i) & RING_MASK] = cqes[i];
+            ring_written_add(&written, &sqes[i], &cqes[i]);
+        }
+
+        head += count;
+        cq_tail += count;
+        n += count;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    ring_written_flush(&written);
+
+    __atomic_store_n(&hdr->sq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->cq_tail, cq_tail, __ATOMIC_RELEASE);
+
+    /* pairs with the fence of the client setting CQ_NEED_WAKEUP */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->flags, __ATOMIC_RELAXED) & CAPFS_RING_CQ_NEED_WAKEUP) {
+        uint64_t one = 1;
+        if (write(r->cq_event, &one, sizeof(one)) < 0) {
+            LOGW("WARNING: waking up the client failed with %i\n", errno);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * @brief blocks until the client submits, exits or the daemon stops
+ *
+ * @return true if the worker should continue
+ */
+static bool ring_sleep(struct ring *r)
+{
+    struct capfs_ring_hdr *hdr = r->hdr;
+
+    __atomic_fetch_or(&hdr->flags, CAPFS_RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+
+    /* a submission may have raced with setting the flag */
+    if (__atomic_load_n(&hdr->sq_tail, __ATOMIC_ACQUIRE) != hdr->sq_head) {
+        __atomic_fetch_and(&hdr->flags, ~CAPFS_RING_SQ_NEED_WAKEUP,
+                           __ATOMIC_RELAXED);
+        return true;
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = r->sq_event, .events = POLLIN },
+        { .fd = r->pidfd,    .events = POLLIN },
+    };
+
+    uint64_t start = ring_now_usec();
+    int ret = poll(fds, (r->pidfd >= 0) ? 2 : 1, -1);
+
+    __atomic_fetch_and(&hdr->flags, ~CAPFS_RING_SQ_NEED_WAKEUP, __ATOMIC_RELAXED);
+
+    if (ret < 0 && errno != EINTR) {
+        return false;
+    }
+
+    if (fds[1].revents) {
+        LOG("client of ring %p has exited\n", (void *)r);
+        return false;
+    }
+
+    if (fds[0].revents & POLLIN) {
+        uint64_t cnt;
+        if (read(r->sq_event, &cnt, sizeof(cnt)) < 0) {
+            return false;
+        }
+    }
+
+    /* a client that submits right after we went to sleep wants us spinning */
+    if (ring_now_usec() - start < r->spin) {
+        r->spin = r->spin * 2 > CAPFS_RING_SPIN_MAX_USEC
+                      ? CAPFS_RING_SPIN_MAX_USEC : r->spin * 2;
+    } else {
+        r->spin = r->spin / 2 < CAPFS_RING_SPIN_MIN_USEC
+                      ? CAPFS_RING_SPIN_MIN_USEC : r->spin / 2;
+    }
+
+    return true;
+}
+
+static void *ring_worker(void *arg)
+{
+    struct ring *r = arg;
+
+    uint64_t last = ring_now_usec();
+    while (!r->stop) {
+        if (__atomic_load_n(&r->hdr->flags, __ATOMIC_ACQUIRE) & CAPFS_RING_SHUTDOWN) {
+            break;
+        }
+
+        if (ring_process(r)) {
+            last = ring_now_usec();
+            continue;
+        }
+
+        if (ring_now_usec() - last < r->spin) {
+            RING_CPU_RELAX();
+            continue;
+        }
+
+        if (!ring_sleep(r)) {
+            break;
+        }
+        last = ring_now_usec();
+    }
+
+    /* tell a waiting client that no more completions will arrive */
+    __atomic_fetch_or(&r->hdr->flags, CAPFS_RING_SHUTDOWN, __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    if (write(r->cq_event, &one, sizeof(one)) < 0) {
+        LOGW("WARNING: waking up the client failed with %i\n", errno);
+    }
+
+    r->done = true;
+
+    return NULL;
+}
+
+
+/*
+ * ============================================================================
+ * Ring management
+ * ============================================================================
+ */
+
+/**
+ * @brief frees the rings whose workers have finished, must hold the lock
+ */
+static void ring_reap(bool all)
+{
+    struct ring **prev = &rings;
+    while (*prev) {
+        struct ring *r = *prev;
+        if (!all && !r->done) {
+            prev = &r->next;
+            continue;
+        }
+
+        *prev = r->next;
+
+        r->stop = true;
+        uint64_t one = 1;
+        if (write(r->sq_event, &one, sizeof(one)) < 0) {
+            LOGW("WARNING: waking up ring %p failed\n", (void *)r);
+        }
+        pthread_join(r->thread, NULL);
+
+        ring_free(r);
+    }
+}
+
+/**
+ * @brief checks whether a client may set up another ring, must hold the lock
+ */
+static bool ring_admit(pid_t client)
+{
+    uint32_t total = 0, own = 0;
+    for (struct ring *r = rings; r; r = r->next) {
+        total++;
+        if (r->client == client) {
+            own++;
+        }
+    }
+
+    return total < CAPFS_RING_MAX && own < CAPFS_RING_MAX_PER_CLIENT;
+}
+
+/**
+ * @brief creates a ring for a client and starts its worker
+ *
+ * @param client    the process id of the client
+ * @param res       returns the descriptors of the ring
+ *
+ * @return ERR_OK on success, error value on failure
+ */
+int capfs_ring_create(pid_t client, union capfs_ioctl_res *res)
+{
+    int err;
+
+    /* held until the ring is in the list, so the limits cannot be raced */
+    pthread_mutex_lock(&rings_lock);
+
+    ring_reap(false);
+
+    if (!ring_admit(client)) {
+        pthread_mutex_unlock(&rings_lock);
+        LOGW("client %i has too many rings\n", (int)client);
+        return -EBUSY;
+    }
+
+    struct ring *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        pthread_mutex_unlock(&rings_lock);
+        return -ENOMEM;
+    }
+
+    r->client = client;
+    r->memfd = r->sq_event = r->cq_event = r->pidfd = -1;
+    r->spin = CAPFS_RING_SPIN_MIN_USEC;
+
+    r->memfd = memfd_create("capfs-ring", MFD_CLOEXEC);
+    r->sq_event = eventfd(0, EFD_CLOEXEC);
+    r->cq_event = eventfd(0, EFD_CLOEXEC);
+    if (r->memfd < 0 || r->sq_event < 0 || r->cq_event < 0) {
+        err = -errno;
+        goto err_out;
+    }
+
+#ifdef SYS_pidfd_open
+    /* without pidfds the ring lives until the client shuts it down */
+    r->pidfd = syscall(SYS_pidfd_open, client, 0);
+#endif
+
+    if (ftruncate(r->memfd, RING_SIZE)) {
+        err = -errno;
+        goto err_out;
+    }
+
+    r->mem = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  r->memfd, 0);
+    if (r->mem == MAP_FAILED) {
+        err = -errno;
+        goto err_out;
+    }
+
+    r->hdr = r->mem;
+    r->sqes = (void *)((char *)r->mem + RING_SQ_OFFSET);
+    r->cqes = (void *)((char *)r->mem + RING_CQ_OFFSET);
+    r->data = (char *)r->mem + RING_DATA_OFFSET;
+
+    r->hdr->entries = CAPFS_RING_ENTRIES;
+    r->hdr->sq_offset = RING_SQ_OFFSET;
+    r->hdr->cq_offset = RING_CQ_OFFSET;
+    r->hdr->data_offset = RING_DATA_OFFSET;
+    r->hdr->data_size = CAPFS_RING_DATA_SIZE;
+
+    if ((err = -pthread_create(&r->thread, NULL, ring_worker, r))) {
+        goto err_out;
+    }
+
+    r->next = rings;
+    rings = r;
+
+    pthread_mutex_unlock(&rings_lock);
+
+    LOG("created ring %p for client %i\n", (void *)r, (int)client);
+
+    res->ring_setup.pid = getpid();
+    res->ring_setup.fd = r->memfd;
+    res->ring_setup.sq_event = r->sq_event;
+    res->ring_setup.cq_event = r->cq_event;
+    res->ring_setup.size = RING_SIZE;
+
+    return 0;
+
+err_out:
+    pthread_mutex_unlock(&rings_lock);
+    ring_free(r);
+    return err;
+}
+
+/**
+ * @brief stops the workers of all rings and frees them
+ */
+void capfs_ring_shutdown_all(void)
+{
+    pthread_mutex_lock(&rings_lock);
+    ring_reap(true);
+    pthread_mutex_unlock(&rings_lock);
+}
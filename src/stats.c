@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* sched_getcpu() */
+
+#include <capfs_internal.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/*
+ * ============================================================================
+ * Histograms
+ * ============================================================================
+ *
+ * Latencies go into log-linear buckets: values below 2^STATS_SUB_BITS have a
+ * bucket each, above that every power of two is split into 2^STATS_SUB_BITS
+ * buckets, so a bucket is within 1/2^STATS_SUB_BITS of its values.
+ */
+
+/// the number of buckets per power of two, as a power of two
+#define STATS_SUB_BITS 4
+
+/// latencies from 2^STATS_MAX_BITS ns (about 68s) share the last bucket
+#define STATS_MAX_BITS 36
+
+/// the number of buckets of a histogram
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+/// the maximum number of shards, CPUs beyond share them
+#define STATS_MAX_SHARDS 64
+
+/// the reported percentiles, in parts per thousand
+static const unsigned stats_pcts[] = { 500, 900, 990, 999 };
+
+#define STATS_NPCTS (sizeof(stats_pcts) / sizeof(stats_pcts[0]))
+
+/**
+ * @brief the latencies of an operation
+ */
+struct stats_hist {
+    uint64_t count;                     ///< number of calls
+    uint64_t sum;                       ///< total latency
+    uint64_t max;                       ///< maximum latency
+    uint64_t buckets[STATS_BUCKETS];    ///< calls per latency bucket
+};
+
+/**
+ * @brief the statistics recorded on a CPU
+ */
+struct stats_shard {
+    struct stats_hist ops[CAPFS_STATS_MAX];
+} __attribute__((aligned(CAPFS_CACHELINE_SIZE)));
+
+/**
+ * @brief the shards of the statistics
+ */
+static struct {
+    struct stats_shard *shards;     ///< one per CPU
+    unsigned nshards;               ///< number of shards
+} g_stats;
+
+static const char *stats_names[] = {
+#define CAPFS_STATS_NAME(id, probe, name) name,
+    CAPFS_STATS_LIST(CAPFS_STATS_NAME)
+#undef CAPFS_STATS_NAME
+};
+
+static unsigned stats_bucket(uint64_t ns)
+{
+    if (ns < (1UL << STATS_SUB_BITS)) {
+        return (unsigned)ns;
+    }
+
+    unsigned e = 63 - __builtin_clzl(ns);
+    if (e >= STATS_MAX_BITS) {
+        return STATS_BUCKETS - 1;
+    }
+
+    return ((e - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+           | ((ns >> (e - STATS_SUB_BITS)) & ((1UL << STATS_SUB_BITS) - 1));
+}
+
+/* the highest latency that falls into a bucket */
+static uint64_t stats_bucket_top(unsigned b)
+{
+    if (b < (1U << STATS_SUB_BITS)) {
+        return b;
+    }
+
+    unsigned e = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t sub = b & ((1UL << STATS_SUB_BITS) - 1);
+
+    return (((sub | (1UL << STATS_SUB_BITS)) + 1) << (e - STATS_SUB_BITS)) - 1;
+}
+
+void capfs_stats_record(enum capfs_stats_id id, uint64_t ns)
+{
+    struct stats_shard *shards = __atomic_load_n(&g_stats.shards,
+                                                 __ATOMIC_ACQUIRE);
+    if (shards == NULL) {
+        return;
+    }
+
+    /* threads may migrate, so the shards are updated atomically */
+    int cpu = sched_getcpu();
+    struct stats_hist *h = &shards[(unsigned)(cpu < 0 ? 0 : cpu)
+                                   % g_stats.nshards].ops[id];
+
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max
+           && !__atomic_compare_exchange_n(&h->max, &max, ns, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+/*
+ * ============================================================================
+ * Public interface
+ * ============================================================================
+ */
+
+int capfs_stats_init(void)
+{
+    if (g_stats.shards) {
+        return 0;
+    }
+
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpus < 1) {
+        ncpus = 1;
+    }
+    if (ncpus > STATS_MAX_SHARDS) {
+        ncpus = STATS_MAX_SHARDS;
+    }
+
+    /* zeroed pages are mapped on first use, idle CPUs cost no memory */
+    struct stats_shard *shards = mmap(NULL, ncpus * sizeof(*shards),
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (shards == MAP_FAILED) {
+        return -ENOMEM;
+    }
+
+    g_stats.nshards = (unsigned)ncpus;
+    __atomic_store_n(&g_stats.shards, shards, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void capfs_stats_reset(void)
+{
+    if (g_stats.shards == NULL) {
+        return;
+    }
+
+    /* calls in progress may be counted in part */
+    for (unsigned s = 0; s < g_stats.nshards; s++) {
+        for (unsigned i = 0; i < CAPFS_STATS_MAX; i++) {
+            struct stats_hist *h = &g_stats.shards[s].ops[i];
+            __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+            for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+                __atomic_store_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/* merges the shards of an operation */
+static void stats_merge(enum capfs_stats_id id, struct stats_hist *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+
+    for (unsigned s = 0; g_stats.shards && s < g_stats.nshards; s++) {
+        struct stats_hist *h = &g_stats.shards[s].ops[id];
+        sum->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        sum->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        if (max > sum->max) {
+            sum->max = max;
+        }
+        for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+            sum->buckets[b] += __atomic_load_n(&h->buckets[b],
+                                               __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* the latency below which a share of the calls completed */
+static uint64_t stats_percentile(const struct stats_hist *h, unsigned pct)
+{
+    /* the bucket counts may be ahead of the call count */
+    uint64_t total = 0;
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+        total += h->buckets[b];
+    }
+
+    uint64_t rank = (total * pct + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen && seen >= rank) {
+            uint64_t top = stats_bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+
+    return 0;
+}
+
+char *capfs_stats_render(size_t *size)
+{
+    size_t cap = (CAPFS_STATS_MAX + 2) * 160;
+    char *buf = malloc(cap);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    struct stats_hist *h = malloc(sizeof(*h));
+    if (h == NULL) {
+        free(buf);
+        return NULL;
+    }
+
+    size_t len = snprintf(buf, cap, "# latencies in nanoseconds\n"
+                          "%-24s %12s %12s %10s %10s %10s %10s %10s %12s\n",
+                          "# op", "count", "mean", "p50", "p90", "p99",
+                          "p999", "max", "total");
+
+    for (unsigned i = 0; i < CAPFS_STATS_MAX; i++) {
+        stats_merge(i, h);
+
+        uint64_t p[STATS_NPCTS];
+        for (unsigned j = 0; j < STATS_NPCTS; j++) {
+            p[j] = stats_percentile(h, stats_pcts[j]);
+        }
+
+        len += snprintf(buf + len, cap - len,
+                        "%-24s %12lu %12lu %10lu %10lu %10lu %10lu %10lu "
+                        "%12lu\n",
+                        stats_names[i], h->count,
+                        h->count ? h->sum / h->count : 0, p[0], p[1], p[2],
+                        p[3], h->max, h->sum);
+        if (len >= cap) {
+            len = cap - 1;
+            break;
+        }
+    }
+
+    free(h);
+
+    *size = len;
+
+    return buf;
+}
+
+const char *capfs_stats_name(enum capfs_stats_id id)
+{
+    if ((unsigned)id >= CAPFS_STATS_MAX) {
+        return "unknown";
+    }
+
+    return stats_names[id];
+}
+
+int capfs_stats_path(const char *path)
+{
+    if (!strcmp(path, CAPFS_STATS_PATH)) {
+        return CAPFS_STATS_PATH_FILE;
+    }
+
+    if (!strcmp(path, CAPFS_STATS_DIR)) {
+        return CAPFS_STATS_PATH_DIR;
+    }
+
+    return CAPFS_STATS_PATH_NONE;
+}
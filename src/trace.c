@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capfs_internal.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/*
+ * ============================================================================
+ * Trace file
+ * ============================================================================
+ */
+
+/// the size of the buffer of the trace file
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+/**
+ * @brief the state of the recorder
+ */
+static struct {
+    FILE *file;                     ///< the trace file, NULL if not recording
+    pthread_mutex_t lock;           ///< serializes the records
+    uint64_t start;                 ///< monotonic time the trace started
+    uint64_t dropped;               ///< records that could not be written
+    struct fuse_operations ops;     ///< the recorded operations
+} g_trace = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* starts a record of an operation */
+static void trace_begin(struct capfs_trace_record *rec, enum capfs_stats_id op,
+                        struct fuse_file_info *fi)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->op = op;
+    rec->fh = fi ? fi->fh : 0;
+    rec->start = capfs_stats_now();
+}
+
+/* completes a record of an operation and writes it */
+static void trace_end(struct capfs_trace_record *rec, int64_t result,
+                      const char *path, const char *path2)
+{
+    uint64_t now = capfs_stats_now();
+    size_t len = path ? strnlen(path, UINT16_MAX) : 0;
+    size_t len2 = path2 ? strnlen(path2, UINT16_MAX) : 0;
+
+    rec->latency = now - rec->start;
+    rec->start -= g_trace.start;
+    rec->result = result;
+    rec->pathlen = (uint16_t)len;
+    rec->path2len = (uint16_t)len2;
+
+    pthread_mutex_lock(&g_trace.lock);
+
+    if (g_trace.file == NULL
+        || fwrite(rec, sizeof(*rec), 1, g_trace.file) != 1
+        || fwrite(path, 1, len, g_trace.file) != len
+        || fwrite(path2, 1, len2, g_trace.file) != len2) {
+        g_trace.dropped++;
+    }
+
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+static void trace_stop(void)
+{
+    pthread_mutex_lock(&g_trace.lock);
+
+    if (g_trace.file) {
+        if (fclose(g_trace.file)) {
+            LOGE("ERROR - closing the trace file failed with %i\n", errno);
+        }
+        g_trace.file = NULL;
+    }
+
+    if (g_trace.dropped) {
+        LOGW("WARNING: %lu records are missing from the trace\n",
+             g_trace.dropped);
+    }
+
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+
+/*
+ * ============================================================================
+ * Recording operations
+ * ============================================================================
+ *
+ * Each wrapper fills in the arguments of its operation, see capfs_trace.h,
+ * calls the recorded operation and records it with its result.
+ */
+
+static int trace_getattr(const char *path, struct stat *stbuf,
+                         struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_GETATTR, fi);
+    int r = g_trace.ops.getattr(path, stbuf, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_access(const char *path, int mask)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_ACCESS, NULL);
+    rec.arg = mask;
+    int r = g_trace.ops.access(path, mask);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_OPENDIR, fi);
+    rec.arg = fi->flags;
+    int r = g_trace.ops.opendir(path, fi);
+    rec.fh = fi->fh;
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_readdir(const char *path, void *dbuf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi,
+                         enum fuse_readdir_flags flags)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_READDIR, fi);
+    rec.offset = offset;
+    rec.arg = flags;
+    int r = g_trace.ops.readdir(path, dbuf, filler, offset, fi, flags);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_RELEASEDIR, fi);
+    int r = g_trace.ops.releasedir(path, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_readlink(const char *path, char *linkbuf, size_t size)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_READLINK, NULL);
+    rec.size = size;
+    int r = g_trace.ops.readlink(path, linkbuf, size);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_MKNOD, NULL);
+    rec.arg = mode;
+    rec.offset = rdev;
+    int r = g_trace.ops.mknod(path, mode, rdev);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_MKDIR, NULL);
+    rec.arg = mode;
+    int r = g_trace.ops.mkdir(path, mode);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_symlink(const char *from, const char *to)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_SYMLINK, NULL);
+    int r = g_trace.ops.symlink(from, to);
+    trace_end(&rec, r, from, to);
+    return r;
+}
+
+static int trace_unlink(const char *path)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_UNLINK, NULL);
+    int r = g_trace.ops.unlink(path);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_rmdir(const char *path)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_RMDIR, NULL);
+    int r = g_trace.ops.rmdir(path);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_rename(const char *from, const char *to, unsigned int flags)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_RENAME, NULL);
+    rec.arg = flags;
+    int r = g_trace.ops.rename(from, to, flags);
+    trace_end(&rec, r, from, to);
+    return r;
+}
+
+static int trace_link(const char *from, const char *to)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_LINK, NULL);
+    int r = g_trace.ops.link(from, to);
+    trace_end(&rec, r, from, to);
+    return r;
+}
+
+static int trace_chmod(const char *path, mode_t mode,
+                       struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_CHMOD, fi);
+    rec.arg = mode;
+    int r = g_trace.ops.chmod(path, mode, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_chown(const char *path, uid_t uid, gid_t gid,
+                       struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_CHOWN, fi);
+    rec.arg = uid;
+    rec.arg2 = gid;
+    int r = g_trace.ops.chown(path, uid, gid, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_truncate(const char *path, off_t size,
+                          struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_TRUNCATE, fi);
+    rec.offset = size;
+    int r = g_trace.ops.truncate(path, size, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_utimens(const char *path, const struct timespec tv[2],
+                         struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_UTIMENS, fi);
+    if (tv) {
+        rec.offset = tv[0].tv_sec;
+        rec.arg = tv[0].tv_nsec;
+        rec.offset2 = tv[1].tv_sec;
+        rec.arg2 = tv[1].tv_nsec;
+    }
+    int r = g_trace.ops.utimens(path, tv, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_OPEN, fi);
+    rec.arg = fi->flags;
+    int r = g_trace.ops.open(path, fi);
+    rec.fh = fi->fh;
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_flush(const char *path, struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_FLUSH, fi);
+    int r = g_trace.ops.flush(path, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_fsync(const char *path, int isdatasync,
+                       struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_FSYNC, fi);
+    rec.arg = isdatasync;
+    int r = g_trace.ops.fsync(path, isdatasync, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_RELEASE, fi);
+    int r = g_trace.ops.release(path, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_read(const char *path, char *rbuf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_READ, fi);
+    rec.offset = offset;
+    rec.size = size;
+    int r = g_trace.ops.read(path, rbuf, size, offset, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_write(const char *path, const char *wbuf, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_WRITE, fi);
+    rec.offset = offset;
+    rec.size = size;
+    int r = g_trace.ops.write(path, wbuf, size, offset, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_statfs(const char *path, struct statvfs *buf)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_STATFS, NULL);
+    int r = g_trace.ops.statfs(path, buf);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_create(const char *path, mode_t mode,
+                        struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_CREATE, fi);
+    rec.arg = mode;
+    rec.arg2 = fi->flags;
+    int r = g_trace.ops.create(path, mode, fi);
+    rec.fh = fi->fh;
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static int trace_ioctl(const char *path, int cmd, void *arg,
+                       struct fuse_file_info *fi, unsigned int flags,
+                       void *data)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_IOCTL, fi);
+    rec.arg = cmd;
+    rec.arg2 = flags;
+    int r = g_trace.ops.ioctl(path, cmd, arg, fi, flags, data);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static ssize_t trace_copy_file_range(const char *path_in,
+                                     struct fuse_file_info *fi_in,
+                                     off_t offset_in, const char *path_out,
+                                     struct fuse_file_info *fi_out,
+                                     off_t offset_out, size_t size, int flags)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_COPY_FILE_RANGE, fi_in);
+    rec.fh2 = fi_out ? fi_out->fh : 0;
+    rec.offset = offset_in;
+    rec.offset2 = offset_out;
+    rec.size = size;
+    rec.arg = flags;
+    ssize_t r = g_trace.ops.copy_file_range(path_in, fi_in, offset_in,
+                                            path_out, fi_out, offset_out,
+                                            size, flags);
+    trace_end(&rec, r, path_in, path_out);
+    return r;
+}
+
+static int trace_fallocate(const char *path, int mode, off_t offset,
+                           off_t length, struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_FALLOCATE, fi);
+    rec.arg = mode;
+    rec.offset = offset;
+    rec.size = length;
+    int r = g_trace.ops.fallocate(path, mode, offset, length, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static off_t trace_lseek(const char *path, off_t off, int whence,
+                         struct fuse_file_info *fi)
+{
+    struct capfs_trace_record rec;
+    trace_begin(&rec, CAPFS_STATS_OP_LSEEK, fi);
+    rec.offset = off;
+    rec.arg = whence;
+    off_t r = g_trace.ops.lseek(path, off, whence, fi);
+    trace_end(&rec, r, path, NULL);
+    return r;
+}
+
+static void trace_destroy(void *private_data)
+{
+    g_trace.ops.destroy(private_data);
+    trace_stop();
+}
+
+
+/*
+ * ============================================================================
+ * Public interface
+ * ============================================================================
+ */
+
+/* replaces an operation by its wrapper, if the file system implements it */
+#define TRACE_WRAP(ops, op)             \
+    do {                                \
+        if ((ops)->op) {                \
+            (ops)->op = trace_##op;     \
+        }                               \
+    } while (0)
+
+int capfs_trace_start(const char *path, struct fuse_operations *ops)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -errno;
+    }
+
+    /* failing to enlarge the buffer only costs more writes */
+    setvbuf(f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    struct capfs_trace_header hdr = {
+        .magic = CAPFS_TRACE_MAGIC,
+        .version = CAPFS_TRACE_VERSION,
+        .recsize = sizeof(struct capfs_trace_record),
+        .realtime = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec,
+    };
+
+    /* written out now, so a forked daemon does not inherit it buffered */
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fflush(f)) {
+        int err = errno;
+        fclose(f);
+        return -err;
+    }
+
+    g_trace.start = capfs_stats_now();
+    g_trace.file = f;
+    g_trace.ops = *ops;
+
+    TRACE_WRAP(ops, getattr);
+    TRACE_WRAP(ops, access);
+    TRACE_WRAP(ops, opendir);
+    TRACE_WRAP(ops, readdir);
+    TRACE_WRAP(ops, releasedir);
+    TRACE_WRAP(ops, readlink);
+    TRACE_WRAP(ops, mknod);
+    TRACE_WRAP(ops, mkdir);
+    TRACE_WRAP(ops, symlink);
+    TRACE_WRAP(ops, unlink);
+    TRACE_WRAP(ops, rmdir);
+    TRACE_WRAP(ops, rename);
+    TRACE_WRAP(ops, link);
+    TRACE_WRAP(ops, chmod);
+    TRACE_WRAP(ops, chown);
+    TRACE_WRAP(ops, truncate);
+    TRACE_WRAP(ops, utimens);
+    TRACE_WRAP(ops, open);
+    TRACE_WRAP(ops, flush);
+    TRACE_WRAP(ops, fsync);
+    TRACE_WRAP(ops, release);
+    TRACE_WRAP(ops, read);
+    TRACE_WRAP(ops, write);
+    TRACE_WRAP(ops, statfs);
+    TRACE_WRAP(ops, create);
+    TRACE_WRAP(ops, ioctl);
+    TRACE_WRAP(ops, copy_file_range);
+    TRACE_WRAP(ops, fallocate);
+    TRACE_WRAP(ops, lseek);
+    TRACE_WRAP(ops, destroy);
+
+    return 0;
+}
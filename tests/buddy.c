@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * unit tests of the buddy allocator of the files backend
+ */
+
+#include <capfs_buddy.h>
+
+#include "check.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MIN_ORDER 6
+#define MAX_ORDER 16
+
+/* the whole range is free again and coalesced into a single block */
+static void check_coalesced(struct capfs_buddy *b)
+{
+    uint64_t addr = ~0UL;
+
+    CHECK(capfs_buddy_free_bytes(b) == (1UL << MAX_ORDER));
+    CHECK(capfs_buddy_alloc(b, MAX_ORDER, &addr) == 0);
+    CHECK(addr == 0);
+    CHECK(capfs_buddy_free(b, addr, MAX_ORDER) == 0);
+}
+
+static void test_order(struct capfs_buddy *b)
+{
+    CHECK(capfs_buddy_order(b, 0) == MIN_ORDER);
+    CHECK(capfs_buddy_order(b, 1) == MIN_ORDER);
+    CHECK(capfs_buddy_order(b, 1UL << MIN_ORDER) == MIN_ORDER);
+    CHECK(capfs_buddy_order(b, (1UL << MIN_ORDER) + 1) == MIN_ORDER + 1);
+    CHECK(capfs_buddy_order(b, 1UL << MAX_ORDER) == MAX_ORDER);
+    CHECK(capfs_buddy_order(b, (1UL << MAX_ORDER) + 1) == MAX_ORDER + 1);
+}
+
+static void test_alloc_free(struct capfs_buddy *b)
+{
+    const uint64_t n = 1UL << (MAX_ORDER - MIN_ORDER);
+    uint64_t *addrs = calloc(n, sizeof(*addrs));
+    char *seen = calloc(n, 1);
+
+    /* every smallest block is handed out exactly once */
+    for (uint64_t i = 0; i < n; i++) {
+        CHECK(capfs_buddy_alloc(b, MIN_ORDER, &addrs[i]) == 0);
+        CHECK((addrs[i] & ((1UL << MIN_ORDER) - 1)) == 0);
+        CHECK(addrs[i] < (1UL << MAX_ORDER));
+        CHECK(!seen[addrs[i] >> MIN_ORDER]);
+        seen[addrs[i] >> MIN_ORDER] = 1;
+    }
+
+    uint64_t addr;
+    CHECK(capfs_buddy_alloc(b, MIN_ORDER, &addr) == -ENOSPC);
+    CHECK(capfs_buddy_free_bytes(b) == 0);
+
+    /* freeing every other block leaves no pair to coalesce */
+    for (uint64_t i = 0; i < n; i += 2) {
+        CHECK(capfs_buddy_free(b, addrs[i], MIN_ORDER) == 0);
+    }
+    CHECK(capfs_buddy_free_bytes(b) == (1UL << (MAX_ORDER - 1)));
+    CHECK(capfs_buddy_alloc(b, MIN_ORDER + 1, &addr) == -ENOSPC
+          || (addr & ((1UL << (MIN_ORDER + 1)) - 1)) == 0);
+
+    for (uint64_t i = 1; i < n; i += 2) {
+        CHECK(capfs_buddy_free(b, addrs[i], MIN_ORDER) == 0);
+    }
+    if (capfs_buddy_free_bytes(b) != (1UL << MAX_ORDER)) {
+        /* the larger block allocated above is still out */
+        CHECK(capfs_buddy_free(b, addr, MIN_ORDER + 1) == 0);
+    }
+    check_coalesced(b);
+
+    /* blocks of mixed orders are naturally aligned and coalesce */
+    uint64_t a, c, d;
+    CHECK(capfs_buddy_alloc(b, MIN_ORDER, &a) == 0);
+    CHECK(capfs_buddy_alloc(b, MIN_ORDER + 3, &c) == 0);
+    CHECK((c & ((1UL << (MIN_ORDER + 3)) - 1)) == 0);
+    CHECK(capfs_buddy_alloc(b, MAX_ORDER - 1, &d) == 0);
+    CHECK((d & ((1UL << (MAX_ORDER - 1)) - 1)) == 0);
+    CHECK(capfs_buddy_alloc(b, MAX_ORDER - 1, &addr) == -ENOSPC);
+    CHECK(capfs_buddy_free(b, c, MIN_ORDER + 3) == 0);
+    CHECK(capfs_buddy_free(b, d, MAX_ORDER - 1) == 0);
+    CHECK(capfs_buddy_free(b, a, MIN_ORDER) == 0);
+    check_coalesced(b);
+
+    /* orders out of range */
+    CHECK(capfs_buddy_alloc(b, MAX_ORDER + 1, &addr) == -ENOSPC);
+    CHECK(capfs_buddy_alloc(b, 0, &addr) == 0);
+    CHECK(capfs_buddy_free(b, addr, MIN_ORDER) == 0);
+    check_coalesced(b);
+
+    free(addrs);
+    free(seen);
+}
+
+static void test_free_invalid(struct capfs_buddy *b)
+{
+    uint64_t a;
+    CHECK(capfs_buddy_alloc(b, MIN_ORDER + 2, &a) == 0);
+
+    /* wrong order, inside the block, never allocated and out of range */
+    CHECK(capfs_buddy_free(b, a, MIN_ORDER + 1) == -EINVAL);
+    CHECK(capfs_buddy_free(b, a + (1UL << MIN_ORDER), MIN_ORDER) == -EINVAL);
+    CHECK(capfs_buddy_free(b, a ^ (1UL << (MAX_ORDER - 1)), MIN_ORDER + 2)
+          == -EINVAL);
+    CHECK(capfs_buddy_free(b, 1UL << MAX_ORDER, MIN_ORDER) == -EINVAL);
+
+    /* double free */
+    CHECK(capfs_buddy_free(b, a, MIN_ORDER + 2) == 0);
+    CHECK(capfs_buddy_free(b, a, MIN_ORDER + 2) == -EINVAL);
+    check_coalesced(b);
+}
+
+static void test_reserve(struct capfs_buddy *b)
+{
+    uint64_t addr;
+
+    /* a block in the middle splits the range around it */
+    uint64_t r = 5UL << (MIN_ORDER + 1);
+    CHECK(capfs_buddy_reserve(b, r, MIN_ORDER + 1) == 0);
+    CHECK(capfs_buddy_free_bytes(b)
+          == (1UL << MAX_ORDER) - (1UL << (MIN_ORDER + 1)));
+    CHECK(capfs_buddy_is_allocated(b, r, 1UL << (MIN_ORDER + 1)));
+
+    /* overlapping reservations fail */
+    CHECK(capfs_buddy_reserve(b, r, MIN_ORDER + 1) == -EBUSY);
+    CHECK(capfs_buddy_reserve(b, r, MIN_ORDER) == -EBUSY);
+    CHECK(capfs_buddy_reserve(b, r + (1UL << MIN_ORDER), MIN_ORDER) == -EBUSY);
+    CHECK(capfs_buddy_reserve(b, 0, MIN_ORDER + 4) == -EBUSY);
+    CHECK(capfs_buddy_alloc(b, MAX_ORDER, &addr) == -ENOSPC);
+
+    /* misaligned or out of range */
+    CHECK(capfs_buddy_reserve(b, 1UL << MIN_ORDER, MIN_ORDER + 1) == -EINVAL);
+    CHECK(capfs_buddy_reserve(b, 1UL << MAX_ORDER, MIN_ORDER) == -EINVAL);
+    CHECK(capfs_buddy_reserve(b, 0, MIN_ORDER - 1) == -EINVAL);
+
+    /* the neighbours split off are still allocatable */
+    CHECK(capfs_buddy_reserve(b, r - (1UL << (MIN_ORDER + 1)), MIN_ORDER + 1)
+          == 0);
+    CHECK(capfs_buddy_reserve(b, 1UL << (MAX_ORDER - 1), MAX_ORDER - 1) == 0);
+
+    /* allocations never overlap the reserved blocks */
+    while (capfs_buddy_alloc(b, MIN_ORDER, &addr) == 0) {
+        CHECK(addr + (1UL << MIN_ORDER) <= r - (1UL << (MIN_ORDER + 1))
+              || (addr >= r + (1UL << (MIN_ORDER + 1))
+                  && addr < (1UL << (MAX_ORDER - 1))));
+    }
+    CHECK(capfs_buddy_free_bytes(b) == 0);
+
+    /* release everything, the whole range coalesces again */
+    for (uint64_t a = 0; a < (1UL << (MAX_ORDER - 1)); a += 1UL << MIN_ORDER) {
+        if (a >= r - (1UL << (MIN_ORDER + 1)) && a < r + (1UL << (MIN_ORDER + 1))) {
+            continue;
+        }
+        CHECK(capfs_buddy_free(b, a, MIN_ORDER) == 0);
+    }
+    CHECK(capfs_buddy_free(b, r, MIN_ORDER + 1) == 0);
+    CHECK(capfs_buddy_free(b, r - (1UL << (MIN_ORDER + 1)), MIN_ORDER + 1) == 0);
+    CHECK(capfs_buddy_free(b, 1UL << (MAX_ORDER - 1), MAX_ORDER - 1) == 0);
+    check_coalesced(b);
+}
+
+static void test_range(struct capfs_buddy *b)
+{
+    const uint64_t g = 1UL << MIN_ORDER;
+    uint64_t a, c, addr;
+
+    /* three granules are carved from a block of four, the tail is free */
+    CHECK(capfs_buddy_alloc_range(b, 3 * g - 1, &a) == 0);
+    CHECK((a & (4 * g - 1)) == 0);
+    CHECK(capfs_buddy_free_bytes(b) == (1UL << MAX_ORDER) - 3 * g);
+    CHECK(capfs_buddy_is_allocated(b, a, 3 * g));
+    CHECK(!capfs_buddy_is_allocated(b, a, 4 * g));
+    CHECK(!capfs_buddy_is_allocated(b, a + g, 2 * g));
+    CHECK(!capfs_buddy_is_allocated(b, a + 2 * g, 2 * g));
+    CHECK(capfs_buddy_reserve(b, a + 3 * g, MIN_ORDER) == 0);
+    CHECK(capfs_buddy_free(b, a + 3 * g, MIN_ORDER) == 0);
+
+    /* a range freed with the wrong size is rejected */
+    CHECK(capfs_buddy_free_range(b, a, 4 * g) == -EINVAL);
+    CHECK(capfs_buddy_free_range(b, a, 5 * g) == -EINVAL);
+    CHECK(capfs_buddy_free_range(b, a + g, 2 * g) == -EINVAL);
+    CHECK(capfs_buddy_free_range(b, a, 0) == -EINVAL);
+
+    /* odd sizes of many granules */
+    CHECK(capfs_buddy_alloc_range(b, 37 * g, &c) == 0);
+    CHECK((c & (64 * g - 1)) == 0);
+    CHECK(capfs_buddy_is_allocated(b, c, 37 * g));
+    CHECK(capfs_buddy_free_bytes(b) == (1UL << MAX_ORDER) - 40 * g);
+
+    CHECK(capfs_buddy_free_range(b, a, 3 * g) == 0);
+    CHECK(capfs_buddy_free_range(b, a, 3 * g) == -EINVAL);
+    CHECK(capfs_buddy_free_range(b, c, 37 * g) == 0);
+    check_coalesced(b);
+
+    /* ranges are too large or empty */
+    CHECK(capfs_buddy_alloc_range(b, (1UL << MAX_ORDER) + 1, &addr) == -ENOSPC);
+    CHECK(capfs_buddy_alloc_range(b, 0, &addr) == -ENOSPC);
+
+    /* the whole range as one range */
+    CHECK(capfs_buddy_alloc_range(b, 1UL << MAX_ORDER, &addr) == 0);
+    CHECK(addr == 0 && capfs_buddy_free_bytes(b) == 0);
+    CHECK(capfs_buddy_free_range(b, addr, 1UL << MAX_ORDER) == 0);
+    check_coalesced(b);
+}
+
+static void test_reserve_range(struct capfs_buddy *b)
+{
+    const uint64_t g = 1UL << MIN_ORDER;
+    uint64_t addr;
+
+    /* a range reserved like one allocated is freed as a range */
+    CHECK(capfs_buddy_reserve_range(b, 8 * g, 5 * g) == 0);
+    CHECK(capfs_buddy_is_allocated(b, 8 * g, 5 * g));
+    CHECK(capfs_buddy_free_bytes(b) == (1UL << MAX_ORDER) - 5 * g);
+
+    /* an unaligned start is split at its alignment */
+    CHECK(capfs_buddy_reserve_range(b, 3 * g, 3 * g) == 0);
+    CHECK(capfs_buddy_is_allocated(b, 3 * g, 3 * g));
+
+    /* overlapping ranges fail and leave the allocator as it was */
+    CHECK(capfs_buddy_reserve_range(b, 0, 4 * g) == -EBUSY);
+    CHECK(capfs_buddy_reserve_range(b, 12 * g, 4 * g) == -EBUSY);
+    CHECK(capfs_buddy_reserve_range(b, 6 * g, 4 * g) == -EBUSY);
+    CHECK(capfs_buddy_free_bytes(b) == (1UL << MAX_ORDER) - 8 * g);
+    CHECK(capfs_buddy_reserve(b, 6 * g, MIN_ORDER + 1) == 0);
+    CHECK(capfs_buddy_free(b, 6 * g, MIN_ORDER + 1) == 0);
+
+    /* misaligned, empty or out of range */
+    CHECK(capfs_buddy_reserve_range(b, g / 2, g) == -EINVAL);
+    CHECK(capfs_buddy_reserve_range(b, 0, 0) == -EINVAL);
+    CHECK(capfs_buddy_reserve_range(b, (1UL << MAX_ORDER) - g, 2 * g)
+          == -EINVAL);
+
+    CHECK(capfs_buddy_free_range(b, 8 * g, 5 * g) == 0);
+    CHECK(capfs_buddy_free_range(b, 3 * g, 3 * g) == 0);
+    CHECK(capfs_buddy_alloc_range(b, 1UL << MAX_ORDER, &addr) == 0);
+    CHECK(capfs_buddy_free_range(b, addr, 1UL << MAX_ORDER) == 0);
+    check_coalesced(b);
+}
+
+static void test_range_below(struct capfs_buddy *b)
+{
+    const uint64_t g = 1UL << MIN_ORDER;
+    uint64_t lo, hi, addr;
+
+    /* a hole at the start is found although larger blocks are free */
+    CHECK(capfs_buddy_reserve(b, 0, MIN_ORDER + 2) == 0);
+    CHECK(capfs_buddy_reserve(b, 4 * g, MIN_ORDER + 2) == 0);
+    CHECK(capfs_buddy_free(b, 0, MIN_ORDER + 2) == 0);
+
+    CHECK(capfs_buddy_alloc_range_below(b, 3 * g, 8 * g, &lo) == 0);
+    CHECK(lo == 0);
+    CHECK(capfs_buddy_alloc_range_below(b, 3 * g, 8 * g, &addr) == -ENOSPC);
+    CHECK(capfs_buddy_alloc_range_below(b, 3 * g, 1UL << MAX_ORDER, &hi) == 0);
+    CHECK(hi >= 8 * g && (hi & (4 * g - 1)) == 0);
+
+    CHECK(capfs_buddy_free_range(b, lo, 3 * g) == 0);
+    CHECK(capfs_buddy_free_range(b, hi, 3 * g) == 0);
+    CHECK(capfs_buddy_free(b, 4 * g, MIN_ORDER + 2) == 0);
+    check_coalesced(b);
+}
+
+int main(void)
+{
+    struct capfs_buddy b;
+    if (capfs_buddy_init(&b, MIN_ORDER, MAX_ORDER)) {
+        fprintf(stderr, "initializing the allocator failed\n");
+        return EXIT_FAILURE;
+    }
+
+    check_coalesced(&b);
+    test_order(&b);
+    test_alloc_free(&b);
+    test_free_invalid(&b);
+    test_reserve(&b);
+    test_range(&b);
+    test_reserve_range(&b);
+    test_range_below(&b);
+
+    capfs_buddy_destroy(&b);
+
+    return check_report();
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2017, ETH Zurich
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * unit tests of the capability encoding of the files backend
+ */
+
+#include <capfs_capability.h>
+
+#include "check.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* the largest length that is encoded without an exponent */
+#define LENGTH_MAX_E0 CAPABILITY_MASK(CAPABILITY_LENGTH_BITS)
+
+/* the largest base that is encoded without an exponent */
+#define BASE_MAX_E0 CAPABILITY_MASK(CAPABILITY_BASE_BITS)
+
+/* encodes and decodes a capability, which must come back unchanged */
+static void check_roundtrip(uint64_t base, uint64_t size, uint8_t perms)
+{
+    struct capability c = { base, size, perms };
+    struct capability d = { 0, 0, 0 };
+
+    CHECK(capability_representable(base, size));
+    capability_decompress(capability_compres(&c), &d);
+    CHECK(d.base == base);
+    CHECK(d.size == size);
+    CHECK(d.perms == perms);
+}
+
+static void test_layout(void)
+{
+    struct capability c = { 0x1000, 0x40, 0x03 };
+    CHECK(capability_compres(&c) == (0x1000UL | (0x40UL << 38) | (3UL << 56)));
+
+    /* every field at its maximum stays in its own bits */
+    c = (struct capability){ BASE_MAX_E0, LENGTH_MAX_E0, 0xff };
+    CHECK(capability_compres(&c)
+          == ~(CAPABILITY_MASK(CAPABILITY_EXP_BITS) << CAPABILITY_EXP_SHIFT));
+
+    /* the exponent is stored next to the length */
+    c = (struct capability){ 0, 1UL << 20, 0 };
+    uint64_t comp = capability_compres(&c);
+    uint64_t e = comp >> CAPABILITY_EXP_SHIFT;
+    CHECK((e & CAPABILITY_MASK(CAPABILITY_EXP_BITS)) == 9);
+    CHECK(((comp >> CAPABILITY_LENGTH_SHIFT) & LENGTH_MAX_E0) == 1UL << 11);
+}
+
+static void test_exponent(void)
+{
+    /* lengths */
+    CHECK(capability_exponent(0, 0) == 0);
+    CHECK(capability_exponent(0, 1) == 0);
+    CHECK(capability_exponent(0, LENGTH_MAX_E0) == 0);
+    CHECK(capability_exponent(0, LENGTH_MAX_E0 + 1) == 1);
+    for (int k = CAPABILITY_LENGTH_BITS; k < 64; k++) {
+        int e = k - CAPABILITY_LENGTH_BITS;
+        CHECK(capability_exponent(0, 1UL << k) == e + 1);
+        CHECK(capability_exponent(0, (1UL << k) - 1) == e);
+    }
+    CHECK(capability_exponent(0, ~0UL) == 64 - CAPABILITY_LENGTH_BITS);
+
+    /* bases */
+    CHECK(capability_exponent(BASE_MAX_E0, 1) == 0);
+    CHECK(capability_exponent(BASE_MAX_E0 + 1, 1) == 1);
+    for (int k = CAPABILITY_BASE_BITS; k < 64; k++) {
+        CHECK(capability_exponent(1UL << k, 1) == k - CAPABILITY_BASE_BITS + 1);
+    }
+
+    /* the larger of both exponents wins */
+    CHECK(capability_exponent(1UL << 50, 1UL << 20) == 13);
+    CHECK(capability_exponent(1UL << 40, 1UL << 30) == 19);
+    CHECK(capability_exponent(~0UL, ~0UL) == 64 - CAPABILITY_LENGTH_BITS);
+}
+
+static void test_representable(void)
+{
+    CHECK(!capability_representable(0, 0));
+    CHECK(capability_representable(0, 1));
+    CHECK(capability_representable(BASE_MAX_E0, LENGTH_MAX_E0));
+
+    /* with an exponent, base and length must be multiples of 2^E */
+    CHECK(capability_representable(0, LENGTH_MAX_E0 + 1));
+    CHECK(!capability_representable(0, LENGTH_MAX_E0 + 2));
+    CHECK(capability_representable(0, LENGTH_MAX_E0 + 3));
+    CHECK(!capability_representable(BASE_MAX_E0 + 2, 1));
+    CHECK(capability_representable(BASE_MAX_E0 + 1, 2));
+    CHECK(!capability_representable(1, 1UL << 20));
+    CHECK(capability_representable(1UL << 9, 1UL << 20));
+    CHECK(!capability_representable(1UL << 8, 1UL << 20));
+    CHECK(capability_representable(1UL << 63, 1UL << 63));
+    CHECK(!capability_representable((1UL << 63) + (1UL << 25), 1));
+}
+
+static void test_round_size(void)
+{
+    CHECK(capability_round_size(1) == 1);
+    CHECK(capability_round_size(LENGTH_MAX_E0) == LENGTH_MAX_E0);
+    CHECK(capability_round_size(LENGTH_MAX_E0 + 2) == LENGTH_MAX_E0 + 3);
+
+    for (int k = CAPABILITY_LENGTH_BITS; k < 63; k++) {
+        uint64_t sizes[] = { (1UL << k) - 1, 1UL << k, (1UL << k) + 1 };
+        for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            uint64_t s = sizes[i];
+            uint64_t r = capability_round_size(s);
+
+            /* up by less than one unit of the exponent, and less than 1/2048 */
+            uint8_t e = capability_exponent(0, s);
+            CHECK(r >= s && r - s < (1UL << e));
+            CHECK(r - s <= s >> (CAPABILITY_LENGTH_BITS - 1));
+            CHECK(capability_representable(0, r));
+        }
+    }
+
+    /* rounding may carry into the next exponent */
+    CHECK(capability_round_size((1UL << 20) - 1) == 1UL << 20);
+    CHECK(capability_exponent(0, 1UL << 20) == 9);
+}
+
+static void test_roundtrip(void)
+{
+    /* every length at the edges of every exponent, at aligned bases */
+    for (int k = 0; k < 63; k++) {
+        uint64_t sizes[] = { (1UL << k) - 1, 1UL << k, (1UL << k) + 1 };
+        for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            uint64_t s = capability_round_size(sizes[i]);
+            if (s == 0) {
+                continue;
+            }
+
+            uint8_t e = capability_exponent(0, s);
+            check_roundtrip(0, s, 0);
+            check_roundtrip(1UL << e, s, 0xff);
+            check_roundtrip(BASE_MAX_E0 << e, s, 0x5a);
+        }
+    }
+
+    /* bases at and across the edge of the base mantissa */
+    for (int k = 0; k < 64; k++) {
+        uint64_t base = 1UL << k;
+        uint8_t e = capability_exponent(base, 1);
+        check_roundtrip(base, 1UL << e, 0x06);
+        check_roundtrip(base | (1UL << e), 1UL << e, 0x06);
+    }
+
+    /* all permissions, they do not affect base and length */
+    for (unsigned p = 0; p < 256; p++) {
+        check_roundtrip(BASE_MAX_E0, LENGTH_MAX_E0, (uint8_t)p);
+        check_roundtrip(1UL << 40, 1UL << 30, (uint8_t)p);
+    }
+}
+
+int main(void)
+{
+    test_layout();
+    test_exponent();
+    test_representable();
+    test_round_size();
+    test_roundtrip();
+
+    return check_report();
+}